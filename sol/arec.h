@@ -17,12 +17,9 @@ typedef struct SARec {
   SValue        registry[10]; // Registry
 } SARec; // 184 = 24+(16*10)
 
-// Create a new activation record. We inline this since it's only used in two
-// places: Creation of a new task and when  calling a function. In the latter
-// case we want to avoid a function call (thus this is inlined.)
-inline static SARec* S_ALWAYS_INLINE
-SARecCreate(SFunc* func, SARec* parent) {
-  SARec* ar = (SARec*)malloc(sizeof(SARec));
+// Initialize activation record `ar` which was allocated by the caller
+inline static void S_ALWAYS_INLINE
+SARecInit(SARec* ar, SFunc* func, SARec* parent) {
   ar->func = func;
   
   // We have to set PC to instrv MINUS ONE since the VM executive sees PC as
@@ -31,6 +28,22 @@ SARecCreate(SFunc* func, SARec* parent) {
   ar->pc = func->instructions -1;
 
   ar->parent = parent;
+
+  // Registers start out as nil. Instructions which overwrite a task handle
+  // release it, so there must be no garbage that looks like one.
+  size_t i = 0;
+  for (; i != s_countof(ar->registry); ++i) {
+    ar->registry[i] = SValueNil;
+  }
+}
+
+// Create a new activation record. We inline this since it's only used in two
+// places: Creation of a new task and when  calling a function. In the latter
+// case we want to avoid a function call (thus this is inlined.)
+inline static SARec* S_ALWAYS_INLINE
+SARecCreate(SFunc* func, SARec* parent) {
+  SARec* ar = (SARec*)malloc(sizeof(SARec));
+  SARecInit(ar, func, parent);
   return ar;
 }
 
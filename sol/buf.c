@@ -0,0 +1,41 @@
+#include "buf.h"
+
+SBuf* SBufCreate(uint32_t len) {
+  SBuf* b = (SBuf*)malloc(sizeof(SBuf) + len);
+  b->refc = 1;
+  b->len = len;
+  b->data = b->bytes;
+  b->base = 0;
+  memset((void*)b->bytes, 0, len);
+  return b;
+}
+
+SBuf* SBufCreateCopy(const void* data, uint32_t len) {
+  SBuf* b = (SBuf*)malloc(sizeof(SBuf) + len);
+  b->refc = 1;
+  b->len = len;
+  b->data = b->bytes;
+  b->base = 0;
+  memcpy((void*)b->bytes, data, len);
+  return b;
+}
+
+SBuf* SBufSlice(SBuf* b, uint32_t start, uint32_t len) {
+  assert(start <= b->len && len <= b->len - start);
+  // A slice of a slice views the bytes of the original buffer directly
+  SBuf* base = (b->base != 0) ? b->base : b;
+  SBufRetain(base);
+  SBuf* s = (SBuf*)malloc(sizeof(SBuf));
+  s->refc = 1;
+  s->len = len;
+  s->data = b->data + start;
+  s->base = base;
+  return s;
+}
+
+void SBufDestroy(SBuf* b) {
+  if (b->base != 0) {
+    SBufRelease(b->base);
+  }
+  free((void*)b);
+}
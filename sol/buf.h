@@ -0,0 +1,50 @@
+// Buffer -- an immutable, reference counted sequence of bytes. A buffer is a
+// value which can be sent to other tasks, also in other schedulers, without
+// copying its bytes: the message only carries a pointer to the buffer, and
+// holds a reference to it.
+//
+// A slice is a buffer which views a part of another buffer's bytes. Making a
+// slice doesn't copy any bytes either. The slice holds a reference to the
+// buffer whose bytes it views, so they stay around for as long as the slice.
+//
+// The bytes of a buffer may only be written to by whoever created the buffer,
+// before passing it on to anyone else.
+#ifndef S_BUF_H_
+#define S_BUF_H_
+#include <sol/common.h>
+
+typedef struct SBuf {
+  volatile uint32_t refc;  // Number of references to the buffer
+  uint32_t          len;   // Number of bytes
+  uint8_t*          data;  // First byte, in `bytes` or in `base`
+  struct SBuf*      base;  // Buffer whose bytes a slice views, or 0
+  uint8_t           bytes[];
+} SBuf;
+
+// Create a new buffer of `len` bytes with a reference count of 1. The bytes
+// are zeroed.
+SBuf* SBufCreate(uint32_t len);
+
+// Create a new buffer with a copy of the `len` bytes at `data`
+SBuf* SBufCreateCopy(const void* data, uint32_t len);
+
+// Create a slice of `len` bytes of buffer `b`, starting at byte `start`. The
+// slice must fit inside `b`.
+SBuf* SBufSlice(SBuf* b, uint32_t start, uint32_t len);
+
+inline static void S_ALWAYS_INLINE SBufRetain(SBuf* b) {
+  SAtomicAdd32((int32_t*)&b->refc, 1);
+}
+
+// Decrement reference count. Frees the buffer when there are no references
+// left.
+void SBufDestroy(SBuf* b);
+inline static void S_ALWAYS_INLINE SBufRelease(SBuf* b) {
+  // A buffer with a single reference is not shared with anyone who could
+  // retain it meanwhile, so no atomic operation is needed to free it.
+  if (b->refc == 1 || SAtomicSubAndFetch(&b->refc, 1) == 0) {
+    SBufDestroy(b);
+  }
+}
+
+#endif // S_BUF_H_
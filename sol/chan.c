@@ -0,0 +1,101 @@
+#include "chan.h"
+#include "task.h"
+#include "host.h"
+
+SChan* SChanCreate(uint32_t cap, SChanFlag flags) {
+  uint32_t n = 2;
+  while (n < cap) {
+    n *= 2;
+  }
+  SChan* c;
+  if (posix_memalign((void**)&c, 64, sizeof(SChan) + sizeof(SChanSlot) * n)) {
+    return 0;
+  }
+  c->sendpos = 0;
+  c->recvcache = 0;
+  c->sendsched = 0;
+  c->recvpos = 0;
+  c->sendcache = 0;
+  c->recvsched = 0;
+  c->refc = 1;
+  c->closed = 0;
+  c->lock = 0;
+  c->mask = n - 1;
+  c->flags = flags;
+  c->membarrier = (flags & SChanFlagSPSC) && SHostMembarrierAvail();
+  c->sendq = (SChanWaitQ){0, 0};
+  c->recvq = (SChanWaitQ){0, 0};
+  c->sendwaiter = 0;
+  c->recvwaiter = 0;
+  uint32_t i = 0;
+  for (; i != n; ++i) {
+    c->slots[i].seq = i;
+  }
+  return c;
+}
+
+void SChanDestroy(SChan* c) {
+  // Waiting tasks hold references to the channel, so there are none
+  assert(c->sendq.head == 0 && c->sendwaiter == 0);
+  assert(c->recvq.head == 0 && c->recvwaiter == 0);
+  SValue v;
+  if (c->flags & SChanFlagSPSC) {
+    while (SChanSPSCTryRecv(c, &v)) {
+      SValueRelease(v);
+    }
+  } else {
+    while (SChanTryRecv(c, &v)) {
+      SValueRelease(v);
+    }
+  }
+  free((void*)c);
+}
+
+void SChanWaitPush(SChanWaitQ* q, SChanWaiter* w) {
+  w->next = 0;
+  w->prev = q->tail;
+  if (q->head == 0) {
+    q->head = w;
+  } else {
+    q->tail->next = w;
+  }
+  q->tail = w;
+  w->queued = true;
+}
+
+SChanWaiter* SChanWaitPop(SChanWaitQ* q) {
+  SChanWaiter* w = q->head;
+  if (w != 0) {
+    SChanWaitRemove(q, w);
+  }
+  return w;
+}
+
+void SChanWaitRemove(SChanWaitQ* q, SChanWaiter* w) {
+  if (!w->queued) {
+    return;
+  }
+  if (w->prev == 0) {
+    q->head = w->next;
+  } else {
+    w->prev->next = w->next;
+  }
+  if (w->next == 0) {
+    q->tail = w->prev;
+  } else {
+    w->next->prev = w->prev;
+  }
+  w->queued = false;
+}
+
+SChanWaiter* SChanWaitTakeAll(SChanWaitQ* q) {
+  SChanWaiter* first = q->head;
+  SChanWaiter* w = first;
+  // Whoever cancels a waiter must see that it's no longer in the list, since
+  // the list is woken up without the lock
+  for (; w != 0; w = w->next) {
+    w->queued = false;
+  }
+  *q = (SChanWaitQ){0, 0};
+  return first;
+}
@@ -0,0 +1,278 @@
+// Channel -- a bounded multi-producer, multi-consumer FIFO queue of values
+// which any number of tasks, in any schedulers, send to and receive from. Each
+// value is received by exactly one task, so e.g. a pool of worker tasks can
+// take jobs off a channel without a dispatcher task in between.
+//
+// The values are kept in a lock-free ring buffer. Each slot has a sequence
+// number which tells whether the slot is ready to be sent to or received from
+// for the current lap around the ring, so a sender or receiver claims a slot
+// with a single CAS on the send or receive position.
+//
+// Tasks which find the channel full or empty wait in a FIFO list of senders or
+// receivers. These lists are short and rarely touched, and are protected by a
+// spinlock. Each value sent wakes at most one waiting receiver, and each value
+// received wakes at most one waiting sender. A task executing SELECT waits in
+// the receivers of each channel it selects on at once, and takes itself out of
+// the lists again when any of them wakes it.
+//
+// A channel created with SChanFlagSPSC has exactly one sender task and one
+// receiver task, e.g. a link in a pipeline. Then the sender owns the send
+// position and the receiver the receive position, and each keeps a copy of
+// the other's position which it only refreshes when the ring looks full or
+// empty. Sending and receiving are plain loads and stores. A task which has to
+// wait puts itself in a waiter slot, and the peer only has to look at the slot
+// to see whether it needs to wake it.
+#ifndef S_CHAN_H_
+#define S_CHAN_H_
+#include <sol/common.h>
+#include <sol/value.h>
+
+struct STask;
+struct SSched;
+
+// Flags for SChanCreate
+typedef uint32_t SChanFlag;
+enum {
+  // Single producer, single consumer. Only one task may send to the channel,
+  // and only one task may receive from it.
+  SChanFlagSPSC = 1,
+};
+
+typedef struct {
+  volatile uint32_t seq;   // Position this slot is ready for
+  SValue            value;
+} SChanSlot;
+
+// A task waiting on a channel. A task waiting to send or receive uses its own
+// `chwait`, and a task executing SELECT uses one waiter per channel. Tasks
+// waiting to read from a topic (see topic.h) use their `chwait` too.
+typedef struct SChanWaiter {
+  struct SChanWaiter* next;
+  struct SChanWaiter* prev;
+  struct STask*       task;
+  uint32_t            sel;    // SELECT source index + 1, or 0 if not SELECT
+  bool                queued; // True while in a wait list
+} SChanWaiter;
+
+// FIFO list of tasks waiting on a channel
+typedef struct {
+  SChanWaiter* volatile head;
+  SChanWaiter*          tail;
+} SChanWaitQ;
+
+typedef struct SChan {
+  // Sender's cache line
+  volatile uint32_t sendpos;   // Position of the next value to be sent
+  uint32_t          recvcache; // SPSC: Sender's copy of `recvpos`
+  struct SSched*    sendsched; // SPSC: Scheduler of the sender
+  uint8_t           _pad1[48];
+
+  // Receiver's cache line
+  volatile uint32_t recvpos;   // Position of the next value to be received
+  uint32_t          sendcache; // SPSC: Receiver's copy of `sendpos`
+  struct SSched*    recvsched; // SPSC: Scheduler of the receiver
+  uint8_t           _pad2[48];
+
+  volatile uint32_t refc;     // Number of references to the channel
+  volatile uint32_t closed;   // 1 when the channel is closed
+  volatile uint32_t lock;     // Protects `sendq` and `recvq`
+  uint32_t          mask;     // Capacity - 1
+  SChanFlag         flags;    // Flags
+  uint32_t          membarrier; // SPSC: Waiting tasks use SHostMembarrier
+  SChanWaitQ        sendq;    // Tasks waiting for room
+  SChanWaitQ        recvq;    // Tasks waiting for a value
+  struct STask* volatile sendwaiter; // SPSC: Sender, if waiting for room
+  struct STask* volatile recvwaiter; // SPSC: Receiver, if waiting for a value
+  SChanSlot         slots[];  // Ring buffer
+} SChan;
+
+// Create a new channel with a reference count of 1. `cap` is rounded up to a
+// power of two, and is at least 2.
+SChan* SChanCreate(uint32_t cap, SChanFlag flags);
+
+// Number of values the channel holds when full
+#define SChanCap(c) ((c)->mask + 1)
+
+inline static void S_ALWAYS_INLINE SChanRetain(SChan* c) {
+  SAtomicAdd32((int32_t*)&c->refc, 1);
+}
+
+// Decrement reference count. Frees the channel, releasing any values still in
+// it, when there are no references left.
+void SChanDestroy(SChan* c);
+inline static void S_ALWAYS_INLINE SChanRelease(SChan* c) {
+  if (SAtomicSubAndFetch(&c->refc, 1) == 0) {
+    SChanDestroy(c);
+  }
+}
+
+// Add `v` to the channel. Returns false if the channel is full. The channel
+// takes over any reference held by `v`. A receiver can take and release the
+// value before this returns, so the reference must already exist.
+inline static bool S_ALWAYS_INLINE SChanTrySend(SChan* c, SValue v) {
+  uint32_t pos = c->sendpos;
+  while (1) {
+    SChanSlot* slot = &c->slots[pos & c->mask];
+    int32_t dif = (int32_t)(slot->seq - pos);
+    if (dif == 0) {
+      // The slot is free in this lap. Claim it.
+      if (SAtomicCAS(&c->sendpos, pos, pos + 1)) {
+        slot->value = v;
+        SAtomicBarrier();
+        slot->seq = pos + 1; // Ready to be received
+        return true;
+      }
+      pos = c->sendpos;
+    } else if (dif < 0) {
+      return false; // The slot still holds a value from the previous lap
+    } else {
+      pos = c->sendpos; // Another sender claimed the slot
+    }
+  }
+}
+
+// Take the oldest value from the channel. Returns false if the channel is
+// empty. `v` takes over any reference held by the value.
+inline static bool S_ALWAYS_INLINE SChanTryRecv(SChan* c, SValue* v) {
+  uint32_t pos = c->recvpos;
+  while (1) {
+    SChanSlot* slot = &c->slots[pos & c->mask];
+    int32_t dif = (int32_t)(slot->seq - (pos + 1));
+    if (dif == 0) {
+      if (SAtomicCAS(&c->recvpos, pos, pos + 1)) {
+        *v = slot->value;
+        SAtomicBarrier();
+        slot->seq = pos + c->mask + 1; // Ready to be sent to in the next lap
+        return true;
+      }
+      pos = c->recvpos;
+    } else if (dif < 0) {
+      return false; // Nothing has been sent to the slot yet
+    } else {
+      pos = c->recvpos;
+    }
+  }
+}
+
+// True if a send would currently find the channel full or a receive would
+// find it empty. Used by tasks about to wait, to check again after they have
+// added themselves to a wait list.
+inline static bool S_ALWAYS_INLINE SChanIsFull(SChan* c) {
+  uint32_t pos = c->sendpos;
+  return (int32_t)(c->slots[pos & c->mask].seq - pos) < 0;
+}
+inline static bool S_ALWAYS_INLINE SChanIsEmpty(SChan* c) {
+  uint32_t pos = c->recvpos;
+  return (int32_t)(c->slots[pos & c->mask].seq - (pos + 1)) < 0;
+}
+
+// Like SChanTrySend and SChanTryRecv, but for SPSC channels. Must only be
+// called by the one sender and the one receiver respectively. As with
+// SChanTrySend, the receiver can release a sent value before this returns.
+inline static bool S_ALWAYS_INLINE SChanSPSCTrySend(SChan* c, SValue v) {
+  uint32_t pos = c->sendpos;
+  if (pos - c->recvcache > c->mask) {
+    c->recvcache = c->recvpos; // Looks full. See if the receiver made room.
+    if (pos - c->recvcache > c->mask) {
+      return false;
+    }
+  }
+  c->slots[pos & c->mask].value = v;
+  SAtomicLightBarrier(); // The value is written before it's published
+  c->sendpos = pos + 1;
+  return true;
+}
+inline static bool S_ALWAYS_INLINE SChanSPSCTryRecv(SChan* c, SValue* v) {
+  uint32_t pos = c->recvpos;
+  if (pos == c->sendcache) {
+    c->sendcache = c->sendpos; // Looks empty. See if the sender sent more.
+    if (pos == c->sendcache) {
+      return false;
+    }
+    SAtomicLightBarrier(); // Read `sendpos` before the values it publishes
+  }
+  *v = c->slots[pos & c->mask].value;
+  SAtomicLightBarrier(); // The value is read before its slot is given back
+  c->recvpos = pos + 1;
+  return true;
+}
+
+// Add up to `n` values from `v` to an SPSC channel, publishing them all at
+// once. Returns the number of values added.
+inline static uint32_t S_ALWAYS_INLINE
+SChanSPSCSendBatch(SChan* c, const SValue* v, uint32_t n) {
+  uint32_t pos = c->sendpos;
+  uint32_t room = SChanCap(c) - (pos - c->recvcache);
+  if (room < n) {
+    c->recvcache = c->recvpos;
+    room = SChanCap(c) - (pos - c->recvcache);
+    if (room < n) {
+      n = room;
+    }
+  }
+  uint32_t i = 0;
+  for (; i != n; ++i) {
+    c->slots[(pos + i) & c->mask].value = v[i];
+  }
+  SAtomicLightBarrier();
+  c->sendpos = pos + n;
+  return n;
+}
+
+// Take up to `n` values from an SPSC channel to `v`, giving back their slots
+// all at once. Returns the number of values taken.
+inline static uint32_t S_ALWAYS_INLINE
+SChanSPSCRecvBatch(SChan* c, SValue* v, uint32_t n) {
+  uint32_t pos = c->recvpos;
+  uint32_t avail = c->sendcache - pos;
+  if (avail < n) {
+    c->sendcache = c->sendpos;
+    SAtomicLightBarrier();
+    avail = c->sendcache - pos;
+    if (avail < n) {
+      n = avail;
+    }
+  }
+  uint32_t i = 0;
+  for (; i != n; ++i) {
+    v[i] = c->slots[(pos + i) & c->mask].value;
+  }
+  SAtomicLightBarrier();
+  c->recvpos = pos + n;
+  return n;
+}
+
+// SPSC versions of SChanIsFull and SChanIsEmpty
+inline static bool S_ALWAYS_INLINE SChanSPSCIsFull(SChan* c) {
+  return c->sendpos - c->recvpos > c->mask;
+}
+inline static bool S_ALWAYS_INLINE SChanSPSCIsEmpty(SChan* c) {
+  return c->sendpos == c->recvpos;
+}
+
+// Lock and unlock the wait lists of a channel
+inline static void S_ALWAYS_INLINE SChanLock(SChan* c) {
+  while (!SAtomicCAS(&c->lock, (uint32_t)0, (uint32_t)1)) {
+    while (c->lock) {}
+  }
+}
+inline static void S_ALWAYS_INLINE SChanUnlock(SChan* c) {
+  SAtomicBarrier();
+  c->lock = 0;
+}
+
+// Add waiter `w` to the end of wait list `q`. Must hold the lock.
+void SChanWaitPush(SChanWaitQ* q, SChanWaiter* w);
+
+// Remove and return the waiter first in wait list `q`, or 0 if the list is
+// empty. Must hold the lock.
+SChanWaiter* SChanWaitPop(SChanWaitQ* q);
+
+// Remove waiter `w` from wait list `q` if it's still in it. Must hold the lock.
+void SChanWaitRemove(SChanWaitQ* q, SChanWaiter* w);
+
+// Remove all waiters from wait list `q` and return the first of them, or 0 if
+// the list is empty. They stay linked through `next`. Must hold the lock.
+SChanWaiter* SChanWaitTakeAll(SChanWaitQ* q);
+
+#endif // S_CHAN_H_
@@ -111,6 +111,13 @@
     assert(!"Declared S_UNREACHABLE but was reaced")
 #endif
 
+// Hint that the memory at `addr` is about to be read
+#if __has_builtin(__builtin_prefetch) || defined(__GNUC__)
+  #define S_PREFETCH(addr) __builtin_prefetch((const void*)(addr))
+#else
+  #define S_PREFETCH(addr) ((void)0)
+#endif
+
 #define S_NOT_IMPLEMENTED S_FATAL("NOT IMPLEMENTED in %s", __PRETTY_FUNCTION__)
 
 
@@ -29,21 +29,37 @@
   #error "Unsupported compiler: Missing support for atomic operations"
 #endif
 
+// Atomically replace the value at `ptr` with `newval` if it is `oldval`.
+// Returns true if the value was replaced.
+// bool SAtomicCAS(T* ptr, T oldval, T newval)
+#if S_WITHOUT_SMP
+  #define SAtomicCAS(ptr, oldval, newval) \
+    ((*(ptr) == (oldval)) ? ((*(ptr) = (newval)), true) : false)
+#elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 4))
+  #define SAtomicCAS __sync_bool_compare_and_swap
+#else
+  #error "Unsupported compiler: Missing support for atomic operations"
+#endif
+
 // Atomically increment a 32-bit integer by N. There's no return value.
-// void SAtomicSubAndFetch(T* operand, T delta)
+// void SAtomicAdd32(int32_t* operand, int32_t delta)
 #if S_WITHOUT_SMP
   #define SAtomicAdd32(operand, delta) (*(operand) += (delta))
 #elif S_TARGET_ARCH_X64 || S_TARGET_ARCH_X86
   inline static void S_UNUSED SAtomicAdd32(int32_t* operand, int32_t delta) {
     // From http://www.memoryhole.net/kyle/2007/05/atomic_incrementing.html
+    // xadd leaves the old value of `operand` in the register of `delta`, so
+    // both are outputs
     __asm__ __volatile__ (
       "lock xaddl %1, %0\n" // add delta to operand
-      : // no output
-      : "m" (*operand), "r" (delta)
+      : "+m" (*operand), "+r" (delta)
+      : // no input
+      : "memory"
     );
   }
 #elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 4))
-  #define SAtomicAdd32 __sync_sub_and_fetch
+  #define SAtomicAdd32(operand, delta) \
+    ((void)__sync_add_and_fetch((operand), (delta)))
 #else
   #error "Unsupported compiler: Missing support for atomic operations"
 #endif
@@ -58,4 +74,47 @@
   #error "Unsupported compiler: Missing support for atomic operations"
 #endif
 
+// Add `delta` to `operand` and return the resulting value of `operand`
+// T SAtomicAddAndFetch(T* operand, T delta)
+#if S_WITHOUT_SMP
+  #define SAtomicAddAndFetch(operand, delta) (*(operand) += (delta))
+#elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 4))
+  #define SAtomicAddAndFetch __sync_add_and_fetch
+#else
+  #error "Unsupported compiler: Missing support for atomic operations"
+#endif
+
+// Full memory barrier. No load or store is moved across it.
+// void SAtomicBarrier()
+#if S_WITHOUT_SMP
+  #define SAtomicBarrier() __asm__ __volatile__("" ::: "memory")
+#elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 4))
+  #define SAtomicBarrier __sync_synchronize
+#else
+  #error "Unsupported compiler: Missing support for atomic operations"
+#endif
+
+// Barrier which keeps loads and stores from being moved across it, except for
+// a store before it being moved after a load after it. The CPU already keeps
+// to that on x86, so there it only stops the compiler.
+// void SAtomicLightBarrier()
+#if S_WITHOUT_SMP || S_TARGET_ARCH_X64 || S_TARGET_ARCH_X86
+  #define SAtomicLightBarrier() __asm__ __volatile__("" ::: "memory")
+#elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 4))
+  #define SAtomicLightBarrier __sync_synchronize
+#else
+  #error "Unsupported compiler: Missing support for atomic operations"
+#endif
+
+// Hint to the CPU that we're in a spin-wait loop. Saves power and frees up
+// resources for the other hardware thread of the core while spinning.
+// void SAtomicPause()
+#if S_TARGET_ARCH_X64 || S_TARGET_ARCH_X86
+  #define SAtomicPause() __builtin_ia32_pause()
+#elif S_TARGET_ARCH_ARM
+  #define SAtomicPause() __asm__ __volatile__("yield" ::: "memory")
+#else
+  #define SAtomicPause() __asm__ __volatile__("" ::: "memory")
+#endif
+
 #endif // S_COMMON_ATOMIC_H_
@@ -0,0 +1,39 @@
+#include "future.h"
+
+SFuture* _SFuturePoolRefill(SFuturePool* p) {
+  // Take all futures freed since we last looked
+  SFuture* f = (SFuture*)SAtomicSwap(&p->remote, (SFuture*)0);
+  if (f != 0) {
+    p->free = f->next;
+    return f;
+  }
+  f = (SFuture*)malloc(sizeof(SFuture));
+  f->pool = p;
+  return f;
+}
+
+void SFutureDestroy(SFuture* f) {
+  // A waiting task holds a reference to the future, so there is none
+  assert(f->waiter == 0);
+  SValueRelease(f->value);
+  SFuturePool* p = f->pool;
+  SFuture* head;
+  do {
+    head = p->remote;
+    f->next = head;
+  } while (!SAtomicCAS(&p->remote, head, f));
+}
+
+static void _FreeList(SFuture* f) {
+  while (f != 0) {
+    SFuture* next = f->next;
+    free((void*)f);
+    f = next;
+  }
+}
+
+void SFuturePoolFree(SFuturePool* p) {
+  _FreeList(p->free);
+  _FreeList((SFuture*)SAtomicSwap(&p->remote, (SFuture*)0));
+  p->free = 0;
+}
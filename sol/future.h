@@ -0,0 +1,113 @@
+// Future -- a slot for a single value which is filled in later, e.g. the reply
+// to a request. A task creates a future, sends it along with a request, and
+// waits for the value with AWAIT. The task which handles the request fills in
+// the value with FULFILL, which wakes the waiting task directly rather than
+// through its inbox.
+//
+// A future is fulfilled once, and then keeps its value until it's freed. Only
+// one task may wait for a future at a time.
+//
+// Futures are allocated from a pool owned by a scheduler and recycled, so
+// making a request doesn't allocate memory once the pool has as many futures
+// as are in use at the same time. Futures are only allocated by the owner of
+// the pool, but may be freed by any thread: a freed future is pushed onto the
+// pool's list of returned futures with a CAS, and the owner takes the whole
+// list when its own free list runs dry.
+#ifndef S_FUTURE_H_
+#define S_FUTURE_H_
+#include <sol/common.h>
+#include <sol/value.h>
+
+struct STask;
+struct SFuturePool;
+
+// State of a future (value of a future's `state` member)
+enum {
+  SFutureStatePending = 0, // Not yet fulfilled
+  SFutureStateFulfilled,   // `value` is set
+};
+
+typedef struct SFuture {
+  volatile uint32_t   refc;    // Number of references to the future
+  volatile uint32_t   state;   // SFutureStatePending or SFutureStateFulfilled
+  volatile uint32_t   lock;    // Protects `waiter`, `waitsel` and fulfilling
+  uint32_t            waitsel; // SELECT source index + 1 of `waiter`, or 0
+  struct STask*       waiter;  // Task waiting for the value, or 0
+  SValue              value;   // The value, once fulfilled
+  struct SFuturePool* pool;    // Pool which owns the future
+  struct SFuture*     next;    // Next future in a free list of the pool
+} SFuture;
+
+typedef struct SFuturePool {
+  SFuture* volatile remote;   // Futures freed by anyone (LIFO)
+  uint8_t           _pad[56]; // Keep `remote` on its own cache line
+  SFuture*          free;     // Free futures (owner only)
+} SFuturePool;
+
+// Constant initializer
+#define S_FUTUREPOOL_INIT (SFuturePool){0, {0}, 0}
+
+// Free all futures in pool `p`. No future allocated from `p` may be used, or
+// released, after this.
+void SFuturePoolFree(SFuturePool* p);
+
+// Slow path of SFutureCreate
+SFuture* _SFuturePoolRefill(SFuturePool* p);
+
+// Create a new, pending future with a reference count of 1 from pool `p`,
+// which must be owned by the calling thread
+inline static SFuture* S_ALWAYS_INLINE SFutureCreate(SFuturePool* p) {
+  SFuture* f = p->free;
+  if (f != 0) {
+    p->free = f->next;
+  } else {
+    f = _SFuturePoolRefill(p);
+  }
+  f->refc = 1;
+  f->state = SFutureStatePending;
+  f->lock = 0;
+  f->waitsel = 0;
+  f->waiter = 0;
+  f->value = SValueNil;
+  return f;
+}
+
+inline static void S_ALWAYS_INLINE SFutureRetain(SFuture* f) {
+  SAtomicAdd32((int32_t*)&f->refc, 1);
+}
+
+// Decrement reference count. Releases the value and gives the future back to
+// its pool when there are no references left.
+void SFutureDestroy(SFuture* f);
+inline static void S_ALWAYS_INLINE SFutureRelease(SFuture* f) {
+  // A future with a single reference is not shared with anyone who could
+  // retain it meanwhile, so no atomic operation is needed to free it.
+  if (f->refc == 1 || SAtomicSubAndFetch(&f->refc, 1) == 0) {
+    SFutureDestroy(f);
+  }
+}
+
+// Lock and unlock a future
+inline static void S_ALWAYS_INLINE SFutureLock(SFuture* f) {
+  while (!SAtomicCAS(&f->lock, (uint32_t)0, (uint32_t)1)) {
+    while (f->lock) {}
+  }
+}
+inline static void S_ALWAYS_INLINE SFutureUnlock(SFuture* f) {
+  SAtomicLightBarrier(); // Nothing we did while locked is moved after this
+  f->lock = 0;
+}
+
+// Take a copy of the value of future `f`, which holds its own reference, if
+// `f` is fulfilled. Returns false if it isn't.
+inline static bool S_ALWAYS_INLINE SFutureTryGet(SFuture* f, SValue* v) {
+  if (f->state != SFutureStateFulfilled) {
+    return false;
+  }
+  SAtomicLightBarrier(); // Read `state` before the value it publishes
+  *v = f->value;
+  SValueRetain(*v);
+  return true;
+}
+
+#endif // S_FUTURE_H_
@@ -0,0 +1,79 @@
+// Binary min-heap -- a priority queue of pointers ordered by a 64-bit key. The
+// key is stored next to the pointer so that sifting never has to dereference
+// the queued objects. Entries with equal keys are not ordered.
+#ifndef S_HEAP_H_
+#define S_HEAP_H_
+#include <sol/common.h>
+
+typedef struct {
+  uint64_t key;
+  void*    value;
+} SHeapEntry;
+
+typedef struct {
+  SHeapEntry* v;    // Entries. v[0] has the smallest key
+  uint32_t    len;  // Number of entries
+  uint32_t    cap;  // Number of entries `v` has room for
+} SHeap;
+
+// Constant initializer
+#define S_HEAP_INIT (SHeap){0, 0, 0}
+
+// Free memory used by the heap. Does not touch the queued objects.
+inline static void S_UNUSED SHeapFree(SHeap* h) {
+  free((void*)h->v);
+  *h = S_HEAP_INIT;
+}
+
+// Key of the entry that SHeapPop would return. Heap must not be empty.
+inline static uint64_t S_ALWAYS_INLINE SHeapMinKey(const SHeap* h) {
+  assert(h->len != 0);
+  return h->v[0].key;
+}
+
+// Add `value` ordered by `key`
+inline static void S_UNUSED SHeapPush(SHeap* h, uint64_t key, void* value) {
+  if (h->len == h->cap) {
+    h->cap = (h->cap == 0) ? 16 : h->cap * 2;
+    h->v = (SHeapEntry*)realloc((void*)h->v, sizeof(SHeapEntry) * h->cap);
+  }
+  // Sift up
+  uint32_t i = h->len++;
+  while (i != 0) {
+    uint32_t parent = (i - 1) / 2;
+    if (h->v[parent].key <= key) {
+      break;
+    }
+    h->v[i] = h->v[parent];
+    i = parent;
+  }
+  h->v[i].key = key;
+  h->v[i].value = value;
+}
+
+// Remove and return the value with the smallest key. Heap must not be empty.
+inline static void* S_UNUSED SHeapPop(SHeap* h) {
+  assert(h->len != 0);
+  void* value = h->v[0].value;
+  uint32_t len = --h->len;
+  if (len != 0) {
+    // Sift down the last entry from the top
+    SHeapEntry last = h->v[len];
+    uint32_t i = 0;
+    uint32_t child;
+    while ((child = (i * 2) + 1) < len) {
+      if (child + 1 < len && h->v[child + 1].key < h->v[child].key) {
+        ++child;
+      }
+      if (last.key <= h->v[child].key) {
+        break;
+      }
+      h->v[i] = h->v[child];
+      i = child;
+    }
+    h->v[i] = last;
+  }
+  return value;
+}
+
+#endif // S_HEAP_H_
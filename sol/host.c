@@ -7,6 +7,15 @@
   #include <unistd.h> // sysconf
   #include <sys/types.h>
   #include <sys/sysctl.h>
+  #include <time.h> // clock_gettime
+  #include <sched.h> // sched_yield
+#endif
+#if S_TARGET_OS_DARWIN
+  #include <mach/mach_time.h>
+#endif
+#if S_TARGET_OS_LINUX
+  #include <sys/syscall.h> // syscall
+  #include <linux/membarrier.h>
 #endif
 
 uint32_t SHostAvailCPUCount() {
@@ -60,3 +69,62 @@ uint32_t SHostAvailCPUCount() {
     return 0;
   #endif
 }
+
+uint64_t SHostMonotonicUSecs() {
+  #if S_TARGET_OS_DARWIN
+    static mach_timebase_info_data_t timebase = {0, 0};
+    if (timebase.denom == 0) {
+      mach_timebase_info(&timebase);
+    }
+    return (mach_absolute_time() * timebase.numer / timebase.denom) / 1000;
+
+  #elif S_TARGET_OS_POSIX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000ULL) + ((uint64_t)ts.tv_nsec / 1000);
+
+  #else
+    // Timers and deadlines depend on this clock, so don't build without it
+    #error "Unsupported host: No monotonic clock"
+  #endif
+}
+
+void SHostYield() {
+  #if S_TARGET_OS_WINDOWS
+    SwitchToThread();
+  #elif S_TARGET_OS_POSIX
+    sched_yield();
+  #else
+    #warning "Unsupported host"
+  #endif
+}
+
+#if S_TARGET_OS_LINUX && defined(__NR_membarrier)
+// 1 when registered for expedited membarriers, -1 when not supported
+static volatile int32_t _membarrier = 0;
+#endif
+
+bool SHostMembarrierAvail() {
+  #if S_TARGET_OS_LINUX && defined(__NR_membarrier)
+    if (_membarrier == 0) {
+      // The process must register before using expedited membarriers. Doing
+      // it more than once is harmless.
+      _membarrier = (syscall(__NR_membarrier,
+                             MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED,
+                             0, 0) == 0) ? 1 : -1;
+    }
+    return _membarrier == 1;
+  #else
+    return false;
+  #endif
+}
+
+bool SHostMembarrier() {
+  #if S_TARGET_OS_LINUX && defined(__NR_membarrier)
+    return SHostMembarrierAvail() &&
+           syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED,
+                   0, 0) == 0;
+  #else
+    return false;
+  #endif
+}
@@ -6,4 +6,21 @@
 // This value can change at runtime (e.g. from power management settings).
 uint32_t SHostAvailCPUCount();
 
+// Microseconds elapsed since some arbitrary point in time. Never goes
+// backwards, and is not affected by changes to the system clock.
+uint64_t SHostMonotonicUSecs();
+
+// Give up the rest of the calling thread's time slice to other threads
+void SHostYield();
+
+// Make all running threads of the process execute a full memory barrier. Lets
+// one side of a store-then-load handshake get away with a compiler barrier, as
+// long as the other, rarely taken, side calls this instead of SAtomicBarrier.
+// Costs a system call. Returns false without doing anything if the host does
+// not support it, in which case both sides need SAtomicBarrier.
+bool SHostMembarrier();
+
+// True if SHostMembarrier is supported by the host
+bool SHostMembarrierAvail();
+
 #endif
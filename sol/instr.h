@@ -58,7 +58,33 @@ typedef uint32_t SInstr;
   _(JUMP,       Bss) /* PC += Bss */\
   _(CALL,       ABC) /* R(A), ... ,R(A+C-1) := R(A)(R(A+1), ... ,R(A+B)) */\
   _(RETURN,     AB_) /* return R(A), ... ,R(A+B-1) */\
-  _(SPAWN,      AB_) /* R(A) = spawn(RK(B)) */\
+  _(SPAWN,      ABC) /* R(A) = spawn(RK(B), R(A+1), ... ,R(A+C)) */\
+  _(SPAWNN,     ABC) /* R(A) = group of RK(C) x spawn(RK(B), i, R(A+1)) */\
+  _(JOIN,       A__) /* wait until the tasks of group R(A) have ended */\
+  _(CANCEL,     A__) /* cancel group R(A) and the tasks it spawned */\
+  _(TID,        AB_) /* R(A) = ID of task R(B), or own ID if R(B) is nil */\
+  _(TASK,       AB_) /* R(A) = task with ID R(B), or nil if it has ended */\
+  _(SEND,       AB_) /* send RK(B) to task R(A) */\
+  _(SENDMV,     AB_) /* send R(B) to task R(A) and set R(B) to nil */\
+  _(RECV,       A__) /* R(A) = receive(); R(A+1) = sender */\
+  _(TRYSEND,    ABC) /* R(A) = send RK(C) to task R(B) if inbox not full */\
+  _(RECVS,      ABC) /* R(A) = receive matching RK(C) by B; R(A+1) = sender */\
+  _(CHAN,       ABC) /* R(A) = new channel with capacity RK(B) and flags C */\
+  _(CHSEND,     AB_) /* send RK(B) to channel R(A) */\
+  _(CHRECV,     AB_) /* R(A) = receive from channel R(B); R(A+1) = !closed */\
+  _(CHCLOSE,    A__) /* close channel R(A) */\
+  _(SELECT,     ABC) /* R(A..A+2) = index, values of first of R(B..B+C-1) */\
+  _(TOPIC,      AB_) /* R(A) = new topic keeping the last RK(B) values */\
+  _(PUBLISH,    AB_) /* publish RK(B) to topic R(A) */\
+  _(SUBSCRIBE,  AB_) /* R(A) = cursor at next value published to topic R(B) */\
+  _(TRECV,      ABC) /* R(A) = topic R(B) at cursor R(C); R(A+1) = missed */\
+  _(FUTURE,     A__) /* R(A) = new future */\
+  _(FULFILL,    AB_) /* fulfill future R(A) with RK(B) */\
+  _(AWAIT,      ABC) /* R(A) = future R(B) within RK(C) ms; R(A+1) = ok */\
+  /* Buffers */ \
+  _(BUF,        AB_) /* R(A) = new buffer of RK(B) zero bytes */\
+  _(BUFLEN,     AB_) /* R(A) = length of buffer R(B) */\
+  _(BUFSLICE,   ABC) /* R(A) = bytes RK(B) up to RK(C) of buffer R(A) */\
   /* Arithmetic */ \
   _(ADD,        ABC) /* R(A) = RK(B) + RK(C) */\
   _(SUB,        ABC) /* R(A) = RK(B) - RK(C) */\
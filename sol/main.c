@@ -72,7 +72,7 @@ int main(int argc, const char** argv) {
     SInstr_LOADK(0, 0),                 // R(0) = K(0)
     SInstr_LE(0, 0, S_INSTR_RK_k+1),    // if (0 == RK(0) < RK(k+1)) else PC++
     SInstr_JUMP(2),                     //   PC += 2 to RETURN
-    SInstr_SPAWN(0, S_INSTR_RK_k+3),    // R(0) = spawn(RK(B))
+    SInstr_SPAWN(0, S_INSTR_RK_k+3, 0), // R(0) = spawn(RK(B))
     SInstr_YIELD(1, S_INSTR_RK_k+2, 0), // yield timeout (K(2) = after_ms)
     SInstr_RETURN(0, 0),                // return
   };
@@ -0,0 +1,246 @@
+#include "mbox.h"
+#include "value.h"
+#include "task.h"
+
+#define S_MBOX_INDEX_MINCAP 16 // Min slots in an index
+#define S_MBOX_COMPACT_MIN  32 // Min taken messages before compacting
+#define S_MBOX_KTYPE_FREE 0xff // `ktype` of a slot which has never been used
+
+// Exact key of `v` when matching by value. Numbers are compared by value, so
+// that 0 and -0 are the same key. Atoms are identified by their type alone.
+inline static uint64_t _ValueKey(SValue v) {
+  if (v.type == SValueTNumber) {
+    union { SNumber n; uint64_t u; } bits;
+    bits.n = (v.value.n == 0) ? 0 : v.value.n;
+    return bits.u;
+  } else if (v.type > _SValueTAtomsBegin && v.type < _SValueTAtomsEnd) {
+    return 0;
+  }
+  return (uint64_t)(uintptr_t)v.value.p;
+}
+
+// Key of message `m` for matches of kind `kind`. `ktype` is set to the type
+// part of the key.
+inline static uint64_t _MsgKey(SMBoxMatch kind, SMsg* m, uint8_t* ktype) {
+  switch (kind) {
+    case SMBoxMatchSender:
+      *ktype = 0;
+      return (uint64_t)(uintptr_t)m->sender;
+    case SMBoxMatchValue:
+      *ktype = m->value.type;
+      return _ValueKey(m->value);
+    default:
+      *ktype = 0;
+      return (uint64_t)m->value.type;
+  }
+}
+
+// Key to look up for a match of kind `kind` on `key`
+inline static uint64_t _MatchKey(SMBoxMatch kind, SValue key, uint8_t* ktype) {
+  switch (kind) {
+    case SMBoxMatchSender:
+      *ktype = 0;
+      return (uint64_t)(uintptr_t)key.value.p;
+    case SMBoxMatchValue:
+      *ktype = key.type;
+      return _ValueKey(key);
+    default:
+      *ktype = 0;
+      return (uint64_t)key.value.n;
+  }
+}
+
+inline static uint32_t _Hash(uint64_t key, uint8_t ktype) {
+  // Finalizer of MurmurHash3
+  key ^= (uint64_t)ktype << 56;
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return (uint32_t)key;
+}
+
+// Find the slot for a key. If the key is not in the index, returns the unused
+// slot where the key would go.
+inline static SMBoxSlot* _Find(SMBox* b, uint64_t key, uint8_t ktype) {
+  uint32_t mask = b->icap - 1;
+  uint32_t i = _Hash(key, ktype) & mask;
+  while (1) {
+    SMBoxSlot* slot = &b->index[i];
+    if (slot->ktype == S_MBOX_KTYPE_FREE ||
+        (slot->key == key && slot->ktype == ktype)) {
+      return slot;
+    }
+    i = (i + 1) & mask;
+  }
+}
+
+// Append message `m` to the messages of its key in the index
+inline static void _IndexAdd(SMBox* b, SMsg* m) {
+  uint8_t ktype;
+  uint64_t key = _MsgKey(b->ikind, m, &ktype);
+  SMBoxSlot* slot = _Find(b, key, ktype);
+  if (slot->ktype == S_MBOX_KTYPE_FREE) {
+    slot->key = key;
+    slot->ktype = ktype;
+    ++b->iused;
+  }
+  m->inext = 0;
+  if (slot->head == 0) {
+    slot->head = m;
+  } else {
+    slot->tail->inext = m;
+  }
+  slot->tail = m;
+}
+
+// Create a new index keyed by `kind` of all messages which are not taken
+static void _IndexBuild(SMBox* b, SMBoxMatch kind) {
+  uint32_t cap = S_MBOX_INDEX_MINCAP;
+  while (cap < b->live * 4) {
+    cap *= 2;
+  }
+  if (cap != b->icap) {
+    free((void*)b->index);
+    b->index = (SMBoxSlot*)malloc(sizeof(SMBoxSlot) * cap);
+    b->icap = cap;
+  }
+  uint32_t i = 0;
+  for (; i != cap; ++i) {
+    b->index[i].head = 0;
+    b->index[i].ktype = S_MBOX_KTYPE_FREE;
+  }
+  b->iused = 0;
+  b->ikind = kind;
+
+  SMsg* m = b->head;
+  for (; m != 0; m = m->next) {
+    if (m->sender != 0) {
+      _IndexAdd(b, m);
+    }
+  }
+}
+
+// Unlink and free taken messages at the head, and compact the mailbox if many
+// taken messages are stuck behind a live one.
+static void _Reap(SMBox* b, SMsgPool* pool) {
+  SMsg* m = b->head;
+  while (m != 0 && m->sender == 0) {
+    SMsg* next = m->next;
+    SMsgFree(pool, m);
+    --b->taken;
+    m = next;
+  }
+  b->head = m;
+  if (m == 0) {
+    b->tail = 0;
+    assert(b->taken == 0);
+    return;
+  }
+
+  if (b->taken >= S_MBOX_COMPACT_MIN && b->taken > b->live) {
+    // Unlink all taken messages. The head is live, so it stays.
+    SMsg* prev = m;
+    for (m = m->next; m != 0; m = prev->next) {
+      if (m->sender == 0) {
+        prev->next = m->next;
+        SMsgFree(pool, m);
+      } else {
+        prev = m;
+      }
+    }
+    b->tail = prev;
+    b->taken = 0;
+  }
+}
+
+// Hand over the value and sender of message `m` and mark it as taken
+inline static void _Take(SMBox* b, SMsg* m, SValue* value,
+                         struct STask** sender) {
+  *value = m->value;
+  *sender = m->sender;
+  m->value = SValueNil;
+  m->sender = 0;
+  --b->live;
+  ++b->taken;
+}
+
+void SMBoxPut(SMBox* b, SMsg* m) {
+  assert(m->sender != 0);
+  m->next = 0;
+  if (b->tail == 0) {
+    b->head = m;
+  } else {
+    b->tail->next = m;
+  }
+  b->tail = m;
+  ++b->live;
+
+  if (b->index != 0) {
+    if ((b->iused + 1) * 2 > b->icap) {
+      // Too full. The new index includes `m`.
+      _IndexBuild(b, b->ikind);
+    } else {
+      _IndexAdd(b, m);
+    }
+  }
+}
+
+bool SMBoxTake(SMBox* b, SMsgPool* pool, SMBoxMatch kind, SValue key,
+               SValue* value, struct STask** sender) {
+  if (b->live == 0) {
+    return false;
+  }
+  if (b->index == 0 || b->ikind != kind) {
+    _IndexBuild(b, kind);
+  }
+
+  uint8_t ktype;
+  uint64_t k = _MatchKey(kind, key, &ktype);
+  SMBoxSlot* slot = _Find(b, k, ktype);
+  SMsg* m = slot->head;
+  if (m == 0) {
+    return false;
+  }
+  slot->head = m->inext;
+
+  _Take(b, m, value, sender);
+  _Reap(b, pool);
+  return true;
+}
+
+bool SMBoxTakeFirst(SMBox* b, SMsgPool* pool, SValue* value,
+                    struct STask** sender) {
+  if (b->live == 0) {
+    return false;
+  }
+  // Taken messages are never left at the head
+  SMsg* m = b->head;
+  assert(m->sender != 0);
+
+  if (b->index != 0) {
+    // The oldest message is also the oldest message with its key
+    uint8_t ktype;
+    uint64_t key = _MsgKey(b->ikind, m, &ktype);
+    SMBoxSlot* slot = _Find(b, key, ktype);
+    assert(slot->head == m);
+    slot->head = m->inext;
+  }
+
+  _Take(b, m, value, sender);
+  _Reap(b, pool);
+  return true;
+}
+
+void SMBoxFree(SMBox* b, SMsgPool* pool) {
+  assert(b->live == 0);
+  SMsg* m = b->head;
+  while (m != 0) {
+    SMsg* next = m->next;
+    SMsgFree(pool, m);
+    m = next;
+  }
+  free((void*)b->index);
+  *b = S_MBOX_INIT;
+}
@@ -0,0 +1,69 @@
+// Mailbox -- messages which a task has taken out of its inbox but not yet
+// received, in the order they arrived. Used for selective receive, where a task
+// receives the oldest message which matches something, skipping others.
+//
+// To not have to scan over non-matching messages again and again, the mailbox
+// keeps a hash index of its messages for the kind of match (e.g. by sender)
+// last asked for. Each key maps to the messages with that key in arrival order,
+// so finding a match costs O(1), and so does adding a message. Switching to
+// another kind of match rebuilds the index once, which is O(n).
+//
+// A message which is taken out of the middle of the mailbox by a match is only
+// marked as taken, and unlinked later when the mailbox is compacted.
+//
+// A mailbox belongs to one task and is not thread safe.
+#ifndef S_MBOX_H_
+#define S_MBOX_H_
+#include <sol/common.h>
+#include <sol/msg.h>
+
+struct STask;
+
+// What a selective receive matches messages on
+typedef uint8_t SMBoxMatch;
+enum {
+  SMBoxMatchSender = 0, // Message was sent by a certain task
+  SMBoxMatchValue,      // Message value is equal to a certain value
+  SMBoxMatchType,       // Message value is of a certain type (SValueT)
+};
+
+typedef struct {
+  uint64_t key;   // Key, which together with `ktype` identifies a key
+  SMsg*    head;  // Oldest message with this key, or 0 if there are none
+  SMsg*    tail;  // Newest message with this key
+  uint8_t  ktype; // Type part of the key. 0xff for slots never used.
+} SMBoxSlot;
+
+typedef struct SMBox {
+  SMsg*      head;  // Oldest message, which might be taken
+  SMsg*      tail;  // Newest message
+  uint32_t   live;  // Number of messages which are not taken
+  uint32_t   taken; // Number of taken messages still linked in
+
+  SMBoxSlot* index; // Index of messages keyed by `ikind`. Open addressing.
+  uint32_t   icap;  // Number of slots in `index`. Always a power of two.
+  uint32_t   iused; // Number of slots in use, including slots with no messages
+  SMBoxMatch ikind; // What `index` is keyed on
+} SMBox;
+
+// Constant initializer
+#define S_MBOX_INIT (SMBox){0, 0, 0, 0, 0, 0, 0, 0}
+
+// Add message `m` as the newest message
+void SMBoxPut(SMBox* b, SMsg* m);
+
+// Take the oldest message which matches `key` by `kind`. Its value and sender
+// are stored to `value` and `sender`, which take over the references held by
+// the message. The message is freed to `pool` (see SMsgFree.) Returns false if
+// no message matches.
+bool SMBoxTake(SMBox* b, SMsgPool* pool, SMBoxMatch kind, SValue key,
+               SValue* value, struct STask** sender);
+
+// Like SMBoxTake, but takes the oldest message no matter what it is
+bool SMBoxTakeFirst(SMBox* b, SMsgPool* pool, SValue* value,
+                    struct STask** sender);
+
+// Free the index and taken messages. The mailbox must have no live messages.
+void SMBoxFree(SMBox* b, SMsgPool* pool);
+
+#endif // S_MBOX_H_
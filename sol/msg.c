@@ -15,6 +15,13 @@ bool SMsgEnqueue(SMsgQ* q, SMsg* m) {
   return prev == &q->sentinel;
 }
 
+bool SMsgEnqueueBatch(SMsgQ* q, SMsg* first, SMsg* last) {
+  last->next = 0;
+  SMsg* prev = SAtomicSwap(&q->head, last);
+  prev->next = first;
+  return prev == &q->sentinel;
+}
+
 SMsg* SMsgDequeue(SMsgQ* q) {
   SMsg* tail = q->tail;
   SMsg* next = tail->next;
@@ -47,3 +54,143 @@ SMsg* SMsgDequeue(SMsgQ* q) {
   }
   return 0;
 }
+
+SMsg* SMsgDequeueAll(SMsgQ* q) {
+  SMsg* tail = q->tail;
+  if (tail == &q->sentinel) {
+    tail = tail->next;
+    if (tail == 0) {
+      return 0;
+    }
+    q->tail = tail;
+  }
+
+  // Walk to the last node which is linked in. All nodes before it are ours.
+  SMsg* first = tail;
+  SMsg* last = 0;
+  SMsg* next;
+  while ((next = tail->next) != 0) {
+    if (next == &q->sentinel) {
+      // The sentinel was put back by an earlier dequeue. Unlink it, unless it's
+      // the last node, in which case it stays as the only node in the queue.
+      next = next->next;
+      if (next == 0) {
+        last = tail;
+        tail = &q->sentinel;
+        goto done;
+      }
+      tail->next = next;
+    }
+    last = tail;
+    tail = next;
+  }
+
+  if (tail == q->head) {
+    // `tail` is the last node in the queue. We can only take it once there's
+    // another node after it, so put the sentinel back.
+    SMsgEnqueue(q, &q->sentinel);
+    next = tail->next;
+    if (next != 0) {
+      last = tail;
+      tail = next;
+    }
+  } // else: a producer is about to link in a node after `tail`
+
+  done:
+  q->tail = tail;
+  if (last == 0) {
+    return 0;
+  }
+  last->next = 0;
+  return first;
+}
+
+// A slab starts with a header which takes up one cache line, followed by nodes
+typedef struct SMsgSlab {
+  SMsgPool*        pool;  // Must be first (see SMsgOwner)
+  struct SMsgSlab* next;  // Next slab owned by the same pool
+} SMsgSlab;
+#define S_MSGSLAB_HEADER_SIZE 64
+#define S_MSGSLAB_NODE_COUNT \
+  ((S_MSGPOOL_SLAB_SIZE - S_MSGSLAB_HEADER_SIZE) / sizeof(SMsg))
+
+void SMsgPoolFree(SMsgPool* p) {
+  SMsgSlab* slab = (SMsgSlab*)p->slabs;
+  while (slab != 0) {
+    SMsgSlab* next = slab->next;
+    free((void*)slab);
+    slab = next;
+  }
+  *p = S_MSGPOOL_INIT;
+}
+
+// Push a chain of nodes onto the remote list of `owner`
+inline static void _SMsgPushRemote(SMsgPool* owner, SMsg* head, SMsg* tail) {
+  SMsg* rhead;
+  do {
+    rhead = owner->remote;
+    tail->next = rhead;
+  } while (!SAtomicCAS(&owner->remote, rhead, head));
+}
+
+void SMsgPoolFlush(SMsgPool* p) {
+  if (p->batchc != 0) {
+    _SMsgPushRemote(p->batchpool, p->batch, p->batchtail);
+    p->batchpool = 0;
+    p->batch = p->batchtail = 0;
+    p->batchc = 0;
+  }
+}
+
+void _SMsgFreeForeign(SMsgPool* p, SMsgPool* owner, SMsg* m) {
+  if (p == 0) {
+    // No pool to batch with
+    _SMsgPushRemote(owner, m, m);
+    return;
+  }
+  if (p->batchpool != owner) {
+    // Only nodes owned by the same pool can be batched together
+    SMsgPoolFlush(p);
+    p->batchpool = owner;
+    p->batchtail = m;
+  }
+  m->next = p->batch;
+  p->batch = m;
+  if (++p->batchc == S_MSGPOOL_BATCH) {
+    SMsgPoolFlush(p);
+  }
+}
+
+SMsg* _SMsgPoolRefill(SMsgPool* p) {
+  // Take back all nodes that other threads have returned
+  SMsg* m = p->remote;
+  if (m != 0) {
+    m = (SMsg*)SAtomicSwap(&p->remote, (SMsg*)0);
+  }
+
+  if (m == 0) {
+    // Allocate a new slab
+    SMsgSlab* slab;
+    if (posix_memalign((void**)&slab, S_MSGPOOL_SLAB_SIZE,
+                       S_MSGPOOL_SLAB_SIZE) != 0) {
+      S_FATAL("posix_memalign failed");
+    }
+    slab->pool = p;
+    slab->next = (SMsgSlab*)p->slabs;
+    p->slabs = (void*)slab;
+    ++p->nslabs;
+
+    // Link all nodes but the first one, which we return, into the free list
+    m = (SMsg*)((uint8_t*)slab + S_MSGSLAB_HEADER_SIZE);
+    size_t i = 1;
+    for (; i != S_MSGSLAB_NODE_COUNT - 1; ++i) {
+      m[i].next = &m[i + 1];
+    }
+    m[i].next = 0;
+    p->free = &m[1];
+    return m;
+  }
+
+  p->free = m->next;
+  return m;
+}
@@ -12,14 +12,15 @@ typedef struct SMsg {
   struct SMsg* volatile next;
   SValue                value;
   struct STask*         sender;
-} SMsg; // 32
+  struct SMsg*          inext;    // Next message with the same key in a mailbox
+} SMsg; // 40
 
 typedef struct SMsgQ {
   SMsg* volatile        head;
   uint8_t               _pad;     // cache line hack
   SMsg*                 tail;
   SMsg                  sentinel;
-} SMsgQ; // 56
+} SMsgQ; // 64
 
 // Constant initializer. E.g. `q = S_MSGQ_INIT(q);`
 #define S_MSGQ_INIT(q) (SMsgQ){&(q).sentinel, 0, &(q).sentinel, {0}}
@@ -27,8 +28,98 @@ typedef struct SMsgQ {
 // Put message `m` at end of queue `q`. Returns true if the queue was empty.
 bool SMsgEnqueue(SMsgQ* q, SMsg* m);
 
+// Put the messages `first` through `last`, which are linked through their
+// `next` members, at end of queue `q` with a single atomic swap. Returns true
+// if the queue was empty.
+bool SMsgEnqueueBatch(SMsgQ* q, SMsg* first, SMsg* last);
+
 // Get the message at the beginning of the queue. Returns 0 if there are no
 // messages.
 SMsg* SMsgDequeue(SMsgQ* q);
 
+// Detach all messages that can currently be dequeued. Returns the first
+// message, which is linked to the others in order through `next`. The last
+// message's `next` is 0. Returns 0 if there are no messages.
+SMsg* SMsgDequeueAll(SMsgQ* q);
+
+// True if there are no messages in the queue. Must only be called by the
+// consumer. Returns false while a message is being enqueued, even though
+// SMsgDequeue might not be able to return it yet.
+inline static bool S_UNUSED SMsgQIsEmpty(SMsgQ* q) {
+  return q->head == &q->sentinel &&
+         q->tail == &q->sentinel &&
+         q->sentinel.next == 0;
+}
+
+// Message pool -- recycles SMsg nodes to avoid calling malloc and free for
+// every message sent.
+//
+// Nodes are carved out of slabs which are aligned to their size, so the pool
+// that owns a node is found by masking the node's address. Each pool has one
+// owner thread (e.g. a scheduler) which allocates and frees nodes without any
+// synchronization. Nodes freed by another thread are collected in a batch and
+// handed back to their owner all at once, costing one CAS per batch instead of
+// one per node. The owner picks up returned nodes when its free list runs dry.
+#define S_MSGPOOL_SLAB_SIZE 4096 // Bytes per slab. Must be a power of two.
+#define S_MSGPOOL_BATCH     32   // Max nodes in a batch freed by a non-owner
+
+typedef struct SMsgPool {
+  SMsg* volatile   remote;    // Nodes returned by other threads (LIFO)
+  uint8_t          _pad[56];  // Keep `remote` on its own cache line
+
+  SMsg*            free;      // Free nodes (owner only)
+  void*            slabs;     // All slabs owned by the pool
+
+  struct SMsgPool* batchpool; // Pool that owns the nodes in `batch`
+  SMsg*            batch;     // Nodes freed by us but owned by `batchpool`
+  SMsg*            batchtail; // Last node in `batch`
+  uint32_t         batchc;    // Number of nodes in `batch`
+
+  uint32_t         nslabs;    // Number of slabs allocated
+} SMsgPool;
+
+// Constant initializer
+#define S_MSGPOOL_INIT (SMsgPool){0, {0}, 0, 0, 0, 0, 0, 0, 0}
+
+// Free all slabs of pool `p`. No node allocated from `p` may be used after
+// this, which includes nodes which are still waiting in an inbox or in another
+// pool's batch.
+void SMsgPoolFree(SMsgPool* p);
+
+// Hand any batch of nodes that `p` has freed on behalf of other pools back to
+// the pool which owns them. Call this when the pool's thread is about to stop
+// freeing nodes for a while, so that the owner can reuse them.
+void SMsgPoolFlush(SMsgPool* p);
+
+// Slow paths of SMsgAlloc and SMsgFree
+SMsg* _SMsgPoolRefill(SMsgPool* p);
+void _SMsgFreeForeign(SMsgPool* p, SMsgPool* owner, SMsg* m);
+
+// Pool which owns node `m`
+#define SMsgOwner(m) \
+  (*(SMsgPool**)((uintptr_t)(m) & ~(uintptr_t)(S_MSGPOOL_SLAB_SIZE - 1)))
+
+// Allocate a message from pool `p`, which must be owned by the calling thread
+inline static SMsg* S_ALWAYS_INLINE SMsgAlloc(SMsgPool* p) {
+  SMsg* m = p->free;
+  if (m != 0) {
+    p->free = m->next;
+    return m;
+  }
+  return _SMsgPoolRefill(p);
+}
+
+// Free message `m`. `p` is the pool owned by the calling thread, or 0 if the
+// calling thread doesn't own a pool, in which case `m` is handed back to its
+// owner right away.
+inline static void S_ALWAYS_INLINE SMsgFree(SMsgPool* p, SMsg* m) {
+  SMsgPool* owner = SMsgOwner(m);
+  if (owner == p) {
+    m->next = p->free;
+    p->free = m;
+  } else {
+    _SMsgFreeForeign(p, owner, m);
+  }
+}
+
 #endif // S_MSG_H_
@@ -0,0 +1,236 @@
+#include "qsbr.h"
+
+volatile uint64_t _SQSBREpoch = 1;
+
+static SQSBR* volatile _records = 0; // All records ever made
+
+// Record of the calling thread while it's online. STaskRelease and friends
+// don't know which thread they're called from, so SQSBRRetire looks it up here.
+static __thread SQSBR* _self = 0;
+
+// Memory retired by threads which are not online participants, by epoch % 3.
+// Each list is freed once the global epoch is 2 past the epoch it's tagged with.
+static SQSBRNode* _orphans[S_QSBR_NLISTS] = {0};
+static uint64_t _orphanepoch[S_QSBR_NLISTS] = {0};
+static volatile uint32_t _norphans = 0; // Non-empty lists in `_orphans`
+static volatile uint32_t _orphanlock = 0;
+
+inline static void S_ALWAYS_INLINE _OrphanLock() {
+  while (!SAtomicCAS(&_orphanlock, (uint32_t)0, (uint32_t)1)) {
+    while (_orphanlock) {}
+  }
+}
+
+inline static void S_ALWAYS_INLINE _OrphanUnlock() {
+  SAtomicBarrier();
+  _orphanlock = 0;
+}
+
+// Free all nodes in list `n`. Returns the number of nodes.
+static uint32_t _FreeList(SQSBRNode* n) {
+  uint32_t count = 0;
+  while (n != 0) {
+    SQSBRNode* next = n->next;
+    n->free(n);
+    n = next;
+    ++count;
+  }
+  return count;
+}
+
+// True if any participant is online. Whatever the caller unlinked before a
+// full barrier can't be read by participants which are found offline, since
+// going online is followed by a full barrier too.
+static bool _AnyOnline() {
+  SQSBR* q = _records;
+  for (; q != 0; q = q->next) {
+    if (q->epoch != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Move the global epoch on from `e` if every online participant announced it
+static void _TryAdvance(uint64_t e) {
+  SQSBR* q = _records;
+  for (; q != 0; q = q->next) {
+    uint64_t qe = q->epoch;
+    if (qe != 0 && qe != e) {
+      return;
+    }
+  }
+  SAtomicCAS(&_SQSBREpoch, e, e + 1);
+}
+
+// Add the list `first` through `last`, retired when the global epoch was `e`,
+// to the shared lists
+static void _Orphan(SQSBRNode* first, SQSBRNode* last, uint64_t e) {
+  uint32_t i = (uint32_t)(e % S_QSBR_NLISTS);
+  _OrphanLock();
+  if (_orphans[i] == 0) {
+    ++_norphans;
+  }
+  // The list might hold memory retired three or more epochs ago, which now
+  // waits a little longer than it needs to
+  _orphanepoch[i] = e;
+  last->next = _orphans[i];
+  _orphans[i] = first;
+  _OrphanUnlock();
+}
+
+// Free the shared lists which were retired when the global epoch was `e` - 2
+// or earlier
+static void _CollectOrphans(uint64_t e) {
+  SQSBRNode* lists[S_QSBR_NLISTS];
+  uint32_t i = 0;
+  _OrphanLock();
+  for (; i != S_QSBR_NLISTS; ++i) {
+    lists[i] = 0;
+    if (_orphans[i] != 0 && _orphanepoch[i] + 2 <= e) {
+      lists[i] = _orphans[i];
+      _orphans[i] = 0;
+      --_norphans;
+    }
+  }
+  _OrphanUnlock();
+  for (i = 0; i != S_QSBR_NLISTS; ++i) {
+    _FreeList(lists[i]);
+  }
+}
+
+// Called when participant `q` announced epoch `e`. Frees our lists which were
+// retired three or more epochs ago, since the global epoch has moved on twice
+// since then.
+static void _Announced(SQSBR* q, uint64_t e) {
+  uint64_t x = q->lepoch;
+  if (e - x > S_QSBR_NLISTS) {
+    x = e - S_QSBR_NLISTS;
+  }
+  while (x != e) {
+    ++x;
+    SQSBRNode** lp = &q->retired[x % S_QSBR_NLISTS];
+    if (*lp != 0) {
+      q->nretired -= _FreeList(*lp);
+      *lp = 0;
+    }
+  }
+  q->lepoch = e;
+}
+
+// Free all memory retired by participant `q`, which must be offline while no
+// participant is online
+static void _FreeAll(SQSBR* q) {
+  uint32_t i = 0;
+  for (; i != S_QSBR_NLISTS; ++i) {
+    _FreeList(q->retired[i]);
+    q->retired[i] = 0;
+  }
+  q->nretired = 0;
+}
+
+SQSBR* SQSBRCreate() {
+  SQSBR* q = _records;
+  for (; q != 0; q = q->next) {
+    if (q->inuse == 0 && SAtomicCAS(&q->inuse, (uint32_t)0, (uint32_t)1)) {
+      return q;
+    }
+  }
+  q = (SQSBR*)calloc(1, sizeof(SQSBR));
+  q->inuse = 1;
+  SQSBR* head;
+  do {
+    head = _records;
+    q->next = head;
+  } while (!SAtomicCAS(&_records, head, q));
+  return q;
+}
+
+void SQSBRDestroy(SQSBR* q) {
+  assert(q->epoch == 0); // must be offline
+  uint32_t i = 0;
+  for (; i != S_QSBR_NLISTS; ++i) {
+    SQSBRNode* first = q->retired[i];
+    if (first != 0) {
+      SQSBRNode* last = first;
+      while (last->next != 0) {
+        last = last->next;
+      }
+      // The global epoch was at most one past ours when these were retired
+      _Orphan(first, last, q->lepoch + 1);
+      q->retired[i] = 0;
+    }
+  }
+  q->nretired = 0;
+  q->lepoch = 0;
+  SAtomicBarrier();
+  if (_norphans != 0 && !_AnyOnline()) {
+    _CollectOrphans(UINT64_MAX);
+  }
+  q->inuse = 0;
+}
+
+void SQSBROnline(SQSBR* q) {
+  assert(q->epoch == 0); // must be offline
+  uint64_t e = _SQSBREpoch;
+  q->epoch = e;
+  // Be seen as online before we read anything
+  SAtomicBarrier();
+  _self = q;
+  _Announced(q, e);
+  q->ticks = S_QSBR_ADVANCE_EVERY;
+}
+
+void SQSBROffline(SQSBR* q) {
+  // Be done reading before we're seen as offline
+  SAtomicBarrier();
+  q->epoch = 0;
+  _self = 0;
+  if (q->nretired != 0 || _norphans != 0) {
+    SAtomicBarrier();
+    if (!_AnyOnline()) {
+      // Nobody can be reading anything
+      _FreeAll(q);
+      _CollectOrphans(UINT64_MAX);
+    }
+  }
+}
+
+bool SQSBRIsOnline() {
+  return _self != 0;
+}
+
+void SQSBRRetire(SQSBRNode* n) {
+  SQSBR* q = _self;
+  if (q != 0) {
+    SQSBRNode** lp = &q->retired[q->lepoch % S_QSBR_NLISTS];
+    n->next = *lp;
+    *lp = n;
+    ++q->nretired;
+    return;
+  }
+  // Whatever we unlinked `n` from must be seen before we look at participants
+  SAtomicBarrier();
+  if (!_AnyOnline()) {
+    n->free(n);
+    return;
+  }
+  n->next = 0;
+  _Orphan(n, n, _SQSBREpoch);
+}
+
+void _SQSBRQuiescent(SQSBR* q, uint64_t e) {
+  if (q->epoch != e) {
+    // Be done reading before we announce that we are
+    SAtomicLightBarrier();
+    q->epoch = e;
+    _Announced(q, e);
+  }
+  q->ticks = S_QSBR_ADVANCE_EVERY;
+  if (q->nretired != 0 || _norphans != 0) {
+    _TryAdvance(e);
+    if (_norphans != 0) {
+      _CollectOrphans(e);
+    }
+  }
+}
@@ -0,0 +1,88 @@
+// Quiescent-state-based reclamation (QSBR) -- defers freeing memory which other
+// threads might still be reading without holding a reference to it, until each
+// of those threads has passed a quiescent state, i.e. a point where it holds on
+// to no such memory. Reading costs nothing: no reference is taken and no shared
+// memory is written.
+//
+// Each thread that reads shared memory this way, e.g. a scheduler, is a
+// participant with an SQSBR record. A participant is online while it may read,
+// and offline while it doesn't, e.g. while a scheduler is parked. An online
+// participant calls SQSBRQuiescent now and then, e.g. once per run-loop cycle,
+// which announces that it has passed a quiescent state.
+//
+// Time is divided into epochs. A participant announces a quiescent state by
+// storing the global epoch in its record, and the global epoch moves on once
+// every online participant has announced the current one. Memory is retired
+// by the thread that unlinks it, e.g. when the last reference to a task goes
+// away, and it's freed once the global epoch has moved on twice, at which
+// point every participant which could have been reading it has passed a
+// quiescent state.
+//
+// Retired memory is kept in lists owned by the retiring participant, one per
+// epoch, and a whole list is freed at once. Memory retired by a thread which is
+// not an online participant goes to a list shared by everyone under a lock,
+// unless no participant is online at all, in which case it's freed right away.
+#ifndef S_QSBR_H_
+#define S_QSBR_H_
+#include <sol/common.h>
+
+// Something to be freed after a grace period. Embedded in what's retired.
+typedef struct SQSBRNode {
+  struct SQSBRNode* next;
+  void (*free)(struct SQSBRNode*); // Frees the memory the node is part of
+} SQSBRNode;
+
+#define S_QSBR_NLISTS 3 // Lists of retired memory: Enough for epochs e-2...e
+#define S_QSBR_ADVANCE_EVERY 32 // Quiescent states between attempts to move
+                                // the global epoch on
+
+// A participant
+typedef struct SQSBR {
+  volatile uint64_t epoch;   // Global epoch last announced, or 0 while offline
+  uint64_t          lepoch;  // Epoch of our newest list in `retired`
+  SQSBRNode*        retired[S_QSBR_NLISTS]; // Retired memory, by epoch % 3
+  uint32_t          nretired; // Nodes in `retired`
+  uint32_t          ticks;   // Quiescent states until we try to advance
+  volatile uint32_t inuse;   // 1 while the record belongs to someone
+  struct SQSBR*     next;    // Next record ever made
+  uint8_t           _pad[8]; // Keep records on separate cache lines
+} SQSBR; // 64
+
+// Take a participant record, which starts out offline. Records are never freed,
+// so that others can look at them at any time, and are reused once given back.
+SQSBR* SQSBRCreate();
+
+// Give back a participant record, which must be offline. Memory retired with
+// it is handed to the shared list.
+void SQSBRDestroy(SQSBR* q);
+
+// Make the calling thread an online participant with record `q`
+void SQSBROnline(SQSBR* q);
+
+// Take participant `q`, which is the calling thread, offline. Any memory read
+// without a reference must not be used after this.
+void SQSBROffline(SQSBR* q);
+
+// True if the calling thread is an online participant
+bool SQSBRIsOnline();
+
+// Free `n` by calling `n->free` once no participant can be reading it. Any
+// thread may call this.
+void SQSBRRetire(SQSBRNode* n);
+
+// Slow path of SQSBRQuiescent
+void _SQSBRQuiescent(SQSBR* q, uint64_t e);
+
+// Global epoch. Starts at 1, since 0 means offline.
+extern volatile uint64_t _SQSBREpoch;
+
+// Announce that participant `q`, which is online and the calling thread, has
+// passed a quiescent state
+inline static void S_ALWAYS_INLINE SQSBRQuiescent(SQSBR* q) {
+  uint64_t e = _SQSBREpoch;
+  if (q->epoch != e || --q->ticks == 0) {
+    _SQSBRQuiescent(q, e);
+  }
+}
+
+#endif // S_QSBR_H_
@@ -1,66 +1,94 @@
 // Run queue -- maintains a queue of tasks which are usually executed by a
 // Scheduler in order from head to tail.
+//
+// The queue is a ring buffer of task pointers rather than a list linked through
+// the tasks themselves. Finding the next task is an array read, which means the
+// scheduler can prefetch upcoming tasks without having to first load the task
+// in front of them. The buffer grows as needed and never shrinks.
 #ifndef S_RUNQ_H_
 #define S_RUNQ_H_
 #include <sol/common.h>
 #include <sol/task.h>
 
 typedef struct {
-  STask* head;  // Highest priority task
-  STask* tail;  // Lowest priority task
-  size_t count; // Number of queued tasks
+  STask**  v;     // Ring buffer of tasks
+  uint32_t head;  // Index in `v` of the first task in the queue
+  uint32_t count; // Number of queued tasks
+  uint32_t cap;   // Number of tasks `v` has room for. Always a power of two.
 } SRunQ;
 
 // Constant initializer
-#define S_RUNQ_INIT (SRunQ){0, 0, 0}
+#define S_RUNQ_INIT (SRunQ){0, 0, 0, 0}
+
+// Free memory used by the queue. Does not touch the queued tasks.
+inline static void S_UNUSED SRunQFree(SRunQ* q) {
+  free((void*)q->v);
+  *q = S_RUNQ_INIT;
+}
+
+// Task at index `i` from head
+#define SRunQAt(q, i) ((q)->v[((q)->head + (i)) & ((q)->cap - 1)])
+
+// Double the capacity of the queue
+inline static void S_UNUSED _SRunQGrow(SRunQ* q) {
+  uint32_t cap = q->cap;
+  q->cap = (cap == 0) ? 16 : cap * 2;
+  q->v = (STask**)realloc((void*)q->v, sizeof(STask*) * q->cap);
+  if (q->head + q->count > cap) {
+    // The queue wrapped around the end of the old buffer. Move the wrapped
+    // tasks to just after the old end so that they follow the others.
+    // 1. [C D A B] --> [_ _ A B C D _ _]
+    uint32_t wrapped = q->head + q->count - cap;
+    memcpy((void*)&q->v[cap], (const void*)q->v, sizeof(STask*) * wrapped);
+  }
+}
+
+// Make room for at least `n` more tasks
+inline static void S_UNUSED SRunQReserve(SRunQ* q, uint32_t n) {
+  while (q->cap - q->count < n) {
+    _SRunQGrow(q);
+  }
+}
 
 // Add to tail (end of queue)
-inline static void SRunQPushTail(SRunQ* q, STask* t) {
-  // 1. []       --> [A -> x]
-  // 2. [A -> x] --> [A -> B -> x]
-  //    ...
-  STask* tail = q->tail;
-  if (tail == 0) {
-    q->head = t;
-  } else {
-    tail->next = t;
+inline static void S_UNUSED SRunQPushTail(SRunQ* q, STask* t) {
+  if (q->count == q->cap) {
+    _SRunQGrow(q);
   }
-  q->tail = t;
+  SRunQAt(q, q->count) = t;
   ++q->count;
 }
 
-// Remove head (first in queue)
-inline static STask* SRunQPopHead(SRunQ* q) {
-  // 1. [A -> x]      --> []
-  // 2. [A -> B -> x] --> [B -> x]
-  //    ...
-  STask* t = q->head;
-  if (t == q->tail) {
-    q->head = 0;
-    q->tail = 0;
-    q->count = 0;
-  } else {
-    q->head = t->next;
-    --q->count;
-  }
+// Remove head (first in queue). Queue must not be empty.
+inline static STask* S_UNUSED SRunQPopHead(SRunQ* q) {
+  assert(q->count != 0);
+  STask* t = q->v[q->head];
+  q->head = (q->head + 1) & (q->cap - 1);
+  --q->count;
   return t;
 }
 
-// Dequeue each task
-#define SRunQPopEachHead(q, t) \
-  for (; ((t) = (q)->head) != 0; (q)->head = (t)->next)
-
 // Move head to tail
-inline static void SRunQPopHeadPushTail(SRunQ* q) {
-  // 1. [A -> x]      --> [A -> x] (noop)
-  // 2. [A -> B -> x] --> [B -> A -> x]
+inline static void S_UNUSED SRunQPopHeadPushTail(SRunQ* q) {
+  // 1. [A]      --> [A] (noop)
+  // 2. [A -> B] --> [B -> A]
   //    ...
-  STask* t = q->head;
-  if (q->tail != t) {
-    q->tail->next = t;
-    q->head = t->next;
-    t->next = 0;
-    q->tail = t;
+  if (q->count > 1) {
+    STask* t = SRunQPopHead(q);
+    SRunQAt(q, q->count) = t;
+    ++q->count;
+  }
+}
+
+// Hint that the tasks at the head of the queue are about to run. Prefetches the
+// second task, and the activation record of the first task (whose STask was
+// prefetched by an earlier call when it was second.)
+inline static void S_ALWAYS_INLINE SRunQPrefetch(const SRunQ* q) {
+  if (q->count != 0) {
+    S_PREFETCH(SRunQAt(q, 0)->ar);
+    if (q->count > 1) {
+      S_PREFETCH(SRunQAt(q, 1));
+    }
   }
 }
 
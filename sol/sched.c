@@ -1,11 +1,94 @@
 #include "sched.h"
+#include "chan.h"
+#include "buf.h"
+#include "topic.h"
 #include "instr.h"
 #include "log.h"
 #include "debug.h"
+#include "host.h"
 #include "../deps/libev/ev.h"
 
 typedef struct ev_loop EVLoop;
 
+// Starvation limit -- the number of times in a row a task can be picked from a
+// higher priority level while a lower priority level has runnable tasks. When
+// the limit is reached, the next task is instead taken from the lowest
+// non-empty priority level. Set to 0 to disable starvation protection.
+#ifndef S_SCHED_STARVE_LIMIT
+  #define S_SCHED_STARVE_LIMIT 32
+#endif
+
+// Maximum CPU utilization that admitted deadline tasks may add up to, in parts
+// per million. The remainder is left for best-effort tasks and the scheduler
+// itself.
+#ifndef S_SCHED_DL_MAX_UTIL
+  #define S_SCHED_DL_MAX_UTIL 900000
+#endif
+
+// Default for SSched.runnext_max -- the number of tasks in a row that can be
+// taken from the runnext slot before a task from the run queue is picked.
+#ifndef S_SCHED_RUNNEXT_MAX
+  #define S_SCHED_RUNNEXT_MAX 3
+#endif
+
+// Defaults for SSched.poll_every and SSched.poll_interval_us -- while there
+// are runnable tasks, events are polled for after this many task executions or
+// this many microseconds, whichever comes first.
+#ifndef S_SCHED_POLL_EVERY
+  #define S_SCHED_POLL_EVERY 64
+#endif
+#ifndef S_SCHED_POLL_INTERVAL_US
+  #define S_SCHED_POLL_INTERVAL_US 1000
+#endif
+
+// Defaults for the idle policy (SSched.idle_spins, idle_yields and
+// idle_park_us.) A parked scheduler that has no event watchers of its own wakes
+// up every `idle_park_us` to see if all other schedulers have become idle too.
+#ifndef S_SCHED_IDLE_SPINS
+  #define S_SCHED_IDLE_SPINS 1000
+#endif
+#ifndef S_SCHED_IDLE_YIELDS
+  #define S_SCHED_IDLE_YIELDS 10
+#endif
+#ifndef S_SCHED_IDLE_PARK_US
+  #define S_SCHED_IDLE_PARK_US 1000
+#endif
+
+// Max number of sources of a SELECT instruction. At most 255.
+#ifndef S_SCHED_SELECT_MAX
+  #define S_SCHED_SELECT_MAX 8
+#endif
+
+// Number of other schedulers whose subscribers a publisher to a topic gathers
+// into batches at once, before handing the batches over
+#ifndef S_SCHED_TOPIC_BATCHES
+  #define S_SCHED_TOPIC_BATCHES 8
+#endif
+
+// Fair mode weight -- instructions executed by a task are charged to the
+// virtual runtime of the task and of its group shifted left by the task's
+// priority level, e.g. a STaskPriLow task is charged 8 times more per
+// instruction than a STaskPriSystem task.
+#define S_SCHED_FAIR_CHARGE(icount, pri) ((icount) << (pri))
+
+typedef struct {
+  ev_timer evtimer; // must be head
+  STask*   task;
+} STimer;
+
+// What a task executing SELECT waits for. Records are kept in a free list of
+// the scheduler, so SELECT doesn't allocate memory once the scheduler has as
+// many records as it has tasks in SELECT at the same time.
+typedef struct SSelect {
+  STimer          timer;   // Timeout. Must be head.
+  struct SSelect* next;    // Next record in the free list
+  uint32_t        timeri;  // Index of the timeout source, or `n` if none
+  uint32_t        n;       // Number of sources
+  SChan*          chans[S_SCHED_SELECT_MAX];   // Channel sources, or 0
+  SFuture*        futs[S_SCHED_SELECT_MAX];    // Future sources, or 0
+  SChanWaiter     waiters[S_SCHED_SELECT_MAX]; // Our waiters in `chans`
+} SSelect;
+
 #if S_DEBUG
 void _DumpQ(STask* t) {
   size_t count = 0;
@@ -19,10 +102,27 @@ void _DumpQ(STask* t) {
     t = t->next;
   }
 }
+void _DumpRQ(SRunQ* q) {
+  uint32_t i = 0;
+  for (; i != q->count; ++i) {
+    fprintf(SLogStream,
+      "%s[task %p]%s",
+      (i % 4 == 0) ? "\n  " : "",
+      SRunQAt(q, i),
+      (i + 1 != q->count) ? " -> " : ""
+    );
+  }
+}
 void _DumpRQAndWQ(SSched* s) {
-  fprintf(SLogStream, "[sched %p] run queue:", s);
-  _DumpQ(s->rhead);
-  fprintf(SLogStream, "\n[sched %p] wait queue:", s);
+  size_t pri = 0;
+  for (; pri != S_TASK_PRI_COUNT; ++pri) {
+    if (s->rq[pri].count != 0) {
+      fprintf(SLogStream, "[sched %p] run queue %zu:", s, pri);
+      _DumpRQ(&s->rq[pri]);
+      fprintf(SLogStream, "\n");
+    }
+  }
+  fprintf(SLogStream, "[sched %p] wait queue:", s);
   _DumpQ(s->whead);
   fprintf(SLogStream, "\n");
 }
@@ -30,12 +130,64 @@ void _DumpRQAndWQ(SSched* s) {
 #define _DumpRQAndWQ(x) ((void)0)
 #endif
 
+static void _UnparkCallback(EVLoop* evloop, ev_async* w, int revents) {
+  // Nothing to do. The scheduler checks its remote queue after being unparked.
+}
+
+static void _UnparkTimerCallback(EVLoop* evloop, ev_timer* w, int revents) {
+  // Nothing to do. The scheduler checks if it should exit after being unparked.
+}
+
 SSched* SSchedCreate() {
   SSched* s = (SSched*)malloc(sizeof(SSched));
 
-  // Initialize run queue
-  s->rhead = 0;
-  s->rtail = 0;
+  // Initialize run queues
+  size_t pri = 0;
+  for (; pri != S_TASK_PRI_COUNT; ++pri) {
+    s->rq[pri] = S_RUNQ_INIT;
+  }
+  s->rqmask = 0;
+  s->starvec = 0;
+  s->starvpri = 0;
+
+  // Initialize fair mode group queue
+  s->policy = SSchedPolicyPriority;
+  s->fairq = S_HEAP_INIT;
+  s->minvrt = 0;
+  s->fcur = 0;
+
+  // Initialize deadline queue
+  s->dlq = S_HEAP_INIT;
+  s->dlutil = 0;
+
+  // Initialize runnext slot
+  s->runnext = 0;
+  s->runnext_max = S_SCHED_RUNNEXT_MAX;
+  s->rnchain = 0;
+
+  // Initialize event polling
+  s->poll_every = S_SCHED_POLL_EVERY;
+  s->poll_interval_us = S_SCHED_POLL_INTERVAL_US;
+  s->pollc = 0;
+  s->polltime = 0;
+  s->timers = S_HEAP_INIT;
+  s->ntimers = 0;
+
+  // Initialize idle policy and remote queue
+  s->idle_spins = S_SCHED_IDLE_SPINS;
+  s->idle_yields = S_SCHED_IDLE_YIELDS;
+  s->idle_park_us = S_SCHED_IDLE_PARK_US;
+  s->rq_remote = 0;
+  s->parked = 0;
+
+  // Initialize message pool, future pool and SELECT records
+  s->msgpool = S_MSGPOOL_INIT;
+  s->tids = S_TASKTAB_CACHE_INIT;
+  s->qs = SQSBRCreate();
+  s->futpool = S_FUTUREPOOL_INIT;
+  s->selfree_ = 0;
+
+  memset((void*)&s->stats, 0, sizeof(SSchedStats));
 
   // Initialize waiting queue
   s->whead = 0;
@@ -48,12 +200,44 @@ SSched* SSchedCreate() {
   // access the owning scheduler.
   ev_set_userdata((EVLoop*)s->events_, (void*)s);
 
+  // Other threads wake us up from being parked through the `unpark_` watcher.
+  // It should not by itself keep the event loop running, hence the unref.
+  ev_async* unpark = (ev_async*)malloc(sizeof(ev_async));
+  ev_async_init(unpark, _UnparkCallback);
+  ev_async_start((EVLoop*)s->events_, unpark);
+  ev_unref((EVLoop*)s->events_);
+  s->unpark_ = (void*)unpark;
+
+  ev_timer* parktimer = (ev_timer*)malloc(sizeof(ev_timer));
+  ev_init(parktimer, _UnparkTimerCallback);
+  s->parktimer_ = (void*)parktimer;
+
   return s;
 }
 
 void SSchedDestroy(SSched* s) {
   // TODO: Free any tasks in RQ and WQ
+  size_t pri = 0;
+  for (; pri != S_TASK_PRI_COUNT; ++pri) {
+    SRunQFree(&s->rq[pri]);
+  }
+  SHeapFree(&s->fairq);
+  SHeapFree(&s->dlq);
+  SHeapFree(&s->timers);
+  SMsgPoolFree(&s->msgpool);
+  SFuturePoolFree(&s->futpool);
+  STaskTabFlush(&s->tids);
+  SQSBRDestroy(s->qs);
+  while (s->selfree_ != 0) {
+    SSelect* sel = (SSelect*)s->selfree_;
+    s->selfree_ = (void*)sel->next;
+    free((void*)sel);
+  }
+  ev_ref((EVLoop*)s->events_); // balances the unref in SSchedCreate
+  ev_async_stop((EVLoop*)s->events_, (ev_async*)s->unpark_);
   ev_loop_destroy((EVLoop*)s->events_);
+  free(s->unpark_);
+  free(s->parktimer_);
   free((void*)s);
 }
 
@@ -97,13 +281,261 @@ _ListRemove(STask** head, STask** tail, STask* t) {
   }
 }
 
-// Add a task to the end of the Run Queue
+// Add task `t` to the live subtasks of task `supt`. If `supt` traps exits, the
+// message which tells it that `t` ended is allocated now, when it's cheap, so
+// that a batch of subtasks ending at once doesn't allocate memory.
+inline static void S_ALWAYS_INLINE
+_SubtaskAdd(SSched* s, STask* supt, STask* t) {
+  if (supt->flags & STaskFlagTrapExit) {
+    t->exitmsg = SMsgAlloc(&s->msgpool);
+  }
+  t->sibprev = 0;
+  t->sibnext = supt->subt;
+  if (supt->subt != 0) {
+    supt->subt->sibprev = t;
+  }
+  supt->subt = t;
+}
+
+// Remove task `t` from the live subtasks of its supertask
+inline static void S_ALWAYS_INLINE _SubtaskRemove(STask* t) {
+  if (t->sibprev != 0) {
+    t->sibprev->sibnext = t->sibnext;
+  } else if (t->supt->subt == t) {
+    t->supt->subt = t->sibnext;
+  }
+  if (t->sibnext != 0) {
+    t->sibnext->sibprev = t->sibprev;
+  }
+}
+
+SSchedGroup* SSchedGroupCreate() {
+  SSchedGroup* g = (SSchedGroup*)malloc(sizeof(SSchedGroup));
+  g->vrt = 0;
+  g->minvrt = 0;
+  g->rq = S_HEAP_INIT;
+  g->refc = 0;
+  g->queued = false;
+  return g;
+}
+
+// Release a task's reference to its scheduling group
+inline static void S_ALWAYS_INLINE _GroupRelease(SSchedGroup* g) {
+  if (--g->refc == 0) {
+    assert(g->rq.len == 0); // no runnable tasks can be left in the group
+    assert(!g->queued);
+    SHeapFree(&g->rq);
+    free((void*)g);
+  }
+}
+
+// Fair mode: Add a task to its group's run queue, and add the group to the
+// scheduler's group queue if the group is not already queued or running.
+//
+// Tasks and groups which have not been runnable for a while are brought up to
+// the smallest virtual runtime currently being scheduled, so that sleeping does
+// not earn credit to later monopolize the scheduler with.
+inline static void S_ALWAYS_INLINE _FairPush(SSched* s, STask* t) {
+  SSchedGroup* g = t->group;
+  assert(g != 0); // must have been assigned by SSchedTask or SPAWN
+  if (t->vrt < g->minvrt) {
+    t->vrt = g->minvrt;
+  }
+  SHeapPush(&g->rq, t->vrt, (void*)t);
+  if (!g->queued && g != s->fcur) {
+    if (g->vrt < s->minvrt) {
+      g->vrt = s->minvrt;
+    }
+    SHeapPush(&s->fairq, g->vrt, (void*)g);
+    g->queued = true;
+  }
+}
+
+// Fair mode: Remove and return the task with the smallest virtual runtime
+// from the group with the smallest virtual runtime. The group is taken off the
+// group queue while the task is executing and is put back by _FairCharge.
+inline static STask* S_ALWAYS_INLINE _FairPop(SSched* s) {
+  if (s->fairq.len == 0) {
+    return 0;
+  }
+  SSchedGroup* g = (SSchedGroup*)SHeapPop(&s->fairq);
+  g->queued = false;
+  s->minvrt = g->vrt;
+  s->fcur = g;
+  STask* t = (STask*)SHeapPop(&g->rq);
+  g->minvrt = t->vrt;
+  return t;
+}
+
+// Fair mode: Charge `icount` executed instructions to task `t` and its group.
+// If `t` was picked by _FairPop, requeue the group if it has other runnable
+// tasks. Must be called before `t` is requeued or unscheduled.
+//
+// Tasks not picked by _FairPop (deadline and runnext tasks) are charged too,
+// even though their group might be sitting in the group queue with a now
+// outdated key. The group is simply ordered by the older, smaller, key until
+// it's picked the next time.
+inline static void S_ALWAYS_INLINE
+_FairCharge(SSched* s, STask* t, uint64_t icount) {
+  SSchedGroup* g = t->group;
+  uint64_t vdelta = S_SCHED_FAIR_CHARGE(icount, t->pri);
+  t->vrt += vdelta;
+  g->vrt += vdelta;
+  if (g == s->fcur) {
+    s->fcur = 0;
+    if (g->rq.len != 0) {
+      SHeapPush(&s->fairq, g->vrt, (void*)g);
+      g->queued = true;
+    }
+  }
+}
+
+// Utilization of a deadline task in parts per million
+#define _DLUtil(deadline_us, runtime_us) \
+  ((uint32_t)(((uint64_t)(runtime_us) * 1000000) / (deadline_us)))
+
+bool SSchedAdmitDeadline(SSched* s, STask* t,
+                         uint32_t deadline_us, uint32_t runtime_us) {
+  assert(!(t->flags & STaskFlagDeadline)); // already admitted
+  if (deadline_us == 0 || runtime_us > deadline_us) {
+    return false;
+  }
+  uint32_t util = _DLUtil(deadline_us, runtime_us);
+  if (s->dlutil + util > S_SCHED_DL_MAX_UTIL) {
+    SLogD("[sched %p] deadline task %p not admitted", s, t);
+    return false;
+  }
+  s->dlutil += util;
+  t->flags |= STaskFlagDeadline;
+  t->dlrel = deadline_us;
+  t->dlrun = runtime_us;
+  return true;
+}
+
+// Start a new activation of deadline task `t` which just became runnable
+inline static void S_ALWAYS_INLINE _DLActivate(STask* t) {
+  if (t->flags & STaskFlagDeadline) {
+    t->dlabs = SHostMonotonicUSecs() + t->dlrel;
+    t->dlused = 0;
+  }
+}
+
+// Called after deadline task `t` ran from time `start` until it stopped with
+// `status`. Charges the time to the current activation, which completes when
+// the task suspends or ends, or yields after using up its runtime. In the
+// latter case the task has no activation (`dlabs` is 0) and is queued as a
+// best-effort task until it next becomes runnable, so that a task which keeps
+// yielding can not keep other tasks from running.
+inline static void S_ALWAYS_INLINE
+_DLRan(SSched* s, STask* t, STaskStatus status, uint64_t start) {
+  if (t->dlabs == 0) {
+    return; // Throttled
+  }
+  uint64_t now = SHostMonotonicUSecs();
+  uint64_t used = (uint64_t)t->dlused + (now - start);
+  t->dlused = (used < UINT32_MAX) ? (uint32_t)used : UINT32_MAX;
+  if (status == STaskStatusYield) {
+    if (t->dlused < t->dlrun) {
+      return; // Keeps running in the deadline class
+    }
+    ++s->stats.dlthrottles;
+    SLogD("[sched %p] task %p used up its runtime", s, t);
+  }
+  ++s->stats.dlruns;
+  if (now > t->dlabs) {
+    ++s->stats.dlmisses;
+    SLogD("[sched %p] task %p missed its deadline", s, t);
+  }
+  if (status == STaskStatusYield) {
+    t->dlabs = 0;
+  }
+}
+
+// True if there are no runnable tasks
+inline static bool S_ALWAYS_INLINE _RQIsEmpty(SSched* s) {
+  return s->rqmask == 0 && s->fairq.len == 0 && s->dlq.len == 0 &&
+         s->runnext == 0;
+}
+
+// Add a task to the end of the Run Queue for its priority level
 inline static void S_ALWAYS_INLINE _RQPush(SSched* s, STask* t) {
-  _ListPush(&s->rhead, &s->rtail, t);
+  if ((t->flags & STaskFlagDeadline) && t->dlabs != 0) {
+    SHeapPush(&s->dlq, t->dlabs, (void*)t);
+    return;
+  }
+  if (s->policy == SSchedPolicyFair) {
+    _FairPush(s, t);
+    return;
+  }
+  assert(t->pri < S_TASK_PRI_COUNT);
+  SRunQPushTail(&s->rq[t->pri], t);
+  s->rqmask |= (uint32_t)1 << t->pri;
 }
 
-inline static void S_ALWAYS_INLINE _RQRemove(SSched* s, STask* t) {
-  _ListRemove(&s->rhead, &s->rtail, t);
+// Remove and return the next task to run, or 0 if the Run Queue is empty.
+// Deadline tasks are always taken first, earliest deadline first. Next is the
+// task in the runnext slot, unless `runnext_max` tasks in a row have already
+// been taken from it or a higher priority level has tasks queued. Otherwise,
+// the task is taken from the highest priority level which has tasks queued,
+// unless lower levels have been passed over S_SCHED_STARVE_LIMIT times in a
+// row, in which case the task is taken from a lower non-empty level. Those
+// take turns, from higher to lower, so that every waiting level gets to run
+// and none of them more than the levels above it.
+inline static STask* S_ALWAYS_INLINE _RQPop(SSched* s) {
+  if (s->dlq.len != 0) {
+    return (STask*)SHeapPop(&s->dlq);
+  }
+
+  STask* t = s->runnext;
+  if (t != 0) {
+    if (s->rqmask & (((uint32_t)1 << t->pri) - 1)) {
+      // A higher priority level has tasks queued. Those go first.
+    } else if (s->rnchain < s->runnext_max ||
+               (s->rqmask == 0 && s->fairq.len == 0)) {
+      // Still within the chain limit, or there's nothing else to run
+      ++s->rnchain;
+      s->runnext = 0;
+      return t;
+    }
+  }
+  s->rnchain = 0;
+
+  if (s->policy == SSchedPolicyFair) {
+    return _FairPop(s);
+  }
+
+  uint32_t mask = s->rqmask;
+  if (mask == 0) {
+    return 0;
+  }
+
+  uint32_t pri = (uint32_t)__builtin_ctz(mask);
+
+  #if S_SCHED_STARVE_LIMIT
+  if ((mask >> pri) != 1) {
+    // There are tasks in lower priority levels waiting to run
+    if (++s->starvec == S_SCHED_STARVE_LIMIT) {
+      s->starvec = 0;
+      // The next level below the one picked last time, or the highest of the
+      // lower levels if there's none
+      uint32_t lower = mask & ~(((uint32_t)2 << pri) - 1);
+      uint32_t after = lower & ~(((uint32_t)2 << s->starvpri) - 1);
+      pri = (uint32_t)__builtin_ctz(after != 0 ? after : lower);
+      s->starvpri = pri;
+    }
+  } else {
+    s->starvec = 0;
+  }
+  #endif
+
+  SRunQ* q = &s->rq[pri];
+  t = SRunQPopHead(q);
+  if (q->count == 0) {
+    s->rqmask = mask & ~((uint32_t)1 << pri);
+  } else {
+    SRunQPrefetch(q);
+  }
+  return t;
 }
 
 // Add a task to the end of the Suspend Queue
@@ -116,36 +548,640 @@ inline static void S_ALWAYS_INLINE _WQRemove(SSched* s, STask* t) {
   _ListRemove(&s->whead, &s->wtail, t);
 }
 
+// Add task `t` which was just woken by the currently executing task to the
+// runnext slot, so that it runs as soon as the current task yields. Any task
+// already in the slot is moved to the end of its regular run queue.
+inline static void S_ALWAYS_INLINE _RQPushNext(SSched* s, STask* t) {
+  if (s->runnext_max == 0 || (t->flags & STaskFlagDeadline)) {
+    _RQPush(s, t);
+    return;
+  }
+  STask* prev = s->runnext;
+  s->runnext = t;
+  if (prev != 0) {
+    _RQPush(s, prev);
+  }
+}
+
+// Add the tasks of group `g`, which were just spawned, to the end of the Run
+// Queue. Room is made for the whole group at once.
+inline static void S_ALWAYS_INLINE _RQPushGroup(SSched* s, STaskGroup* g) {
+  uint32_t i = 0;
+  if (s->policy == SSchedPolicyFair) {
+    for (; i != g->n; ++i) {
+      _FairPush(s, STaskGroupAt(g, i));
+    }
+    return;
+  }
+  if (g->n == 0) {
+    return;
+  }
+  // The tasks inherited the priority level of the same supertask
+  STaskPri pri = STaskGroupAt(g, 0)->pri;
+  assert(pri < S_TASK_PRI_COUNT);
+  SRunQ* q = &s->rq[pri];
+  SRunQReserve(q, g->n);
+  for (; i != g->n; ++i) {
+    SRunQAt(q, q->count) = STaskGroupAt(g, i);
+    ++q->count;
+  }
+  s->rqmask |= (uint32_t)1 << pri;
+}
+
 void SSchedTask(SSched* s, STask* t) {
+  // A subtask must run in the scheduler which counts its references
+  assert(t->lrefc == 0 || t->sched == s);
+  t->sched = s;
+  if (s->policy == SSchedPolicyFair) {
+    // Each root task is its own group unless told otherwise
+    if (t->group == 0) {
+      t->group = SSchedGroupCreate();
+    }
+    ++t->group->refc;
+  }
+  _DLActivate(t);
   _RQPush(s, t);
 }
 
-typedef struct {
-  ev_timer evtimer; // must be head
-  STask*   task;
-} STimer;
+// Hand the `n` tasks `first` through `last`, which are linked through their
+// `rwnext` members, to scheduler `s` with a single CAS. `s` runs them in the
+// reverse order of the list.
+static void _SchedTaskRemoteBatch(SVM* vm, SSched* s, STask* first,
+                                  STask* last, int32_t n) {
+  // Count the tasks as work in the VM until `s` has picked them up, so that no
+  // scheduler exits in the meantime.
+  SAtomicAddAndFetch(&vm->nwork, n);
+  STask* head;
+  do {
+    head = s->rq_remote;
+    last->rwnext = head;
+  } while (!SAtomicCAS(&s->rq_remote, head, first));
+  // SAtomicCAS is a full barrier, so if `s` parks after this it will see the
+  // tasks when it checks its remote queue just before parking.
+  if (s->parked) {
+    ev_async_send((EVLoop*)s->events_, (ev_async*)s->unpark_);
+  }
+}
+
+void SSchedTaskRemote(SVM* vm, SSched* s, STask* t) {
+  _SchedTaskRemoteBatch(vm, s, t, t, 1);
+}
+
+// Move task `t` which is waiting for something from the Wait Queue to the end
+// of the Run Queue for the task's priority level.
+inline static void S_ALWAYS_INLINE _SchedWake(SSched* s, STask* t) {
+  assert(t->wp != 0); // must be waiting for something
+  _WQRemove(s, t);
+  t->wp = 0;
+  _DLActivate(t);
+  _RQPush(s, t);
+}
+
+// Like _SchedWake, but for a task woken by the currently executing task, which
+// is put in the runnext slot.
+inline static void S_ALWAYS_INLINE _SchedWakeNext(SSched* s, STask* t) {
+  assert(t->wp != 0); // must be waiting for something
+  _WQRemove(s, t);
+  t->wp = 0;
+  _DLActivate(t);
+  _RQPushNext(s, t);
+}
+
+// Values of STask.selstate. While a task waits in SELECT, its `selstate` is
+// S_SEL_ARMED, plus S_SEL_INBOX and the index of the inbox source if one of the
+// sources is the inbox. The first source to fire claims the SELECT by changing
+// `selstate` to S_SEL_FIRED plus its index, and only that source wakes the
+// task. The other sources are canceled by the task once it runs again.
+#define S_SEL_ARMED (1u << 31)
+#define S_SEL_INBOX (1u << 30)
+#define S_SEL_FIRED (1u << 29)
+#define S_SEL_INDEX(st) ((st) & 0xff)
+
+// Claim the SELECT that task `t` is waiting in for source `i`. Returns true if
+// the caller should wake `t`, or false if `t` is not waiting in a SELECT or
+// another source claimed it first.
+inline static bool S_ALWAYS_INLINE _SelectClaim(STask* t, uint32_t i) {
+  uint32_t st = t->selstate;
+  return (st & S_SEL_ARMED) && SAtomicCAS(&t->selstate, st, S_SEL_FIRED | i);
+}
+
+// Reserve room for one message in the inbox of task `to`. Returns false if the
+// inbox is full.
+inline static bool S_ALWAYS_INLINE _InboxReserve(STask* to) {
+  // `inboxout` might be stale, which only makes the inbox look fuller
+  uint32_t cap = to->inboxcap;
+  uint32_t n;
+  if (cap == 0) {
+    n = SAtomicAddAndFetch(&to->inboxin, 1);
+  } else {
+    do {
+      n = to->inboxin;
+      if (n - to->inboxout >= cap) {
+        return false;
+      }
+    } while (!SAtomicCAS(&to->inboxin, n, n + 1));
+    ++n;
+  }
+  uint32_t len = n - to->inboxout;
+  if (len > to->inboxhwm) {
+    to->inboxhwm = len; // Racy, but never lower than any single sender's view
+  }
+  return true;
+}
+
+// Lock and unlock the list of tasks waiting for room in the inbox of task `t`
+inline static void S_ALWAYS_INLINE _SendqLock(STask* t) {
+  while (!SAtomicCAS(&t->sendlock, (uint32_t)0, (uint32_t)1)) {
+    while (t->sendlock) {}
+  }
+}
+inline static void S_ALWAYS_INLINE _SendqUnlock(STask* t) {
+  SAtomicBarrier();
+  t->sendlock = 0;
+}
+
+// Wake task `t`, which waited for room in an inbox
+inline static void S_ALWAYS_INLINE _SchedWakeSender(SVM* vm, SSched* s,
+                                                    STask* t) {
+  if (t->sched == s) {
+    _SchedWake(s, t);
+  } else {
+    SSchedTaskRemote(vm, t->sched, t);
+  }
+}
+
+// Wake the task which has waited the longest for room in the inbox of task
+// `to`, if any. Called once for each message received, since that makes room
+// for exactly one more.
+static void _SchedWakeSenderFirst(SVM* vm, SSched* s, STask* to) {
+  _SendqLock(to);
+  SChanWaiter* w = SChanWaitPop(&to->sendq);
+  _SendqUnlock(to);
+  if (w != 0) {
+    _SchedWakeSender(vm, s, w->task);
+  }
+}
+
+// Wake all tasks waiting for room in the inbox of task `to`. Only needed when
+// the inbox's limit is lifted.
+static void _SchedWakeSendersAll(SVM* vm, SSched* s, STask* to) {
+  _SendqLock(to);
+  SChanWaiter* w = SChanWaitTakeAll(&to->sendq);
+  _SendqUnlock(to);
+  while (w != 0) {
+    SChanWaiter* next = w->next; // before waking, which may reuse `w`
+    _SchedWakeSender(vm, s, w->task);
+    w = next;
+  }
+}
+
+// Called when executing task `t` found the inbox of task `to` full. Adds `t` to
+// the end of the tasks waiting for room in the inbox. Returns true if `t`
+// should be suspended, or false if room was made meanwhile and `t` should
+// retry sending.
+static bool _SchedSendWait(SVM* vm, SSched* s, STask* t, STask* to) {
+  t->wp = (void*)&to->inbox;
+  t->wtype = STaskWaitSend;
+  _SendqLock(to);
+  SChanWaitPush(&to->sendq, &t->chwait);
+  SAtomicBarrier();
+  if (to->inboxcap != 0 && STaskInboxLen(to) >= to->inboxcap) {
+    _SendqUnlock(to);
+    return true;
+  }
+  // Room was made meanwhile, by a receiver which might not have seen us. Wake
+  // the first waiter in its place, which might be us. If the list is empty,
+  // the receiver did see us and is waking us.
+  SChanWaiter* w = SChanWaitPop(&to->sendq);
+  _SendqUnlock(to);
+  if (w != 0 && w->task == t) {
+    t->wp = 0;
+    return false;
+  }
+  if (w != 0) {
+    _SchedWakeSender(vm, s, w->task);
+  }
+  return true;
+}
+
+// Put message `m` in the inbox of task `to`, which has room reserved for it,
+// and wake `to` if it's waiting for a message
+inline static void S_ALWAYS_INLINE
+_SchedDeliver(SVM* vm, SSched* s, STask* to, SMsg* m) {
+  SMsgEnqueue(&to->inbox, m);
+
+  // SMsgEnqueue is a full barrier, so if `to` started waiting before our
+  // message was enqueued, we see `msgwait` set. Of all senders that do, only
+  // one gets to wake `to` up. If `to` is instead in a SELECT which waits for
+  // its inbox among other things, we wake it if we claim the SELECT first.
+  uint32_t st;
+  if ((to->msgwait && SAtomicCAS(&to->msgwait, (uint32_t)1, (uint32_t)0)) ||
+      (((st = to->selstate) & S_SEL_INBOX) &&
+       SAtomicCAS(&to->selstate, st, S_SEL_FIRED | S_SEL_INDEX(st)))) {
+    if (to->sched == s) {
+      _SchedWakeNext(s, to);
+    } else {
+      SSchedTaskRemote(vm, to->sched, to);
+    }
+  }
+}
+
+// Send `value` from task `from` to the inbox of task `to`. If `to` is waiting
+// for a message, it's woken up. Returns false without sending if the inbox of
+// `to` is full. If `move` is true, the message takes over the caller's
+// reference to what `value` references instead of adding one.
+inline static bool S_ALWAYS_INLINE
+_SchedTrySend(SVM* vm, SSched* s, STask* from, STask* to, SValue value,
+              bool move) {
+  if (!_InboxReserve(to)) {
+    return false;
+  }
+  SMsg* m = SMsgAlloc(&s->msgpool);
+  m->value = value;
+  m->sender = from;
+  STaskRetain(from); // The message references its sender...
+  if (!move) {
+    SValueRetain(value); // ...and anything its value references
+  }
+  _SchedDeliver(vm, s, to, m);
+  return true;
+}
+
+// Called by executing task `t` after receiving a message. Gives back the room
+// the message took up in the inbox of `t`, waking the task which has waited
+// the longest for room.
+inline static void S_ALWAYS_INLINE
+_SchedInboxRelease(SVM* vm, SSched* s, STask* t) {
+  ++t->inboxout; // Only ever written by the receiver
+  if (t->inboxcap != 0) {
+    // A sender adds itself to `sendq` before it looks at `inboxout` again, so
+    // with a barrier in between, one of us sees the other.
+    SAtomicBarrier();
+    if (t->sendq.head != 0) {
+      _SchedWakeSenderFirst(vm, s, t);
+    }
+  }
+}
+
+// Wake task `t` which is waiting for something that the executing task just
+// did. `t` might belong to another scheduler.
+inline static void S_ALWAYS_INLINE _SchedWakeAny(SVM* vm, SSched* s, STask* t) {
+  if (t->sched == s) {
+    _SchedWakeNext(s, t);
+  } else {
+    SSchedTaskRemote(vm, t->sched, t);
+  }
+}
+
+// Remove waiters from the front of wait list `q` until one of them can be
+// woken, and return its task, or 0 if there's none. A waiter in a SELECT which
+// another source claimed first is only removed. Must hold the channel's lock.
+static STask* _ChanWaitTake(SChanWaitQ* q) {
+  SChanWaiter* w;
+  while ((w = SChanWaitPop(q)) != 0) {
+    // The task can't cancel the SELECT without taking its waiters out of the
+    // lists first, which it needs the lock for
+    if (w->sel == 0 || _SelectClaim(w->task, w->sel - 1)) {
+      return w->task;
+    }
+  }
+  return 0;
+}
+
+// Called by the executing task after sending to or receiving from channel `c`.
+// Wakes the first task in wait list `q`, if any.
+inline static void S_ALWAYS_INLINE
+_SchedChanWakeOne(SVM* vm, SSched* s, SChan* c, SChanWaitQ* q) {
+  // A task adds itself to a wait list before it looks at the channel again, so
+  // with a barrier in between, one of us sees the other.
+  SAtomicBarrier();
+  if (q->head == 0) {
+    return;
+  }
+  SChanLock(c);
+  STask* t = _ChanWaitTake(q);
+  SChanUnlock(c);
+  if (t != 0) {
+    _SchedWakeAny(vm, s, t);
+  }
+}
+
+// Called when executing task `t` found channel `c` full (if `sending`) or
+// empty. Adds `t` to the channel's senders or receivers. Returns true if `t`
+// should be suspended, or false if it should try again right away.
+static bool _SchedChanWait(SVM* vm, SSched* s, STask* t, SChan* c,
+                           bool sending) {
+  SChanWaitQ* q = sending ? &c->sendq : &c->recvq;
+  SChanLock(c);
+  if (c->closed) {
+    SChanUnlock(c);
+    return false;
+  }
+  t->wp = (void*)c;
+  t->wtype = STaskWaitChan;
+  SChanWaitPush(q, &t->chwait);
+  SAtomicBarrier();
+  if (sending ? SChanIsFull(c) : SChanIsEmpty(c)) {
+    SChanUnlock(c);
+    return true;
+  }
+  // Room was made or a value arrived meanwhile, by someone who might not have
+  // seen us. Wake the first waiter in its place, which might be us.
+  STask* w = _ChanWaitTake(q);
+  SChanUnlock(c);
+  if (w == t) {
+    t->wp = 0;
+    return false;
+  }
+  _SchedWakeAny(vm, s, w);
+  return true;
+}
+
+// Called by the executing task after sending to or receiving from SPSC channel
+// `c`. Wakes the peer if it's waiting in slot `w`.
+inline static void S_ALWAYS_INLINE
+_SchedSPSCWake(SVM* vm, SSched* s, SChan* c, STask* volatile* w) {
+  // A task puts itself in its waiter slot and then looks at the channel again,
+  // with a barrier in between which also covers us (see _SchedSPSCWait.) If
+  // SHostMembarrier isn't available, we need a barrier too.
+  if (c->membarrier) {
+    SAtomicLightBarrier();
+  } else {
+    SAtomicBarrier();
+  }
+  if (*w != 0) {
+    STask* t = (STask*)SAtomicSwap(w, (STask*)0);
+    if (t != 0) {
+      _SchedWakeAny(vm, s, t);
+    }
+  }
+}
+
+// Like _SchedChanWait, but for SPSC channel `c`
+static bool _SchedSPSCWait(SVM* vm, SSched* s, STask* t, SChan* c,
+                           bool sending) {
+  STask* volatile* w = sending ? &c->sendwaiter : &c->recvwaiter;
+  SSched* peer = sending ? c->recvsched : c->sendsched;
+  t->wp = (void*)c;
+  t->wtype = STaskWaitChan;
+  *w = t;
+  if (peer == s) {
+    // The peer runs in our thread, so it's not sending or receiving right now
+    SAtomicLightBarrier();
+  } else if (!c->membarrier || !SHostMembarrier()) {
+    SAtomicBarrier();
+  }
+  if (!c->closed && (sending ? SChanSPSCIsFull(c) : SChanSPSCIsEmpty(c))) {
+    return true;
+  }
+  // Room was made, a value arrived or the channel was closed meanwhile. Take
+  // ourselves out of the waiter slot, unless the peer already did so to wake
+  // us up.
+  if (SAtomicCAS(w, t, (STask*)0)) {
+    t->wp = 0;
+    return false;
+  }
+  return true;
+}
+
+// Close channel `c` and wake all tasks waiting on it
+static void _SchedChanClose(SVM* vm, SSched* s, SChan* c) {
+  c->closed = 1;
+  if (c->flags & SChanFlagSPSC) {
+    SAtomicBarrier();
+    STask* waiters[] = {
+      (STask*)SAtomicSwap(&c->sendwaiter, (STask*)0),
+      (STask*)SAtomicSwap(&c->recvwaiter, (STask*)0),
+    };
+    size_t i = 0;
+    for (; i != s_countof(waiters); ++i) {
+      if (waiters[i] != 0) {
+        _SchedWakeAny(vm, s, waiters[i]);
+      }
+    }
+    return;
+  }
+  // Collect the tasks to wake while holding the lock, and wake them after
+  STask* head = 0;
+  STask* tail = 0;
+  STask* t;
+  SChanLock(c);
+  SChanWaitQ* lists[] = {&c->sendq, &c->recvq};
+  size_t i = 0;
+  for (; i != s_countof(lists); ++i) {
+    while ((t = _ChanWaitTake(lists[i])) != 0) {
+      t->rwnext = 0;
+      if (head == 0) {
+        head = t;
+      } else {
+        tail->rwnext = t;
+      }
+      tail = t;
+    }
+  }
+  SChanUnlock(c);
+  while (head != 0) {
+    t = head;
+    head = t->rwnext; // before waking, which may link `t` elsewhere
+    _SchedWakeAny(vm, s, t);
+  }
+}
+
+// Called when executing task `t` found nothing at cursor `pos` of topic `tp`.
+// Adds `t` to the topic's waiting subscribers. Returns true if `t` should be
+// suspended, or false if a value was published meanwhile.
+static bool _SchedTopicWait(STask* t, STopic* tp, uint32_t pos) {
+  // Publishers hold the lock, so no value can be published while we look
+  STopicLock(tp);
+  if (tp->pubpos != pos) {
+    STopicUnlock(tp);
+    return false;
+  }
+  t->wp = (void*)tp;
+  t->wtype = STaskWaitTopic;
+  SChanWaitPush(&tp->waitq, &t->chwait);
+  STopicUnlock(tp);
+  return true;
+}
+
+// Wake the tasks in the list starting with waiter `w`, which was taken from a
+// wait list with SChanWaitTakeAll, e.g. by a publisher from a topic. Our own
+// tasks are put in the run queue, and the tasks of each other scheduler are
+// handed to it in one batch.
+static void _SchedWakeWaiters(SVM* vm, SSched* s, SChanWaiter* w) {
+  struct {
+    SSched*  sched;
+    STask*   first;
+    STask*   last;
+    int32_t  n;
+  } batches[S_SCHED_TOPIC_BATCHES];
+  size_t nbatches = 0;
+  size_t i;
+  for (; w != 0; w = w->next) {
+    STask* t = w->task;
+    if (t->sched == s) {
+      _SchedWake(s, t);
+      continue;
+    }
+    for (i = 0; i != nbatches && batches[i].sched != t->sched; ++i) {}
+    if (i == s_countof(batches)) {
+      // Subscribers in more schedulers than we have batches for. Hand over
+      // what we have so far.
+      for (i = 0; i != nbatches; ++i) {
+        _SchedTaskRemoteBatch(vm, batches[i].sched, batches[i].first,
+                              batches[i].last, batches[i].n);
+      }
+      nbatches = 0;
+      i = 0;
+    }
+    if (i == nbatches) {
+      batches[i].sched = t->sched;
+      batches[i].last = t;
+      batches[i].n = 0;
+      ++nbatches;
+    }
+    // The scheduler runs the list in reverse, so build it in reverse
+    t->rwnext = (batches[i].n == 0) ? 0 : batches[i].first;
+    batches[i].first = t;
+    ++batches[i].n;
+  }
+  for (i = 0; i != nbatches; ++i) {
+    _SchedTaskRemoteBatch(vm, batches[i].sched, batches[i].first,
+                          batches[i].last, batches[i].n);
+  }
+}
+
+// Publish `v` to topic `tp`, which takes over any reference held by `v`, and
+// wake all subscribers waiting for it
+static void _SchedTopicPublish(SVM* vm, SSched* s, STopic* tp, SValue v) {
+  STopicLock(tp);
+  SValue old = STopicPublish(tp, v);
+  SChanWaiter* w = SChanWaitTakeAll(&tp->waitq);
+  STopicUnlock(tp);
+  SValueRelease(old);
+  if (w != 0) {
+    _SchedWakeWaiters(vm, s, w);
+  }
+}
+
+// Fulfill future `f` with `v`, which the future takes over any reference held
+// by, and wake the task waiting for it. Returns false without doing anything if
+// `f` is already fulfilled.
+static bool _SchedFutureFulfill(SVM* vm, SSched* s, SFuture* f, SValue v) {
+  SFutureLock(f);
+  if (f->state != SFutureStatePending) {
+    SFutureUnlock(f);
+    return false;
+  }
+  f->value = v;
+  SAtomicLightBarrier(); // The value is written before it's published
+  f->state = SFutureStateFulfilled;
+  // A task waiting in a SELECT is only woken if we claim the SELECT first.
+  // We do so while holding the lock, since the task takes itself out of
+  // `waiter` under the lock once any source has claimed the SELECT.
+  STask* t = f->waiter;
+  if (t != 0 && f->waitsel != 0 && !_SelectClaim(t, f->waitsel - 1)) {
+    t = 0;
+  }
+  f->waiter = 0;
+  SFutureUnlock(f);
+  if (t != 0) {
+    _SchedWakeAny(vm, s, t);
+  }
+  return true;
+}
+
+// Called when executing task `t` found future `f` pending. Makes `t` the task
+// waiting for `f`. Returns true if `t` should be suspended, or false if `f` was
+// fulfilled meanwhile.
+static bool _SchedFutureWait(STask* t, SFuture* f) {
+  SFutureLock(f);
+  if (f->state != SFutureStatePending) {
+    SFutureUnlock(f);
+    return false;
+  }
+  assert(f->waiter == 0); // only one task may wait for a future
+  f->waiter = t;
+  f->waitsel = 0;
+  t->wp = (void*)f;
+  t->wtype = STaskWaitFuture;
+  SFutureUnlock(f);
+  return true;
+}
+
+// Called when executing task `t` found tasks of group `g` still alive. Adds
+// `t` to the tasks waiting in JOIN. Returns true if `t` should be suspended, or
+// false if the last task of `g` ended meanwhile.
+static bool _SchedJoinWait(STask* t, STaskGroup* g) {
+  STaskGroupLock(g);
+  if (g->live == 0) {
+    STaskGroupUnlock(g);
+    return false;
+  }
+  t->wp = (void*)g;
+  t->wtype = STaskWaitJoin;
+  SChanWaitPush(&g->waitq, &t->chwait);
+  STaskGroupUnlock(g);
+  return true;
+}
+
+// Called when a task of group `g` ended. Wakes the tasks waiting in JOIN if it
+// was the last one.
+inline static void S_ALWAYS_INLINE
+_SchedGroupTaskEnded(SVM* vm, SSched* s, STaskGroup* g) {
+  if (SAtomicSubAndFetch(&g->live, 1) != 0) {
+    return;
+  }
+  // A joining task looks at `live` while holding the lock, so it either saw
+  // the tasks alive and is in the wait list by now, or sees them all ended
+  STaskGroupLock(g);
+  SChanWaiter* w = SChanWaitTakeAll(&g->waitq);
+  STaskGroupUnlock(g);
+  if (w != 0) {
+    _SchedWakeWaiters(vm, s, w);
+  }
+}
+
+// Release the references held by task handles and other reference values in
+// the registers of activation record `ar`
+inline static void S_ALWAYS_INLINE _ARecReleaseRegs(SARec* ar) {
+  size_t i = 0;
+  for (; i != s_countof(ar->registry); ++i) {
+    if (SValueHoldsRef(ar->registry[i])) {
+      _SValueReleaseRef(ar->registry[i]);
+      ar->registry[i] = SValueNil;
+    }
+  }
+}
+
+// Release the references held by reference values in the registers of
+// activation record `ar` and its parents.
+inline static void S_ALWAYS_INLINE _ARecReleaseRefs(SARec* ar) {
+  for (; ar != 0; ar = ar->parent) {
+    _ARecReleaseRegs(ar);
+  }
+}
+
+// Free a timer made by _TimerStart once it has expired or been stopped
+static inline void _TimerFree(STimer* timer) {
+  free(timer);
+}
 
 static void _TimerCallback(EVLoop *evloop, ev_timer *w, int revents) {
   SSched* s = (SSched*)ev_userdata(evloop);
   STimer* timer = (STimer*)w;
   _DumpRQAndWQ(s);
   SLogD("[ev] timer triggered -- moving task from WQ to RQ");
+  --s->ntimers;
 
-  bool sched_is_waiting = (s->rhead == 0 && s->whead != 0);
+  bool sched_is_waiting = (_RQIsEmpty(s) && s->whead != 0);
 
-  // Remove task from wait queue and add it to the run queue
-  _WQRemove(s, timer->task);
-  _RQPush(s, timer->task);
+  // Move the task from the wait queue to the end of the run queue for its
+  // priority level and mark the task as no longer waiting for anything. Within
+  // a priority level, events are processed in the order they arrive in.
+  _SchedWake(s, timer->task);
 
-  // Here, we could have some logic to schedule the task according to some
-  // priority level. Right now, we are always scheduling the task at the end of
-  // the RQ. This means that events are processed in the order they arrive in.
-
-  // Mark the task as no longer waiting for anything
-  timer->task->wp = 0;
-
-  // Free the timer
-  free(timer); // FIXME
+  _TimerFree(timer);
 
   // If the scheduler is in the waiting loop, break the ev loop
   if (sched_is_waiting) {
@@ -154,84 +1190,593 @@ static void _TimerCallback(EVLoop *evloop, ev_timer *w, int revents) {
   }
 }
 
-// Start a timer
-static inline STimer*
-_TimerStart(SSched* s, STask* task, SNumber after_ms, SNumber repeat_ms) {
-  STimer* timer = (STimer*)malloc(sizeof(STimer)); // FIXME: malloc
-  timer->task = task;
-  
-  // Set the timer as the tasks "waiting for"
-  task->wp = timer;
-  task->wtype = STaskWaitTimer;
-
-  // Configure and schedule the timer
+// Schedule `timer` to call `cb` after `after_ms`
+static void _TimerSchedule(SSched* s, STimer* timer,
+                           void (*cb)(EVLoop*, ev_timer*, int),
+                           SNumber after_ms, SNumber repeat_ms) {
   ev_tstamp after_sec =
     (ev_tstamp)(after_ms == (SNumber)0) ? 0 : (after_ms / (SNumber)1000.0);
   
   ev_tstamp repeat_sec =
     (ev_tstamp)(repeat_ms == (SNumber)0) ? 0 : (repeat_ms / (SNumber)1000.0);
 
-  ev_timer_init((ev_timer*)timer, _TimerCallback, after_sec, repeat_sec);
+  ev_timer_init((ev_timer*)timer, cb, after_sec, repeat_sec);
   ev_timer_start((EVLoop*)s->events_, (ev_timer*)timer);
+
+  // Remember when the timer expires so that polling can be skipped until then.
+  // ev_now is never ahead of the monotonic clock, so this is never earlier
+  // than when ev considers the timer expired.
+  ++s->ntimers;
+  uint64_t after_us = (uint64_t)(after_ms * (SNumber)1000.0);
+  SHeapPush(&s->timers, SHostMonotonicUSecs() + after_us, 0);
   SLogD("[ev] timer scheduled to trigger after " SNumberFormat " ms", after_ms);
+}
 
+// Start a timer
+static inline STimer*
+_TimerStart(SSched* s, STask* task, SNumber after_ms, SNumber repeat_ms) {
+  STimer* timer = (STimer*)malloc(sizeof(STimer)); // FIXME: malloc
+  timer->task = task;
+
+  // Set the timer as the tasks "waiting for"
+  task->wp = timer;
+  task->wtype = STaskWaitTimer;
+
+  _TimerSchedule(s, timer, _TimerCallback, after_ms, repeat_ms);
   return timer;
 }
 
+// Stop and free a timer made by _TimerStart that hasn't expired yet
 static inline void _TimerCancel(SSched* s, STimer* timer) {
   assert(timer->task != 0);
   assert(timer->task->wtype == STaskWaitTimer);
   assert(timer->task->wp == timer);
   timer->task->wp = 0;
   ev_timer_stop((EVLoop*)s->events_, (ev_timer*)timer);
+  --s->ntimers;
+  // The timer's entry in `s->timers` is left in place and dropped when it
+  // expires. Until then, it causes at most one unnecessary poll.
+  _TimerFree(timer);
 }
 
+static void _SelectTimerCallback(EVLoop* evloop, ev_timer* w, int revents) {
+  SSched* s = (SSched*)ev_userdata(evloop);
+  SSelect* sel = (SSelect*)w;
+  --s->ntimers;
+  if (_SelectClaim(sel->timer.task, sel->timeri)) {
+    bool sched_is_waiting = (_RQIsEmpty(s) && s->whead != 0);
+    _SchedWake(s, sel->timer.task);
+    if (sched_is_waiting) {
+      ev_break(evloop, EVBREAK_ALL);
+    }
+  }
+}
 
-// Called when a task ended. Cleans it up and potentially free's it.
-// Returns true if `t` has subtasks which are still alive.
-inline static bool S_ALWAYS_INLINE
-_EndTask(SSched* s, STask* t, STaskStatus status) {
+// True if SELECT source `src` of task `t` has a value. A source is the inbox
+// of `t` (nil), an MPMC channel to receive from, a future, or a timeout in
+// milliseconds which only has a value if it's not positive.
+inline static bool S_ALWAYS_INLINE _SelectReady(STask* t, SValue src) {
+  switch (src.type) {
+    case SValueTNil:  return t->mbox.live != 0 || !SMsgQIsEmpty(&t->inbox);
+    case SValueTChan: return ((SChan*)src.value.p)->closed ||
+                             !SChanIsEmpty((SChan*)src.value.p);
+    case SValueTFuture: return ((SFuture*)src.value.p)->state ==
+                               SFutureStateFulfilled;
+    default:          return src.value.n <= 0;
+  }
+}
 
-  if (status == STaskStatusError) {
-    SLogE("Task error");
+// Take a value from SELECT source `src` of task `t`, if it has one. Sets `v`
+// and `v2` like RECV and CHRECV set their two registers, like AWAIT for a
+// future, or to nil for a timeout. Returns false if the source has no value.
+static bool _SelectTake(SVM* vm, SSched* s, STask* t, SValue src,
+                        SValue* v, SValue* v2) {
+  switch (src.type) {
+    case SValueTNil: {
+      STask* sender;
+      if (t->mbox.live != 0) {
+        // Messages skipped by RECVS are older than anything in the inbox
+        SMBoxTakeFirst(&t->mbox, &s->msgpool, v, &sender);
+      } else {
+        SMsg* m = SMsgDequeue(&t->inbox);
+        if (m == 0) {
+          return false;
+        }
+        *v = m->value;
+        sender = m->sender;
+        SMsgFree(&s->msgpool, m);
+      }
+      *v2 = SValueTask(sender);
+      _SchedInboxRelease(vm, s, t);
+      return true;
+    }
+    case SValueTChan: {
+      SChan* c = (SChan*)src.value.p;
+      if (SChanTryRecv(c, v)) {
+        *v2 = SValueTrue;
+        _SchedChanWakeOne(vm, s, c, &c->sendq);
+        return true;
+      }
+      if (!c->closed) {
+        return false;
+      }
+      // Values sent just before the channel was closed are still received
+      if (SChanTryRecv(c, v)) {
+        *v2 = SValueTrue;
+      } else {
+        *v = SValueNil;
+        *v2 = SValueFalse;
+      }
+      return true;
+    }
+    case SValueTFuture: {
+      if (!SFutureTryGet((SFuture*)src.value.p, v)) {
+        return false;
+      }
+      *v2 = SValueTrue;
+      return true;
+    }
+    default: {
+      if (src.value.n > 0) {
+        return false;
+      }
+      *v = SValueNil;
+      *v2 = SValueNil;
+      return true;
+    }
   }
+}
 
-  if (t->supt != 0) {
-    // This task has a supertask
-    SLogD(">>> subtask with supertask");
+// Called when executing task `t` found none of its `n` SELECT sources `src`
+// with a value. Starts waiting for all of them. Returns true if `t` should be
+// suspended, or false if a source got a value meanwhile and `t` claimed the
+// SELECT itself.
+static bool _SelectArm(SVM* vm, SSched* s, STask* t, SValue* src, uint32_t n) {
+  SSelect* sel = (SSelect*)s->selfree_;
+  if (sel != 0) {
+    s->selfree_ = (void*)sel->next;
+  } else {
+    sel = (SSelect*)malloc(sizeof(SSelect));
+  }
+  sel->timeri = n;
+  sel->n = n;
+  uint32_t st = S_SEL_ARMED;
+  uint32_t i = 0;
+  for (; i != n; ++i) {
+    sel->chans[i] = 0;
+    sel->futs[i] = 0;
+    if (src[i].type == SValueTNil) {
+      st |= S_SEL_INBOX | i;
+    }
+  }
+  t->sel = sel;
+  t->wp = (void*)sel;
+  t->wtype = STaskWaitSelect;
+
+  // `selstate` is always 0 here. Setting it with a CAS gives senders to our
+  // inbox the same guarantee as setting `msgwait` does for RECV.
+  SAtomicCAS(&t->selstate, (uint32_t)0, st);
+
+  for (i = 0; i != n; ++i) {
+    if (src[i].type == SValueTChan) {
+      SChan* c = (SChan*)src[i].value.p;
+      SChanWaiter* w = &sel->waiters[i];
+      w->task = t;
+      w->sel = i + 1;
+      sel->chans[i] = c;
+      SChanLock(c);
+      SChanWaitPush(&c->recvq, w);
+      SChanUnlock(c);
+    } else if (src[i].type == SValueTFuture) {
+      SFuture* f = (SFuture*)src[i].value.p;
+      sel->futs[i] = f;
+      SFutureLock(f);
+      assert(f->waiter == 0); // only one task may wait for a future
+      f->waiter = t;
+      f->waitsel = i + 1;
+      SFutureUnlock(f);
+    } else if (src[i].type == SValueTNumber) {
+      sel->timeri = i;
+      sel->timer.task = t;
+      _TimerSchedule(s, &sel->timer, _SelectTimerCallback, src[i].value.n, 0);
+    }
+  }
+
+  // Look at the sources again, in case one got a value before its waker could
+  // see us. If it did but we fail to claim the SELECT, another source claimed
+  // it and is waking us.
+  SAtomicBarrier();
+  for (i = 0; i != n; ++i) {
+    if (_SelectReady(t, src[i])) {
+      if (_SelectClaim(t, i)) {
+        t->wp = 0;
+        return false;
+      }
+      break;
+    }
+  }
+  return true;
+}
+
+// Called when task `t` runs again after a source claimed its SELECT. Stops
+// waiting for the other sources. Returns the index of the source which
+// claimed the SELECT.
+static uint32_t _SelectDisarm(SSched* s, STask* t) {
+  SSelect* sel = t->sel;
+  uint32_t st = t->selstate;
+  assert(st & S_SEL_FIRED);
+  t->selstate = 0;
+  t->sel = 0;
+  uint32_t i = 0;
+  for (; i != sel->n; ++i) {
+    SChan* c = sel->chans[i];
+    if (c != 0) {
+      SChanLock(c);
+      SChanWaitRemove(&c->recvq, &sel->waiters[i]);
+      SChanUnlock(c);
+    }
+    SFuture* f = sel->futs[i];
+    if (f != 0) {
+      SFutureLock(f);
+      if (f->waiter == t) {
+        f->waiter = 0;
+      }
+      SFutureUnlock(f);
+    }
+  }
+  if (sel->timeri != sel->n && ev_is_active(&sel->timer.evtimer)) {
+    ev_timer_stop((EVLoop*)s->events_, &sel->timer.evtimer);
+    --s->ntimers;
+  }
+  sel->next = (SSelect*)s->selfree_;
+  s->selfree_ = (void*)sel;
+  return S_SEL_INDEX(st);
+}
+
+// True if the `n` sources `src` are valid for SELECT: at most
+// S_SCHED_SELECT_MAX sources, of which at most one is a timeout, and no SPSC
+// channels (which only have room for one waiting receiver.)
+static bool _SelectValid(SValue* src, uint32_t n) {
+  if (n == 0 || n > S_SCHED_SELECT_MAX) {
+    return false;
+  }
+  bool timeout = false;
+  uint32_t i = 0;
+  for (; i != n; ++i) {
+    switch (src[i].type) {
+      case SValueTNil: break;
+      case SValueTFuture: break;
+      case SValueTChan: {
+        if (((SChan*)src[i].value.p)->flags & SChanFlagSPSC) {
+          return false;
+        }
+        break;
+      }
+      case SValueTNumber: {
+        if (timeout) {
+          return false;
+        }
+        timeout = true;
+        break;
+      }
+      default: return false;
+    }
+  }
+  return true;
+}
+
+// Execute SELECT for task `t` with `n` sources `src`. Takes a value from the
+// first source which has one and sets `index` to the index of that source and
+// `v` and `v2` to what it gave (see _SelectTake.) Returns false if no source
+// has a value, in which case `t` should be suspended and run SELECT again when
+// woken.
+static bool _SchedSelect(SVM* vm, SSched* s, STask* t, SValue* src, uint32_t n,
+                         uint32_t* index, SValue* v, SValue* v2) {
+  // A timeout counts from when the SELECT first ran, not from each time it
+  // waits again after another task took the value of the source that woke us.
+  // Wait for whatever is left of it instead.
+  SValue tsrc[S_SCHED_SELECT_MAX];
+  uint32_t ti = 0;
+  for (; ti != n && src[ti].type != SValueTNumber; ++ti) {}
+  if (ti != n && src[ti].value.n > 0) {
+    uint64_t now = SHostMonotonicUSecs();
+    if (t->sel == 0) {
+      // First run of this SELECT
+      t->seldl = now + (uint64_t)(src[ti].value.n * (SNumber)1000.0);
+    }
+    uint32_t i = 0;
+    for (; i != n; ++i) {
+      tsrc[i] = src[i];
+    }
+    tsrc[ti].value.n = (t->seldl > now) ?
+      (SNumber)(t->seldl - now) / (SNumber)1000.0 : (SNumber)0;
+    src = tsrc;
+  }
+
+  while (1) {
+    uint32_t i = n;
+    if (t->sel != 0) {
+      // A source claimed the SELECT and woke us
+      uint32_t timeri = t->sel->timeri;
+      i = _SelectDisarm(s, t);
+      if (i == timeri) {
+        *index = i;
+        *v = SValueNil;
+        *v2 = SValueNil;
+        return true;
+      }
+      // Prefer the source which woke us. Another task might have taken its
+      // value first though.
+      if (_SelectTake(vm, s, t, src[i], v, v2)) {
+        *index = i;
+        return true;
+      }
+    }
+    for (i = 0; i != n; ++i) {
+      if (_SelectTake(vm, s, t, src[i], v, v2)) {
+        *index = i;
+        return true;
+      }
+    }
+    if (_SelectArm(vm, s, t, src, n)) {
+      return false;
+    }
+  }
+}
+
+// Stop suspended task `t` of our scheduler from waiting, on behalf of CANCEL.
+// Returns true if `t` should be woken by the caller, or false if whoever it
+// was waiting for already took it out of their wait list and is waking it.
+static bool _SchedCancelWait(SVM* vm, SSched* s, STask* t) {
+  bool found;
+  switch (t->wtype) {
+    case STaskWaitTimer: {
+      _TimerCancel(s, (STimer*)t->wp);
+      return true;
+    }
+    case STaskWaitMsg: {
+      return SAtomicCAS(&t->msgwait, (uint32_t)1, (uint32_t)0);
+    }
+    case STaskWaitSend: {
+      STask* to = (STask*)((char*)t->wp - offsetof(STask, inbox));
+      _SendqLock(to);
+      found = t->chwait.queued;
+      SChanWaitRemove(&to->sendq, &t->chwait);
+      _SendqUnlock(to);
+      return found;
+    }
+    case STaskWaitChan: {
+      SChan* c = (SChan*)t->wp;
+      if (c->flags & SChanFlagSPSC) {
+        return SAtomicCAS(&c->sendwaiter, t, (STask*)0) ||
+               SAtomicCAS(&c->recvwaiter, t, (STask*)0);
+      }
+      // Removing a waiter only touches the ends of the list it's in. If it's
+      // at neither end of `sendq`, it makes no difference which list we pass.
+      SChanWaiter* w = &t->chwait;
+      SChanLock(c);
+      SChanWaitQ* q = (c->sendq.head == w || c->sendq.tail == w) ? &c->sendq
+                                                                 : &c->recvq;
+      found = w->queued;
+      SChanWaitRemove(q, w);
+      SChanUnlock(c);
+      return found;
+    }
+    case STaskWaitSelect: {
+      // The task disarms the SELECT when it ends
+      return _SelectClaim(t, 0);
+    }
+    case STaskWaitTopic: {
+      STopic* tp = (STopic*)t->wp;
+      STopicLock(tp);
+      found = t->chwait.queued;
+      SChanWaitRemove(&tp->waitq, &t->chwait);
+      STopicUnlock(tp);
+      return found;
+    }
+    case STaskWaitFuture: {
+      SFuture* f = (SFuture*)t->wp;
+      SFutureLock(f);
+      found = (f->waiter == t);
+      if (found) {
+        f->waiter = 0;
+      }
+      SFutureUnlock(f);
+      return found;
+    }
+    case STaskWaitJoin: {
+      STaskGroup* g = (STaskGroup*)t->wp;
+      STaskGroupLock(g);
+      found = t->chwait.queued;
+      SChanWaitRemove(&g->waitq, &t->chwait);
+      STaskGroupUnlock(g);
+      return found;
+    }
+    default: {
+      assert(!"unexpected wait type");
+      return false;
+    }
+  }
+}
 
-    if (t->supt->next == &STaskDead) {
-      // Supertask is dead
-      SLogD(">>> supertask is dead and we might become a zombie");
+// Cancel task `t` of our scheduler with `flags`. `self` is the executing task,
+// which ends after the instruction that canceled it. Other tasks end the next
+// time they would run, and suspended tasks are woken up to do so. Returns false
+// if `t` had already ended or been canceled.
+static bool _SchedCancelTask(SVM* vm, SSched* s, STask* self, STask* t,
+                             STaskFlag flags) {
+  if (t->ar == 0 || (t->flags & STaskFlagCancel)) {
+    return false;
+  }
+  t->flags |= flags;
+  if (t != self && t->wp != 0 && _SchedCancelWait(vm, s, t)) {
+    // Like _SchedWake, but `wp` might already be cleared
+    _WQRemove(s, t);
+    t->wp = 0;
+    _RQPush(s, t);
+  }
+  return true;
+}
 
-      // Release our reference to the dead supertask
-      // if (!STaskRelease(t->supt)) {
-      //   // In this case:
-      //   // - Supertask is dead
-      //   // - Supertask has more references (more live subtasks)
-      //   // If we add "zombie collection" to the scheduler, we could set a flag
-      //   // here to speed up a collection as we know there are more zombies.
-      //   SLogD(">>> there are more zombies out there");
-      // }
+// Cancel task `root` with `flags`, and every task it spawned, directly or not,
+// with STaskFlagCancel. Walks down the lists of live subtasks, and uses `supt`
+// to find the way back up, so that no memory is needed however large the tree
+// is. The subtasks of a task which was already canceled were canceled along
+// with it, so they're skipped.
+static void _SchedCancelTree(SVM* vm, SSched* s, STask* self, STask* root,
+                             STaskFlag flags) {
+  if (!_SchedCancelTask(vm, s, self, root, flags)) {
+    return;
+  }
+  STask* t = root;
+  while (1) {
+    if (t->subt != 0) {
+      t = t->subt;
     } else {
-      // The supertask is still alive and well.
+      while (t != root && t->sibnext == 0) {
+        t = t->supt;
+      }
+      if (t == root) {
+        return;
+      }
+      t = t->sibnext;
+    }
+    while (!_SchedCancelTask(vm, s, self, t, STaskFlagCancel)) {
+      // Skip the subtree of `t`
+      while (t != root && t->sibnext == 0) {
+        t = t->supt;
+      }
+      if (t == root) {
+        return;
+      }
+      t = t->sibnext;
+    }
+  }
+}
+
+// Cancel the tasks of group `g` and every task they spawned
+static void _SchedCancelGroup(SVM* vm, SSched* s, STask* self, STaskGroup* g) {
+  uint32_t i = 0;
+  for (; i != g->n; ++i) {
+    _SchedCancelTree(vm, s, self, STaskGroupAt(g, i), STaskFlagCancel);
+  }
+}
+
+// Status which canceled task `t` ends with
+#define _SchedCancelStatus(t) \
+  (((t)->flags & STaskFlagLinkedError) ? STaskStatusError : STaskStatusCancel)
+
+// Tell supertask `supt` that its subtask `t` ended with `status`, by sending it
+// an exit message if it traps exits, or else by making it end too if `t` ended
+// from a fault
+inline static void S_ALWAYS_INLINE
+_SchedSubtaskEnded(SVM* vm, SSched* s, STask* supt, STask* t,
+                   STaskStatus status) {
+  if (supt->flags & STaskFlagTrapExit) {
+    SMsg* m = t->exitmsg;
+    if (m == 0) {
+      // Spawned by other means than SPAWN or SPAWNN
+      m = SMsgAlloc(&s->msgpool);
+    }
+    t->exitmsg = 0;
+    m->value = SValueExit((SNumber)status);
+    m->sender = t;
+    STaskRetain(t); // The message references its sender
+    // We can't wait for room in the inbox
+    SAtomicAdd32((int32_t*)&supt->inboxin, 1);
+    _SchedDeliver(vm, s, supt, m);
+  } else if (status == STaskStatusError && supt->sched == s) {
+    // Take down the supertask and its other subtasks. Only done in our own
+    // scheduler, which is where SPAWN puts subtasks.
+    _SchedCancelTree(vm, s, t, supt, STaskFlagCancel | STaskFlagLinkedError);
+  }
+}
+
+// Drop expiry times of timers which have expired at time `now`. Entries of
+// timers which were canceled are dropped the same way.
+inline static void S_ALWAYS_INLINE _TimersExpire(SSched* s, uint64_t now) {
+  while (s->timers.len != 0 && SHeapMinKey(&s->timers) <= now) {
+    SHeapPop(&s->timers);
+  }
+}
+
+// Handle any events that have triggered, without blocking. `now` is the time
+// at which the poll started.
+inline static void S_ALWAYS_INLINE
+_SchedPoll(SSched* s, EVLoop* evloop, uint64_t now) {
+  SLogD("[RL] ev_run(NOWAIT) (%d refs)", *ev_refcount(evloop));
+  ev_run(evloop, EVRUN_NOWAIT);
+  uint64_t end = SHostMonotonicUSecs();
+  ++s->stats.polls;
+  s->stats.pollusecs += end - now;
+  s->pollc = 0;
+  s->polltime = end;
+  _TimersExpire(s, now);
+}
 
-      // TODO: Enqueue a "subtask exited" in parent tasks' inbox
+// Called after each task execution while there are runnable tasks and active
+// event watchers. Polls for events when a timer has expired, or when
+// `poll_every` tasks have executed or `poll_interval_us` microseconds have
+// passed since the last poll. In the latter case the poll is skipped if the
+// only active watchers are timers, since none of them has expired.
+inline static void S_ALWAYS_INLINE
+_SchedMaybePoll(SSched* s, EVLoop* evloop, int evrefs) {
+  uint64_t now = SHostMonotonicUSecs();
+  if (s->timers.len == 0 || SHeapMinKey(&s->timers) > now) {
+    // No timer has expired
+    if (++s->pollc < s->poll_every && now - s->polltime < s->poll_interval_us) {
+      return;
+    }
+    if (evrefs <= (int)s->ntimers) {
+      // No watchers other than timers
+      ++s->stats.pollskips;
+      s->pollc = 0;
+      s->polltime = now;
+      return;
     }
+  }
+  _SchedPoll(s, evloop, now);
+}
+
+
+// Called when a task ended. Cleans it up and potentially free's it.
+inline static void S_ALWAYS_INLINE
+_EndTask(SVM* vm, SSched* s, STask* t, STaskStatus status) {
+
+  if (status == STaskStatusError) {
+    SLogE("Task error");
+  }
 
-    // Release our reference to the supertask.
-    if (STaskRelease(t->supt)) {
-      SLogD(">>> we caused the final collection of our supertask");
+  // Our ID is stale from here on, even though our memory lingers while anyone
+  // holds a handle to us
+  STaskTabEnd(&s->tids, t);
+
+  STask* supt = t->supt;
+  if (supt != 0) {
+    // This task has a supertask, which runs in our scheduler, so we can look
+    // at it without synchronization
+    _SubtaskRemove(t);
+    if (supt->ar != 0) {
+      // The supertask is still alive and well
+      _SchedSubtaskEnded(vm, s, supt, t, status);
+    } else if (supt->subt == 0) {
+      // The supertask ended before us, and we were its last live subtask. It
+      // kept its "live" reference for its subtasks, which we release.
+      SLogD(">>> we were the last subtask of a dead supertask");
+      STaskReleaseLive(supt);
     }
   }
+  if (t->exitmsg != 0) {
+    SMsgFree(&s->msgpool, t->exitmsg);
+    t->exitmsg = 0;
+  }
 
-  // TODO: Free as much as possible from the task. Actually, free everything
-  // that needs free'ing except `next` (which is needed for the "zombie" flag).
-  // The most important thing is to (optionally first unwind and then) free the
-  // AR stack.
+  // TODO: Free as much as possible from the task. The most important thing is
+  // to (optionally first unwind and then) free the AR stack. Clearing `ar`
+  // tells our subtasks that we ended.
   if (t->ar) {
-    SARecDestroy(t->ar);
-    t->ar = 0;
+    _ARecReleaseRefs(t->ar);
+    STaskARecDestroy(t);
   }
 
   // Cancel anything that the task is waiting for
@@ -240,36 +1785,39 @@ _EndTask(SSched* s, STask* t, STaskStatus status) {
       _TimerCancel(s, t->wp);
     }
   }
+  if (t->sel != 0) {
+    // Woken from a SELECT to be canceled
+    _SelectDisarm(s, t);
+  }
 
-  // Release our one "live" reference.
-  if (STaskRelease(t)) {
-    SLogD(">>> task finally collected");
-    return false;
-  } else {
-    SLogD(">>> supertask died before all its subtasks died");
-    // There are more references to us. Mark ourselves as undead by setting
-    // `next` to `STaskDead`.
-
-    // The following STORE is SMP-safe. However we need to be cautious:
-    //
-    // - `t` is no longer in any RQ or WQ and so `next` not `prev` will be
-    //   accessed by any scheduler. All good.
-    //
-    // - But if a subtask ends at the same time in a different scheduler,
-    //   `_EndTask` will LOAD the value of `next` to compare it against
-    //   `STaskDead`. Since we do allow zombies, this race condition can be
-    //   ignored.
-    //
-    // So instead of CAS-ing around the LOAD, which happens _every time_ a task
-    // ends which has, or did have, a supertask (basically all tasks). But this
-    // case of a supertask dying before all of its subtasks happens more rarely.
-    // The `next` value is marked "volatile" and so LOADs should be ordered. We
-    // don't need care about CAS here when STORE-ing, since the only value ever
-    // stored is this one value. If we ever store anything else into `next`
-    // after the task has ended, we will need SAtomicSwap here.
-    t->next = (STask*)&STaskDead;
+  // Let tasks waiting for our group know when we were the last one
+  if (t->tgroup != 0) {
+    _SchedGroupTaskEnded(vm, s, t->tgroup);
+  }
 
-    return true;
+  // Nobody receives from our inbox anymore. Lift its limit so that senders
+  // waiting for room don't wait forever.
+  if (t->inboxcap != 0) {
+    t->inboxcap = 0;
+    _SchedWakeSendersAll(vm, s, t);
+  }
+
+  // Give back our share of deadline class utilization
+  if (t->flags & STaskFlagDeadline) {
+    s->dlutil -= _DLUtil(t->dlrel, t->dlrun);
+  }
+
+  // Leave our scheduling group
+  if (t->group) {
+    _GroupRelease(t->group);
+    t->group = 0;
+  }
+
+  // Release our one "live" reference, unless we have subtasks which are still
+  // alive. They look at our memory when they end, so the last of them releases
+  // it instead.
+  if (t->subt == 0 && STaskReleaseLive(t)) {
+    SLogD(">>> task finally collected");
   }
 }
 
@@ -284,17 +1832,173 @@ STaskStatus SchedExec(SVM* vm, SSched* s, STask *t) {
 }
 #endif
 
+// Schedule all tasks which other threads have handed us. If `busy` is false,
+// we're idle and not counted in `vm->nwork`, and become busy by calling this.
+inline static void S_ALWAYS_INLINE
+_RemoteDrain(SVM* vm, SSched* s, bool busy) {
+  STask* t = SAtomicSwap(&s->rq_remote, (STask*)0);
+  if (t == 0) {
+    return;
+  }
+  // The remote queue is LIFO. Reverse it so that tasks run in the order they
+  // were handed to us.
+  STask* prev = 0;
+  int32_t count = 0;
+  while (t != 0) {
+    STask* next = t->rwnext;
+    t->rwnext = prev;
+    prev = t;
+    t = next;
+    ++count;
+  }
+  while (prev != 0) {
+    t = prev;
+    prev = t->rwnext;
+    if (t->sched == s && t->wp != 0) {
+      // Woken up by another thread, e.g. by a message
+      _SchedWake(s, t);
+    } else {
+      SSchedTask(s, t);
+    }
+  }
+  // The tasks are no longer on their way to us. We are busy instead.
+  SAtomicSubAndFetch(&vm->nwork, busy ? count : count - 1);
+}
+
+// Park in the event loop until an event triggers, another thread hands us a
+// task or, if `timeout` is set, `idle_park_us` has passed.
+static void _SchedPark(SSched* s, EVLoop* evloop, bool timeout) {
+  SAtomicSwap(&s->parked, (uint32_t)1);
+  if (s->rq_remote == 0) {
+    uint64_t start = SHostMonotonicUSecs();
+    ev_timer* parktimer = (ev_timer*)s->parktimer_;
+    if (timeout) {
+      ev_timer_set(parktimer, (ev_tstamp)s->idle_park_us / 1000000.0, 0.0);
+      ev_timer_start(evloop, parktimer);
+    }
+    ev_ref(evloop); // so that the unpark watcher keeps ev_run from returning
+    SLogD("[EL] ev_run(ONCE) (%d refs)", *ev_refcount(evloop));
+    ev_run(evloop, EVRUN_ONCE);
+    ev_unref(evloop);
+    ev_timer_stop(evloop, parktimer);
+    ++s->stats.parks;
+    s->stats.parkusecs += SHostMonotonicUSecs() - start;
+  }
+  s->parked = 0;
+}
+
+// Called when the run queue is empty. Polls for events, spins and yields the
+// CPU if other schedulers are running, and then parks until there are tasks to
+// run. Returns true when there are tasks to run, or false if the scheduler
+// should exit.
+static bool _SchedIdle(SVM* vm, SSched* s, EVLoop* evloop, int* evrefs) {
+  // Events which triggered while we were running tasks might have made tasks
+  // runnable, so poll for them before going idle. As in _SchedMaybePoll, skip
+  // the poll if the only watchers are timers and none of them has expired.
+  if (*evrefs > 0) {
+    uint64_t now = SHostMonotonicUSecs();
+    if ((s->timers.len != 0 && SHeapMinKey(&s->timers) <= now) ||
+        *evrefs > (int)s->ntimers) {
+      _SchedPoll(s, evloop, now);
+      if (!_RQIsEmpty(s)) {
+        return true;
+      }
+    }
+  }
+
+  ++s->stats.idles;
+  uint64_t start = SHostMonotonicUSecs();
+  bool busy = true;
+  #if !S_WITHOUT_SMP
+  uint32_t spins = 0;
+  #endif
+  uint32_t yields = 0;
+  uint64_t parks = s->stats.parks;
+
+  // Give nodes of messages sent from other schedulers back to their owners now
+  // rather than holding on to them while we're idle.
+  SMsgPoolFlush(&s->msgpool);
+
+  // We're not looking at any tasks that we don't hold references to while
+  // idle, so nobody needs to wait for us to free memory
+  SQSBROffline(s->qs);
+
+  while (1) {
+    if (s->rq_remote != 0) {
+      _RemoteDrain(vm, s, busy);
+      busy = true;
+    }
+    if (!_RQIsEmpty(s)) {
+      break;
+    }
+    if (busy && *evrefs == 0) {
+      // Nothing of our own can produce work anymore
+      busy = false;
+      SAtomicSubAndFetch(&vm->nwork, 1);
+    }
+    if (!busy && vm->nwork == 0) {
+      // No scheduler has any work, and no task is on its way to a scheduler
+      break;
+    }
+
+    // Spinning and yielding only pay off when another scheduler might hand us
+    // a task. On our own, we park right away.
+    #if !S_WITHOUT_SMP
+    if (vm->nsched > 1) {
+      if (spins < s->idle_spins) {
+        ++spins;
+        SAtomicPause();
+        continue;
+      }
+      if (yields < s->idle_yields) {
+        ++yields;
+        SHostYield();
+        continue;
+      }
+    }
+    #endif
+
+    // Park until an event or another thread wakes us. If we have no event
+    // watchers, wake up now and then to see if every scheduler is idle.
+    _SchedPark(s, evloop, !busy);
+    s->pollc = 0;
+    s->polltime = SHostMonotonicUSecs();
+    _TimersExpire(s, s->polltime);
+    _DumpRQAndWQ(s);
+  }
+
+  s->stats.idleusecs += SHostMonotonicUSecs() - start;
+  if (!busy) {
+    return false;
+  }
+  SQSBROnline(s->qs);
+  if (parks == s->stats.parks) {
+    if (yields == 0) {
+      ++s->stats.spinwakes;
+    } else {
+      ++s->stats.yieldwakes;
+    }
+  }
+  return true;
+}
+
 void SSchedRun(SVM* vm, SSched* s) {
   STask* t;
 
   EVLoop* evloop = (EVLoop*)s->events_;
   int* evrefs = ev_refcount(evloop);
 
+  // We're busy while running tasks
+  SAtomicAddAndFetch(&vm->nwork, 1);
+  SAtomicAddAndFetch(&vm->nsched, 1);
+  SQSBROnline(s->qs);
+  STaskThreadSched = s; // we own the tasks spawned in `s` (see STaskRetain)
+  _RemoteDrain(vm, s, true);
+
   _DumpRQAndWQ(s);
 
   exec_loop:
-  t = s->rhead;
-  while (t != 0) {
+  while ((t = _RQPop(s)) != 0) {
 
     // If vm instructions are being logged, write a header
     #if S_VM_DEBUG_LOG
@@ -305,68 +2009,79 @@ void SSchedRun(SVM* vm, SSched* s) {
     #endif
 
     // Execute the task
-    STaskStatus status = _SchedExec(vm, s, t);
+    STaskStatus status;
+    uint64_t dlstart = 0;
+    if (t->flags & STaskFlagDeadline) {
+      dlstart = SHostMonotonicUSecs();
+    }
+    while (1) {
+      uint64_t icount = t->icount;
+      status = _SchedExec(vm, s, t);
 
-    // TODO: Clean this up with a switch
-    if (status == STaskStatusError ||
-        status == STaskStatusEnd ||
-        status == STaskStatusSuspend) {
+      if (s->policy == SSchedPolicyFair) {
+        _FairCharge(s, t, t->icount - icount);
+      }
 
-      // Remove task from the run queue
-      _RQRemove(s, t);
+      // Fast path: If the task yielded and is the only runnable task, resume
+      // it right away instead of passing it through the run queue. Events
+      // are still polled for on the usual schedule, and might make other
+      // tasks runnable.
+      if (status != STaskStatusYield || !_RQIsEmpty(s) || s->rq_remote != 0) {
+        break;
+      }
+      if (*evrefs > 0) {
+        _SchedMaybePoll(s, evloop, *evrefs);
+        if (!_RQIsEmpty(s)) {
+          break;
+        }
+      }
+      ++s->stats.resumes;
+      SQSBRQuiescent(s->qs);
+    }
 
-      // Store next task in a temporary value
-      STask* next_task = t->next;
+    if (t->flags & STaskFlagDeadline) {
+      _DLRan(s, t, status, dlstart);
+    }
 
-      if (status == STaskStatusSuspend) {
+    switch (status) {
+      case STaskStatusYield: {
+        // Put the task back at the end of its run queue
+        _RQPush(s, t);
+        break;
+      }
+      case STaskStatusSuspend: {
         // Add task to waiting queue
         _WQPush(s, t);
-      } else {
+        break;
+      }
+      default: {
         // Task ended
-        _EndTask(s, t, status);
+        _EndTask(vm, s, t, status);
+        break;
       }
-      
-      // Advance to the next task
-      t = next_task;
-
-    } else {
-      assert(status == STaskStatusYield);
-      // Keep task in run queue.
-      // Advance to the next task
-      t = t->next;
     }
 
-    // `t` could be the special `STaskDead` value if we made a programming error
-    // and assigned `STaskDead` to a task that was still in the RQ or WQ.
-    assert(t != &STaskDead);
-
-    if (t == 0) {
-      // We reached the end of one run queue cycle.
-      _DumpRQAndWQ(s);
-
-      // Wrap around the run queue
-      t = s->rhead;
+    if (s->rq_remote != 0) {
+      // Pick up tasks handed to us by other threads
+      _RemoteDrain(vm, s, true);
     }
 
-    if (t != 0 && *evrefs > 0) {
-      // Handle any immediate events that triggered event watchers
-      SLogD("[RL] ev_run(NOWAIT) (%d refs)", *evrefs);
-      ev_run(evloop, EVRUN_NOWAIT);
+    if (!_RQIsEmpty(s) && *evrefs > 0) {
+      // Handle any events that triggered event watchers, now and then
+      _SchedMaybePoll(s, evloop, *evrefs);
     }
 
-  } // while there are queued tasks
+    // We hold on to no task that we don't have a reference to
+    SQSBRQuiescent(s->qs);
 
-  // While there are active event watchers:
-  if (*evrefs > 0) {
-    SLogD("[EL] ev_run(WAIT) (%d refs)", *evrefs);
-    ev_run(evloop, 0);
-    _DumpRQAndWQ(s);
+  } // while there are queued tasks
 
-    if (s->rhead != 0) {
-      // At least one task was scheduled
-      goto exec_loop;
-    } // else: we fall through and cause the scheduler to exit
-  }
+  if (_SchedIdle(vm, s, evloop, evrefs)) {
+    // At least one task was scheduled
+    goto exec_loop;
+  } // else: no scheduler can produce more work, so we exit
 
+  SAtomicSubAndFetch(&vm->nsched, 1);
+  STaskThreadSched = 0;
   return;
 }
@@ -1,9 +1,96 @@
 // Scheduler -- maintains a run queue of tasks which are executed in order.
 //
+// There's one run queue per task priority level (see STaskPri). The scheduler
+// always takes the next task from the highest-priority non-empty run queue.
 // When a task's execution is suspended with a "yield" status, the task is
-// placed at the end of the queue so that it can run again once other queued
-// tasks have had a chance to run. When a task is suspended with a "end" or
-// "error" status, the task is removed from the scheduler (unscheduled).
+// placed at the end of its priority level's queue so that it can run again
+// once other queued tasks of the same level have had a chance to run. When a
+// task is suspended with a "end" or "error" status, the task is removed from
+// the scheduler (unscheduled).
+//
+// In fair mode (SSchedPolicyFair), the scheduler instead divides instructions
+// executed evenly between scheduling groups, and within a group between its
+// tasks. A group is usually one root task and all the tasks it spawned, so a
+// group with many tasks does not get more CPU time than a group with one task.
+//
+// Tasks in the deadline class (see SSchedAdmitDeadline) always run before any
+// other tasks, earliest deadline first.
+//
+// Tasks send each other messages with the SEND and RECV instructions. A task
+// which executes RECV with an empty inbox is suspended until a message
+// arrives. The sender wakes it up, also when the two tasks belong to
+// different schedulers. Message nodes come from the sending scheduler's pool
+// and are recycled instead of freed. A task with an `inboxcap` has a bounded
+// inbox: SEND to it suspends the sender while the inbox is full, and TRYSEND
+// gives up instead.
+//
+// A message holds a reference to what its value references, e.g. a buffer (see
+// buf.h), so large payloads are sent without copying them. SENDMV moves the
+// sender's reference into the message instead of adding one, which makes
+// sending a buffer cost the same as sending a number.
+//
+// RECVS receives the oldest message that matches a sender, a value or a type
+// of value. Messages it skips are kept in the task's mailbox (see mbox.h),
+// which is indexed so that skipped messages are not looked at again.
+//
+// Channels (see chan.h) are values which any number of tasks send to with
+// CHSEND and receive from with CHRECV. A task which finds a channel full or
+// empty is suspended, and each value sent or received wakes at most one such
+// task. CHCLOSE wakes them all. A channel with exactly one sender and one
+// receiver can be created with SChanFlagSPSC, which makes sending and
+// receiving cheaper.
+//
+// SELECT waits for any of several sources at once: the task's inbox (nil),
+// MPMC channels to receive from, futures and a timeout in milliseconds. It
+// takes a value from the first source that has one, e.g. to receive a message
+// or give up after a while. A task waiting in SELECT is woken by the first
+// source to get a value, and cancels its wait for the others when it runs
+// again.
+//
+// A task which makes a request to another task can send a future (see
+// future.h) along with it, and wait for the reply with AWAIT, optionally with
+// a timeout. FULFILL wakes the waiting task directly. Futures come from a pool
+// of the scheduler whose task created them, and are recycled.
+//
+// Topics (see topic.h) broadcast values: PUBLISH appends a value to a topic's
+// log once, and each subscriber reads every value with TRECV at its own
+// cursor, which it got from SUBSCRIBE. Publishing wakes only subscribers which
+// are waiting for a value, and hands those of each other scheduler over at
+// once.
+//
+// SPAWNN spawns a group of tasks (see STaskGroup in task.h) with a single
+// instruction. JOIN waits until every task of a group has ended, and CANCEL
+// ends the tasks of a group along with all tasks they spawned. Each task keeps
+// a list of its live subtasks, so spawning and ending a task costs the same
+// however many tasks there are, and canceling only visits the tasks it ends.
+//
+// A task's memory is not freed as soon as its last reference goes away, but
+// retired and freed in batches once every scheduler has passed a quiescent
+// state (see qsbr.h). A scheduler passes one each cycle of its run loop, and
+// is offline while idle. This lets a scheduler look at a task it holds no
+// reference to, e.g. when looking up a task ID. Subtasks run in the scheduler
+// of their supertask, so they don't take references to it. Instead a task
+// which ends before its subtasks keeps its memory until the last of them ends.
+//
+// When a task wakes another task (e.g. by spawning it), the woken task is put
+// in the "runnext" slot and runs as soon as the current task yields, instead
+// of waiting for a full round through the run queue. To not starve the run
+// queue, at most `runnext_max` tasks in a row are taken from the slot.
+//
+// While there are runnable tasks, events (e.g. expired timers) are polled for
+// after every `poll_every` task executions or `poll_interval_us` microseconds,
+// or right away when a timer expires. A poll is skipped if the only active
+// event watchers are timers which have not yet expired.
+//
+// When the run queue runs empty, the scheduler first polls for events, which
+// might make tasks runnable. If there's still nothing to run, the scheduler is
+// idle. It first spins for `idle_spins` checks for tasks handed to it by other
+// threads, then yields the CPU `idle_yields` times, and finally parks in the
+// event loop until an event triggers or another thread hands it a task.
+// Spinning gives the lowest latency and parking uses the least power. A
+// scheduler which is the only one running in its VM, or any scheduler of a
+// build without SMP support, parks right away. The scheduler exits when it is
+// idle and no scheduler in the VM can produce more work.
 //
 // To run a task, schedule it by calling `SSchedTask` and then enter the
 // scheduler's runloop by calling `SSchedRun`. `SSchedRun` will return when all
@@ -13,12 +100,88 @@
 #define S_SCHED_H_
 #include <sol/common.h>
 #include <sol/task.h>
+#include <sol/runq.h>
+#include <sol/heap.h>
+#include <sol/future.h>
 #include <sol/vm.h>
 
-// Task scheduler
+// Scheduling policy
+typedef enum {
+  SSchedPolicyPriority = 0, // Round-robin within strict priority levels
+  SSchedPolicyFair,         // Fair share of instructions between groups
+} SSchedPolicy;
+
+// Scheduling group -- a set of tasks which share one fair portion of CPU time
+// when the scheduler runs in fair mode. Subtasks belong to the group of their
+// supertask. Each task holds a reference to its group. Groups are owned by one
+// scheduler and are not thread safe.
+typedef struct SSchedGroup {
+  uint64_t vrt;     // Virtual runtime: weighted instructions executed by tasks
+  uint64_t minvrt;  // Virtual runtime of the most recently picked task
+  SHeap    rq;      // Runnable tasks ordered by virtual runtime
+  uint32_t refc;    // Number of tasks referencing this group
+  bool     queued;  // True when in the scheduler's group queue
+} SSchedGroup;
+
+// Scheduler statistics. Counters only ever increase.
 typedef struct {
-  STask* rhead;   // Run queue queue head
-  STask* rtail;   // Run queue queue tail
+  uint64_t dlruns;    // Deadline task activations completed
+  uint64_t dlmisses;  // Deadline task activations completed past the deadline
+  uint64_t dlthrottles; // Deadline task activations that used up their runtime
+  uint64_t polls;     // Non-blocking polls for events
+  uint64_t pollskips; // Polls skipped since only unexpired timers were active
+  uint64_t pollusecs; // Microseconds spent in non-blocking polls
+  uint64_t resumes;   // Times a yielding task was resumed as the only runnable
+  uint64_t idles;     // Times the run queue ran empty
+  uint64_t spinwakes; // Idle periods that ended while spinning
+  uint64_t yieldwakes; // Idle periods that ended while yielding the CPU
+  uint64_t parks;     // Times parked in the event loop
+  uint64_t idleusecs; // Microseconds spent idle, including parked
+  uint64_t parkusecs; // Microseconds spent parked
+} SSchedStats;
+
+// Task scheduler
+typedef struct SSched {
+  SRunQ    rq[S_TASK_PRI_COUNT]; // Run queues, one per priority level
+  uint32_t rqmask;  // Bit N is set when run queue N is non-empty
+  uint32_t starvec; // Picks in a row that passed over a lower priority level
+  uint32_t starvpri; // Level last picked to not starve it
+
+  SSchedPolicy policy; // Must be set before any tasks are scheduled
+  SHeap    fairq;   // Fair mode: runnable groups ordered by virtual runtime
+  uint64_t minvrt;  // Fair mode: virtual runtime of most recently picked group
+  SSchedGroup* fcur; // Fair mode: group of the task currently executing
+
+  STask*   runnext; // Most recently woken task. Runs next.
+  uint32_t runnext_max; // Max tasks in a row from `runnext`. 0 disables it.
+  uint32_t rnchain; // Tasks taken in a row from `runnext`
+
+  SHeap    dlq;     // Runnable deadline tasks ordered by absolute deadline
+  uint32_t dlutil;  // Utilization of admitted deadline tasks (ppm)
+
+  uint32_t poll_every; // Poll for events at least every N task executions
+  uint32_t poll_interval_us; // ...or at least every N microseconds
+  uint32_t pollc;   // Task executions since last poll
+  uint64_t polltime; // When events were last polled for
+  SHeap    timers;  // Expiry times of started timers. Stale entries allowed.
+  uint32_t ntimers; // Number of active timers
+
+  uint32_t idle_spins;  // Idle: times to check for work before yielding
+  uint32_t idle_yields; // Idle: times to yield the CPU before parking
+  uint32_t idle_park_us; // Idle: max time parked when only others can wake us
+  STask* volatile rq_remote; // Tasks handed to us by other threads (LIFO)
+  volatile uint32_t parked;  // 1 while parked in the event loop
+  void*  unpark_;
+  void*  parktimer_;
+
+  SMsgPool msgpool; // Nodes for messages sent by our tasks
+  SFuturePool futpool; // Futures created by our tasks
+  STaskTabCache tids; // Free task table slots for IDs asked for by our tasks
+  SQSBR*   qs;      // Our QSBR participant record (see qsbr.h)
+  void*    selfree_; // Free SELECT records
+
+  SSchedStats stats;
+
   STask* whead;   // Waiting queue head
   STask* wtail;   // Waiting queue tail
   void*  events_;
@@ -32,10 +195,33 @@ SSched* SSchedCreate();
 void SSchedDestroy(SSched* s);
 
 // Schedule a task `t` by adding it to the end of the run queue of scheduler
-// `s`. It's important not to schedule tasks that have already been scheduled.
+// `s` for the task's priority level. In fair mode, a task which has no group
+// is placed in a new group of its own. It's important not to schedule tasks
+// that have already been scheduled.
 void SSchedTask(SSched* s, STask* t);
 
-// Run the scheduler. This function exits when the run queue is empty.
+// Schedule a task `t` on scheduler `s` from another thread. Must be called
+// from a task running in a scheduler of `vm`, or before `s` starts running.
+// If `t` already belongs to `s` and is waiting for something, `t` is woken up
+// instead.
+void SSchedTaskRemote(SVM* vm, SSched* s, STask* t);
+
+// Create a new scheduling group with no tasks. Add a task to the group by
+// assigning the task's `group` member before the task is scheduled.
+SSchedGroup* SSchedGroupCreate();
+
+// Put task `t` in the deadline class with a relative deadline of `deadline_us`
+// microseconds, for a task that needs about `runtime_us` microseconds of CPU
+// time each time it's woken. Returns false without changing anything if the
+// scheduler can not guarantee this, i.e. if the admitted deadline tasks would
+// use more than S_SCHED_DL_MAX_UTIL of the CPU. Must be called before the
+// task is scheduled. A task that yields after using up `runtime_us` runs as a
+// best-effort task until it's next woken.
+bool SSchedAdmitDeadline(SSched* s, STask* t,
+                         uint32_t deadline_us, uint32_t runtime_us);
+
+// Run the scheduler. This function exits when the run queue is empty and no
+// other scheduler running in `vm` can hand us more tasks.
 void SSchedRun(SVM* vm, SSched* s);
 
 #if S_DEBUG
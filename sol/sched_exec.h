@@ -24,10 +24,8 @@
 // some code.
 #ifndef S_VM_EXEC_LIMIT
   #define S_VM_EXEC_LIMIT 100
-  #define S_VM_EXEC_LIMIT_INCR(increment) (icounter += (increment))
-#else
-  #define S_VM_EXEC_LIMIT_INCR(x) ((void)0)
 #endif
+#define S_VM_EXEC_LIMIT_INCR(increment) (icounter += (increment))
 
 // Contains SVMDLog macros
 #include "sched_exec_debug.h"
@@ -39,6 +37,21 @@
 //   clang -I. -O2 -std=c99 -S -emit-llvm -o - sol/sched.c | $EDITOR
 //
 
+// Release the reference held by register `r` if it holds one (e.g. a task
+// handle.) Called before an instruction overwrites a register.
+#define RELEASE_REG(r) SValueRelease(r)
+
+// Write `v` to register `r`, releasing the reference that `r` held, if any.
+// Instructions write registers this way, unless they move a reference out of a
+// register (e.g. SENDMV.) `v` is evaluated first, so it may be computed from
+// `r`.
+#define SET_REG(r, v) do { \
+  SValue* _reg = &(r); \
+  SValue _regv = (v); \
+  RELEASE_REG(*_reg); \
+  *_reg = _regv; \
+} while (0)
+
 // RK_(index)
 inline static SValue S_ALWAYS_INLINE
 RK_(uint32_t index, SValue* constants, SValue* registry) {
@@ -49,6 +62,11 @@ RK_(uint32_t index, SValue* constants, SValue* registry) {
 inline static STaskStatus S_ALWAYS_INLINE
 _SchedExec(SVM* vm, SSched* sched, STask *task) {
 
+  // A canceled task ends instead of running (see CANCEL)
+  if (task->flags & STaskFlagCancel) {
+    return _SchedCancelStatus(task);
+  }
+
   // Get current activation record and set `pc` to the PC of that AR
   SARec *ar = task->ar;
   SInstr *pc = ar->pc;
@@ -68,16 +86,22 @@ _SchedExec(SVM* vm, SSched* sched, STask *task) {
   #define RK_C(i)  RK_(SInstrGetC(i), constants, registry)
   #define RK_Bu(i) RK_(SInstrGetBu(i), constants, registry)
 
-  #if S_VM_EXEC_LIMIT
   // Number of instructions executed. We need to keep a dedicated counter since
   // JUMPs offset `pc` and so there's no way of telling how many instructions
   // have been executed from comparing `pc` to for instance `task->pc`.
   // Most operations have a cost of 1, but some operations, like CALL with
   // arguments, might have a higher cost in which case that instruction's logic
   // increments this counter in addition to the monotonic increment per op.
-  // The S_VM_EXEC_LIMIT_INCR macro is used for this purpose.
+  // The S_VM_EXEC_LIMIT_INCR macro is used for this purpose. The count is
+  // added to the task's `icount` when we return.
   size_t icounter = 0;
-  #endif // S_VM_EXEC_LIMIT
+
+  // Return `status` from inside an operation. `icounter` does not yet include
+  // the operation that is returning, thus the +1.
+  #define RETURN_STATUS(status) do { \
+    task->icount += icounter + 1; \
+    return (status); \
+  } while (0)
 
   while (1) {
     switch (SInstrGetOP(*++pc)) {
@@ -87,13 +111,17 @@ _SchedExec(SVM* vm, SSched* sched, STask *task) {
 
     case S_OP_LOADK: {  // R(A) = K(Bu)
       SVMDLogOpABu();
-      R_A(*pc) = K_Bu(*pc);
+      SET_REG(R_A(*pc), K_Bu(*pc));
       break;
     }
 
     case S_OP_MOVE: {  // R(A) = R(B)
       SVMDLogOpAB();
-      R_A(*pc) = R_B(*pc);
+      if (SInstrGetA(*pc) == SInstrGetB(*pc)) {
+        break;
+      }
+      SET_REG(R_A(*pc), R_B(*pc));
+      SValueRetain(R_A(*pc)); // each handle holds a reference
       break;
     }
 
@@ -109,7 +137,7 @@ _SchedExec(SVM* vm, SSched* sched, STask *task) {
       ar->pc = pc;
       switch (SInstrGetA(*pc)) {
       case 0: {
-        return STaskStatusYield;
+        RETURN_STATUS(STaskStatusYield);
       }
       case 1: {
         // The task is waiting for a timeout. The task wants to be resumed after
@@ -119,11 +147,11 @@ _SchedExec(SVM* vm, SSched* sched, STask *task) {
         SNumber after_ms = RK_B(*pc).value.n;
         _TimerStart(sched, task, after_ms, (SNumber)0);
 
-        return STaskStatusSuspend;
+        RETURN_STATUS(STaskStatusSuspend);
       }
       default: {
         SVMDLogOp("unexpected yield type %u", SInstrGetA(*pc));
-        return STaskStatusError;
+        RETURN_STATUS(STaskStatusError);
       }
       }
     }
@@ -158,12 +186,15 @@ _SchedExec(SVM* vm, SSched* sched, STask *task) {
         // Add +1 to execution cost
         S_VM_EXEC_LIMIT_INCR(1);
 
-        // copy &reg[A+1],len from parent reg to new reg
-        memcpy(
-          (void*)ar->registry,
-          (const void*)&parent_ar->registry[SInstrGetA(*pc)+1],
-          sizeof(SValue) * argc
-        );
+        // copy &reg[A+1],len from parent reg to new reg. The callee's
+        // registers hold their own references, like the caller's.
+        assert(SInstrGetA(*pc) + argc < s_countof(parent_ar->registry));
+        SValue* args = &parent_ar->registry[SInstrGetA(*pc)+1];
+        uint16_t i = 0;
+        for (; i != argc; ++i) {
+          SValueRetain(args[i]);
+          ar->registry[i] = args[i];
+        }
       }
 
       // Push the new AR to the top of the task's AR stack
@@ -185,7 +216,7 @@ _SchedExec(SVM* vm, SSched* sched, STask *task) {
         // This is the last activation record -- entry function. So let's exit
         // the task.
         ar->pc = pc;
-        return STaskStatusEnd;
+        RETURN_STATUS(STaskStatusEnd);
 
       } else {
         // Keep a temporary reference to the returning-from AR
@@ -205,8 +236,8 @@ _SchedExec(SVM* vm, SSched* sched, STask *task) {
         // Add +1 to execution cost
         S_VM_EXEC_LIMIT_INCR(1);
 
-        // Copy any return values into the new AR's registry
-        uint16_t resc = SInstrGetB(*pc);
+        // Move any return values into the new AR's registry
+        uint16_t resc = SInstrGetB(*prev_pc);
         if (resc != 0) {
           // Since the CALL instruction decides where return arguments go into
           // the callers registry, we must get the landing offset and length
@@ -219,41 +250,544 @@ _SchedExec(SVM* vm, SSched* sched, STask *task) {
             uint8_t srcri = SInstrGetA(*prev_pc);
             uint8_t dstri = SInstrGetA(*pc);
             //SLogD("resc: %u, dstlen: %u, dstri: %u", resc, dstlen, dstri);
-            memcpy(
-              (void*)&ar->registry[dstri],
-              (const void*)&prev_ar->registry[srcri],
-              sizeof(SValue) * (resc < dstlen ? resc : dstlen)
-            );
+            uint16_t n = resc < dstlen ? resc : dstlen;
+            assert(srcri + n <= s_countof(prev_ar->registry));
+            assert(dstri + n <= s_countof(ar->registry));
+            uint16_t i = 0;
+            for (; i != n; ++i) {
+              // The value's reference moves along with it
+              SET_REG(ar->registry[dstri + i], prev_ar->registry[srcri + i]);
+              prev_ar->registry[srcri + i] = SValueNil;
+            }
           }
         } // end: copying return values.
 
-        // Discard returned-from ativation record
+        // Discard returned-from ativation record, and whatever its registers
+        // still reference
+        _ARecReleaseRegs(prev_ar);
         SARecDestroy(prev_ar);
         break;
       }
     } // case S_OP_RETURN
 
-    case S_OP_SPAWN: {  // R(A) = spawn(RK(B))
-      SVMDLogOpAB();
+    case S_OP_SPAWN: {  // R(A) = spawn(RK(B), R(A+1), ... ,R(A+C))
+      SVMDLogOpABC();
       assert(RK_B(*pc).type == SValueTFunc);
       SFunc* func = (SFunc*)RK_B(*pc).value.p;
       STask* t = STaskCreate(func, task, 0);
-      STaskRetain(task);
-      _RQPush(sched, t);
+      t->sched = sched;
+
+      // Copy any arguments into the new task's registry, like CALL. The task
+      // may outlive us, so it gets its own references.
+      uint16_t argc = SInstrGetC(*pc);
+      if (argc != 0) {
+        assert(SInstrGetA(*pc) + argc < s_countof(ar->registry));
+        S_VM_EXEC_LIMIT_INCR(1);
+        SValue* args = &R_A(*pc) + 1;
+        uint16_t i = 0;
+        for (; i != argc; ++i) {
+          SValueRetain(args[i]);
+          t->ar->registry[i] = args[i];
+        }
+      }
+
+      // R(A) is a handle to the new task, and holds a reference to it
+      STaskRetain(t);
+      SET_REG(R_A(*pc), SValueTask(t));
+
+      // Subtasks belong to the scheduling group of their supertask
+      if (task->group != 0) {
+        t->group = task->group;
+        ++t->group->refc;
+      }
+      _SubtaskAdd(sched, task, t);
+
+      // Hand off to the new task as soon as we yield
+      _RQPushNext(sched, t);
       SLogD("[task %p] spawned new [task %p]", task, t);
       break;
     }
 
+    case S_OP_SPAWNN: {  // R(A) = group of RK(C) x spawn(RK(B), i, R(A+1))
+      SVMDLogOpABC();
+      assert(RK_B(*pc).type == SValueTFunc);
+      assert(RK_C(*pc).type == SValueTNumber);
+      assert(SInstrGetA(*pc) + 1 < s_countof(ar->registry));
+      SNumber count = RK_C(*pc).value.n;
+      if (!(count >= 0 && count < (SNumber)UINT32_MAX)) {
+        SVMDLogOp("task count out of range");
+        RETURN_STATUS(STaskStatusError);
+      }
+      uint32_t n = (uint32_t)count;
+      STaskGroup* g = STaskGroupCreate((SFunc*)RK_B(*pc).value.p, task, 0, n);
+      S_VM_EXEC_LIMIT_INCR(1);
+
+      // Each task gets its index in the group and a copy of R(A+1)
+      SValue arg = registry[SInstrGetA(*pc) + 1];
+      uint32_t i = 0;
+      for (; i != n; ++i) {
+        STask* t = STaskGroupAt(g, i);
+        t->sched = sched;
+        t->ar->registry[0] = SValueNumber((SNumber)i);
+        SValueRetain(arg);
+        t->ar->registry[1] = arg;
+        _SubtaskAdd(sched, task, t);
+      }
+
+      // Subtasks belong to the scheduling group of their supertask
+      if (task->group != 0) {
+        for (i = 0; i != n; ++i) {
+          STaskGroupAt(g, i)->group = task->group;
+        }
+        task->group->refc += n;
+      }
+
+      // R(A) is a handle to the group, and holds the reference it was created
+      // with
+      SET_REG(R_A(*pc), SValueGroup(g));
+
+      // Unlike SPAWN, we keep running. The tasks run in order after the tasks
+      // already in the run queue.
+      _RQPushGroup(sched, g);
+      SLogD("[task %p] spawned group [%p] of %u tasks", task, g, n);
+      break;
+    }
+
+    case S_OP_JOIN: {  // wait until the tasks of group R(A) have ended
+      SVMDLogOpA;
+      assert(R_A(*pc).type == SValueTGroup);
+      STaskGroup* g = (STaskGroup*)R_A(*pc).value.p;
+      if (task->tgroup == g) {
+        SVMDLogOp("task would wait for itself");
+        RETURN_STATUS(STaskStatusError);
+      }
+      if (g->live != 0 && _SchedJoinWait(task, g)) {
+        // Suspend until the last task ends, and then run JOIN again
+        ar->pc = pc - 1;
+        RETURN_STATUS(STaskStatusSuspend);
+      }
+      break;
+    }
+
+    case S_OP_CANCEL: {  // cancel group R(A) and the tasks it spawned
+      SVMDLogOpA;
+      assert(R_A(*pc).type == SValueTGroup);
+      STaskGroup* g = (STaskGroup*)R_A(*pc).value.p;
+      if (g->n != 0 && STaskGroupAt(g, 0)->sched != sched) {
+        SVMDLogOp("group belongs to another scheduler");
+        RETURN_STATUS(STaskStatusError);
+      }
+      _SchedCancelGroup(vm, sched, task, g);
+      if (task->flags & STaskFlagCancel) {
+        // We canceled ourselves
+        RETURN_STATUS(_SchedCancelStatus(task));
+      }
+      break;
+    }
+
+    case S_OP_TID: {  // R(A) = ID of task R(B), or own ID if R(B) is nil
+      SVMDLogOpAB();
+      STask* t = task;
+      if (R_B(*pc).type != SValueTNil) {
+        assert(R_B(*pc).type == SValueTTask);
+        t = (STask*)R_B(*pc).value.p;
+      }
+      SET_REG(R_A(*pc), SValueTaskID(STaskTabID(&sched->tids, t)));
+      break;
+    }
+
+    case S_OP_TASK: {  // R(A) = task with ID R(B), or nil if it has ended
+      SVMDLogOpAB();
+      assert(R_B(*pc).type == SValueTTaskID);
+      // The lookup takes a reference for R(A)
+      STask* t = STaskTabLookup(R_B(*pc).value.id);
+      SET_REG(R_A(*pc), (t != 0) ? SValueTask(t) : SValueNil);
+      break;
+    }
+
+    case S_OP_SEND: {  // send RK(B) to task R(A)
+      SVMDLogOpAB();
+      assert(R_A(*pc).type == SValueTTask);
+      STask* to = (STask*)R_A(*pc).value.p;
+      while (!_SchedTrySend(vm, sched, task, to, RK_B(*pc), false)) {
+        if (_SchedSendWait(vm, sched, task, to)) {
+          // Suspend until the receiver makes room, and then run SEND again
+          ar->pc = pc - 1;
+          RETURN_STATUS(STaskStatusSuspend);
+        }
+      }
+      break;
+    }
+
+    case S_OP_SENDMV: {  // send R(B) to task R(A) and set R(B) to nil
+      SVMDLogOpAB();
+      assert(R_A(*pc).type == SValueTTask);
+      STask* to = (STask*)R_A(*pc).value.p;
+      while (!_SchedTrySend(vm, sched, task, to, R_B(*pc), true)) {
+        if (_SchedSendWait(vm, sched, task, to)) {
+          // Suspend until the receiver makes room, and then run SENDMV again
+          ar->pc = pc - 1;
+          RETURN_STATUS(STaskStatusSuspend);
+        }
+      }
+      // The message took over the reference held by R(B), e.g. to a buffer,
+      // so sending costs no reference counting
+      R_B(*pc) = SValueNil;
+      break;
+    }
+
+    case S_OP_TRYSEND: {  // R(A) = send RK(C) to task R(B) if inbox not full
+      SVMDLogOpABC();
+      assert(R_B(*pc).type == SValueTTask);
+      bool sent = _SchedTrySend(vm, sched, task, (STask*)R_B(*pc).value.p,
+                                RK_C(*pc), false);
+      SET_REG(R_A(*pc), sent ? SValueTrue : SValueFalse);
+      break;
+    }
+
+    case S_OP_RECV: {  // R(A) = receive(); R(A+1) = sender
+      SVMDLogOpA;
+      assert(SInstrGetA(*pc) + 1 < s_countof(ar->registry));
+      if (task->mbox.live != 0) {
+        // Messages skipped by RECVS are older than anything in the inbox
+        SValue v;
+        STask* sender;
+        SMBoxTakeFirst(&task->mbox, &sched->msgpool, &v, &sender);
+        SET_REG(R_A(*pc), v);
+        SET_REG(registry[SInstrGetA(*pc) + 1], SValueTask(sender));
+        _SchedInboxRelease(vm, sched, task);
+        break;
+      }
+      SMsg* m;
+      while ((m = SMsgDequeue(&task->inbox)) == 0) {
+        // The inbox is empty. Tell senders that we're waiting, then look again
+        // in case a message arrived before they could see that.
+        task->wp = (void*)&task->inbox;
+        task->wtype = STaskWaitMsg;
+        // msgwait is always 0 here. Setting it with a CAS gives us the full
+        // barrier we need before looking at the inbox again.
+        SAtomicCAS(&task->msgwait, (uint32_t)0, (uint32_t)1);
+        if (SMsgQIsEmpty(&task->inbox) ||
+            !SAtomicCAS(&task->msgwait, (uint32_t)1, (uint32_t)0)) {
+          // Suspend until a sender wakes us up, and then run RECV again
+          ar->pc = pc - 1;
+          RETURN_STATUS(STaskStatusSuspend);
+        }
+        task->wp = 0;
+      }
+      // Registers take over the message's references
+      SET_REG(R_A(*pc), m->value);
+      SET_REG(registry[SInstrGetA(*pc) + 1], SValueTask(m->sender));
+      SMsgFree(&sched->msgpool, m);
+      _SchedInboxRelease(vm, sched, task);
+      break;
+    }
+
+    case S_OP_RECVS: {  // R(A) = receive matching RK(C) by B; R(A+1) = sender
+      SVMDLogOpABC();
+      assert(SInstrGetA(*pc) + 1 < s_countof(ar->registry));
+      SValue v;
+      STask* sender;
+      while (1) {
+        // Move everything in the inbox to the mailbox, which is indexed
+        SMsg* m = SMsgDequeueAll(&task->inbox);
+        while (m != 0) {
+          SMsg* next = m->next;
+          SMBoxPut(&task->mbox, m);
+          m = next;
+        }
+        if (SMBoxTake(&task->mbox, &sched->msgpool, (SMBoxMatch)SInstrGetB(*pc),
+                      RK_C(*pc), &v, &sender)) {
+          break;
+        }
+        // Nothing matched. Wait for more messages just like RECV does.
+        task->wp = (void*)&task->inbox;
+        task->wtype = STaskWaitMsg;
+        SAtomicCAS(&task->msgwait, (uint32_t)0, (uint32_t)1);
+        if (SMsgQIsEmpty(&task->inbox) ||
+            !SAtomicCAS(&task->msgwait, (uint32_t)1, (uint32_t)0)) {
+          // Suspend until a sender wakes us up, and then run RECVS again
+          ar->pc = pc - 1;
+          RETURN_STATUS(STaskStatusSuspend);
+        }
+        task->wp = 0;
+      }
+      SET_REG(R_A(*pc), v);
+      SET_REG(registry[SInstrGetA(*pc) + 1], SValueTask(sender));
+      _SchedInboxRelease(vm, sched, task);
+      break;
+    }
+
+    case S_OP_CHAN: {  // R(A) = new channel with capacity RK(B) and flags C
+      SVMDLogOpABC();
+      assert(RK_B(*pc).type == SValueTNumber);
+      SChan* c = SChanCreate((uint32_t)RK_B(*pc).value.n,
+                             (SChanFlag)SInstrGetC(*pc));
+      SET_REG(R_A(*pc), SValueChan(c));
+      break;
+    }
+
+    case S_OP_CHSEND: {  // send RK(B) to channel R(A)
+      SVMDLogOpAB();
+      assert(R_A(*pc).type == SValueTChan);
+      SChan* c = (SChan*)R_A(*pc).value.p;
+      SValue v = RK_B(*pc);
+      bool spsc = (c->flags & SChanFlagSPSC) != 0;
+      if (spsc && c->sendsched != sched) {
+        c->sendsched = sched;
+      }
+      // A receiver on another thread can take and release the value as soon
+      // as it's in the channel, so the channel's reference must exist first
+      SValueRetain(v);
+      while (1) {
+        if (c->closed) {
+          SValueRelease(v);
+          SVMDLogOp("send on closed channel");
+          RETURN_STATUS(STaskStatusError);
+        }
+        if (spsc ? SChanSPSCTrySend(c, v) : SChanTrySend(c, v)) {
+          break;
+        }
+        if (spsc ? _SchedSPSCWait(vm, sched, task, c, true) :
+                   _SchedChanWait(vm, sched, task, c, true)) {
+          SValueRelease(v);
+          // Suspend until a receiver makes room, and then run CHSEND again
+          ar->pc = pc - 1;
+          RETURN_STATUS(STaskStatusSuspend);
+        }
+      }
+      if (spsc) {
+        _SchedSPSCWake(vm, sched, c, &c->recvwaiter);
+      } else {
+        _SchedChanWakeOne(vm, sched, c, &c->recvq);
+      }
+      break;
+    }
+
+    case S_OP_CHRECV: {  // R(A) = receive from channel R(B); R(A+1) = !closed
+      SVMDLogOpAB();
+      assert(SInstrGetA(*pc) + 1 < s_countof(ar->registry));
+      assert(R_B(*pc).type == SValueTChan);
+      SChan* c = (SChan*)R_B(*pc).value.p;
+      SValue v;
+      bool ok = true;
+      bool spsc = (c->flags & SChanFlagSPSC) != 0;
+      if (spsc && c->recvsched != sched) {
+        c->recvsched = sched;
+      }
+      while (!(spsc ? SChanSPSCTryRecv(c, &v) : SChanTryRecv(c, &v))) {
+        if (c->closed) {
+          // Values sent just before the channel was closed are still received
+          if (!(spsc ? SChanSPSCTryRecv(c, &v) : SChanTryRecv(c, &v))) {
+            v = SValueNil;
+            ok = false;
+          }
+          break;
+        }
+        if (spsc ? _SchedSPSCWait(vm, sched, task, c, false) :
+                   _SchedChanWait(vm, sched, task, c, false)) {
+          // Suspend until a sender wakes us up, and then run CHRECV again
+          ar->pc = pc - 1;
+          RETURN_STATUS(STaskStatusSuspend);
+        }
+      }
+      if (ok) {
+        if (spsc) {
+          _SchedSPSCWake(vm, sched, c, &c->sendwaiter);
+        } else {
+          _SchedChanWakeOne(vm, sched, c, &c->sendq);
+        }
+      }
+      // R(B) might be one of the registers we write, so `c` is not used below
+      SET_REG(R_A(*pc), v);
+      SET_REG(registry[SInstrGetA(*pc) + 1], ok ? SValueTrue : SValueFalse);
+      break;
+    }
+
+    case S_OP_CHCLOSE: {  // close channel R(A)
+      SVMDLogOpA;
+      assert(R_A(*pc).type == SValueTChan);
+      _SchedChanClose(vm, sched, (SChan*)R_A(*pc).value.p);
+      break;
+    }
+
+    case S_OP_SELECT: {  // R(A) = index of first of R(B)..R(B+C-1) with a
+                         // value; R(A+1), R(A+2) = the value
+      SVMDLogOpABC();
+      assert(SInstrGetA(*pc) + 2 < s_countof(ar->registry));
+      SValue* src = &registry[SInstrGetB(*pc)];
+      uint32_t n = SInstrGetC(*pc);
+      // Check the bounds before _SelectValid looks at the registers
+      if (SInstrGetB(*pc) + n > s_countof(ar->registry) ||
+          !_SelectValid(src, n)) {
+        SVMDLogOp("invalid SELECT sources");
+        RETURN_STATUS(STaskStatusError);
+      }
+      uint32_t i;
+      SValue v, v2;
+      if (!_SchedSelect(vm, sched, task, src, n, &i, &v, &v2)) {
+        // Suspend until a source wakes us up, and then run SELECT again
+        ar->pc = pc - 1;
+        RETURN_STATUS(STaskStatusSuspend);
+      }
+      // Registers take over the references of `v` and `v2`
+      SET_REG(R_A(*pc), SValueNumber((SNumber)i));
+      SET_REG(registry[SInstrGetA(*pc) + 1], v);
+      SET_REG(registry[SInstrGetA(*pc) + 2], v2);
+      break;
+    }
+
+    case S_OP_TOPIC: {  // R(A) = new topic keeping the last RK(B) values
+      SVMDLogOpAB();
+      assert(RK_B(*pc).type == SValueTNumber);
+      STopic* tp = STopicCreate((uint32_t)RK_B(*pc).value.n);
+      SET_REG(R_A(*pc), SValueTopic(tp));
+      break;
+    }
+
+    case S_OP_PUBLISH: {  // publish RK(B) to topic R(A)
+      SVMDLogOpAB();
+      assert(R_A(*pc).type == SValueTTopic);
+      SValue v = RK_B(*pc);
+      SValueRetain(v); // The topic's log holds its own reference
+      _SchedTopicPublish(vm, sched, (STopic*)R_A(*pc).value.p, v);
+      break;
+    }
+
+    case S_OP_SUBSCRIBE: {  // R(A) = cursor at next value published to topic
+                            // R(B)
+      SVMDLogOpAB();
+      assert(R_B(*pc).type == SValueTTopic);
+      uint32_t pos = STopicSubscribe((STopic*)R_B(*pc).value.p);
+      SET_REG(R_A(*pc), SValueNumber((SNumber)pos));
+      break;
+    }
+
+    case S_OP_TRECV: {  // R(A) = topic R(B) at cursor R(C); R(A+1) = missed
+      SVMDLogOpABC();
+      assert(SInstrGetA(*pc) + 1 < s_countof(ar->registry));
+      assert(R_B(*pc).type == SValueTTopic);
+      assert(R_C(*pc).type == SValueTNumber);
+      STopic* tp = (STopic*)R_B(*pc).value.p;
+      uint32_t pos = (uint32_t)R_C(*pc).value.n;
+      uint32_t missed = 0;
+      SValue v;
+      while (!STopicRead(tp, &pos, &v, &missed)) {
+        if (_SchedTopicWait(task, tp, pos)) {
+          // Suspend until a publisher wakes us up, and then run TRECV again.
+          // Values we found missing are counted again then.
+          ar->pc = pc - 1;
+          RETURN_STATUS(STaskStatusSuspend);
+        }
+      }
+      SET_REG(R_C(*pc), SValueNumber((SNumber)pos));
+      SET_REG(R_A(*pc), v);
+      SET_REG(registry[SInstrGetA(*pc) + 1], SValueNumber((SNumber)missed));
+      break;
+    }
+
+    case S_OP_FUTURE: {  // R(A) = new future
+      SVMDLogOpA;
+      SFuture* f = SFutureCreate(&sched->futpool);
+      SET_REG(R_A(*pc), SValueFuture(f));
+      break;
+    }
+
+    case S_OP_FULFILL: {  // fulfill future R(A) with RK(B)
+      SVMDLogOpAB();
+      assert(R_A(*pc).type == SValueTFuture);
+      SValue v = RK_B(*pc);
+      SValueRetain(v); // The future holds its own reference
+      if (!_SchedFutureFulfill(vm, sched, (SFuture*)R_A(*pc).value.p, v)) {
+        SValueRelease(v);
+        SVMDLogOp("future already fulfilled");
+        RETURN_STATUS(STaskStatusError);
+      }
+      break;
+    }
+
+    case S_OP_AWAIT: {  // R(A) = future R(B) within RK(C) ms; R(A+1) = ok
+      SVMDLogOpABC();
+      assert(SInstrGetA(*pc) + 1 < s_countof(ar->registry));
+      assert(R_B(*pc).type == SValueTFuture);
+      SValue v;
+      SValue ok = SValueTrue;
+      if (RK_C(*pc).type != SValueTNumber) {
+        // No timeout
+        SFuture* f = (SFuture*)R_B(*pc).value.p;
+        while (!SFutureTryGet(f, &v)) {
+          if (_SchedFutureWait(task, f)) {
+            // Suspend until the future is fulfilled, and then run AWAIT again
+            ar->pc = pc - 1;
+            RETURN_STATUS(STaskStatusSuspend);
+          }
+        }
+      } else {
+        // Wait for the future and the timeout as the sources of a SELECT
+        SValue src[] = {R_B(*pc), RK_C(*pc)};
+        uint32_t i;
+        if (!_SchedSelect(vm, sched, task, src, 2, &i, &v, &ok)) {
+          // Suspend until either one wakes us up, and then run AWAIT again
+          ar->pc = pc - 1;
+          RETURN_STATUS(STaskStatusSuspend);
+        }
+        if (i == 1) {
+          ok = SValueFalse; // Timed out
+        }
+      }
+      SET_REG(R_A(*pc), v);
+      SET_REG(registry[SInstrGetA(*pc) + 1], ok);
+      break;
+    }
+
     // End: Control flow
     // -------------------------------------------------------------------------
+    // Start: Buffers
+
+    case S_OP_BUF: {  // R(A) = new buffer of RK(B) zero bytes
+      SVMDLogOpAB();
+      assert(RK_B(*pc).type == SValueTNumber);
+      SBuf* b = SBufCreate((uint32_t)RK_B(*pc).value.n);
+      SET_REG(R_A(*pc), SValueBuf(b));
+      break;
+    }
+
+    case S_OP_BUFLEN: {  // R(A) = length of buffer R(B)
+      SVMDLogOpAB();
+      assert(R_B(*pc).type == SValueTBuf);
+      SNumber len = (SNumber)((SBuf*)R_B(*pc).value.p)->len;
+      SET_REG(R_A(*pc), SValueNumber(len));
+      break;
+    }
+
+    case S_OP_BUFSLICE: {  // R(A) = bytes RK(B) up to RK(C) of buffer R(A)
+      SVMDLogOpABC();
+      assert(R_A(*pc).type == SValueTBuf);
+      assert(RK_B(*pc).type == SValueTNumber);
+      assert(RK_C(*pc).type == SValueTNumber);
+      SBuf* b = (SBuf*)R_A(*pc).value.p;
+      SNumber start = RK_B(*pc).value.n;
+      SNumber end = RK_C(*pc).value.n;
+      if (!(start >= 0 && start <= end && end <= (SNumber)b->len)) {
+        SVMDLogOp("slice out of range");
+        RETURN_STATUS(STaskStatusError);
+      }
+      // The slice keeps the bytes of `b` alive, so the register lets go of `b`
+      SET_REG(R_A(*pc), SValueBuf(SBufSlice(b, (uint32_t)start,
+                                            (uint32_t)(end - start))));
+      break;
+    }
+
+    // End: Buffers
+    // -------------------------------------------------------------------------
     // Start: Arithmetic
 
     case S_OP_ADD: { // R(A) = RK(B) + RK(C)
       SVMDLogOpABC();
       assert(RK_B(*pc).type == SValueTNumber);
       assert(RK_C(*pc).type == SValueTNumber);
-      R_A(*pc).type = SValueTNumber;
-      R_A(*pc).value.n = RK_B(*pc).value.n + RK_C(*pc).value.n;
+      SET_REG(R_A(*pc),
+              SValueNumber(RK_B(*pc).value.n + RK_C(*pc).value.n));
       break;
     }
 
@@ -261,8 +795,8 @@ _SchedExec(SVM* vm, SSched* sched, STask *task) {
       SVMDLogOpABC();
       assert(RK_B(*pc).type == SValueTNumber);
       assert(RK_C(*pc).type == SValueTNumber);
-      R_A(*pc).type = SValueTNumber;
-      R_A(*pc).value.n = RK_B(*pc).value.n - RK_C(*pc).value.n;
+      SET_REG(R_A(*pc),
+              SValueNumber(RK_B(*pc).value.n - RK_C(*pc).value.n));
       break;
     }
 
@@ -270,8 +804,8 @@ _SchedExec(SVM* vm, SSched* sched, STask *task) {
       SVMDLogOpABC();
       assert(RK_B(*pc).type == SValueTNumber);
       assert(RK_C(*pc).type == SValueTNumber);
-      R_A(*pc).type = SValueTNumber;
-      R_A(*pc).value.n = RK_B(*pc).value.n * RK_C(*pc).value.n;
+      SET_REG(R_A(*pc),
+              SValueNumber(RK_B(*pc).value.n * RK_C(*pc).value.n));
       break;
     }
 
@@ -279,8 +813,8 @@ _SchedExec(SVM* vm, SSched* sched, STask *task) {
       SVMDLogOpABC();
       assert(RK_B(*pc).type == SValueTNumber);
       assert(RK_C(*pc).type == SValueTNumber);
-      R_A(*pc).type = SValueTNumber;
-      R_A(*pc).value.n = RK_B(*pc).value.n / RK_C(*pc).value.n;
+      SET_REG(R_A(*pc),
+              SValueNumber(RK_B(*pc).value.n / RK_C(*pc).value.n));
       break;
     }
 
@@ -290,13 +824,7 @@ _SchedExec(SVM* vm, SSched* sched, STask *task) {
 
     case S_OP_NOT: { // R(A) = not R(B)
       SVMDLogOpAB();
-      if (R_B(*pc).value.p) {
-        R_A(*pc).type = SValueTFalse;
-        R_A(*pc).value.n = 0.0;
-      } else {
-        R_A(*pc).type = SValueTTrue;
-        R_A(*pc).value.n = 1.0;
-      }
+      SET_REG(R_A(*pc), R_B(*pc).value.p ? SValueFalse : SValueTrue);
       break;
     }
 
@@ -369,15 +897,18 @@ _SchedExec(SVM* vm, SSched* sched, STask *task) {
 
     default:
       SVMDLogOp("unexpected operation");
-      return STaskStatusError;
+      RETURN_STATUS(STaskStatusError);
     }
 
+    ++icounter;
+
     #if S_VM_EXEC_LIMIT
     // Reached execution limit?
-    if (++icounter >= S_VM_EXEC_LIMIT) {
+    if (icounter >= S_VM_EXEC_LIMIT) {
       SVMDLog("execution limit (" S_STR(S_VM_EXEC_LIMIT)
               ") reached -- yielding");
       ar->pc = pc;
+      task->icount += icounter;
       return STaskStatusYield;
     }
     #endif
@@ -386,6 +917,7 @@ _SchedExec(SVM* vm, SSched* sched, STask *task) {
   #undef R_A
   #undef R_B
   #undef R_C
+  #undef RETURN_STATUS
 
   S_UNREACHABLE;
   return STaskStatusError;
@@ -2,37 +2,149 @@
 #include "msg.h"
 #include "log.h"
 
-const STask STaskDead = {0};
-
-STask* STaskCreate(SFunc* func, STask* supt, STaskFlag flags) {
-  STask* t = (STask*)malloc(sizeof(STask)); // TODO: malloc
+__thread struct SSched* STaskThreadSched = 0;
 
+// Initialize task `t` with entry activation record `ar`
+static void _STaskInit(STask* t, SARec* ar, STask* supt, STaskFlag flags) {
   // Scheduler doubly-linked list links
   t->next = 0;
   t->prev = 0;
 
   // Entry activation record
-  t->ar = SARecCreate(func, 0);
+  t->ar = ar;
 
   // Set parent task, initialize refcount and STORE flags
   t->supt = supt;
-  t->refc = 1; // 1 is our "live" refcount which is decremented when we end
+  t->tgroup = 0;
+  t->subt = 0;
+  t->sibnext = 0;
+  t->sibprev = 0;
+  t->exitmsg = 0;
+  // 1 is our "live" refcount which is decremented when we end. A subtask runs
+  // in the scheduler of its supertask, which counts it (see STaskRetain.)
+  t->sched = supt ? supt->sched : 0;
+  if (t->sched != 0) {
+    t->refc = 0;
+    t->lrefc = 1;
+  } else {
+    t->refc = S_TASK_REFC_MERGED + 1;
+    t->lrefc = 0;
+  }
+  t->id = 0; // Given on first use (see STaskTabID)
   t->flags = flags;
 
   // waiting for nothing
   t->wp = 0;
   t->wtype = 0;
 
-  // Initialize inbox
+  // Inherit priority level from our supertask
+  t->pri = supt ? supt->pri : STaskPriNormal;
+
+  // Nothing executed yet. The scheduler assigns a group if needed.
+  t->icount = 0;
+  t->vrt = 0;
+  t->group = 0;
+
+  // Not in the deadline class
+  t->dlabs = 0;
+  t->dlrel = 0;
+  t->dlrun = 0;
+  t->dlused = 0;
+
+  // Initialize inbox. Inherit its capacity from our supertask.
   t->inbox = S_MSGQ_INIT(t->inbox);
+  t->msgwait = 0;
+  t->inboxcap = supt ? supt->inboxcap : 0;
+  t->inboxin = 0;
+  t->inboxout = 0;
+  t->inboxhwm = 0;
+  t->sendlock = 0;
+  t->sendq = (SChanWaitQ){0, 0};
+  t->mbox = S_MBOX_INIT;
 
+  // Not in a SELECT or waiting on a channel
+  t->selstate = 0;
+  t->sel = 0;
+  t->seldl = 0;
+  t->chwait.task = t;
+  t->chwait.sel = 0;
+  t->chwait.queued = false;
+
+  // Not in a remote queue
+  t->rwnext = 0;
+}
+
+STask* STaskCreate(SFunc* func, STask* supt, STaskFlag flags) {
+  STask* t = (STask*)malloc(sizeof(STask)); // TODO: malloc
+  _STaskInit(t, SARecCreate(func, 0), supt, flags);
   return t;
 }
 
+STaskGroup* STaskGroupCreate(SFunc* func, STask* supt, STaskFlag flags,
+                             uint32_t n) {
+  STaskGroup* g = (STaskGroup*)malloc(sizeof(STaskGroup) +
+                                      sizeof(STaskGroupSlot) * n);
+  g->refc = n + 1;
+  g->n = n;
+  g->live = n;
+  g->lock = 0;
+  g->waitq = (SChanWaitQ){0, 0};
+  uint32_t i = 0;
+  for (; i != n; ++i) {
+    STaskGroupSlot* slot = &g->slots[i];
+    SARecInit(&slot->ar, func, 0);
+    _STaskInit(&slot->task, &slot->ar, supt, flags);
+    slot->task.tgroup = g;
+  }
+  return g;
+}
+
+static void _STaskGroupFree(SQSBRNode* n) {
+  free((void*)((char*)n - offsetof(STaskGroup, qsnode)));
+}
+
+void STaskGroupDestroy(STaskGroup* g) {
+  SLogD("STaskGroupDestroy %p", g);
+  // Joining tasks hold references to the group, so there are none
+  assert(g->waitq.head == 0);
+  g->qsnode.free = _STaskGroupFree;
+  SQSBRRetire(&g->qsnode);
+}
+
+static void _STaskFree(SQSBRNode* n) {
+  free((void*)((char*)n - offsetof(STask, qsnode)));
+}
+
 void STaskDestroy(STask* t) {
   SLogD("STaskDestroy %p", t);
   if (t->ar) {
-    SARecDestroy(t->ar);
+    // The task never ran to its end
+    STaskTabEnd(0, t);
+    STaskARecDestroy(t);
+  }
+  // Discard messages that were never received
+  SMsg* m;
+  while ((m = SMsgDequeue(&t->inbox)) != 0) {
+    STaskMsgFree(0, m);
+  }
+  SValue v;
+  STask* sender;
+  while (SMBoxTakeFirst(&t->mbox, 0, &v, &sender)) {
+    SValueRelease(v);
+    STaskRelease(sender);
   }
-  free((void*)t); // TODO
+  SMBoxFree(&t->mbox, 0);
+  if (t->tgroup != 0) {
+    // The memory of `t` belongs to its group
+    STaskGroupRelease(t->tgroup);
+  } else {
+    t->qsnode.free = _STaskFree;
+    SQSBRRetire(&t->qsnode);
+  }
+}
+
+void STaskMsgFree(SMsgPool* pool, SMsg* m) {
+  SValueRelease(m->value);
+  STaskRelease(m->sender);
+  SMsgFree(pool, m);
 }
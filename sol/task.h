@@ -9,6 +9,15 @@
 #include <sol/common.h>
 #include <sol/arec.h>
 #include <sol/msg.h>
+#include <sol/mbox.h>
+#include <sol/chan.h>
+#include <sol/tasktab.h>
+#include <sol/qsbr.h>
+
+struct SSchedGroup;
+struct STaskGroup;
+struct SSched;
+struct SSelect;
 
 // Status of a task, returned by SSchedExec after executing a task
 typedef enum {
@@ -16,6 +25,7 @@ typedef enum {
   STaskStatusError,     // The task ended from a fault
   STaskStatusEnd,       // The task ended normally
   STaskStatusSuspend,   // The task is suspended (e.g. waiting for I/O or timer)
+  STaskStatusCancel,    // The task ended because it was canceled
 } STaskStatus;
 
 // Type of thing a task is waiting for (value of a task's `wtype` member)
@@ -23,54 +33,282 @@ typedef uint8_t STaskWait;
 enum {
   STaskWaitTimer = 0,   // Waiting for a timer
   STaskWaitMsg,         // Waiting for a message to arrive to its inbox
+  STaskWaitSend,        // Waiting for room in another task's full inbox
+  STaskWaitChan,        // Waiting to send to or receive from a channel
+  STaskWaitSelect,      // Waiting for any of the sources of a SELECT
+  STaskWaitTopic,       // Waiting for a value to be published to a topic
+  STaskWaitFuture,      // Waiting for a future to be fulfilled
+  STaskWaitJoin,        // Waiting for the tasks of a group to end
+};
+
+// Scheduling priority of a task (value of a task's `pri` member.) A scheduler
+// always runs tasks of a higher priority level (lower value) before tasks of a
+// lower priority level, except for an occasional pick of a lower level to
+// avoid starving it (see S_SCHED_STARVE_LIMIT in sched.c)
+typedef uint8_t STaskPri;
+enum {
+  STaskPriSystem = 0,   // Runtime-internal tasks
+  STaskPriHigh,         // Latency-sensitive tasks
+  STaskPriNormal,       // Default
+  STaskPriLow,          // Background and batch tasks
 };
+#define S_TASK_PRI_COUNT 4 // Number of priority levels
 
 // Various flags set for a task
 typedef uint32_t STaskFlag;
 enum {
   // Normally when a subtask exits abnormally, the exit propagates to the
-  // supertask, causing the supertask to exit with the same status. If the
-  // STaskFlagTrapExit flag is set however, the supertask will instead receive
-  // a message "subtask exited abnormally".
+  // supertask, causing the supertask to exit with the same status, and its
+  // other subtasks to be canceled. If the STaskFlagTrapExit flag is set
+  // however, the supertask will instead receive a message whenever a subtask
+  // exits, normally or not. Its value is SValueExit(status) where status is
+  // the subtask's STaskStatus, and its sender is the subtask. The message is
+  // allocated when the subtask is spawned, so exiting never allocates memory,
+  // and it's delivered even when the supertask's inbox is full.
   STaskFlagTrapExit = 1,
+
+  // The task is in the deadline scheduling class. Each time it becomes
+  // runnable it must run to completion (suspend or end) within `dlrel`
+  // microseconds. If it yields after using `dlrun` microseconds, it runs as a
+  // best-effort task until it next becomes runnable. Set by
+  // SSchedAdmitDeadline.
+  STaskFlagDeadline = 1 << 1,
+
+  // The task was canceled together with its group or supertask (see CANCEL),
+  // and ends the next time it would run
+  STaskFlagCancel = 1 << 2,
+
+  // Set together with STaskFlagCancel when a subtask ended from a fault and
+  // the task doesn't trap exits. The task ends with STaskStatusError instead
+  // of STaskStatusCancel, which propagates the fault further up.
+  STaskFlagLinkedError = 1 << 3,
 };
 
-typedef struct S_PACKED STask {
-  struct STask* volatile next; // Next task (used by scheduler queues)
-  struct STask*     prev;   // Previous task (used by scheduler queues)
+typedef struct STask {
+  struct STask* volatile next; // Next task (used by the wait queue)
+  struct STask*     prev;   // Previous task (used by the wait queue)
 
   SARec*            ar;     // Call stack top. Singly-linked LIFO list
 
   struct STask*     supt;   // Our supertask -- task that spawned us
-  volatile uint32_t refc;   // Number of live tasks that reference this task
+  struct STaskGroup* tgroup; // Task group the task was allocated in, or 0
+  struct STask*     subt;   // First of our live subtasks
+  struct STask*     sibnext; // Next live subtask of our supertask
+  struct STask*     sibprev; // Previous live subtask of our supertask
+  volatile uint32_t refc;   // Handles and messages that reference this task,
+                            // plus one while the task or any of its subtasks
+                            // is alive. Counted by other threads than our
+                            // owner's (see STaskRetain.)
   STaskFlag         flags;  // Flags
+  volatile STaskID  id;     // ID in the task table, 0 until first asked for
+                            // (see tasktab.h)
 
   void*             wp;     // Something the task is waiting for
   STaskWait         wtype;  // Type of thing the task is waiting for
+  STaskPri          pri;    // Priority level
+  uint32_t          lrefc;  // References counted by our owner's thread (see
+                            // STaskRetain)
+
+  uint64_t          icount; // Number of instructions executed
+  uint64_t          vrt;    // Virtual runtime (fair scheduling)
+  struct SSchedGroup* group; // Scheduling group (fair scheduling)
+
+  uint64_t          dlabs;  // Absolute deadline of the current activation
+  uint32_t          dlrel;  // Relative deadline (microseconds)
+  uint32_t          dlrun;  // Runtime needed per activation (microseconds)
+  uint32_t          dlused; // Runtime used by the current activation
 
   SMsgQ             inbox;  // Message inbox
-} STask; // 113
+  volatile uint32_t msgwait; // 1 while suspended waiting for a message
+  uint32_t          inboxcap; // Max messages in inbox. 0 means no limit.
+  volatile uint32_t inboxin;  // Messages sent to inbox, incl. being sent
+  volatile uint32_t inboxout; // Messages received from inbox
+  uint32_t          inboxhwm; // Most messages seen in inbox (high-water mark)
+  volatile uint32_t selstate; // SELECT: Waiting, or which source woke us
+  volatile uint32_t sendlock; // Protects `sendq`
+  SChanWaitQ        sendq;  // Tasks waiting for room in inbox, oldest first
+  SMBox             mbox;   // Messages skipped by selective receive
+  SMsg*             exitmsg; // Message for our supertask when we end, if it
+                             // traps exits (see STaskFlagTrapExit)
+  struct SSelect*   sel;    // SELECT: Sources waited for (see sched.c)
+  uint64_t          seldl;  // SELECT: When its timeout expires (microseconds)
+  SChanWaiter       chwait; // Used while waiting to send to or receive from
+                            // a channel, to read from a topic, or for room
+                            // in another task's inbox
+
+  struct SSched*    sched;  // Scheduler which the task belongs to
+  struct STask* volatile rwnext; // Next task in a scheduler's remote queue
+  SQSBRNode         qsnode; // Frees the task once nobody can read it anymore
+} STask; // 376
+
+// Number of messages in the inbox of task `t`, including messages which are
+// being sent
+#define STaskInboxLen(t) ((uint32_t)((t)->inboxin - (t)->inboxout))
 
+// Create a new task. The task inherits the priority level of its supertask, or
+// gets STaskPriNormal if it has no supertask. Change `pri` before scheduling the
+// task to give it a different priority.
+//
+// The task's inbox capacity `inboxcap` is also inherited, or 0 (no limit) if
+// there's no supertask. A task which sends to a full inbox is suspended until
+// the receiver makes room. Change `inboxcap` before scheduling the task.
 STask* STaskCreate(SFunc* func, STask* supt, STaskFlag flags);
+
+// Destroy a task when its last reference is released. The task's memory is
+// retired rather than freed right away (see qsbr.h), since schedulers might be
+// looking at it without a reference, e.g. while looking up its ID.
 void STaskDestroy(STask* t);
 
-// Special constant STask that gets assigned to the `next` member of tasks that
-// have live subtasks. The subtasks are considered "zombies" in this case.
-const STask STaskDead;
+// Task group -- `n` tasks running the same function, which are allocated
+// together in a single block of memory along with their entry activation
+// records. Created by SPAWNN, which gives the spawning task a handle to the
+// group.
+//
+// JOIN waits until every task in the group has ended, and CANCEL ends the
+// tasks of the group along with all tasks they spawned. Any task with a handle
+// may JOIN, but only tasks of the scheduler which runs the group may CANCEL.
+//
+// The group is retired (see STaskDestroy) when there are no handles to it, and
+// every task in it has been destroyed.
+typedef struct {
+  STask task;
+  SARec ar;   // Entry activation record of `task`
+} STaskGroupSlot;
+
+typedef struct STaskGroup {
+  volatile uint32_t refc;    // Handles, plus tasks in `slots` not yet destroyed
+  uint32_t          n;       // Number of tasks
+  volatile uint32_t live;    // Number of tasks which have not yet ended
+  volatile uint32_t lock;    // Protects `waitq`
+  SChanWaitQ        waitq;   // Tasks waiting in JOIN
+  SQSBRNode         qsnode;  // Frees the group once nobody can read it anymore
+  STaskGroupSlot    slots[];
+} STaskGroup;
+
+// Create a group of `n` tasks running `func`, like `n` calls to STaskCreate.
+// The group has one reference for the caller.
+STaskGroup* STaskGroupCreate(SFunc* func, STask* supt, STaskFlag flags,
+                             uint32_t n);
+void STaskGroupDestroy(STaskGroup* g);
+
+// Task at index `i` of group `g`
+#define STaskGroupAt(g, i) (&(g)->slots[(i)].task)
+
+// Lock and unlock a group
+inline static void S_ALWAYS_INLINE STaskGroupLock(STaskGroup* g) {
+  while (!SAtomicCAS(&g->lock, (uint32_t)0, (uint32_t)1)) {
+    while (g->lock) {}
+  }
+}
+inline static void S_ALWAYS_INLINE STaskGroupUnlock(STaskGroup* g) {
+  SAtomicBarrier();
+  g->lock = 0;
+}
+
+inline static void S_ALWAYS_INLINE STaskGroupRetain(STaskGroup* g) {
+  SAtomicAdd32((int32_t*)&g->refc, 1);
+}
+
+inline static void S_ALWAYS_INLINE STaskGroupRelease(STaskGroup* g) {
+  if (SAtomicSubAndFetch(&g->refc, 1) == 0) {
+    STaskGroupDestroy(g);
+  }
+}
+
+// Free activation record `t->ar` of task `t` and its parents, which are there
+// when the task ended inside a call. The entry activation record of a task in a
+// group is part of the group's memory, and is left alone.
+inline static void S_ALWAYS_INLINE STaskARecDestroy(STask* t) {
+  SARec* ar = t->ar;
+  while (ar != 0) {
+    SARec* parent = ar->parent;
+    if (t->tgroup == 0 || ar != &((STaskGroupSlot*)t)->ar) {
+      SARecDestroy(ar);
+    }
+    ar = parent;
+  }
+  t->ar = 0;
+}
+
+// Free a message which was not delivered to a register, releasing the
+// references it holds to its sender and to anything its value references.
+// `pool` is the message pool owned by the calling thread, or 0 (see SMsgFree.)
+void STaskMsgFree(SMsgPool* pool, SMsg* m);
+
+// Task references are counted with biased reference counting. Almost all
+// references to a task are taken and released by the thread which runs its
+// scheduler, its owner, which counts them in `lrefc` without atomic operations.
+// Other threads count theirs in `refc` with atomic operations, which goes
+// "below zero" when they release references that the owner counted.
+//
+// The owner merges the counts by adding `lrefc` and S_TASK_REFC_MERGED to
+// `refc` when `lrefc` drops to zero, or at the latest when the task releases its
+// "live" reference, after which anyone might release the last reference. From
+// then on everyone uses `refc`, and the task is destroyed when `refc` is
+// S_TASK_REFC_MERGED. A subtask is owned from the start by the scheduler of its
+// supertask, in which it runs. Any other task has no owner and starts out
+// merged.
+#define S_TASK_REFC_MERGED (1u << 30)
+
+// Scheduler which the calling thread runs, or 0 (see SSchedRun)
+extern __thread struct SSched* STaskThreadSched;
 
 // Increment reference count
 inline static void S_ALWAYS_INLINE STaskRetain(STask* t) {
-  SAtomicAdd32((int32_t*)&t->refc, 1);
+  if (t->sched == STaskThreadSched && t->lrefc != 0) {
+    ++t->lrefc;
+  } else {
+    SAtomicAdd32((int32_t*)&t->refc, 1);
+  }
 }
 
-// Decrement reference count. Returns true if `t` was free'd
+// Increment reference count, unless it has dropped to zero, i.e. unless `t` is
+// being destroyed. Returns false in that case. Used with a task that the caller
+// found without holding a reference to it, while it's an online QSBR
+// participant, which keeps the task's memory from being freed.
+inline static bool S_ALWAYS_INLINE STaskTryRetain(STask* t) {
+  uint32_t n;
+  do {
+    n = t->refc;
+    if (n == S_TASK_REFC_MERGED) {
+      return false;
+    }
+  } while (!SAtomicCAS(&t->refc, n, n + 1));
+  return true;
+}
+
+// Decrement reference count. Returns true if `t` was destroyed
 inline static bool S_ALWAYS_INLINE STaskRelease(STask* t) {
-  if (SAtomicSubAndFetch(&t->refc, 1) == 0) {
+  uint32_t n;
+  if (t->sched == STaskThreadSched && t->lrefc != 0) {
+    if (--t->lrefc != 0) {
+      return false;
+    }
+    n = SAtomicAddAndFetch(&t->refc, S_TASK_REFC_MERGED);
+  } else {
+    n = SAtomicSubAndFetch(&t->refc, 1);
+  }
+  if (n == S_TASK_REFC_MERGED) {
+    STaskDestroy(t);
+    return true;
+  }
+  return false;
+}
+
+// Release the "live" reference of `t`, which has ended along with all of its
+// subtasks. Called by its owner, if any. Returns true if `t` was destroyed
+inline static bool S_ALWAYS_INLINE STaskReleaseLive(STask* t) {
+  uint32_t d = (uint32_t)-1;
+  if (t->lrefc != 0) {
+    // Merge the references we counted
+    d += t->lrefc + S_TASK_REFC_MERGED;
+    t->lrefc = 0;
+  }
+  if (SAtomicAddAndFetch(&t->refc, d) == S_TASK_REFC_MERGED) {
     STaskDestroy(t);
     return true;
-  } else {
-    return false;
   }
+  return false;
 }
 
 #endif // S_TASK_H_
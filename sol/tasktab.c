@@ -0,0 +1,243 @@
+#include "tasktab.h"
+#include "task.h"
+#include "qsbr.h"
+
+#define S_TASKTAB_MAX (S_TASKTAB_MAX_CHUNKS * S_TASKTAB_CHUNK_SIZE)
+
+static STaskTabSlot* volatile _chunks[S_TASKTAB_MAX_CHUNKS];
+static volatile uint32_t _nslots = 0;  // Slots handed out, free or not
+static volatile uint64_t _batches = 0; // Tag << 32 | index + 1 of the first
+                                       // slot of the first free batch, or 0
+static STaskTabCache _shared = {0, 0}; // Cache for threads without their own
+static volatile uint32_t _sharedlock = 0;
+
+// Slot at index `i`, which must have been handed out
+#define _SlotAt(i) \
+  (&_chunks[(i) >> S_TASKTAB_CHUNK_BITS][(i) & (S_TASKTAB_CHUNK_SIZE - 1)])
+
+// Slot of an ID, or 0 if there's no such slot
+inline static STaskTabSlot* S_ALWAYS_INLINE _SlotOf(STaskID id) {
+  uint32_t i = STaskIDIndex(id);
+  if ((STaskIDGen(id) & 1) == 0 || i >= S_TASKTAB_MAX) {
+    return 0; // Not an ID we gave out
+  }
+  STaskTabSlot* c = _chunks[i >> S_TASKTAB_CHUNK_BITS];
+  return c == 0 ? 0 : &c[i & (S_TASKTAB_CHUNK_SIZE - 1)];
+}
+
+// Add a batch of free slots, linked through `nextfree` from the slot with
+// index `first - 1`, to the table
+static void _PushBatch(uint32_t first) {
+  STaskTabSlot* s = _SlotAt(first - 1);
+  uint64_t head;
+  do {
+    head = _batches;
+    s->nextbatch = (uint32_t)head;
+  } while (!SAtomicCAS(&_batches, head,
+                       ((head >> 32) + 1) << 32 | (uint64_t)first));
+}
+
+// Take a batch of free slots from the table. Returns the index + 1 of its first
+// slot, or 0 if there's none.
+static uint32_t _PopBatch() {
+  uint64_t head;
+  uint32_t first;
+  do {
+    head = _batches;
+    first = (uint32_t)head;
+    if (first == 0) {
+      return 0;
+    }
+    // Slots are never freed, so this is safe to read even if someone took the
+    // batch meanwhile, in which case the tag has changed and the CAS fails.
+  } while (!SAtomicCAS(&_batches, head,
+                       ((head >> 32) + 1) << 32 |
+                       _SlotAt(first - 1)->nextbatch));
+  return first;
+}
+
+// Make a batch of slots which have never been used. Returns the index + 1 of
+// its first slot, or 0 if the table is full.
+static uint32_t _NewBatch() {
+  uint32_t i = SAtomicAddAndFetch(&_nslots, S_TASKTAB_BATCH) - S_TASKTAB_BATCH;
+  if (i >= S_TASKTAB_MAX) {
+    return 0;
+  }
+  // A batch never spans two chunks. Whoever gets the first batch of a chunk
+  // might not be the first to use the chunk, so anyone who finds it missing
+  // makes one, and all but one give up theirs.
+  STaskTabSlot* volatile* cp = &_chunks[i >> S_TASKTAB_CHUNK_BITS];
+  if (*cp == 0) {
+    STaskTabSlot* c = (STaskTabSlot*)calloc(S_TASKTAB_CHUNK_SIZE,
+                                            sizeof(STaskTabSlot));
+    if (!SAtomicCAS(cp, (STaskTabSlot*)0, c)) {
+      free((void*)c);
+    }
+  }
+  uint32_t end = i + S_TASKTAB_BATCH;
+  uint32_t n = i;
+  for (; n != end; ++n) {
+    _SlotAt(n)->nextfree = (n + 1 != end) ? n + 2 : 0;
+  }
+  return i + 1;
+}
+
+static STaskID _Add(STaskTabCache* c, STask* t) {
+  if (c->head == 0) {
+    uint32_t first = _PopBatch();
+    if (first == 0 && (first = _NewBatch()) == 0) {
+      return 0;
+    }
+    c->head = first;
+    c->count = 0;
+    for (; first != 0; first = _SlotAt(first - 1)->nextfree) {
+      ++c->count;
+    }
+  }
+  uint32_t i = c->head - 1;
+  STaskTabSlot* s = _SlotAt(i);
+  c->head = s->nextfree;
+  --c->count;
+  // The generation is even, so no lookup pins the slot until we make it odd,
+  // which publishes the task
+  s->task = t;
+  uint32_t gen = STaskIDGen(s->state) + 1;
+  SAtomicLightBarrier(); // Store `task` before `state`
+  s->state = (uint64_t)gen << 32;
+  return (uint64_t)gen << 32 | i;
+}
+
+static void _Give(STaskTabCache* c, uint32_t i) {
+  _SlotAt(i)->nextfree = c->head;
+  c->head = i + 1;
+  if (++c->count == 2 * S_TASKTAB_BATCH) {
+    // Keep the slots we gave back last, which are the most likely to be in the
+    // CPU cache, and hand the rest back to the table
+    STaskTabSlot* s = _SlotAt(c->head - 1);
+    uint32_t n = 1;
+    for (; n != S_TASKTAB_BATCH; ++n) {
+      s = _SlotAt(s->nextfree - 1);
+    }
+    _PushBatch(s->nextfree);
+    s->nextfree = 0;
+    c->count = S_TASKTAB_BATCH;
+  }
+}
+
+inline static void S_ALWAYS_INLINE _SharedLock() {
+  while (!SAtomicCAS(&_sharedlock, (uint32_t)0, (uint32_t)1)) {
+    while (_sharedlock) {}
+  }
+}
+
+inline static void S_ALWAYS_INLINE _SharedUnlock() {
+  SAtomicBarrier();
+  _sharedlock = 0;
+}
+
+// Take the slot of live task ID `id`, and give it back to cache `c`
+static void _Remove(STaskTabCache* c, STaskID id) {
+  STaskTabSlot* s = _SlotOf(id);
+  uint64_t st;
+  do {
+    // Wait for lookups to unpin the slot
+    while ((uint32_t)(st = s->state) != 0) {}
+  } while (!SAtomicCAS(&s->state, st, (uint64_t)(STaskIDGen(id) + 1) << 32));
+  s->task = 0;
+  if (c != 0) {
+    _Give(c, STaskIDIndex(id));
+  } else {
+    _SharedLock();
+    _Give(&_shared, STaskIDIndex(id));
+    _SharedUnlock();
+  }
+}
+
+// ID of a task which ended without being given an ID
+#define S_TASKID_ENDED ((STaskID)2 << 32)
+
+STaskID STaskTabID(STaskTabCache* c, STask* t) {
+  while (1) {
+    STaskID id = t->id;
+    if (id != 0) {
+      return id;
+    }
+    if (c != 0) {
+      id = _Add(c, t);
+    } else {
+      _SharedLock();
+      id = _Add(&_shared, t);
+      _SharedUnlock();
+    }
+    if (id == 0 || SAtomicCAS(&t->id, (STaskID)0, id)) {
+      return id;
+    }
+    // Someone else gave `t` an ID meanwhile, or `t` ended
+    _Remove(c, id);
+  }
+}
+
+void STaskTabEnd(STaskTabCache* c, STask* t) {
+  // Turn the ID into a stale one by making its generation even, which also
+  // keeps STaskTabID from giving `t` a new ID
+  STaskID id, ended;
+  do {
+    id = t->id;
+    if (id != 0 && (STaskIDGen(id) & 1) == 0) {
+      return; // Already ended
+    }
+    ended = id + ((STaskID)1 << 32);
+    if (ended == 0 || id == 0) {
+      ended = S_TASKID_ENDED; // The generation wrapped around, or no ID
+    }
+  } while (!SAtomicCAS(&t->id, id, ended));
+  if (id != 0) {
+    _Remove(c, id);
+  }
+}
+
+void STaskTabFlush(STaskTabCache* c) {
+  if (c->head != 0) {
+    _PushBatch(c->head);
+  }
+  *c = S_TASKTAB_CACHE_INIT;
+}
+
+STask* STaskTabLookup(STaskID id) {
+  STaskTabSlot* s = _SlotOf(id);
+  if (s == 0) {
+    return 0;
+  }
+  if (SQSBRIsOnline()) {
+    // The memory of a task which we find in the slot isn't freed before we pass
+    // a quiescent state, so we don't pin the slot. Instead we take a reference
+    // unless the task is being destroyed, and check that the slot still holds
+    // the ID afterwards, which means that we got the task with the ID.
+    if (STaskIDGen(s->state) != STaskIDGen(id)) {
+      return 0; // Stale
+    }
+    SAtomicLightBarrier(); // Load `state` before `task`
+    STask* t = s->task;
+    if (t == 0 || !STaskTryRetain(t)) {
+      return 0;
+    }
+    if (STaskIDGen(s->state) != STaskIDGen(id)) {
+      STaskRelease(t);
+      return 0;
+    }
+    return t;
+  }
+  uint64_t st;
+  do {
+    st = s->state;
+    if (STaskIDGen(st) != STaskIDGen(id)) {
+      return 0; // Stale
+    }
+  } while (!SAtomicCAS(&s->state, st, st + 1));
+  // While the slot is pinned, the task can't give it back, and it holds a
+  // reference to itself until it does
+  STask* t = s->task;
+  STaskRetain(t);
+  SAtomicSubAndFetch(&s->state, (uint64_t)1);
+  return t;
+}
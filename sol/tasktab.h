@@ -0,0 +1,81 @@
+// Task table -- gives each task an ID which stays valid only for as long as the
+// task lives. Unlike a task handle, which holds a reference to its task, an ID
+// can be kept by anyone without keeping the task alive, and looking up an ID
+// of a task which has ended finds nothing instead of a dangling task.
+//
+// An ID is the index of the task's slot in a global table in its low 32 bits
+// and the generation of the slot in its high 32 bits. A slot's generation is
+// odd while a task uses it and even while it's free, and it's incremented each
+// time the slot is taken and given back, so an old ID never matches a slot
+// which has been reused. 0 is never a valid ID.
+//
+// Most tasks are never referred to by ID, so a task only gets a slot the first
+// time its ID is asked for. Spawning and ending such a task costs nothing more.
+//
+// Looking up an ID is lock-free: it pins the slot with a CAS on a word which
+// holds the generation together with a count of lookups in progress, takes a
+// reference to the task, and unpins the slot. A task gives back its slot when
+// it ends, by bumping the generation once no lookup has the slot pinned. Lookups
+// pin a slot for a few instructions only, so that wait is short. A scheduler,
+// which is a QSBR participant (see qsbr.h), doesn't pin the slot, since the
+// memory of the task it finds there stays valid until it passes a quiescent
+// state. It only writes to the task's reference count.
+//
+// Free slots are handed out from caches, one per scheduler, which take slots
+// from and give slots back to the table in batches of S_TASKTAB_BATCH, so that
+// threads rarely touch the same memory. The table keeps the batches in a
+// lock-free LIFO list, whose head is tagged with a counter to avoid the ABA
+// problem. The table grows in chunks which are never moved or freed, so a slot
+// can be read at any time.
+#ifndef S_TASKTAB_H_
+#define S_TASKTAB_H_
+#include <sol/common.h>
+
+struct STask;
+
+typedef uint64_t STaskID;
+
+#define S_TASKTAB_CHUNK_BITS 12 // 4096 slots per chunk
+#define S_TASKTAB_CHUNK_SIZE (1 << S_TASKTAB_CHUNK_BITS)
+#define S_TASKTAB_MAX_CHUNKS 65536 // Max number of live tasks is 2^28
+#define S_TASKTAB_BATCH      64 // Slots moved between a cache and the table
+
+typedef struct {
+  volatile uint64_t     state;     // Generation << 32 | lookups in progress
+  struct STask* volatile task;     // Task using the slot
+  uint32_t              nextfree;  // Index + 1 of next free slot in a batch
+  volatile uint32_t     nextbatch; // First slot of a batch: Index + 1 of the
+                                   // first slot of the next batch
+} STaskTabSlot; // 24
+
+// Free slots owned by one thread, e.g. a scheduler
+typedef struct {
+  uint32_t head;  // Index + 1 of first free slot, or 0
+  uint32_t count; // Number of free slots
+} STaskTabCache;
+
+// Constant initializer
+#define S_TASKTAB_CACHE_INIT (STaskTabCache){0, 0}
+
+// Slot index and generation of an ID
+#define STaskIDIndex(id) ((uint32_t)(id))
+#define STaskIDGen(id)   ((uint32_t)((id) >> 32))
+
+// ID of task `t`, which is given a slot in the table if it doesn't have one.
+// If `t` has ended, the ID is stale. `c` is the cache owned by the calling
+// thread, or 0 if it doesn't own one, in which case a shared cache is used
+// under a lock. Returns 0 if the table is full.
+STaskID STaskTabID(STaskTabCache* c, struct STask* t);
+
+// Called when task `t` has ended, or is freed without having ended. Makes its
+// ID stale, and gives its slot back to cache `c` (see STaskTabID).
+void STaskTabEnd(STaskTabCache* c, struct STask* t);
+
+// Give all slots in cache `c` back to the table
+void STaskTabFlush(STaskTabCache* c);
+
+// Take a reference to the task with ID `id`. Returns 0 if the ID is stale, i.e.
+// if the task has ended.
+struct STask* STaskTabLookup(STaskID id);
+
+#endif // S_TASKTAB_H_
@@ -0,0 +1,80 @@
+#include "topic.h"
+#include "task.h"
+
+STopic* STopicCreate(uint32_t cap) {
+  uint32_t n = 2;
+  while (n < cap) {
+    n *= 2;
+  }
+  STopic* t;
+  if (posix_memalign((void**)&t, 64, sizeof(STopic) + sizeof(STopicSlot) * n)) {
+    return 0;
+  }
+  t->pubpos = 0;
+  t->refc = 1;
+  t->lock = 0;
+  t->mask = n - 1;
+  t->waitq = (SChanWaitQ){0, 0};
+  uint32_t i = 0;
+  for (; i != n; ++i) {
+    t->slots[i].seq = 0;
+    t->slots[i].value = SValueNil;
+  }
+  return t;
+}
+
+void STopicDestroy(STopic* t) {
+  // Waiting tasks hold references to the topic, so there are none
+  assert(t->waitq.head == 0);
+  uint32_t i = 0;
+  for (; i != STopicCap(t); ++i) {
+    SValueRelease(t->slots[i].value);
+  }
+  free((void*)t);
+}
+
+bool STopicRead(STopic* t, uint32_t* pos, SValue* v, uint32_t* missed) {
+  while (1) {
+    uint32_t p = *pos;
+    STopicSlot* slot = &t->slots[p & t->mask];
+    uint32_t seq = slot->seq;
+    if (seq == p + 1) {
+      SAtomicLightBarrier(); // Read `seq` before the value it publishes
+      SValue val = slot->value;
+      if (!SValueHoldsRef(val)) {
+        SAtomicLightBarrier();
+        if (slot->seq == seq) {
+          *v = val;
+          *pos = p + 1;
+          return true;
+        }
+        continue; // Overwritten while we read it
+      }
+      // Retain the value before a publisher can overwrite and release it
+      STopicLock(t);
+      bool ok = (slot->seq == seq);
+      if (ok) {
+        *v = slot->value;
+        SValueRetain(*v);
+      }
+      STopicUnlock(t);
+      if (ok) {
+        *pos = p + 1;
+        return true;
+      }
+      continue;
+    }
+    uint32_t pub = t->pubpos;
+    if ((int32_t)(pub - p) <= 0) {
+      return false; // Nothing has been published at the cursor yet
+    }
+    if (pub - p > STopicCap(t)) {
+      // We fell behind and the value at the cursor was overwritten. Skip to the
+      // oldest value still in the log.
+      uint32_t oldest = pub - STopicCap(t);
+      *missed += oldest - p;
+      *pos = oldest;
+    }
+    // Otherwise a publisher is writing to the slot right now. Look again.
+  }
+}
@@ -0,0 +1,103 @@
+// Topic -- a broadcast log of values. Any number of tasks, in any schedulers,
+// publish to a topic, and every subscriber receives every value published
+// after it subscribed. Publishing a value costs the same no matter how many
+// subscribers there are: the value is appended once to the topic's log, and
+// each subscriber reads the log at its own cursor.
+//
+// The log is a ring buffer which keeps the last `cap` values. A subscriber
+// which falls more than `cap` values behind misses the oldest ones, and is
+// told how many it missed. Publishers never wait for subscribers.
+//
+// Each slot has a sequence number, which is the position of the value in the
+// slot plus one, or 0 while a publisher is writing to it. A subscriber reads
+// a value that holds no reference (e.g. a number) without locking, and uses
+// the sequence number to check that the slot wasn't overwritten meanwhile. A
+// value that holds a reference (e.g. a buffer) is read while holding the
+// topic's lock, so that it can't be released before the subscriber retains
+// it.
+//
+// Subscribers which have read everything wait in a list, which a publisher
+// takes over as a whole, so that only subscribers which are actually waiting
+// are woken. Publishers are serialized by the lock.
+#ifndef S_TOPIC_H_
+#define S_TOPIC_H_
+#include <sol/common.h>
+#include <sol/value.h>
+#include <sol/chan.h> // for SChanWaitQ
+
+typedef struct {
+  volatile uint32_t seq;   // Position of the value + 1, or 0 while written
+  SValue            value;
+} STopicSlot;
+
+typedef struct STopic {
+  volatile uint32_t pubpos;  // Position of the next value to be published
+  uint8_t           _pad[60];
+
+  volatile uint32_t refc;    // Number of references to the topic
+  volatile uint32_t lock;    // Protects publishing and `waitq`
+  uint32_t          mask;    // Capacity - 1
+  SChanWaitQ        waitq;   // Subscribers waiting for a value
+  STopicSlot        slots[]; // Ring buffer
+} STopic;
+
+// Create a new topic with a reference count of 1, which keeps the last `cap`
+// values published. `cap` is rounded up to a power of two, and is at least 2.
+STopic* STopicCreate(uint32_t cap);
+
+// Number of values the topic keeps
+#define STopicCap(t) ((t)->mask + 1)
+
+inline static void S_ALWAYS_INLINE STopicRetain(STopic* t) {
+  SAtomicAdd32((int32_t*)&t->refc, 1);
+}
+
+// Decrement reference count. Frees the topic, releasing the values in its log,
+// when there are no references left.
+void STopicDestroy(STopic* t);
+inline static void S_ALWAYS_INLINE STopicRelease(STopic* t) {
+  if (SAtomicSubAndFetch(&t->refc, 1) == 0) {
+    STopicDestroy(t);
+  }
+}
+
+// Lock and unlock publishing and the wait list of a topic
+inline static void S_ALWAYS_INLINE STopicLock(STopic* t) {
+  while (!SAtomicCAS(&t->lock, (uint32_t)0, (uint32_t)1)) {
+    while (t->lock) {}
+  }
+}
+inline static void S_ALWAYS_INLINE STopicUnlock(STopic* t) {
+  SAtomicBarrier();
+  t->lock = 0;
+}
+
+// Cursor of a new subscriber, which receives values published from now on
+inline static uint32_t S_ALWAYS_INLINE STopicSubscribe(STopic* t) {
+  return t->pubpos;
+}
+
+// Append `v` to the log. Must hold the lock. The topic takes over any
+// reference held by `v`. Returns the value which `v` replaced in the log,
+// which the caller should release after unlocking.
+inline static SValue S_ALWAYS_INLINE STopicPublish(STopic* t, SValue v) {
+  uint32_t pos = t->pubpos;
+  STopicSlot* slot = &t->slots[pos & t->mask];
+  SValue old = slot->value;
+  slot->seq = 0;
+  SAtomicBarrier(); // Readers see the slot as being written before it changes
+  slot->value = v;
+  SAtomicBarrier();
+  slot->seq = pos + 1;
+  t->pubpos = pos + 1;
+  return old;
+}
+
+// Read the value at cursor `*pos` into `v`, and advance the cursor. `v` holds
+// its own reference. If the value at the cursor was overwritten, the cursor is
+// first moved to the oldest value still in the log, and the number of values
+// skipped is added to `*missed`. Returns false if there's no value at the
+// cursor yet.
+bool STopicRead(STopic* t, uint32_t* pos, SValue* v, uint32_t* missed);
+
+#endif // S_TOPIC_H_
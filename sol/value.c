@@ -1,4 +1,9 @@
 #include "value.h"
+#include "task.h"
+#include "chan.h"
+#include "buf.h"
+#include "topic.h"
+#include "future.h"
 
 const SValue SValueNil   = {{ .p = 0 }, SValueTNil};
 const SValue SValueTrue  = {{ .n = 1 }, SValueTTrue};
@@ -20,7 +25,74 @@ char* SValueRepr(char* buf, size_t bufsize, SValue* v) {
     snprintf(buf, bufsize, "<func %p>", v->value.p);
     return buf;
   }
+
+  case SValueTExit: {
+    snprintf(buf, bufsize, "<exit %d>", (int)v->value.n);
+    return buf;
+  }
+
+  case SValueTTaskID: {
+    snprintf(buf, bufsize, "<tid %u:%u>", STaskIDIndex(v->value.id),
+             STaskIDGen(v->value.id));
+    return buf;
+  }
+
+  case SValueTTask: {
+    snprintf(buf, bufsize, "<task %p>", v->value.p);
+    return buf;
+  }
+
+  case SValueTChan: {
+    snprintf(buf, bufsize, "<chan %p>", v->value.p);
+    return buf;
+  }
+
+  case SValueTBuf: {
+    snprintf(buf, bufsize, "<buf %p %u>", v->value.p,
+             ((SBuf*)v->value.p)->len);
+    return buf;
+  }
+
+  case SValueTTopic: {
+    snprintf(buf, bufsize, "<topic %p>", v->value.p);
+    return buf;
+  }
+
+  case SValueTFuture: {
+    snprintf(buf, bufsize, "<future %p>", v->value.p);
+    return buf;
+  }
+
+  case SValueTGroup: {
+    snprintf(buf, bufsize, "<group %p %u>", v->value.p,
+             ((STaskGroup*)v->value.p)->n);
+    return buf;
+  }
   
   default: return memcpy(buf, "(?)", bufsize);
   }
 }
+
+void _SValueRetainRef(SValue v) {
+  switch (v.type) {
+    case SValueTTask: STaskRetain((STask*)v.value.p); break;
+    case SValueTChan: SChanRetain((SChan*)v.value.p); break;
+    case SValueTBuf:  SBufRetain((SBuf*)v.value.p); break;
+    case SValueTTopic: STopicRetain((STopic*)v.value.p); break;
+    case SValueTFuture: SFutureRetain((SFuture*)v.value.p); break;
+    case SValueTGroup: STaskGroupRetain((STaskGroup*)v.value.p); break;
+    default: assert(!"not a reference type");
+  }
+}
+
+void _SValueReleaseRef(SValue v) {
+  switch (v.type) {
+    case SValueTTask: STaskRelease((STask*)v.value.p); break;
+    case SValueTChan: SChanRelease((SChan*)v.value.p); break;
+    case SValueTBuf:  SBufRelease((SBuf*)v.value.p); break;
+    case SValueTTopic: STopicRelease((STopic*)v.value.p); break;
+    case SValueTFuture: SFutureRelease((SFuture*)v.value.p); break;
+    case SValueTGroup: STaskGroupRelease((STaskGroup*)v.value.p); break;
+    default: assert(!"not a reference type");
+  }
+}
@@ -15,13 +15,23 @@ typedef enum {
   SValueTNumber,
   SValueTFunc,
   SValueTOpaque,
+  SValueTExit,   // Status of a task which ended (see STaskFlagTrapExit)
+  SValueTTaskID, // Task ID, which doesn't keep the task alive (see tasktab.h)
+  // Types of values which hold a reference to what they point to
+ _SValueTRefsBegin,
+  SValueTTask,   // Task handle
+  SValueTChan,   // Channel (see chan.h)
+  SValueTBuf,    // Buffer (see buf.h)
+  SValueTTopic,  // Topic (see topic.h)
+  SValueTFuture, // Future (see future.h)
+  SValueTGroup,  // Task group (see task.h)
 } SValueT;
 
 #define SNumberFormat "%f"
 typedef double SNumber;
 
 typedef struct {
-  union { void* p; SNumber n; } value;
+  union { void* p; SNumber n; uint64_t id; } value;
   uint8_t type;
 } SValue;
 
@@ -40,6 +50,44 @@ const SValue SValueFalse;
 #define SValueOpaque(v) \
   ((SValue){.type = SValueTOpaque, .value = {.p = v}})
 
+#define SValueExit(v) \
+  ((SValue){.type = SValueTExit, .value = {.n = v}})
+
+#define SValueTaskID(v) \
+  ((SValue){.type = SValueTTaskID, .value = {.id = v}})
+
+#define SValueTask(v) \
+  ((SValue){.type = SValueTTask, .value = {.p = v}})
+
+#define SValueChan(v) \
+  ((SValue){.type = SValueTChan, .value = {.p = v}})
+
+#define SValueBuf(v) \
+  ((SValue){.type = SValueTBuf, .value = {.p = v}})
+
+#define SValueTopic(v) \
+  ((SValue){.type = SValueTTopic, .value = {.p = v}})
+
+#define SValueFuture(v) \
+  ((SValue){.type = SValueTFuture, .value = {.p = v}})
+
+#define SValueGroup(v) \
+  ((SValue){.type = SValueTGroup, .value = {.p = v}})
+
+// True if `v` holds a reference to what it points to
+#define SValueHoldsRef(v) ((v).type > _SValueTRefsBegin)
+
+// Retain or release the reference held by `v`, if any. Called when a value is
+// copied (e.g. into a message) and when a copy is discarded.
+void _SValueRetainRef(SValue v);
+void _SValueReleaseRef(SValue v);
+inline static void S_ALWAYS_INLINE SValueRetain(SValue v) {
+  if (SValueHoldsRef(v)) { _SValueRetainRef(v); }
+}
+inline static void S_ALWAYS_INLINE SValueRelease(SValue v) {
+  if (SValueHoldsRef(v)) { _SValueReleaseRef(v); }
+}
+
 char* SValueRepr(char* buf, size_t bufsize, SValue* v);
 
 #endif // S_VALUE_H_
@@ -12,10 +12,21 @@
 
 typedef struct {
   // TODO: own schedulers
+
+  // Number of schedulers which are busy, plus the number of tasks that have
+  // been handed to a scheduler by another thread but not yet picked up. A
+  // scheduler is busy while it has runnable tasks or active event watchers.
+  // When this reaches zero, no scheduler can get any more work.
+  volatile int32_t nwork;
+
+  // Number of schedulers currently in SSchedRun
+  volatile int32_t nsched;
 } SVM;
 
 #define SVM_INIT ((SVM){ \
   /*.constants = { .values = {}, .size = 100, .count = 0 }*/ \
+  .nwork = 0, \
+  .nsched = 0, \
 })
 
 #endif // S_VM_H_
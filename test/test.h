@@ -17,6 +17,7 @@
 #include <sol/vm.h>
 #include <sol/sched.h>
 #include <sol/task.h>
+#include <sol/chan.h>
 #include <sol/instr.h>
 #include <sol/debug.h>
 #include <sol/log.h>
@@ -25,4 +26,43 @@ static void __attribute__((constructor)) init_test() {
   SLogStream = stdout;
 }
 
+// Create a task which runs `func` with channel `c` in R(0)
+inline static STask* S_UNUSED chan_task(SFunc* func, SChan* c) {
+  STask* t = STaskCreate(func, 0, 0);
+  SChanRetain(c);
+  t->ar->registry[0] = SValueChan(c);
+  return t;
+}
+
+#if !S_WITHOUT_SMP
+#include <pthread.h>
+
+typedef struct {
+  pthread_t thread;
+  SVM*      vm;
+  SSched*   sched;
+} SchedThread;
+
+static void* sched_thread_main(void* d) {
+  SchedThread* t = (SchedThread*)d;
+  SSchedRun(t->vm, t->sched);
+  return 0;
+}
+
+// Run each of the `count` schedulers `scheds` in a thread of its own, and
+// return once all of them have exited
+static void S_UNUSED run_scheds(SVM* vm, SSched** scheds, size_t count) {
+  SchedThread threads[count];
+  size_t i = 0;
+  for (; i != count; ++i) {
+    threads[i] = (SchedThread){0, vm, scheds[i]};
+    SAssertNil(pthread_create(&threads[i].thread, 0, &sched_thread_main,
+                              (void*)&threads[i]));
+  }
+  for (i = 0; i != count; ++i) {
+    SAssertNil(pthread_join(threads[i].thread, 0));
+  }
+}
+#endif
+
 #endif  // S_TEST_TEST_H_
@@ -0,0 +1,259 @@
+// Tests SPSC channels without tasks, by passing values through a pipeline of
+// threads where each thread receives from the previous one and sends to the
+// next one. Compares pipelines linked by SPSC channels with pipelines linked by
+// message queues, passing one value at a time and in batches.
+#include "test.h"
+#include "bench.h"
+#include <sol/common.h>
+#include <sol/host.h> // for SHostYield
+#include <sol/chan.h>
+#include <sol/msg.h>
+
+// TODO: Disable this test if the system does not have pthreads
+#include <pthread.h>
+
+#if S_TEST_SUIT_RUNNING
+#define VALUE_COUNT  100000
+#else
+#define VALUE_COUNT  10000000
+#endif
+
+#define STAGE_COUNT 4   // Threads in a pipeline, including source and sink
+#define BATCH_SIZE  16  // Values per batch in batched mode
+#define CHAN_CAP    256 // Values per SPSC channel
+
+bool use_chan = false; // Link stages with SPSC channels instead of SMsgQs
+bool batched = false;  // Pass values on in batches
+
+typedef struct Stage {
+  uint32_t  id;
+  pthread_t thread;
+  SChan*    in;       // Channel from the previous stage
+  SChan*    out;      // Channel to the next stage
+  SMsgQ*    inq;      // Queue from the previous stage
+  SMsgQ*    outq;     // Queue to the next stage
+  SMsgPool  pool;
+  uint32_t  count;    // Values passed on (or for the sink, received)
+  SNumber   sum;      // Sink: Sum of values received
+  SValue    buf[BATCH_SIZE]; // Values received but not yet passed on
+  uint32_t  bufi;     // First value in `buf` not passed on
+  uint32_t  bufn;     // Number of values in `buf`
+} Stage;
+
+inline static bool is_source(Stage* s) { return s->id == 0; }
+inline static bool is_sink(Stage* s) { return s->id == STAGE_COUNT - 1; }
+
+// Take in values, up to BATCH_SIZE (or 1 if not batched), if `buf` is empty.
+// Returns true if any value was taken in.
+static bool take_in(Stage* s) {
+  if (s->bufi != s->bufn) {
+    return false;
+  }
+  uint32_t max = batched ? BATCH_SIZE : 1;
+  s->bufi = 0;
+  s->bufn = 0;
+  if (is_source(s)) {
+    while (s->bufn != max && s->count + s->bufn != VALUE_COUNT) {
+      s->buf[s->bufn] = SValueNumber((SNumber)(s->count + s->bufn + 1));
+      ++s->bufn;
+    }
+  } else if (use_chan) {
+    if (batched) {
+      s->bufn = SChanSPSCRecvBatch(s->in, s->buf, max);
+    } else if (SChanSPSCTryRecv(s->in, &s->buf[0])) {
+      s->bufn = 1;
+    }
+  } else {
+    SMsg* m = batched ? SMsgDequeueAll(s->inq) : SMsgDequeue(s->inq);
+    bool took = (m != 0);
+    while (m != 0) {
+      // A batch from SMsgDequeueAll might be larger than `buf`, so we always
+      // take in all of it. The sink only counts the values.
+      SMsg* next = batched ? m->next : 0;
+      if (is_sink(s)) {
+        ++s->count;
+        s->sum += m->value.value.n;
+      } else {
+        SMsg* n = SMsgAlloc(&s->pool);
+        n->value = m->value;
+        n->next = 0;
+        if (s->bufn == 0) {
+          s->buf[0].value.p = (void*)n; // head of chain
+        } else {
+          ((SMsg*)s->buf[1].value.p)->next = n;
+        }
+        s->buf[1].value.p = (void*)n; // tail of chain
+        ++s->bufn;
+      }
+      SMsgFree(&s->pool, m);
+      m = next;
+    }
+    if (s->bufn != 0) {
+      // The whole chain is passed on at once
+      s->bufn = 1;
+    }
+    return took;
+  }
+  return s->bufn != 0;
+}
+
+// Pass on values in `buf`. Returns true if any value was passed on.
+static bool pass_on(Stage* s) {
+  if (s->bufi == s->bufn) {
+    return false;
+  }
+  if (is_sink(s)) {
+    // Only channel stages get here, with values in `buf`
+    for (; s->bufi != s->bufn; ++s->bufi) {
+      s->sum += s->buf[s->bufi].value.n;
+      ++s->count;
+    }
+    return true;
+  }
+  if (use_chan) {
+    uint32_t n = SChanSPSCSendBatch(s->out, &s->buf[s->bufi],
+                                    s->bufn - s->bufi);
+    s->bufi += n;
+    s->count += n;
+    return n != 0;
+  }
+  if (is_source(s)) {
+    // Make a chain of messages of the values
+    SMsg* first = 0;
+    SMsg* last = 0;
+    for (; s->bufi != s->bufn; ++s->bufi) {
+      SMsg* m = SMsgAlloc(&s->pool);
+      m->value = s->buf[s->bufi];
+      m->next = 0;
+      if (first == 0) {
+        first = m;
+      } else {
+        last->next = m;
+      }
+      last = m;
+      ++s->count;
+    }
+    SMsgEnqueueBatch(s->outq, first, last);
+  } else {
+    // Pass on the chain made by take_in
+    SMsg* first = (SMsg*)s->buf[0].value.p;
+    SMsg* last = (SMsg*)s->buf[1].value.p;
+    SMsg* m = first;
+    for (; m != 0; m = m->next) {
+      ++s->count;
+    }
+    SMsgEnqueueBatch(s->outq, first, last);
+    s->bufi = s->bufn;
+  }
+  return true;
+}
+
+// Do a bit of work. Returns true when the stage is done.
+static bool step(Stage* s, bool* progress) {
+  if (s->count == VALUE_COUNT && s->bufi == s->bufn) {
+    return true;
+  }
+  bool took = take_in(s);
+  *progress = pass_on(s) || took || *progress;
+  return false;
+}
+
+void* thread_main(void* d) {
+  Stage* s = (Stage*)d;
+  bool progress = false;
+  while (!step(s, &progress)) {
+    if (!progress) {
+      SHostYield(); // Nothing to do. Let the other stages run.
+    }
+    progress = false;
+  }
+  SMsgPoolFlush(&s->pool);
+  #if !S_WITHOUT_SMP
+  pthread_exit(0);
+  #endif
+  return 0;
+}
+
+void run() {
+  Stage stages[STAGE_COUNT];
+  SChan* chans[STAGE_COUNT - 1];
+  SMsgQ queues[STAGE_COUNT - 1];
+  size_t i = 0;
+  for (; i != STAGE_COUNT - 1; ++i) {
+    chans[i] = SChanCreate(CHAN_CAP, SChanFlagSPSC);
+    queues[i] = S_MSGQ_INIT(queues[i]);
+  }
+  for (i = 0; i != STAGE_COUNT; ++i) {
+    Stage* s = &stages[i];
+    memset((void*)s, 0, sizeof(Stage));
+    s->id = (uint32_t)i;
+    s->in = (i == 0) ? 0 : chans[i - 1];
+    s->inq = (i == 0) ? 0 : &queues[i - 1];
+    s->out = (i == STAGE_COUNT - 1) ? 0 : chans[i];
+    s->outq = (i == STAGE_COUNT - 1) ? 0 : &queues[i];
+    s->pool = S_MSGPOOL_INIT;
+  }
+
+  SResUsage rstart;
+  SAssertTrue(SResUsageSample(&rstart));
+
+  #if S_WITHOUT_SMP
+  // Take turns running the stages in this thread
+  bool done = false;
+  while (!done) {
+    bool progress = false;
+    done = true;
+    for (i = 0; i != STAGE_COUNT; ++i) {
+      done = step(&stages[i], &progress) && done;
+    }
+  }
+  #else
+  for (i = 0; i != STAGE_COUNT; ++i) {
+    if (pthread_create(&stages[i].thread, 0, &thread_main,
+                       (void*)&stages[i]) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+  for (i = 0; i != STAGE_COUNT; ++i) {
+    SAssertNil(pthread_join(stages[i].thread, 0));
+  }
+  #endif
+
+  // The sink received every value exactly once, in some order
+  Stage* sink = &stages[STAGE_COUNT - 1];
+  assert(sink->count == VALUE_COUNT);
+  assert(sink->sum == (SNumber)VALUE_COUNT * (VALUE_COUNT + 1) / 2);
+
+  #if !S_TEST_SUIT_RUNNING
+  SResUsage rend;
+  SAssertTrue(SResUsageSample(&rend));
+  print("--- %u stages, %s, %s ---", STAGE_COUNT,
+        use_chan ? "SPSC channels" : "message queues",
+        batched ? "batched" : "one at a time");
+  SResUsagePrintSummary(&rstart, &rend, "value", VALUE_COUNT, STAGE_COUNT);
+  #endif
+
+  for (i = 0; i != STAGE_COUNT - 1; ++i) {
+    assert(SChanSPSCIsEmpty(chans[i]));
+    SChanRelease(chans[i]);
+    assert(SMsgQIsEmpty(&queues[i]));
+  }
+  for (i = 0; i != STAGE_COUNT; ++i) {
+    SMsgPoolFree(&stages[i].pool);
+  }
+}
+
+int main() {
+  use_chan = false;
+  batched = false;
+  run();
+  batched = true;
+  run();
+  use_chan = true;
+  batched = false;
+  run();
+  batched = true;
+  run();
+  return 0;
+}
@@ -1,4 +1,7 @@
-// Tests the message queue, which is a lock-free MP,SC FIFO queue.
+// Tests the message queue, which is a lock-free MP,SC FIFO queue. Runs once
+// with messages from malloc and once with messages from message pools. Then
+// compares sending and receiving one message at a time with sending and
+// receiving batches of messages, with 1 to 16 producers.
 #include "test.h"
 #include "bench.h"
 #include <sol/common.h>
@@ -11,22 +14,45 @@
 #if S_TEST_SUIT_RUNNING
 #define VALUE_COUNT  10000
 #else
-#define VALUE_COUNT  10000
-//#define VALUE_COUNT  10000000
+#define VALUE_COUNT  1000000
 #endif
 
+#define BATCH_SIZE 16 // Messages per batch sent by a producer in batched mode
+
+// Microseconds the consumer waits for a message before giving up. Producers
+// might not get to run for a while, e.g. when there are more of them than
+// CPUs, so the consumer yields while the queue is empty.
+#define STALL_TIMEOUT_USECS 10000000
+
+static const size_t producer_counts[] = { 1, 2, 4, 8, 16 };
+
 size_t thread_count = 3;
 uint32_t total_count = 0;
+bool pooled = false;  // Use message pools instead of malloc
+bool batched = false; // Use SMsgEnqueueBatch and SMsgDequeueAll
 
 typedef struct Thread {
   uint32_t  tid;
   pthread_t thread;
   SMsgQ*    q;
+  SMsgPool  pool;
 } Thread;
 
+inline static SMsg* alloc_msg(Thread* t) {
+  return pooled ? SMsgAlloc(&t->pool) : (SMsg*)malloc(sizeof(SMsg));
+}
+
+inline static void free_msg(Thread* t, SMsg* n) {
+  if (pooled) {
+    SMsgFree(&t->pool, n);
+  } else {
+    free(n);
+  }
+}
+
 void* thread_main(void* d) {
   Thread* t = (Thread*)d;
-  bool is_consumer = (t->tid == 1);
+  bool is_consumer = (t->tid == 0);
   uint32_t count;
 
   if (is_consumer) {
@@ -43,31 +69,69 @@ void* thread_main(void* d) {
     expected_sum *= (SNumber)(thread_count-1);
 
     count = total_value_count;
-    size_t failures = 0;
+    uint64_t stalled_since = 0; // When the queue was first found empty
 
     do {
-      SMsg* n = SMsgDequeue(t->q);
+      SMsg* n = batched ? SMsgDequeueAll(t->q) : SMsgDequeue(t->q);
       if (n) {
-        failures = 0;
-        --count;
-        sum += n->value.value.n;
-        //print("  [consumer] recv %u", n->value);
-        free(n);
-      } else if (++failures == 100000) {
-        SAssert(!"Too many consecutive 'dequeue' errors");
+        stalled_since = 0;
+        do {
+          SMsg* next = batched ? n->next : 0;
+          --count;
+          sum += n->value.value.n;
+          //print("  [consumer] recv %u", n->value);
+          free_msg(t, n);
+          n = next;
+        } while (n);
+      } else {
+        uint64_t now = SHostMonotonicUSecs();
+        if (stalled_since == 0) {
+          stalled_since = now;
+        } else if (now - stalled_since > STALL_TIMEOUT_USECS) {
+          SAssert(!"Timed out waiting for messages");
+        }
+        SHostYield();
       }
     } while (count);
+    SMsgPoolFlush(&t->pool);
     print("  [consumer] received all %u values (sum: " SNumberFormat ")",
           total_value_count, sum);
     assert(sum == expected_sum);
 
+  } else if (batched) {
+    // We must produce VALUE_COUNT values, BATCH_SIZE at a time
+    count = VALUE_COUNT;
+    print("[producer %u] starting, will send %u values", t->tid, count);
+    SMsg* first = 0;
+    SMsg* last = 0;
+    uint32_t n_batched = 0;
+    do {
+      SMsg* n = alloc_msg(t);
+      n->value.value.n = (SNumber)count;
+      if (first == 0) {
+        first = n;
+      } else {
+        last->next = n;
+      }
+      last = n;
+      if (++n_batched == BATCH_SIZE) {
+        SMsgEnqueueBatch(t->q, first, last);
+        first = 0;
+        n_batched = 0;
+      }
+    } while (--count);
+    if (first != 0) {
+      SMsgEnqueueBatch(t->q, first, last);
+    }
+    print("[producer %u] exiting", t->tid);
+
   } else {
     // We must produce VALUE_COUNT values
     count = VALUE_COUNT;
     print("[producer %u] starting, will send %u values", t->tid, count);
     do {
       //print("[producer %u] sending %u", t->tid, count);
-      SMsg* n = (SMsg*)malloc(sizeof(SMsg));
+      SMsg* n = alloc_msg(t);
       n->value.value.n = (SNumber)count;
       SMsgEnqueue(t->q, n);
     } while (--count);
@@ -90,33 +154,33 @@ bool spawn_thread(Thread* t) {
   }
 }
 
-int main() {
-  // Use a minimum of <thread_count> OS threads
-  thread_count = S_MAX(thread_count, SHostAvailCPUCount());
+// Run one consumer and `thread_count - 1` producers
+void run() {
   total_count = (thread_count-1) * VALUE_COUNT;
   SMsgQ q = S_MSGQ_INIT(q);
   SResUsage rstart;
 
-#if S_WITHOUT_SMP
-  thread_count = 2; // or our sum and count calculations will be off
-  total_count = VALUE_COUNT;
-  Thread producer = {0,0,&q};
-  Thread consumer = {1,0,&q};
-  SAssertTrue(SResUsageSample(&rstart));
-  thread_main((void*)&producer);
-  thread_main((void*)&consumer);
-
-#else // S_WITHOUT_SMP
-  print("thread_count: %zu", thread_count);
   Thread* threads = (Thread*)malloc(sizeof(Thread) * thread_count);
-  SAssertTrue(SResUsageSample(&rstart));
-
   size_t i = 0;
   for (; i != thread_count; ++i) {
     threads[i].tid = (uint32_t)i;
     threads[i].q = &q;
+    threads[i].pool = S_MSGPOOL_INIT;
+  }
+  SAssertTrue(SResUsageSample(&rstart));
+
+#if S_WITHOUT_SMP
+  // Run the producers one after another, and then the consumer
+  for (i = 1; i != thread_count; ++i) {
+    thread_main((void*)&threads[i]);
+  }
+  thread_main((void*)&threads[0]);
+
+#else // S_WITHOUT_SMP
+  print("thread_count: %zu", thread_count);
+  for (i = 0; i != thread_count; ++i) {
     if (!spawn_thread(&threads[i])) {
-      return 1;
+      exit(1);
     }
   }
 
@@ -129,14 +193,43 @@ int main() {
 #endif // S_WITHOUT_SMP
 
   SAssertNil(SMsgDequeue(&q));
+  SAssertNil(SMsgDequeueAll(&q));
 
   // Sample #2 and print stats
   #if !S_TEST_SUIT_RUNNING
   SResUsage rend;
   SAssertTrue(SResUsageSample(&rend));
+  print("--- %zu producers, %s, %s ---", thread_count - 1,
+        pooled ? "message pool" : "malloc",
+        batched ? "batched" : "one at a time");
   SResUsagePrintSummary(&rstart, &rend, "send+recv", total_count, thread_count);
   #endif
 
+  // All messages have been received, so no pool has nodes in use
+  for (i = 0; i != thread_count; ++i) {
+    SMsgPoolFree(&threads[i].pool);
+  }
+  free((void*)threads);
+}
+
+int main() {
+  // Use a minimum of <thread_count> OS threads
+  thread_count = S_MAX(thread_count, SHostAvailCPUCount());
+
+  pooled = false;
+  run();
+  pooled = true;
+  run();
+
+  size_t i = 0;
+  for (; i != s_countof(producer_counts); ++i) {
+    thread_count = producer_counts[i] + 1;
+    batched = false;
+    run();
+    batched = true;
+    run();
+  }
+
   pthread_exit(NULL);
   return 0;
 }
@@ -1,7 +1,9 @@
-// Tests basic programming
+// Tests basic programming, and that CALL and RETURN keep the references held
+// by arguments and results balanced
 #include "test.h"
 #include <sol/vm.h>
 #include <sol/sched.h>
+#include <sol/chan.h>
 
 /*
 clang -Wall -g -std=c99 -arch x86_64 -O0 -DS_DEBUG=1 -I.. \
@@ -289,6 +291,94 @@ void test_control_flow(SVM* vm) {
   SFuncDestroy(func);
 }
 
+bool call_entered = false;
+bool call_checked = false;
+SChan* fault_chan = 0;
+
+void call_enter(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // The argument is referenced by the caller's register and ours
+  SValue* r = t->ar->registry;
+  assert(r[0].type == SValueTChan && ((SChan*)r[0].value.p)->refc == 2);
+  call_entered = true;
+}
+
+void call_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // The callee overwrote its argument, which left ours alone, and returned a
+  // channel of its own
+  SValue* r = t->ar->registry;
+  assert(r[0].type == SValueTChan && ((SChan*)r[0].value.p)->refc == 1);
+  assert(r[1].type == SValueTChan && ((SChan*)r[1].value.p)->refc == 1);
+  assert(r[0].value.p != r[1].value.p);
+  call_checked = true;
+}
+
+void fault_enter(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // Keep the argument around to see that it's released once when we fault
+  fault_chan = (SChan*)t->ar->registry[0].value.p;
+  SChanRetain(fault_chan);
+}
+
+void test_call(SVM* vm) {
+  // Covered: CALL and RETURN with arguments and results that hold references
+  SValue constants1[] = {
+    SValueOpaque(&call_enter),
+    SValueNumber(1),
+  };
+  SInstr instructions1[] = {
+    SInstr_DBGCB(0, 0, 0),              // check R(0)
+    SInstr_CHAN(0, S_INSTR_RK_k+1, 0),  // R(0) = new channel of 1
+    SInstr_RETURN(0, 1),                // return R(0)
+  };
+  SFunc* callee_func = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueOpaque(&fault_enter),
+    SValueNumber(1),
+    SValueNumber(5),
+  };
+  SInstr instructions2[] = {
+    SInstr_DBGCB(0, 0, 0),              // hold on to R(0)
+    SInstr_BUF(1, S_INSTR_RK_k+1),      // R(1) = new buffer of 1 byte
+    SInstr_BUFSLICE(1, S_INSTR_RK_k+1,  // R(1) = bytes 1 up to 5 of R(1),
+                    S_INSTR_RK_k+2),    //        which faults
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* fault_func = SFuncCreate(constants2, instructions2);
+
+  SValue constants3[] = {
+    SValueFunc(callee_func),
+    SValueNumber(1),
+    SValueOpaque(&call_check),
+    SValueFunc(fault_func),
+  };
+  SInstr instructions3[] = {
+    SInstr_LOADK(0, 0),                 // R(0) = callee
+    SInstr_CHAN(1, S_INSTR_RK_k+1, 0),  // R(1) = new channel of 1
+    SInstr_CALL(0, 1, 1),               // R(0) = callee(R(1))
+    SInstr_DBGCB(0, 2, 0),              // check R(0) and R(1)
+    SInstr_LOADK(3, 3),                 // R(3) = fault_func
+    SInstr_MOVE(4, 1),                  // R(4) = R(1)
+    SInstr_CALL(3, 1, 0),               // fault_func(R(4)), which ends us
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* caller_func = SFuncCreate(constants3, instructions3);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(caller_func, 0, 0));
+  SSchedRun(vm, sched);
+
+  assert(call_entered);
+  assert(call_checked);
+  // Our reference is the only one left
+  assert(fault_chan != 0 && fault_chan->refc == 1);
+  SChanRelease(fault_chan);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(callee_func);
+  SFuncDestroy(fault_func);
+  SFuncDestroy(caller_func);
+}
+
 int main(int argc, const char** argv) {
   SVM vm = SVM_INIT;
 
@@ -296,6 +386,7 @@ int main(int argc, const char** argv) {
   test_arithmetic(&vm);
   test_logic_tests(&vm);
   test_control_flow(&vm);
+  test_call(&vm);
 
   return 0;
 }
@@ -0,0 +1,251 @@
+// Tests buffers and slices of buffers, and benchmarks sending a large buffer
+// back and forth between two tasks, compared with sending a number.
+#include "test.h"
+#include "bench.h"
+#include <sol/vm.h>
+#include <sol/sched.h>
+#include <sol/buf.h>
+
+#if S_TEST_SUIT_RUNNING
+#define VALUE_COUNT 10000
+#else
+#define VALUE_COUNT 1000000
+#endif
+
+#define PAYLOAD_SIZE (1024 * 1024) // Bytes in the buffer sent by bench_send
+
+void test_slice() {
+  // Slices view the bytes of the buffer they're made from, and keep the
+  // buffer alive
+  SBuf* b = SBufCreateCopy("hello, world", 12);
+  assert(b->len == 12);
+  assert(b->base == 0);
+
+  SBuf* s1 = SBufSlice(b, 7, 5);
+  assert(s1->len == 5);
+  assert(s1->base == b);
+  assert(memcmp(s1->data, "world", 5) == 0);
+  assert(b->refc == 2);
+
+  // A slice of a slice views the original buffer directly
+  SBuf* s2 = SBufSlice(s1, 1, 3);
+  assert(s2->len == 3);
+  assert(s2->base == b);
+  assert(memcmp(s2->data, "orl", 3) == 0);
+  assert(b->refc == 3);
+  assert(s1->refc == 1);
+
+  // Empty slices are fine
+  SBuf* s3 = SBufSlice(b, 12, 0);
+  assert(s3->len == 0);
+  SBufRelease(s3);
+
+  SBufRelease(b);
+  SBufRelease(s1);
+  assert(b->refc == 1);
+  assert(memcmp(s2->data, "orl", 3) == 0);
+  SBufRelease(s2);
+}
+
+bool recv_checked = false;
+
+void recv_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // R(0) is a slice of bytes 10 up to 20 of the buffer received, whose length
+  // is in R(2). R(1) still has the sender.
+  assert(t->ar->registry[2].type == SValueTNumber);
+  assert(t->ar->registry[2].value.n == 100);
+  assert(t->ar->registry[0].type == SValueTBuf);
+  SBuf* b = (SBuf*)t->ar->registry[0].value.p;
+  assert(b->len == 10);
+  assert(b->refc == 1);
+  // Nobody else references the buffer anymore: The sender moved it
+  assert(b->base != 0);
+  assert(b->base->len == 100);
+  assert(b->base->refc == 1);
+  assert(t->ar->registry[1].type == SValueTTask);
+  recv_checked = true;
+}
+
+bool send_checked = false;
+
+void send_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // SENDMV left R(1) nil
+  assert(t->ar->registry[1].type == SValueTNil);
+  send_checked = true;
+}
+
+void test_send(SVM* vm) {
+  // Covered: BUF, BUFLEN, BUFSLICE, SENDMV
+  SValue constants1[] = {
+    SValueNumber(10),
+    SValueNumber(20),
+    SValueOpaque(&recv_check),
+  };
+  SInstr instructions1[] = {
+    SInstr_RECV(0),                     // R(0) = receive(); R(1) = sender
+    SInstr_BUFLEN(2, 0),                // R(2) = length of R(0)
+    SInstr_BUFSLICE(0, S_INSTR_RK_k+0,  // R(0) = bytes 10 up to 20 of R(0)
+                       S_INSTR_RK_k+1),
+    SInstr_DBGCB(0, 2, 0),              // check R(0..2)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* child_func = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueFunc(child_func),
+    SValueNumber(100),
+    SValueOpaque(&send_check),
+  };
+  SInstr instructions2[] = {
+    SInstr_SPAWN(0, S_INSTR_RK_k+0, 0), // R(0) = spawn(K(0))
+    SInstr_BUF(1, S_INSTR_RK_k+1),      // R(1) = new buffer of 100 bytes
+    SInstr_SENDMV(0, 1),                // send R(1) to R(0) and clear R(1)
+    SInstr_DBGCB(0, 2, 0),              // check R(1)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* parent_func = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(parent_func, 0, 0));
+  SSchedRun(vm, sched);
+
+  assert(send_checked);
+  assert(recv_checked);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(child_func);
+  SFuncDestroy(parent_func);
+}
+
+void test_slice_range(SVM* vm) {
+  // BUFSLICE outside of the buffer is an error
+  SValue constants[] = {
+    SValueNumber(4),
+    SValueNumber(5),
+  };
+  SInstr instructions[] = {
+    SInstr_BUF(0, S_INSTR_RK_k+0),      // R(0) = new buffer of 4 bytes
+    SInstr_BUFSLICE(0, S_INSTR_RK_k+0,  // R(0) = bytes 4 up to 5 of R(0)
+                       S_INSTR_RK_k+1),
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* func = SFuncCreate(constants, instructions);
+  STask* t = STaskCreate(func, 0, 0);
+  SSched* sched = SSchedCreate();
+  S_UNUSED STaskStatus status = SchedExec(vm, sched, t);
+  assert(status == STaskStatusError);
+
+  // The buffer is still in R(0)
+  assert(t->ar->registry[0].type == SValueTBuf);
+  SBufRelease((SBuf*)t->ar->registry[0].value.p);
+
+  STaskRelease(t);
+  SSchedDestroy(sched);
+  SFuncDestroy(func);
+}
+
+bool pingpong_checked = false;
+
+void pingpong_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // The payload came back unchanged after its last round
+  SValue* v = &t->ar->registry[5];
+  if (v->type == SValueTBuf) {
+    SBuf* b = (SBuf*)v->value.p;
+    assert(b->len == PAYLOAD_SIZE);
+    assert(b->refc == 1);
+    assert(b->data[PAYLOAD_SIZE - 1] == 0xff);
+  } else {
+    assert(v->type == SValueTNumber);
+    assert(v->value.n == 1);
+  }
+  pingpong_checked = true;
+}
+
+// Sends `payload` back and forth between two tasks VALUE_COUNT times, with
+// SENDMV if `move` is true or SEND otherwise
+void bench_send(SVM* vm, SValue payload, bool move) {
+  SValue constants1[] = {
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(VALUE_COUNT),
+  };
+  SInstr instructions1[] = {
+    SInstr_LOADK(7, 0),                 // 0  R(7) = 0
+    SInstr_RECV(2),                     // 1  R(2) = receive(); R(3) = sender
+    move ? SInstr_SENDMV(3, 2)          // 2  send R(2) back to R(3)
+         : SInstr_SEND(3, 2),
+    SInstr_ADD(7, 7, S_INSTR_RK_k+1),   // 3  R(7) = R(7) + 1
+    SInstr_LT(0, 7, S_INSTR_RK_k+2),    // 4  if (R(7) < VALUE_COUNT) JUMP
+    SInstr_JUMP(-5),                    // 5    PC -= 5 to RECV
+    SInstr_RETURN(0, 0),                // 6  return
+  };
+  SFunc* echo_func = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueFunc(echo_func),
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(VALUE_COUNT),
+    SValueOpaque(&pingpong_check),
+  };
+  SInstr instructions2[] = {
+    SInstr_SPAWN(0, S_INSTR_RK_k+0, 0), // 0  R(0) = spawn(K(0))
+    SInstr_LOADK(7, 1),                 // 1  R(7) = 0
+    move ? SInstr_SENDMV(0, 5)          // 2  send R(5) to R(0)
+         : SInstr_SEND(0, 5),
+    SInstr_RECV(5),                     // 3  R(5) = receive(); R(6) = sender
+    SInstr_ADD(7, 7, S_INSTR_RK_k+2),   // 4  R(7) = R(7) + 1
+    SInstr_LT(0, 7, S_INSTR_RK_k+3),    // 5  if (R(7) < VALUE_COUNT) JUMP
+    SInstr_JUMP(-5),                    // 6    PC -= 5 to SEND
+    SInstr_DBGCB(0, 4, 0),              // 7  check R(5)
+    SInstr_RETURN(0, 0),                // 8  return
+  };
+  SFunc* main_func = SFuncCreate(constants2, instructions2);
+
+  // The task takes over our reference to the payload
+  STask* t = STaskCreate(main_func, 0, 0);
+  t->ar->registry[5] = payload;
+  pingpong_checked = false;
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, t);
+
+  SResUsage rstart;
+  SAssertTrue(SResUsageSample(&rstart));
+
+  SSchedRun(vm, sched);
+
+  assert(pingpong_checked);
+
+  #if !S_TEST_SUIT_RUNNING
+  SResUsage rend;
+  SAssertTrue(SResUsageSample(&rend));
+  print("--- %s with %s ---",
+        payload.type == SValueTBuf ? "1 MB buffer" : "number",
+        move ? "SENDMV" : "SEND");
+  SResUsagePrintSummary(&rstart, &rend, "round", VALUE_COUNT, 1);
+  #endif
+
+  SSchedDestroy(sched);
+  SFuncDestroy(echo_func);
+  SFuncDestroy(main_func);
+}
+
+SValue payload_buf() {
+  SBuf* b = SBufCreate(PAYLOAD_SIZE);
+  b->data[PAYLOAD_SIZE - 1] = 0xff;
+  return SValueBuf(b);
+}
+
+int main(int argc, const char** argv) {
+  SVM vm = SVM_INIT;
+
+  test_slice();
+  test_send(&vm);
+  test_slice_range(&vm);
+  bench_send(&vm, SValueNumber(1), false);
+  bench_send(&vm, payload_buf(), false);
+  bench_send(&vm, payload_buf(), true);
+
+  return 0;
+}
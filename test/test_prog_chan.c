@@ -0,0 +1,250 @@
+// Tests channels with the CHAN, CHSEND, CHRECV and CHCLOSE instructions, and
+// benchmarks channel throughput with MPMC and SPSC channels.
+#include "test.h"
+#include "bench.h"
+#include <sol/vm.h>
+#include <sol/sched.h>
+#include <sol/chan.h>
+
+#if S_TEST_SUIT_RUNNING
+#define VALUE_COUNT 10000
+#else
+#define VALUE_COUNT 1000000
+#endif
+
+#define WORKERS_COUNT 100
+bool workers_checked = false;
+
+void workers_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // Each value was received by exactly one worker
+  assert(t->ar->registry[5].type == SValueTNumber);
+  assert(t->ar->registry[5].value.n ==
+         (SNumber)(WORKERS_COUNT * (WORKERS_COUNT + 1) / 2));
+  workers_checked = true;
+}
+
+void test_workers(SVM* vm) {
+  // Covered: CHAN, CHSEND to a full channel, CHRECV from an empty channel,
+  // CHCLOSE waking waiting receivers, sending a channel in a message
+  // A task hands out numbers to three workers through a small channel. Each
+  // worker sums up the numbers it takes until the channel is closed, and sends
+  // back its sum.
+  SValue constants1[] = {
+    SValueNumber(0),
+    SValueFalse,
+  };
+  SInstr instructions1[] = {
+    SInstr_RECV(0),                     // 0  R(0) = receive(); R(1) = sender
+    SInstr_LOADK(4, 0),                 // 1  R(4) = 0
+    SInstr_CHRECV(2, 0),                // 2  R(2) = receive from R(0)
+    SInstr_EQ(0, 3, S_INSTR_RK_k+1),    // 3  if (R(3) == false) JUMP
+    SInstr_JUMP(2),                     // 4    PC += 2 to SEND
+    SInstr_ADD(4, 4, 2),                // 5  R(4) = R(4) + R(2)
+    SInstr_JUMP(-5),                    // 6  PC -= 5 to CHRECV
+    SInstr_SEND(1, 4),                  // 7  send R(4) to R(1)
+    SInstr_RETURN(0, 0),                // 8  return
+  };
+  SFunc* worker_func = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueNumber(4),
+    SValueFunc(worker_func),
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(WORKERS_COUNT),
+    SValueOpaque(&workers_check),
+  };
+  SInstr instructions2[] = {
+    SInstr_CHAN(0, S_INSTR_RK_k+0, 0),  // 0  R(0) = new channel of 4
+    SInstr_SPAWN(1, S_INSTR_RK_k+1, 0), // 1  R(1) = spawn(K(1))
+    SInstr_SPAWN(2, S_INSTR_RK_k+1, 0), // 2  R(2) = spawn(K(1))
+    SInstr_SPAWN(3, S_INSTR_RK_k+1, 0), // 3  R(3) = spawn(K(1))
+    SInstr_SEND(1, 0),                  // 4  send R(0) to R(1)
+    SInstr_SEND(2, 0),                  // 5  send R(0) to R(2)
+    SInstr_SEND(3, 0),                  // 6  send R(0) to R(3)
+    SInstr_LOADK(4, 2),                 // 7  R(4) = 0
+    SInstr_ADD(4, 4, S_INSTR_RK_k+3),   // 8  R(4) = R(4) + 1
+    SInstr_CHSEND(0, 4),                // 9  send R(4) to R(0)
+    SInstr_LT(0, 4, S_INSTR_RK_k+4),    // 10 if (R(4) < WORKERS_COUNT) JUMP
+    SInstr_JUMP(-4),                    // 11   PC -= 4 to ADD
+    SInstr_CHCLOSE(0),                  // 12 close R(0)
+    SInstr_RECV(5),                     // 13 R(5) = receive()
+    SInstr_RECV(7),                     // 14 R(7) = receive()
+    SInstr_ADD(5, 5, 7),                // 15 R(5) = R(5) + R(7)
+    SInstr_RECV(7),                     // 16 R(7) = receive()
+    SInstr_ADD(5, 5, 7),                // 17 R(5) = R(5) + R(7)
+    SInstr_DBGCB(0, 5, 0),              // 18 check R(5)
+    SInstr_RETURN(0, 0),                // 19 return
+  };
+  SFunc* parent_func = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(parent_func, 0, 0));
+  SSchedRun(vm, sched);
+
+  assert(workers_checked);
+  assert(sched->whead == 0);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(worker_func);
+  SFuncDestroy(parent_func);
+}
+
+bool closed_checked = false;
+
+void closed_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // The value sent before the channel was closed is still received
+  assert(t->ar->registry[1].type == SValueTNumber);
+  assert(t->ar->registry[1].value.n == 7);
+  assert(t->ar->registry[2].type == SValueTTrue);
+  // After that, receiving gives nil and false
+  assert(t->ar->registry[3].type == SValueTNil);
+  assert(t->ar->registry[4].type == SValueTFalse);
+  // R(0) holds the only reference to the channel
+  assert(t->ar->registry[0].type == SValueTChan);
+  SChan* c = (SChan*)t->ar->registry[0].value.p;
+  assert(c->refc == 1);
+  assert(SChanCap(c) == 2);
+  closed_checked = true;
+}
+
+void test_closed(SVM* vm) {
+  // Covered: CHRECV from a closed channel
+  SValue constants[] = {
+    SValueNumber(1),
+    SValueNumber(7),
+    SValueOpaque(&closed_check),
+  };
+  SInstr instructions[] = {
+    SInstr_CHAN(0, S_INSTR_RK_k+0, 0),  // R(0) = new channel of 1 (rounded up)
+    SInstr_CHSEND(0, S_INSTR_RK_k+1),   // send 7 to R(0)
+    SInstr_CHCLOSE(0),                  // close R(0)
+    SInstr_CHRECV(1, 0),                // R(1) = receive from R(0)
+    SInstr_CHRECV(3, 0),                // R(3) = receive from R(0)
+    SInstr_DBGCB(0, 2, 0),              // check R(1) to R(4)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* func = SFuncCreate(constants, instructions);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(func, 0, 0));
+  SSchedRun(vm, sched);
+
+  assert(closed_checked);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(func);
+}
+
+size_t consumer_count = 0;
+
+void consumer_done(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  assert(t->ar->registry[2].type == SValueTNumber);
+  consumer_count += (size_t)t->ar->registry[2].value.n;
+}
+
+void bench_throughput(SVM* vm, bool remote, SChanFlag flags) {
+  // Receives from channel R(0) until it's closed, and counts the values
+  SValue constants1[] = {
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueFalse,
+    SValueOpaque(&consumer_done),
+  };
+  SInstr instructions1[] = {
+    SInstr_LOADK(2, 0),                 // 0  R(2) = 0
+    SInstr_CHRECV(3, 0),                // 1  R(3) = receive from R(0)
+    SInstr_EQ(0, 4, S_INSTR_RK_k+2),    // 2  if (R(4) == false) JUMP
+    SInstr_JUMP(2),                     // 3    PC += 2 to DBGCB
+    SInstr_ADD(2, 2, S_INSTR_RK_k+1),   // 4  R(2) = R(2) + 1
+    SInstr_JUMP(-5),                    // 5  PC -= 5 to CHRECV
+    SInstr_DBGCB(0, 3, 0),              // 6  consumer_count += R(2)
+    SInstr_RETURN(0, 0),                // 7  return
+  };
+  SFunc* consumer_func = SFuncCreate(constants1, instructions1);
+
+  // Sends VALUE_COUNT values to channel R(0) and closes it
+  SValue constants2[] = {
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(VALUE_COUNT),
+  };
+  SInstr instructions2[] = {
+    SInstr_LOADK(1, 0),                 // 0  R(1) = 0
+    SInstr_ADD(1, 1, S_INSTR_RK_k+1),   // 1  R(1) = R(1) + 1
+    SInstr_CHSEND(0, 1),                // 2  send R(1) to R(0)
+    SInstr_LT(0, 1, S_INSTR_RK_k+2),    // 3  if (R(1) < VALUE_COUNT) JUMP
+    SInstr_JUMP(-4),                    // 4    PC -= 4 to ADD
+    SInstr_CHCLOSE(0),                  // 5  close R(0)
+    SInstr_RETURN(0, 0),                // 6  return
+  };
+  SFunc* producer_func = SFuncCreate(constants2, instructions2);
+  consumer_count = 0;
+
+  SChan* c = SChanCreate(64, flags);
+  S_UNUSED bool spsc = (flags & SChanFlagSPSC) != 0;
+  S_UNUSED size_t nsched = remote ? (spsc ? 2 : 3) : 1;
+  SSched* sched = SSchedCreate();
+  STask* producer = chan_task(producer_func, c);
+
+  SResUsage rstart;
+  SAssertTrue(SResUsageSample(&rstart));
+
+  if (!remote) {
+    SSchedTask(sched, producer);
+    SSchedTask(sched, chan_task(consumer_func, c));
+    SChanRelease(c);
+    SSchedRun(vm, sched);
+    SSchedDestroy(sched);
+  } else {
+    // Consumers which run in other schedulers, in other threads. There are
+    // two, unless the channel is SPSC.
+    #if !S_WITHOUT_SMP
+    SSched* sched2 = SSchedCreate();
+    SSched* sched3 = SSchedCreate();
+
+    // Hand all tasks over before the schedulers run, so that no scheduler
+    // exits before the others have started.
+    SSchedTaskRemote(vm, sched, producer);
+    SSchedTaskRemote(vm, sched2, chan_task(consumer_func, c));
+    if (!spsc) {
+      SSchedTaskRemote(vm, sched3, chan_task(consumer_func, c));
+    }
+    SChanRelease(c);
+
+    SSched* scheds[] = {sched, sched2, sched3};
+    run_scheds(vm, scheds, nsched);
+    SSchedDestroy(sched);
+    SSchedDestroy(sched2);
+    SSchedDestroy(sched3);
+    #endif
+  }
+
+  assert(consumer_count == VALUE_COUNT);
+  assert(vm->nwork == 0);
+
+  #if !S_TEST_SUIT_RUNNING
+  SResUsage rend;
+  SAssertTrue(SResUsageSample(&rend));
+  print("--- %s, %zu scheduler(s) ---", spsc ? "SPSC" : "MPMC", nsched);
+  SResUsagePrintSummary(&rstart, &rend, "value", VALUE_COUNT, nsched);
+  #endif
+
+  SFuncDestroy(producer_func);
+  SFuncDestroy(consumer_func);
+}
+
+int main(int argc, const char** argv) {
+  SVM vm = SVM_INIT;
+
+  test_workers(&vm);
+  test_closed(&vm);
+  bench_throughput(&vm, false, 0);
+  bench_throughput(&vm, false, SChanFlagSPSC);
+  #if !S_WITHOUT_SMP
+  bench_throughput(&vm, true, 0);
+  bench_throughput(&vm, true, SChanFlagSPSC);
+  #endif
+
+  return 0;
+}
@@ -0,0 +1,220 @@
+// Tests how the end of a subtask is told to its supertask: with an exit message
+// if the supertask traps exits, and otherwise by a fault taking the supertask
+// down. Benchmarks a supertask which traps the exits of many subtasks.
+#include "test.h"
+#include "bench.h"
+#include <sol/vm.h>
+#include <sol/sched.h>
+
+#if S_TEST_SUIT_RUNNING
+#define TASK_COUNT 10000
+#else
+#define TASK_COUNT 100000
+#endif
+
+// Checks that the message in R(a) and its sender in R(a+1) tell that the task
+// handle in R(t) ended with `status`
+static bool exit_msg_is(SValue* r, int a, int t, STaskStatus status) {
+  return r[a].type == SValueTExit && r[a].value.n == (SNumber)status &&
+         r[a+1].type == SValueTTask && r[a+1].value.p == r[t].value.p;
+}
+
+bool trap_checked = false;
+
+void trap_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // One exit message per subtask, in either order
+  SValue* r = t->ar->registry;
+  assert((exit_msg_is(r, 2, 0, STaskStatusEnd) &&
+          exit_msg_is(r, 4, 1, STaskStatusError)) ||
+         (exit_msg_is(r, 2, 1, STaskStatusError) &&
+          exit_msg_is(r, 4, 0, STaskStatusEnd)));
+  trap_checked = true;
+}
+
+void test_trap(SVM* vm) {
+  // Covered: exit messages for normal and abnormal exits
+  SInstr instructions1[] = {
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* ok_func = SFuncCreate(0, instructions1);
+
+  SValue constants2[] = {
+    SValueFunc(ok_func),
+    SValueNumber(-1),
+  };
+  SInstr instructions2[] = {
+    SInstr_SPAWNN(0, S_INSTR_RK_k+0,    // fails: task count out of range
+                  S_INSTR_RK_k+1),
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* fault_func = SFuncCreate(constants2, instructions2);
+
+  SValue constants3[] = {
+    SValueFunc(ok_func),
+    SValueFunc(fault_func),
+    SValueOpaque(&trap_check),
+  };
+  SInstr instructions3[] = {
+    SInstr_SPAWN(0, S_INSTR_RK_k+0, 0), // R(0) = spawn(K(0))
+    SInstr_SPAWN(1, S_INSTR_RK_k+1, 0), // R(1) = spawn(K(1))
+    SInstr_RECV(2),                     // R(2) = receive(); R(3) = sender
+    SInstr_RECV(4),                     // R(4) = receive(); R(5) = sender
+    SInstr_DBGCB(0, 2, 0),              // check R(2..5)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* parent_func = SFuncCreate(constants3, instructions3);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(parent_func, 0, STaskFlagTrapExit));
+  SSchedRun(vm, sched);
+
+  assert(trap_checked);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(ok_func);
+  SFuncDestroy(fault_func);
+  SFuncDestroy(parent_func);
+}
+
+bool linked_checked = false;
+
+void linked_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // The fault propagated to the task in R(0), which ended with an error too
+  assert(exit_msg_is(t->ar->registry, 1, 0, STaskStatusError));
+  linked_checked = true;
+}
+
+void test_linked(SVM* vm) {
+  // Covered: a fault ending the supertask and its other subtasks, and the
+  // supertask's exit message to a supertask which traps exits
+  SInstr instructions1[] = {
+    SInstr_RECV(0),                     // R(0) = receive()
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* wait_func = SFuncCreate(0, instructions1);
+
+  SValue constants2[] = {
+    SValueFunc(wait_func),
+    SValueNumber(-1),
+  };
+  SInstr instructions2[] = {
+    SInstr_SPAWNN(0, S_INSTR_RK_k+0,    // fails: task count out of range
+                  S_INSTR_RK_k+1),
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* fault_func = SFuncCreate(constants2, instructions2);
+
+  SValue constants3[] = {
+    SValueFunc(wait_func),
+    SValueFunc(fault_func),
+  };
+  SInstr instructions3[] = {
+    SInstr_SPAWN(0, S_INSTR_RK_k+0, 0), // R(0) = spawn(K(0))
+    SInstr_SPAWN(1, S_INSTR_RK_k+1, 0), // R(1) = spawn(K(1))
+    SInstr_RECV(2),                     // R(2) = receive(), which never comes
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* parent_func = SFuncCreate(constants3, instructions3);
+
+  SValue constants4[] = {
+    SValueFunc(parent_func),
+    SValueOpaque(&linked_check),
+  };
+  SInstr instructions4[] = {
+    SInstr_SPAWN(0, S_INSTR_RK_k+0, 0), // R(0) = spawn(K(0))
+    SInstr_RECV(1),                     // R(1) = receive(); R(2) = sender
+    SInstr_DBGCB(0, 1, 0),              // check R(1..2)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* supervisor_func = SFuncCreate(constants4, instructions4);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(supervisor_func, 0, STaskFlagTrapExit));
+  SSchedRun(vm, sched);
+
+  assert(linked_checked);
+  // The subtask waiting for a message ended instead of waiting forever
+  assert(sched->whead == 0);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(wait_func);
+  SFuncDestroy(fault_func);
+  SFuncDestroy(parent_func);
+  SFuncDestroy(supervisor_func);
+}
+
+uint32_t exits_nslabs = 0;
+bool exits_checked = false;
+
+void exits_spawned(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  exits_nslabs = s->msgpool.nslabs;
+}
+
+void exits_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  assert(t->ar->registry[5].value.n == TASK_COUNT);
+  // No memory was allocated for exit messages after spawning
+  assert(s->msgpool.nslabs == exits_nslabs);
+  exits_checked = true;
+}
+
+// Spawns TASK_COUNT tasks with SPAWNN which end right away, and receives their
+// exit messages
+void bench_exits(SVM* vm) {
+  SInstr instructions1[] = {
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* child_func = SFuncCreate(0, instructions1);
+
+  SValue constants2[] = {
+    SValueNumber(TASK_COUNT),
+    SValueFunc(child_func),
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueOpaque(&exits_spawned),
+    SValueOpaque(&exits_check),
+  };
+  SInstr instructions2[] = {
+    SInstr_SPAWNN(0, S_INSTR_RK_k+1,    // 0  R(0) = group of K(0) x
+                  S_INSTR_RK_k+0),      //          spawn(K(1), i, R(1))
+    SInstr_DBGCB(0, 4, 0),              // 1  note memory used
+    SInstr_LOADK(5, 2),                 // 2  R(5) = 0
+    SInstr_RECV(2),                     // 3  R(2) = receive(); R(3) = sender
+    SInstr_ADD(5, 5, S_INSTR_RK_k+3),   // 4  R(5) = R(5) + 1
+    SInstr_LT(0, 5, S_INSTR_RK_k+0),    // 5  if (R(5) < TASK_COUNT) JUMP
+    SInstr_JUMP(-4),                    // 6    PC -= 4 to RECV
+    SInstr_DBGCB(0, 5, 0),              // 7  check R(5)
+    SInstr_RETURN(0, 0),                // 8  return
+  };
+  SFunc* parent_func = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(parent_func, 0, STaskFlagTrapExit));
+
+  SResUsage rstart;
+  SAssertTrue(SResUsageSample(&rstart));
+
+  SSchedRun(vm, sched);
+
+  assert(exits_checked);
+
+  #if !S_TEST_SUIT_RUNNING
+  SResUsage rend;
+  SAssertTrue(SResUsageSample(&rend));
+  print("--- trap exits of %u tasks ---", TASK_COUNT);
+  SResUsagePrintSummary(&rstart, &rend, "task", TASK_COUNT, 1);
+  #endif
+
+  SSchedDestroy(sched);
+  SFuncDestroy(child_func);
+  SFuncDestroy(parent_func);
+}
+
+int main(int argc, const char** argv) {
+  SVM vm = SVM_INIT;
+
+  test_trap(&vm);
+  test_linked(&vm);
+  bench_exits(&vm);
+
+  return 0;
+}
@@ -0,0 +1,266 @@
+// Tests futures with the FUTURE, FULFILL and AWAIT instructions, and benchmarks
+// request/reply round trips with a future compared with a reply message.
+#include "test.h"
+#include "bench.h"
+#include <sol/vm.h>
+#include <sol/sched.h>
+#include <sol/future.h>
+#include <sol/host.h>
+
+#if S_TEST_SUIT_RUNNING
+#define VALUE_COUNT 10000
+#else
+#define VALUE_COUNT 1000000
+#endif
+
+bool reply_checked = false;
+
+void reply_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  SValue* r = t->ar->registry;
+  // Awaited without a timeout
+  assert(r[3].type == SValueTNumber && r[3].value.n == 42);
+  assert(r[4].type == SValueTTrue);
+  // Awaited with a timeout, which was canceled
+  assert(r[5].type == SValueTNumber && r[5].value.n == 42);
+  assert(r[6].type == SValueTTrue);
+  assert(s->ntimers == 0);
+  reply_checked = true;
+}
+
+void test_reply(SVM* vm) {
+  // Covered: FUTURE, FULFILL waking a task in AWAIT, with and without a
+  // timeout
+  SValue constants1[] = {
+    SValueNumber(42),
+  };
+  SInstr instructions1[] = {
+    SInstr_RECV(0),                     // R(0) = receive(); R(1) = sender
+    SInstr_YIELD(0, 0, 0),              // let the requester start waiting
+    SInstr_FULFILL(0, S_INSTR_RK_k+0),  // fulfill R(0) with 42
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* child_func = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueFunc(child_func),
+    SValueNil,
+    SValueNumber(10000),
+    SValueOpaque(&reply_check),
+  };
+  SInstr instructions2[] = {
+    SInstr_FUTURE(0),                   // R(0) = new future
+    SInstr_SPAWN(1, S_INSTR_RK_k+0, 0), // R(1) = spawn(K(0))
+    SInstr_SEND(1, 0),                  // send R(0) to R(1)
+    SInstr_AWAIT(3, 0, S_INSTR_RK_k+1), // R(3) = await R(0); R(4) = ok
+    SInstr_FUTURE(0),                   // R(0) = new future
+    SInstr_SPAWN(1, S_INSTR_RK_k+0, 0), // R(1) = spawn(K(0))
+    SInstr_SEND(1, 0),                  // send R(0) to R(1)
+    SInstr_AWAIT(5, 0, S_INSTR_RK_k+2), // R(5) = await R(0) for 10 s
+    SInstr_DBGCB(0, 3, 0),              // check R(3..6)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* parent_func = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(parent_func, 0, 0));
+  SSchedRun(vm, sched);
+
+  assert(reply_checked);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(child_func);
+  SFuncDestroy(parent_func);
+}
+
+bool timeout_checked = false;
+
+void timeout_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  SValue* r = t->ar->registry;
+  // The first AWAIT timed out
+  assert(r[1].type == SValueTNil);
+  assert(r[2].type == SValueTFalse);
+  // The second found the future fulfilled right away
+  assert(r[3].type == SValueTNumber && r[3].value.n == 5);
+  assert(r[4].type == SValueTTrue);
+  timeout_checked = true;
+}
+
+void test_timeout(SVM* vm) {
+  // Covered: AWAIT which times out, AWAIT of a fulfilled future
+  SValue constants[] = {
+    SValueNumber(20),
+    SValueNumber(5),
+    SValueOpaque(&timeout_check),
+  };
+  SInstr instructions[] = {
+    SInstr_FUTURE(0),                   // R(0) = new future
+    SInstr_AWAIT(1, 0, S_INSTR_RK_k+0), // R(1) = await R(0) for 20 ms
+    SInstr_FULFILL(0, S_INSTR_RK_k+1),  // fulfill R(0) with 5
+    SInstr_AWAIT(3, 0, S_INSTR_RK_k+0), // R(3) = await R(0) for 20 ms
+    SInstr_DBGCB(0, 2, 0),              // check R(1..4)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* func = SFuncCreate(constants, instructions);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(func, 0, 0));
+  uint64_t start = SHostMonotonicUSecs();
+  SSchedRun(vm, sched);
+
+  assert(timeout_checked);
+  assert(SHostMonotonicUSecs() - start >= 20000);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(func);
+}
+
+void test_fulfill_twice(SVM* vm) {
+  // A future is only fulfilled once
+  SValue constants[] = {
+    SValueNumber(1),
+  };
+  SInstr instructions[] = {
+    SInstr_FUTURE(0),                   // R(0) = new future
+    SInstr_FULFILL(0, S_INSTR_RK_k+0),  // fulfill R(0) with 1
+    SInstr_FULFILL(0, S_INSTR_RK_k+0),  // fulfill R(0) with 1 again
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* func = SFuncCreate(constants, instructions);
+  STask* t = STaskCreate(func, 0, 0);
+  SSched* sched = SSchedCreate();
+  S_UNUSED STaskStatus status = SchedExec(vm, sched, t);
+  assert(status == STaskStatusError);
+
+  // Futures are recycled
+  SFuture* f = (SFuture*)t->ar->registry[0].value.p;
+  t->ar->registry[0] = SValueNil;
+  SFutureRelease(f);
+  S_UNUSED SFuture* f2 = SFutureCreate(&sched->futpool);
+  assert(f2 == f);
+  SFutureRelease(f2);
+
+  STaskRelease(t);
+  SSchedDestroy(sched);
+  SFuncDestroy(func);
+}
+
+bool calls_checked = false;
+
+void calls_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // Each request got a reply of 1
+  assert(t->ar->registry[6].type == SValueTNumber);
+  assert(t->ar->registry[6].value.n == VALUE_COUNT);
+  calls_checked = true;
+}
+
+// Makes VALUE_COUNT requests to a server task, which runs in another scheduler
+// if `remote` is true. The server replies with FULFILL if `future` is true, or
+// else with a message.
+void bench_call(SVM* vm, bool remote, bool future) {
+  SValue constants1[] = {
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(VALUE_COUNT),
+  };
+  SInstr instructions1[] = {
+    SInstr_LOADK(5, 0),                 // 0  R(5) = 0
+    SInstr_RECV(2),                     // 1  R(2) = receive(); R(3) = sender
+    future ? SInstr_FULFILL(2,          // 2  fulfill R(2) with 1
+                            S_INSTR_RK_k+1)
+           : SInstr_SEND(3,             // 2  send 1 to R(3)
+                         S_INSTR_RK_k+1),
+    SInstr_ADD(5, 5, S_INSTR_RK_k+1),   // 3  R(5) = R(5) + 1
+    SInstr_LT(0, 5, S_INSTR_RK_k+2),    // 4  if (R(5) < VALUE_COUNT) JUMP
+    SInstr_JUMP(-5),                    // 5    PC -= 5 to RECV
+    SInstr_RETURN(0, 0),                // 6  return
+  };
+  SFunc* server_func = SFuncCreate(constants1, instructions1);
+
+  // Calls server R(0)
+  SValue constants2[] = {
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(VALUE_COUNT),
+    SValueNil,
+    SValueOpaque(&calls_check),
+  };
+  SInstr instructions2[] = {
+    SInstr_LOADK(5, 0),                 // 0  R(5) = 0
+    SInstr_LOADK(6, 0),                 // 1  R(6) = 0
+    future ? SInstr_FUTURE(2)           // 2  R(2) = new future
+           : SInstr_LOADK(2, 1),        // 2  R(2) = 1
+    SInstr_SEND(0, 2),                  // 3  send R(2) to R(0)
+    future ? SInstr_AWAIT(3, 2,         // 4  R(3) = await R(2)
+                          S_INSTR_RK_k+3)
+           : SInstr_RECV(3),            // 4  R(3) = receive()
+    SInstr_ADD(6, 6, 3),                // 5  R(6) = R(6) + R(3)
+    SInstr_ADD(5, 5, S_INSTR_RK_k+1),   // 6  R(5) = R(5) + 1
+    SInstr_LT(0, 5, S_INSTR_RK_k+2),    // 7  if (R(5) < VALUE_COUNT) JUMP
+    SInstr_JUMP(-7),                    // 8    PC -= 7 to FUTURE
+    SInstr_DBGCB(0, 4, 0),              // 9  check R(6)
+    SInstr_RETURN(0, 0),                // 10 return
+  };
+  SFunc* client_func = SFuncCreate(constants2, instructions2);
+  calls_checked = false;
+
+  S_UNUSED size_t nsched = remote ? 2 : 1;
+  SSched* sched = SSchedCreate();
+  STask* server = STaskCreate(server_func, 0, 0);
+  STask* client = STaskCreate(client_func, 0, 0);
+  STaskRetain(server);
+  client->ar->registry[0] = SValueTask(server);
+
+  SResUsage rstart;
+  SAssertTrue(SResUsageSample(&rstart));
+
+  if (!remote) {
+    SSchedTask(sched, server);
+    SSchedTask(sched, client);
+    SSchedRun(vm, sched);
+    SSchedDestroy(sched);
+  } else {
+    #if !S_WITHOUT_SMP
+    SSched* sched2 = SSchedCreate();
+
+    // Hand both tasks over before the schedulers run, so that no scheduler
+    // exits before the other has started.
+    SSchedTaskRemote(vm, sched, client);
+    SSchedTaskRemote(vm, sched2, server);
+
+    SSched* scheds[] = {sched, sched2};
+    run_scheds(vm, scheds, nsched);
+    SSchedDestroy(sched);
+    SSchedDestroy(sched2);
+    #endif
+  }
+
+  assert(calls_checked);
+  assert(vm->nwork == 0);
+
+  #if !S_TEST_SUIT_RUNNING
+  SResUsage rend;
+  SAssertTrue(SResUsageSample(&rend));
+  print("--- reply with %s, %zu scheduler(s) ---",
+        future ? "FULFILL" : "SEND", nsched);
+  SResUsagePrintSummary(&rstart, &rend, "call", VALUE_COUNT, nsched);
+  #endif
+
+  SFuncDestroy(server_func);
+  SFuncDestroy(client_func);
+}
+
+int main(int argc, const char** argv) {
+  SVM vm = SVM_INIT;
+
+  test_reply(&vm);
+  test_timeout(&vm);
+  test_fulfill_twice(&vm);
+  bench_call(&vm, false, false);
+  bench_call(&vm, false, true);
+  #if !S_WITHOUT_SMP
+  bench_call(&vm, true, false);
+  bench_call(&vm, true, true);
+  #endif
+
+  return 0;
+}
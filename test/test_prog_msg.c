@@ -0,0 +1,554 @@
+// Tests message passing between tasks with the SEND and RECV instructions, and
+// selective receive with RECVS. Benchmarks message throughput, and receiving
+// replies out of order.
+#include "test.h"
+#include "bench.h"
+#include <sol/vm.h>
+#include <sol/sched.h>
+
+#if S_TEST_SUIT_RUNNING
+#define MSG_COUNT 10000
+#define REPLY_COUNT 1000
+#else
+#define MSG_COUNT 1000000
+#define REPLY_COUNT 100000
+#endif
+
+STask* child_task = 0;
+bool ping_checked = false;
+
+void ping_spawned(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  assert(t->ar->registry[0].type == SValueTTask);
+  child_task = (STask*)t->ar->registry[0].value.p;
+}
+
+void ping_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // R(1) = reply, R(2) = sender of the reply
+  assert(t->ar->registry[1].type == SValueTNumber);
+  assert(t->ar->registry[1].value.n == 42);
+  assert(t->ar->registry[2].type == SValueTTask);
+  assert(t->ar->registry[2].value.p == child_task);
+  ping_checked = true;
+}
+
+void test_ping(SVM* vm) {
+  // Covered: SPAWN, SEND, RECV
+  // A task spawns a child, sends it a number and waits for the child to send
+  // back the number plus one.
+  SValue constants1[] = {
+    SValueNumber(1),
+  };
+  SInstr instructions1[] = {
+    SInstr_RECV(0),                   // R(0) = receive(); R(1) = sender
+    SInstr_ADD(0, 0, S_INSTR_RK_k+0), // R(0) = R(0) + 1
+    SInstr_SEND(1, 0),                // send R(0) to R(1)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* child_func = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueFunc(child_func),
+    SValueNumber(41),
+    SValueOpaque(&ping_spawned),
+    SValueOpaque(&ping_check),
+  };
+  SInstr instructions2[] = {
+    SInstr_SPAWN(0, S_INSTR_RK_k+0, 0),  // R(0) = spawn(K(0))
+    SInstr_DBGCB(0, 2, 0),               // child_task = R(0)
+    SInstr_SEND(0, S_INSTR_RK_k+1),      // send K(1) to R(0)
+    SInstr_RECV(1),                      // R(1) = receive(); R(2) = sender
+    SInstr_DBGCB(0, 3, 0),               // check R(1) and R(2)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* parent_func = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(parent_func, 0, 0));
+  SSchedRun(vm, sched);
+
+  assert(ping_checked);
+  assert(sched->whead == 0);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(child_func);
+  SFuncDestroy(parent_func);
+}
+
+#define BOUNDED_COUNT 100
+#define BOUNDED_CAP 4
+
+void bounded_check_consumer(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // The producer is faster than us, so our inbox filled up but never overflowed
+  assert(t->inboxcap == BOUNDED_CAP);
+  assert(t->inboxhwm == BOUNDED_CAP);
+  assert(STaskInboxLen(t) == 0);
+  assert(t->sendq.head == 0);
+}
+
+bool bounded_checked = false;
+
+void bounded_check_producer(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  assert(t->ar->registry[2].type == SValueTNumber);
+  assert(t->ar->registry[2].value.n ==
+         (SNumber)(BOUNDED_COUNT * (BOUNDED_COUNT + 1) / 2));
+  bounded_checked = true;
+}
+
+void test_bounded(SVM* vm) {
+  // Covered: SEND to a full inbox, RECV waking a waiting sender
+  // A task sends numbers to a child with a small inbox, which sums them up and
+  // sends back the sum.
+  SValue constants1[] = {
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(BOUNDED_COUNT),
+    SValueOpaque(&bounded_check_consumer),
+  };
+  SInstr instructions1[] = {
+    SInstr_LOADK(2, 0),                 // 0  R(2) = 0 (sum)
+    SInstr_LOADK(3, 0),                 // 1  R(3) = 0 (count)
+    SInstr_RECV(0),                     // 2  R(0) = receive(); R(1) = sender
+    SInstr_ADD(2, 2, 0),                // 3  R(2) = R(2) + R(0)
+    SInstr_ADD(3, 3, S_INSTR_RK_k+1),   // 4  R(3) = R(3) + 1
+    SInstr_LT(0, 3, S_INSTR_RK_k+2),    // 5  if (R(3) < BOUNDED_COUNT) JUMP
+    SInstr_JUMP(-5),                    // 6    PC -= 5 to RECV
+    SInstr_DBGCB(0, 3, 0),              // 7  check inbox
+    SInstr_SEND(1, 2),                  // 8  send R(2) to R(1)
+    SInstr_RETURN(0, 0),                // 9  return
+  };
+  SFunc* child_func = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueFunc(child_func),
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(BOUNDED_COUNT),
+    SValueOpaque(&bounded_check_producer),
+  };
+  SInstr instructions2[] = {
+    SInstr_SPAWN(0, S_INSTR_RK_k+0, 0), // 0  R(0) = spawn(K(0))
+    SInstr_LOADK(1, 1),                 // 1  R(1) = 0
+    SInstr_ADD(1, 1, S_INSTR_RK_k+2),   // 2  R(1) = R(1) + 1
+    SInstr_SEND(0, 1),                  // 3  send R(1) to R(0)
+    SInstr_LT(0, 1, S_INSTR_RK_k+3),    // 4  if (R(1) < BOUNDED_COUNT) JUMP
+    SInstr_JUMP(-4),                    // 5    PC -= 4 to ADD
+    SInstr_RECV(2),                     // 6  R(2) = receive(); R(3) = sender
+    SInstr_DBGCB(0, 4, 0),              // 7  check R(2)
+    SInstr_RETURN(0, 0),                // 8  return
+  };
+  SFunc* parent_func = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  STask* parent = STaskCreate(parent_func, 0, 0);
+  parent->inboxcap = BOUNDED_CAP; // inherited by the child
+  SSchedTask(sched, parent);
+  SSchedRun(vm, sched);
+
+  assert(bounded_checked);
+  assert(sched->whead == 0);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(child_func);
+  SFuncDestroy(parent_func);
+}
+
+void trysend_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  assert(t->ar->registry[1].type == SValueTTrue);
+  assert(t->ar->registry[2].type == SValueTTrue);
+  assert(t->ar->registry[3].type == SValueTFalse);
+  STask* child = (STask*)t->ar->registry[0].value.p;
+  assert(STaskInboxLen(child) == 2);
+  assert(child->inboxhwm == 2);
+}
+
+void test_trysend(SVM* vm) {
+  // Covered: TRYSEND, SEND to a full inbox of a task which ends
+  // A task sends to a child with room for two messages, which the child never
+  // receives. TRYSEND gives up on the third message, and SEND waits until the
+  // child has ended.
+  SInstr instructions1[] = {
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* child_func = SFuncCreate(0, instructions1);
+
+  SValue constants2[] = {
+    SValueFunc(child_func),
+    SValueNumber(1),
+    SValueOpaque(&trysend_check),
+  };
+  SInstr instructions2[] = {
+    SInstr_SPAWN(0, S_INSTR_RK_k+0, 0),   // R(0) = spawn(K(0))
+    SInstr_TRYSEND(1, 0, S_INSTR_RK_k+1), // R(1) = try send K(1) to R(0)
+    SInstr_TRYSEND(2, 0, S_INSTR_RK_k+1), // R(2) = try send K(1) to R(0)
+    SInstr_TRYSEND(3, 0, S_INSTR_RK_k+1), // R(3) = try send K(1) to R(0)
+    SInstr_DBGCB(0, 2, 0),                // check R(1), R(2) and R(3)
+    SInstr_SEND(0, S_INSTR_RK_k+1),       // send K(1) to R(0)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* parent_func = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  STask* parent = STaskCreate(parent_func, 0, 0);
+  parent->inboxcap = 2; // inherited by the child
+  SSchedTask(sched, parent);
+  SSchedRun(vm, sched);
+
+  assert(sched->whead == 0);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(child_func);
+  SFuncDestroy(parent_func);
+}
+
+#define FIFO_SENDERS 4
+
+SNumber fifo_values[FIFO_SENDERS]; // Values in the order received
+size_t fifo_waiting[FIFO_SENDERS]; // Senders still waiting after each receive
+size_t fifo_count = 0;
+
+void fifo_record(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  assert(fifo_count < FIFO_SENDERS);
+  assert(t->ar->registry[0].type == SValueTNumber);
+  fifo_values[fifo_count] = t->ar->registry[0].value.n;
+  size_t n = 0;
+  SChanWaiter* w = t->sendq.head;
+  for (; w != 0; w = w->next) {
+    ++n;
+  }
+  fifo_waiting[fifo_count] = n;
+  ++fifo_count;
+}
+
+void test_senders_fifo(SVM* vm) {
+  // Covered: RECV waking one sender per message received, oldest first
+  // Senders 1 to FIFO_SENDERS each send their number to a task with room for
+  // one message, which only starts receiving once all of them have tried.
+  SValue constants1[] = {
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(FIFO_SENDERS),
+    SValueOpaque(&fifo_record),
+  };
+  SInstr instructions1[] = {
+    SInstr_YIELD(0, 0, 0),              // 0  let the senders run
+    SInstr_LOADK(2, 0),                 // 1  R(2) = 0 (count)
+    SInstr_RECV(0),                     // 2  R(0) = receive(); R(1) = sender
+    SInstr_DBGCB(0, 3, 0),              // 3  record R(0)
+    SInstr_ADD(2, 2, S_INSTR_RK_k+1),   // 4  R(2) = R(2) + 1
+    SInstr_LT(0, 2, S_INSTR_RK_k+2),    // 5  if (R(2) < FIFO_SENDERS) JUMP
+    SInstr_JUMP(-5),                    // 6    PC -= 5 to RECV
+    SInstr_RETURN(0, 0),                // 7  return
+  };
+  SFunc* receiver_func = SFuncCreate(constants1, instructions1);
+
+  SInstr instructions2[] = {
+    SInstr_SEND(0, 1),                  // send R(1) to R(0)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* sender_func = SFuncCreate(0, instructions2);
+
+  SSched* sched = SSchedCreate();
+  STask* receiver = STaskCreate(receiver_func, 0, 0);
+  receiver->inboxcap = 1;
+  SSchedTask(sched, receiver);
+  size_t i = 0;
+  for (; i != FIFO_SENDERS; ++i) {
+    STask* sender = STaskCreate(sender_func, 0, 0);
+    STaskRetain(receiver);
+    sender->ar->registry[0] = SValueTask(receiver);
+    sender->ar->registry[1] = SValueNumber((SNumber)(i + 1));
+    SSchedTask(sched, sender);
+  }
+  fifo_count = 0;
+  SSchedRun(vm, sched);
+
+  // The first sender found room. Each message received then let exactly one
+  // more sender send, in the order they started waiting.
+  assert(fifo_count == FIFO_SENDERS);
+  for (i = 0; i != FIFO_SENDERS; ++i) {
+    assert(fifo_values[i] == (SNumber)(i + 1));
+    assert(fifo_waiting[i] == ((i < FIFO_SENDERS - 2) ? FIFO_SENDERS - 2 - i
+                                                      : 0));
+  }
+  assert(sched->whead == 0);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(receiver_func);
+  SFuncDestroy(sender_func);
+}
+
+bool selective_checked = false;
+
+void selective_check_sender(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // R(4) = reply from R(1), which is its number plus one
+  assert(t->ar->registry[4].type == SValueTNumber);
+  assert(t->ar->registry[4].value.n == 21);
+  assert(t->ar->registry[5].value.p == t->ar->registry[1].value.p);
+  // R(6) = reply from R(0)
+  assert(t->ar->registry[6].type == SValueTNumber);
+  assert(t->ar->registry[6].value.n == 11);
+  assert(t->ar->registry[7].value.p == t->ar->registry[0].value.p);
+  assert(t->mbox.live == 0);
+}
+
+void selective_check_value(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // Messages arrived as 1, true, 2 and were received as 2, true, 1
+  assert(t->ar->registry[2].type == SValueTNumber);
+  assert(t->ar->registry[2].value.n == 2);
+  assert(t->ar->registry[4].type == SValueTTrue);
+  assert(t->ar->registry[6].type == SValueTNumber);
+  assert(t->ar->registry[6].value.n == 1);
+  assert(t->mbox.live == 0);
+  assert(t->mbox.head == 0);
+  selective_checked = true;
+}
+
+void test_selective(SVM* vm) {
+  // Covered: RECVS by sender, value and type, RECV of a skipped message
+  // A task sends numbers to two children and receives the reply of the second
+  // child before the reply of the first. Then it has a third child send it a
+  // few values which it receives in another order than they were sent.
+  SValue constants1[] = {
+    SValueNumber(1),
+  };
+  SInstr instructions1[] = {
+    SInstr_RECV(0),                   // R(0) = receive(); R(1) = sender
+    SInstr_ADD(0, 0, S_INSTR_RK_k+0), // R(0) = R(0) + 1
+    SInstr_SEND(1, 0),                // send R(0) to R(1)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* reply_func = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueNumber(1),
+    SValueTrue,
+    SValueNumber(2),
+  };
+  SInstr instructions2[] = {
+    SInstr_RECV(0),                   // R(0) = receive(); R(1) = sender
+    SInstr_SEND(1, S_INSTR_RK_k+0),   // send 1 to R(1)
+    SInstr_SEND(1, S_INSTR_RK_k+1),   // send true to R(1)
+    SInstr_SEND(1, S_INSTR_RK_k+2),   // send 2 to R(1)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* values_func = SFuncCreate(constants2, instructions2);
+
+  SValue constants3[] = {
+    SValueFunc(reply_func),
+    SValueNumber(10),
+    SValueNumber(20),
+    SValueOpaque(&selective_check_sender),
+    SValueFunc(values_func),
+    SValueNumber(2),
+    SValueNumber(SValueTTrue),
+    SValueOpaque(&selective_check_value),
+  };
+  SInstr instructions3[] = {
+    SInstr_SPAWN(0, S_INSTR_RK_k+0, 0),   // R(0) = spawn(K(0))
+    SInstr_SPAWN(1, S_INSTR_RK_k+0, 0),   // R(1) = spawn(K(0))
+    SInstr_SEND(0, S_INSTR_RK_k+1),       // send 10 to R(0)
+    SInstr_SEND(1, S_INSTR_RK_k+2),       // send 20 to R(1)
+    SInstr_RECVS(4, SMBoxMatchSender, 1), // R(4) = receive from R(1)
+    SInstr_RECVS(6, SMBoxMatchSender, 0), // R(6) = receive from R(0)
+    SInstr_DBGCB(0, 3, 0),                // check R(4) and R(6)
+
+    SInstr_SPAWN(0, S_INSTR_RK_k+4, 0),   // R(0) = spawn(K(4))
+    SInstr_SEND(0, S_INSTR_RK_k+5),       // send 2 to R(0)
+    SInstr_RECVS(2, SMBoxMatchValue, S_INSTR_RK_k+5), // R(2) = receive 2
+    SInstr_RECVS(4, SMBoxMatchType, S_INSTR_RK_k+6),  // R(4) = receive a true
+    SInstr_RECV(6),                       // R(6) = receive()
+    SInstr_DBGCB(0, 7, 0),                // check R(2), R(4) and R(6)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* parent_func = SFuncCreate(constants3, instructions3);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(parent_func, 0, 0));
+  SSchedRun(vm, sched);
+
+  assert(selective_checked);
+  assert(sched->whead == 0);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(reply_func);
+  SFuncDestroy(values_func);
+  SFuncDestroy(parent_func);
+}
+
+void reverse_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // The last reply received was the first one sent
+  assert(t->ar->registry[2].type == SValueTNumber);
+  assert(t->ar->registry[2].value.n == 1);
+  assert(t->mbox.live == 0);
+  assert(t->mbox.taken == 0);
+}
+
+void bench_reverse(SVM* vm) {
+  // Sends R(0) replies numbered 1 to R(0) back to the sender
+  SValue constants1[] = {
+    SValueNumber(0),
+    SValueNumber(1),
+  };
+  SInstr instructions1[] = {
+    SInstr_RECV(0),                     // 0  R(0) = receive(); R(1) = sender
+    SInstr_LOADK(2, 0),                 // 1  R(2) = 0
+    SInstr_ADD(2, 2, S_INSTR_RK_k+1),   // 2  R(2) = R(2) + 1
+    SInstr_SEND(1, 2),                  // 3  send R(2) to R(1)
+    SInstr_LT(0, 2, 0),                 // 4  if (R(2) < R(0)) JUMP
+    SInstr_JUMP(-4),                    // 5    PC -= 4 to ADD
+    SInstr_RETURN(0, 0),                // 6  return
+  };
+  SFunc* replier_func = SFuncCreate(constants1, instructions1);
+
+  // Asks for REPLY_COUNT replies and receives them newest first. Every RECVS
+  // skips all replies which are still in the mailbox.
+  SValue constants2[] = {
+    SValueFunc(replier_func),
+    SValueNumber(REPLY_COUNT),
+    SValueNumber(1),
+    SValueNumber(0),
+    SValueOpaque(&reverse_check),
+  };
+  SInstr instructions2[] = {
+    SInstr_SPAWN(0, S_INSTR_RK_k+0, 0), // 0  R(0) = spawn(K(0))
+    SInstr_LOADK(1, 1),                 // 1  R(1) = REPLY_COUNT
+    SInstr_SEND(0, 1),                  // 2  send R(1) to R(0)
+    SInstr_RECVS(2, SMBoxMatchValue, 1),// 3  R(2) = receive R(1)
+    SInstr_SUB(1, 1, S_INSTR_RK_k+2),   // 4  R(1) = R(1) - 1
+    SInstr_LT(0, S_INSTR_RK_k+3, 1),    // 5  if (0 < R(1)) JUMP
+    SInstr_JUMP(-4),                    // 6    PC -= 4 to RECVS
+    SInstr_DBGCB(0, 4, 0),              // 7  check R(2)
+    SInstr_RETURN(0, 0),                // 8  return
+  };
+  SFunc* requester_func = SFuncCreate(constants2, instructions2);
+
+  SResUsage rstart;
+  SAssertTrue(SResUsageSample(&rstart));
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(requester_func, 0, 0));
+  SSchedRun(vm, sched);
+  assert(sched->whead == 0);
+  SSchedDestroy(sched);
+
+  #if !S_TEST_SUIT_RUNNING
+  SResUsage rend;
+  SAssertTrue(SResUsageSample(&rend));
+  print("--- replies received in reverse order ---");
+  SResUsagePrintSummary(&rstart, &rend, "reply", REPLY_COUNT, 1);
+  #endif
+
+  SFuncDestroy(replier_func);
+  SFuncDestroy(requester_func);
+}
+
+size_t consumer_count = 0;
+
+void producer_done(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  assert(t->ar->registry[2].type == SValueTNumber);
+  consumer_count = (size_t)t->ar->registry[2].value.n;
+}
+
+void bench_throughput(SVM* vm, bool remote) {
+  // Receives MSG_COUNT messages and replies to the last sender with the count
+  SValue constants1[] = {
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(MSG_COUNT),
+  };
+  SInstr instructions1[] = {
+    SInstr_LOADK(2, 0),                 // 0  R(2) = 0
+    SInstr_RECV(0),                     // 1  R(0) = receive(); R(1) = sender
+    SInstr_ADD(2, 2, S_INSTR_RK_k+1),   // 2  R(2) = R(2) + 1
+    SInstr_LT(0, 2, S_INSTR_RK_k+2),    // 3  if (R(2) < MSG_COUNT) JUMP
+    SInstr_JUMP(-4),                    // 4    PC -= 4 to RECV
+    SInstr_SEND(1, 2),                  // 5  send R(2) to R(1)
+    SInstr_RETURN(0, 0),                // 6  return
+  };
+  SFunc* consumer_func = SFuncCreate(constants1, instructions1);
+
+  // Sends MSG_COUNT messages to R(0) and waits for the reply. Starts at
+  // instruction 1 if R(0) is already a consumer, or at 0 to spawn one.
+  SValue constants2[] = {
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(MSG_COUNT),
+    SValueFunc(consumer_func),
+    SValueOpaque(&producer_done),
+  };
+  SInstr instructions2[] = {
+    SInstr_SPAWN(0, S_INSTR_RK_k+3, 0), // 0  R(0) = spawn(K(3))
+    SInstr_LOADK(1, 0),                 // 1  R(1) = 0
+    SInstr_ADD(1, 1, S_INSTR_RK_k+1),   // 2  R(1) = R(1) + 1
+    SInstr_SEND(0, 1),                  // 3  send R(1) to R(0)
+    SInstr_LT(0, 1, S_INSTR_RK_k+2),    // 4  if (R(1) < MSG_COUNT) JUMP
+    SInstr_JUMP(-4),                    // 5    PC -= 4 to ADD
+    SInstr_RECV(2),                     // 6  R(2) = receive(); R(3) = sender
+    SInstr_DBGCB(0, 4, 0),              // 7  consumer_count = R(2)
+    SInstr_RETURN(0, 0),                // 8  return
+  };
+  SFunc* producer_func = SFuncCreate(constants2, instructions2);
+  consumer_count = 0;
+
+  SSched* sched = SSchedCreate();
+  STask* producer = STaskCreate(producer_func, 0, 0);
+
+  SResUsage rstart;
+  SAssertTrue(SResUsageSample(&rstart));
+
+  if (!remote) {
+    // The producer spawns the consumer in its own scheduler
+    SSchedTask(sched, producer);
+    SSchedRun(vm, sched);
+    SSchedDestroy(sched);
+  } else {
+    // The consumer runs in another scheduler, in another thread
+    #if !S_WITHOUT_SMP
+    SSched* sched2 = SSchedCreate();
+    STask* consumer = STaskCreate(consumer_func, 0, 0);
+    STaskRetain(consumer);
+    producer->ar->registry[0] = SValueTask(consumer);
+    producer->ar->pc = producer_func->instructions; // skip SPAWN
+
+    // Hand both tasks over before the schedulers run, so that neither
+    // scheduler exits before the other one has started.
+    SSchedTaskRemote(vm, sched, producer);
+    SSchedTaskRemote(vm, sched2, consumer);
+
+    SSched* scheds[] = {sched, sched2};
+    run_scheds(vm, scheds, s_countof(scheds));
+    SSchedDestroy(sched);
+    SSchedDestroy(sched2);
+    #endif
+  }
+
+  assert(consumer_count == MSG_COUNT);
+  assert(vm->nwork == 0);
+
+  #if !S_TEST_SUIT_RUNNING
+  SResUsage rend;
+  SAssertTrue(SResUsageSample(&rend));
+  print("--- %s ---", remote ? "two schedulers" : "one scheduler");
+  SResUsagePrintSummary(&rstart, &rend, "message", MSG_COUNT, remote ? 2 : 1);
+  #endif
+
+  SFuncDestroy(producer_func);
+  SFuncDestroy(consumer_func);
+}
+
+int main(int argc, const char** argv) {
+  SVM vm = SVM_INIT;
+
+  test_ping(&vm);
+  test_bounded(&vm);
+  test_trysend(&vm);
+  test_senders_fifo(&vm);
+  test_selective(&vm);
+  bench_reverse(&vm);
+  bench_throughput(&vm, false);
+  #if !S_WITHOUT_SMP
+  bench_throughput(&vm, true);
+  #endif
+
+  return 0;
+}
@@ -0,0 +1,373 @@
+// Tests waiting for several sources at once with the SELECT instruction, and
+// benchmarks tasks which receive from a channel with SELECT.
+#include "test.h"
+#include "bench.h"
+#include <sol/vm.h>
+#include <sol/sched.h>
+#include <sol/chan.h>
+#include <sol/host.h>
+
+#if S_TEST_SUIT_RUNNING
+#define VALUE_COUNT 10000
+#else
+#define VALUE_COUNT 1000000
+#endif
+
+bool timeout_checked = false;
+
+void timeout_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // The timeout, source 1, fired since nothing was sent to us
+  assert(t->ar->registry[0].type == SValueTNumber);
+  assert(t->ar->registry[0].value.n == 1);
+  assert(t->ar->registry[1].type == SValueTNil);
+  assert(t->ar->registry[2].type == SValueTNil);
+  timeout_checked = true;
+}
+
+void test_timeout(SVM* vm) {
+  // Covered: SELECT with a timeout which fires
+  SValue constants[] = {
+    SValueNil,
+    SValueNumber(20),
+    SValueOpaque(&timeout_check),
+  };
+  SInstr instructions[] = {
+    SInstr_LOADK(6, 0),                 // R(6) = nil (our inbox)
+    SInstr_LOADK(7, 1),                 // R(7) = 20 (timeout in ms)
+    SInstr_SELECT(0, 6, 2),             // R(0..2) = select R(6), R(7)
+    SInstr_DBGCB(0, 2, 0),              // check R(0..2)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* func = SFuncCreate(constants, instructions);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(func, 0, 0));
+  uint64_t start = SHostMonotonicUSecs();
+  SSchedRun(vm, sched);
+
+  assert(timeout_checked);
+  assert(SHostMonotonicUSecs() - start >= 20000);
+  assert(sched->ntimers == 0);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(func);
+}
+
+bool message_checked = false;
+
+void message_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // The message arrived before the timeout
+  assert(t->ar->registry[0].type == SValueTNumber);
+  assert(t->ar->registry[0].value.n == 0);
+  assert(t->ar->registry[1].type == SValueTNumber);
+  assert(t->ar->registry[1].value.n == 7);
+  assert(t->ar->registry[2].type == SValueTTask);
+  assert((STask*)t->ar->registry[2].value.p == t->supt);
+  message_checked = true;
+}
+
+void test_message(SVM* vm) {
+  // Covered: SELECT woken by a message, canceling its timeout
+  SValue constants1[] = {
+    SValueNil,
+    SValueNumber(10000),
+    SValueOpaque(&message_check),
+  };
+  SInstr instructions1[] = {
+    SInstr_LOADK(6, 0),                 // R(6) = nil (our inbox)
+    SInstr_LOADK(7, 1),                 // R(7) = 10000 (timeout in ms)
+    SInstr_SELECT(0, 6, 2),             // R(0..2) = select R(6), R(7)
+    SInstr_DBGCB(0, 2, 0),              // check R(0..2)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* child_func = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueFunc(child_func),
+    SValueNumber(7),
+  };
+  SInstr instructions2[] = {
+    SInstr_SPAWN(0, S_INSTR_RK_k+0, 0), // R(0) = spawn(K(0))
+    SInstr_YIELD(0, 0, 0),              // let the child start waiting
+    SInstr_SEND(0, S_INSTR_RK_k+1),     // send 7 to R(0)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* parent_func = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(parent_func, 0, 0));
+  uint64_t start = SHostMonotonicUSecs();
+  SSchedRun(vm, sched);
+
+  // The scheduler didn't wait for the timeout, which was canceled
+  assert(message_checked);
+  assert(SHostMonotonicUSecs() - start < 5000000);
+  assert(sched->ntimers == 0);
+  assert(sched->selfree_ != 0); // the SELECT record was given back
+
+  SSchedDestroy(sched);
+  SFuncDestroy(child_func);
+  SFuncDestroy(parent_func);
+}
+
+int chans_checked = 0;
+
+void chans_check1(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // Source 1, channel B, got 3
+  assert(t->ar->registry[0].value.n == 1);
+  assert(t->ar->registry[1].type == SValueTNumber);
+  assert(t->ar->registry[1].value.n == 3);
+  assert(t->ar->registry[2].type == SValueTTrue);
+  ++chans_checked;
+}
+
+void chans_check2(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // Source 0, channel A, was closed
+  assert(t->ar->registry[0].value.n == 0);
+  assert(t->ar->registry[1].type == SValueTNil);
+  assert(t->ar->registry[2].type == SValueTFalse);
+  ++chans_checked;
+}
+
+// Create a task which runs `func` with channels `a` and `b` in R(r) and R(r+1)
+STask* chans_task(SFunc* func, SChan* a, SChan* b, uint8_t r) {
+  STask* t = STaskCreate(func, 0, 0);
+  SChanRetain(a);
+  SChanRetain(b);
+  t->ar->registry[r] = SValueChan(a);
+  t->ar->registry[r + 1] = SValueChan(b);
+  return t;
+}
+
+void test_chans(SVM* vm) {
+  // Covered: SELECT woken by a value sent to a channel, and by a channel being
+  // closed
+  SValue constants1[] = {
+    SValueOpaque(&chans_check1),
+    SValueOpaque(&chans_check2),
+  };
+  SInstr instructions1[] = {
+    SInstr_SELECT(0, 5, 2),             // R(0..2) = select R(5), R(6)
+    SInstr_DBGCB(0, 0, 0),              // check R(0..2)
+    SInstr_SELECT(0, 5, 2),             // R(0..2) = select R(5), R(6)
+    SInstr_DBGCB(0, 1, 0),              // check R(0..2)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* selector_func = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueNumber(3),
+  };
+  SInstr instructions2[] = {
+    SInstr_CHSEND(1, S_INSTR_RK_k+0),   // send 3 to R(1)
+    SInstr_YIELD(0, 0, 0),              // let the selector wait again
+    SInstr_CHCLOSE(0),                  // close R(0)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* producer_func = SFuncCreate(constants2, instructions2);
+
+  SChan* a = SChanCreate(4, 0);
+  SChan* b = SChanCreate(4, 0);
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, chans_task(selector_func, a, b, 5));
+  SSchedTask(sched, chans_task(producer_func, a, b, 0));
+  SSchedRun(vm, sched);
+
+  // The selector took its waiters out of both channels
+  assert(chans_checked == 2);
+  assert(a->recvq.head == 0);
+  assert(b->recvq.head == 0);
+
+  SChanRelease(a);
+  SChanRelease(b);
+  SSchedDestroy(sched);
+  SFuncDestroy(selector_func);
+  SFuncDestroy(producer_func);
+}
+
+volatile uint64_t selector_sum = 0;
+volatile uint32_t selectors_done = 0;
+
+void selector_done(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // Selectors in different threads might end at the same time
+  assert(t->ar->registry[3].type == SValueTNumber);
+  SAtomicAddAndFetch(&selector_sum, (uint64_t)t->ar->registry[3].value.n);
+  SAtomicAddAndFetch(&selectors_done, 1);
+}
+
+#define STEAL_MAX_USECS 2000000
+uint64_t steal_start = 0;   // When the stealing test started
+uint64_t steal_timeout = 0; // When the selector timed out, or 0
+size_t steals = 0;          // Values taken from under the selector
+
+void steal_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // The timeout, source 1, fired
+  assert(t->ar->registry[2].type == SValueTNumber);
+  assert(t->ar->registry[2].value.n == 1);
+  steal_timeout = SHostMonotonicUSecs();
+}
+
+void steal(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // Take the value just sent to the channel before the selector it woke runs
+  SValue v;
+  if (SChanTryRecv((SChan*)t->ar->registry[0].value.p, &v)) {
+    ++steals;
+  }
+  t->ar->registry[1] = SValueNumber((steal_timeout != 0 ||
+    SHostMonotonicUSecs() - steal_start > STEAL_MAX_USECS) ? 1 : 0);
+}
+
+void test_timeout_stolen(SVM* vm) {
+  // Covered: SELECT with a timeout, which is woken by a channel over and over
+  // but never gets the value. The timeout still fires in time.
+  SValue constants1[] = {
+    SValueNumber(20),
+    SValueOpaque(&steal_check),
+  };
+  SInstr instructions1[] = {
+    SInstr_LOADK(1, 0),                 // R(1) = 20 (timeout in ms)
+    SInstr_SELECT(2, 0, 2),             // R(2..4) = select R(0), R(1)
+    SInstr_DBGCB(0, 1, 0),              // check R(2)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* selector_func = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueNumber(1),
+    SValueOpaque(&steal),
+  };
+  SInstr instructions2[] = {
+    SInstr_CHSEND(0, S_INSTR_RK_k+0),   // 0  send 1 to R(0), waking selector
+    SInstr_DBGCB(0, 1, 0),              // 1  take it back; R(1) = done
+    SInstr_EQ(0, 1, S_INSTR_RK_k+0),    // 2  if (R(1) == 1) JUMP else PC++
+    SInstr_JUMP(2),                     // 3    PC += 2 to RETURN
+    SInstr_YIELD(0, 0, 0),              // 4  let the selector run
+    SInstr_JUMP(-6),                    // 5  PC -= 6 to CHSEND
+    SInstr_RETURN(0, 0),                // 6  return
+  };
+  SFunc* producer_func = SFuncCreate(constants2, instructions2);
+
+  SChan* c = SChanCreate(4, 0);
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, chan_task(selector_func, c));
+  SSchedTask(sched, chan_task(producer_func, c));
+  SChanRelease(c);
+  steal_start = SHostMonotonicUSecs();
+  steal_timeout = 0;
+  steals = 0;
+  SSchedRun(vm, sched);
+
+  assert(steals > 1);
+  assert(steal_timeout != 0);
+  assert(steal_timeout - steal_start >= 20000);
+  assert(steal_timeout - steal_start < STEAL_MAX_USECS);
+  assert(sched->ntimers == 0);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(selector_func);
+  SFuncDestroy(producer_func);
+}
+
+void bench_select(SVM* vm, bool remote) {
+  // Two selectors wait for a value from channel R(0), a message or a timeout,
+  // and sum up the values until the channel is closed
+  SValue constants1[] = {
+    SValueNumber(0),
+    SValueNumber(10000),
+    SValueFalse,
+    SValueOpaque(&selector_done),
+  };
+  SInstr instructions1[] = {
+    SInstr_LOADK(2, 1),                 // 0  R(2) = 10000 (timeout in ms)
+    SInstr_LOADK(3, 0),                 // 1  R(3) = 0
+    SInstr_SELECT(4, 0, 3),             // 2  R(4..6) = select R(0), R(1), R(2)
+    SInstr_EQ(0, 6, S_INSTR_RK_k+2),    // 3  if (R(6) == false) JUMP
+    SInstr_JUMP(2),                     // 4    PC += 2 to DBGCB
+    SInstr_ADD(3, 3, 5),                // 5  R(3) = R(3) + R(5)
+    SInstr_JUMP(-5),                    // 6  PC -= 5 to SELECT
+    SInstr_DBGCB(0, 3, 0),              // 7  selector_sum += R(3)
+    SInstr_RETURN(0, 0),                // 8  return
+  };
+  SFunc* selector_func = SFuncCreate(constants1, instructions1);
+
+  // Sends 1 to VALUE_COUNT to channel R(0) and closes it
+  SValue constants2[] = {
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(VALUE_COUNT),
+  };
+  SInstr instructions2[] = {
+    SInstr_LOADK(1, 0),                 // 0  R(1) = 0
+    SInstr_ADD(1, 1, S_INSTR_RK_k+1),   // 1  R(1) = R(1) + 1
+    SInstr_CHSEND(0, 1),                // 2  send R(1) to R(0)
+    SInstr_LT(0, 1, S_INSTR_RK_k+2),    // 3  if (R(1) < VALUE_COUNT) JUMP
+    SInstr_JUMP(-4),                    // 4    PC -= 4 to ADD
+    SInstr_CHCLOSE(0),                  // 5  close R(0)
+    SInstr_RETURN(0, 0),                // 6  return
+  };
+  SFunc* producer_func = SFuncCreate(constants2, instructions2);
+  selector_sum = 0;
+  selectors_done = 0;
+
+  SChan* c = SChanCreate(64, 0);
+  S_UNUSED size_t nsched = remote ? 3 : 1;
+  SSched* sched = SSchedCreate();
+
+  SResUsage rstart;
+  SAssertTrue(SResUsageSample(&rstart));
+
+  if (!remote) {
+    SSchedTask(sched, chan_task(producer_func, c));
+    SSchedTask(sched, chan_task(selector_func, c));
+    SSchedTask(sched, chan_task(selector_func, c));
+    SChanRelease(c);
+    SSchedRun(vm, sched);
+    SSchedDestroy(sched);
+  } else {
+    // The selectors run in other schedulers, in other threads
+    #if !S_WITHOUT_SMP
+    SSched* sched2 = SSchedCreate();
+    SSched* sched3 = SSchedCreate();
+    SSchedTaskRemote(vm, sched, chan_task(producer_func, c));
+    SSchedTaskRemote(vm, sched2, chan_task(selector_func, c));
+    SSchedTaskRemote(vm, sched3, chan_task(selector_func, c));
+    SChanRelease(c);
+
+    SSched* scheds[] = {sched, sched2, sched3};
+    run_scheds(vm, scheds, nsched);
+    SSchedDestroy(sched);
+    SSchedDestroy(sched2);
+    SSchedDestroy(sched3);
+    #endif
+  }
+
+  // Each value was received by exactly one selector
+  assert(selectors_done == 2);
+  assert(selector_sum == (uint64_t)VALUE_COUNT * (VALUE_COUNT + 1) / 2);
+  assert(vm->nwork == 0);
+
+  #if !S_TEST_SUIT_RUNNING
+  SResUsage rend;
+  SAssertTrue(SResUsageSample(&rend));
+  print("--- %zu scheduler(s) ---", nsched);
+  SResUsagePrintSummary(&rstart, &rend, "value", VALUE_COUNT, nsched);
+  #endif
+
+  SFuncDestroy(producer_func);
+  SFuncDestroy(selector_func);
+}
+
+int main(int argc, const char** argv) {
+  SVM vm = SVM_INIT;
+
+  test_timeout(&vm);
+  test_message(&vm);
+  test_chans(&vm);
+  test_timeout_stolen(&vm);
+  bench_select(&vm, false);
+  #if !S_WITHOUT_SMP
+  bench_select(&vm, true);
+  #endif
+
+  return 0;
+}
@@ -0,0 +1,381 @@
+// Tests SPAWN with arguments, and task groups with SPAWNN, JOIN and CANCEL.
+// Tests that references to a spawned task, counted by its scheduler, are
+// merged with those released by other threads when the task ends. Benchmarks spawning many tasks with a SPAWN per task compared with a single
+// SPAWNN.
+#include "test.h"
+#include "bench.h"
+#include <sol/vm.h>
+#include <sol/sched.h>
+#include <sol/chan.h>
+#include <sol/host.h>
+
+// TODO: Disable this test if the system does not have pthreads
+#include <pthread.h>
+
+#if S_TEST_SUIT_RUNNING
+#define TASK_COUNT 10000
+#else
+#define TASK_COUNT 100000
+#endif
+
+bool args_child_checked = false;
+bool args_checked = false;
+
+void args_child_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // The arguments were copied into our first registers
+  SValue* r = t->ar->registry;
+  assert(r[0].type == SValueTNumber && r[0].value.n == 5);
+  assert(r[1].type == SValueTChan);
+  // The channel is referenced by the parent's register and ours
+  assert(((SChan*)r[1].value.p)->refc == 2);
+  assert(r[2].type == SValueTNil);
+  args_child_checked = true;
+}
+
+void args_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  SValue* r = t->ar->registry;
+  assert(r[0].type == SValueTTask);
+  assert(r[3].type == SValueTNumber && r[3].value.n == 5);
+  args_checked = true;
+}
+
+void test_args(SVM* vm) {
+  // Covered: SPAWN with arguments
+  SValue constants1[] = {
+    SValueOpaque(&args_child_check),
+  };
+  SInstr instructions1[] = {
+    SInstr_DBGCB(0, 0, 0),              // check R(0..2)
+    SInstr_CHSEND(1, 0),                // send R(0) to channel R(1)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* child_func = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueNumber(1),
+    SValueNumber(5),
+    SValueFunc(child_func),
+    SValueOpaque(&args_check),
+  };
+  SInstr instructions2[] = {
+    SInstr_LOADK(1, 1),                 // R(1) = 5
+    SInstr_CHAN(2, S_INSTR_RK_k+0, 0),  // R(2) = new channel of 1
+    SInstr_SPAWN(0, S_INSTR_RK_k+2, 2), // R(0) = spawn(K(2), R(1), R(2))
+    SInstr_CHRECV(3, 2),                // R(3) = receive from R(2)
+    SInstr_DBGCB(0, 3, 0),              // check R(0) and R(3)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* parent_func = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(parent_func, 0, 0));
+  SSchedRun(vm, sched);
+
+  assert(args_child_checked);
+  assert(args_checked);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(child_func);
+  SFuncDestroy(parent_func);
+}
+
+STask* refs_held = 0;
+
+void* refs_release(void* d) {
+  SAssertFalse(STaskRelease((STask*)d));
+  return 0;
+}
+
+void refs_hold(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  STask* c = (STask*)t->ar->registry[0].value.p;
+  // Our scheduler counts the child's "live" reference and our handle
+  assert(c->sched == s && c->lrefc == 2 && c->refc == 0);
+  STaskRetain(c);
+  STaskRetain(c);
+  assert(c->lrefc == 4);
+  // Another thread releases one of them, which it counts below zero
+  pthread_t thread;
+  SAssertNil(pthread_create(&thread, 0, &refs_release, (void*)c));
+  SAssertNil(pthread_join(thread, 0));
+  assert(c->lrefc == 4 && c->refc == (uint32_t)-1);
+  refs_held = c;
+}
+
+void test_refs(SVM* vm) {
+  SInstr instructions1[] = {
+    SInstr_YIELD(0, 0, 0),
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* child_func = SFuncCreate(0, instructions1);
+
+  SValue constants2[] = {
+    SValueFunc(child_func),
+    SValueOpaque(&refs_hold),
+  };
+  SInstr instructions2[] = {
+    SInstr_SPAWN(0, S_INSTR_RK_k+0, 0), // R(0) = spawn(K(0))
+    SInstr_DBGCB(0, 1, 0),              // hold on to R(0)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* parent_func = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(parent_func, 0, 0));
+  SSchedRun(vm, sched);
+
+  // The child ended, and merged the counts. We hold the last reference.
+  STask* t = refs_held;
+  assert(t != 0 && t->ar == 0);
+  assert(t->lrefc == 0 && t->refc == S_TASK_REFC_MERGED + 1);
+  SAssertTrue(STaskRelease(t));
+
+  SSchedDestroy(sched);
+  SFuncDestroy(child_func);
+  SFuncDestroy(parent_func);
+}
+
+#define GROUP_COUNT 100
+bool group_checked = false;
+
+void group_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  SValue* r = t->ar->registry;
+  // R(0) is the only handle to the group
+  assert(r[0].type == SValueTGroup);
+  STaskGroup* g = (STaskGroup*)r[0].value.p;
+  assert(g->n == GROUP_COUNT);
+  // Each task received a distinct index
+  assert(r[3].type == SValueTNumber);
+  assert(r[3].value.n == (SNumber)(GROUP_COUNT * (GROUP_COUNT - 1) / 2));
+  group_checked = true;
+}
+
+void test_group(SVM* vm) {
+  // Covered: SPAWNN
+  // Each task in the group sends its index to the channel it gets as argument
+  SInstr instructions1[] = {
+    SInstr_CHSEND(1, 0),                // send R(0) to channel R(1)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* child_func = SFuncCreate(0, instructions1);
+
+  SValue constants2[] = {
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(GROUP_COUNT),
+    SValueFunc(child_func),
+    SValueOpaque(&group_check),
+  };
+  SInstr instructions2[] = {
+    SInstr_CHAN(1, S_INSTR_RK_k+1, 0),  // 0  R(1) = new channel of 1
+    SInstr_SPAWNN(0, S_INSTR_RK_k+3,    // 1  R(0) = group of K(2) x
+                  S_INSTR_RK_k+2),      //         spawn(K(3), i, R(1))
+    SInstr_LOADK(3, 0),                 // 2  R(3) = 0
+    SInstr_LOADK(4, 0),                 // 3  R(4) = 0
+    SInstr_CHRECV(5, 1),                // 4  R(5) = receive from R(1)
+    SInstr_ADD(3, 3, 5),                // 5  R(3) = R(3) + R(5)
+    SInstr_ADD(4, 4, S_INSTR_RK_k+1),   // 6  R(4) = R(4) + 1
+    SInstr_LT(0, 4, S_INSTR_RK_k+2),    // 7  if (R(4) < GROUP_COUNT) JUMP
+    SInstr_JUMP(-5),                    // 8    PC -= 5 to CHRECV
+    SInstr_DBGCB(0, 4, 0),              // 9  check R(0) and R(3)
+    SInstr_RETURN(0, 0),                // 10 return
+  };
+  SFunc* parent_func = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(parent_func, 0, 0));
+  SSchedRun(vm, sched);
+
+  assert(group_checked);
+  assert(sched->whead == 0);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(child_func);
+  SFuncDestroy(parent_func);
+}
+
+uint32_t join_count = 0;
+bool join_checked = false;
+
+void join_count_incr(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  ++join_count;
+}
+
+void join_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // Every task of the group ended before JOIN returned
+  STaskGroup* g = (STaskGroup*)t->ar->registry[0].value.p;
+  assert(g->live == 0);
+  assert(join_count == GROUP_COUNT);
+  join_checked = true;
+}
+
+void test_join(SVM* vm) {
+  // Covered: JOIN
+  SValue constants1[] = {
+    SValueOpaque(&join_count_incr),
+  };
+  SInstr instructions1[] = {
+    SInstr_YIELD(0, 0, 0),              // let the parent start waiting
+    SInstr_DBGCB(0, 0, 0),              // count that we ran
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* child_func = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueNumber(GROUP_COUNT),
+    SValueFunc(child_func),
+    SValueOpaque(&join_check),
+  };
+  SInstr instructions2[] = {
+    SInstr_SPAWNN(0, S_INSTR_RK_k+1,    // R(0) = group of K(0) x
+                  S_INSTR_RK_k+0),      //        spawn(K(1), i, R(1))
+    SInstr_JOIN(0),                     // wait for R(0)
+    SInstr_JOIN(0),                     // again, which returns right away
+    SInstr_DBGCB(0, 2, 0),              // check that all tasks ended
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* parent_func = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(parent_func, 0, 0));
+  SSchedRun(vm, sched);
+
+  assert(join_checked);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(child_func);
+  SFuncDestroy(parent_func);
+}
+
+bool cancel_checked = false;
+
+void cancel_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // The tasks of the group ended without waiting for their timers
+  STaskGroup* g = (STaskGroup*)t->ar->registry[0].value.p;
+  assert(g->live == 0);
+  assert(s->ntimers == 0);
+  // We're the only task with subtasks left
+  assert(t->subt == 0);
+  cancel_checked = true;
+}
+
+void test_cancel(SVM* vm) {
+  // Covered: CANCEL of tasks waiting for a timer and of their subtasks
+  // waiting for a message, which the group doesn't know about
+  SInstr instructions1[] = {
+    SInstr_RECV(0),                     // R(0) = receive()
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* grandchild_func = SFuncCreate(0, instructions1);
+
+  SValue constants2[] = {
+    SValueFunc(grandchild_func),
+    SValueNumber(10000),
+  };
+  SInstr instructions2[] = {
+    SInstr_SPAWN(2, S_INSTR_RK_k+0, 0), // R(2) = spawn(K(0))
+    SInstr_YIELD(1, S_INSTR_RK_k+1, 0), // sleep for 10 s
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* child_func = SFuncCreate(constants2, instructions2);
+
+  SValue constants3[] = {
+    SValueNumber(GROUP_COUNT),
+    SValueFunc(child_func),
+    SValueOpaque(&cancel_check),
+  };
+  SInstr instructions3[] = {
+    SInstr_SPAWNN(0, S_INSTR_RK_k+1,    // R(0) = group of K(0) x
+                  S_INSTR_RK_k+0),      //        spawn(K(1), i, R(1))
+    SInstr_YIELD(0, 0, 0),              // let the tasks start waiting
+    SInstr_YIELD(0, 0, 0),
+    SInstr_CANCEL(0),                   // cancel R(0)
+    SInstr_JOIN(0),                     // wait for R(0)
+    SInstr_DBGCB(0, 2, 0),              // check that all tasks ended
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* parent_func = SFuncCreate(constants3, instructions3);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(parent_func, 0, 0));
+  uint64_t start = SHostMonotonicUSecs();
+  SSchedRun(vm, sched);
+
+  assert(cancel_checked);
+  assert(SHostMonotonicUSecs() - start < 5000000);
+  // The subtasks ended too, instead of waiting for a message forever
+  assert(sched->whead == 0);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(grandchild_func);
+  SFuncDestroy(child_func);
+  SFuncDestroy(parent_func);
+}
+
+// Spawns TASK_COUNT tasks with one SPAWN each, or with a single SPAWNN if
+// `group` is true. The tasks wait until a channel is closed, so that they are
+// all alive at the same time like workers fanned out to.
+void bench_spawn(SVM* vm, bool group) {
+  SInstr instructions1[] = {
+    SInstr_CHRECV(2, 1),                // R(2) = receive from R(1)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* child_func = SFuncCreate(0, instructions1);
+
+  SValue constants2[] = {
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(TASK_COUNT),
+    SValueFunc(child_func),
+  };
+  SInstr instructions2[] = {
+    SInstr_CHAN(2, S_INSTR_RK_k+1, 0),  // 0  R(2) = new channel of 1
+    SInstr_LOADK(1, 0),                 // 1  R(1) = 0
+    SInstr_SPAWN(0, S_INSTR_RK_k+3, 2), // 2  R(0) = spawn(K(3), R(1), R(2))
+    SInstr_ADD(1, 1, S_INSTR_RK_k+1),   // 3  R(1) = R(1) + 1
+    SInstr_LT(0, 1, S_INSTR_RK_k+2),    // 4  if (R(1) < TASK_COUNT) JUMP
+    SInstr_JUMP(-4),                    // 5    PC -= 4 to SPAWN
+    SInstr_CHCLOSE(2),                  // 6  close R(2)
+    SInstr_RETURN(0, 0),                // 7  return
+  };
+  SInstr instructions3[] = {
+    SInstr_CHAN(1, S_INSTR_RK_k+1, 0),  // 0  R(1) = new channel of 1
+    SInstr_SPAWNN(0, S_INSTR_RK_k+3,    // 1  R(0) = group of TASK_COUNT x
+                  S_INSTR_RK_k+2),      //         spawn(K(3), i, R(1))
+    SInstr_CHCLOSE(1),                  // 2  close R(1)
+    SInstr_RETURN(0, 0),                // 3  return
+  };
+  SFunc* parent_func = SFuncCreate(constants2,
+                                   group ? instructions3 : instructions2);
+
+  SResUsage rstart;
+  SAssertTrue(SResUsageSample(&rstart));
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(parent_func, 0, 0));
+  SSchedRun(vm, sched);
+
+  #if !S_TEST_SUIT_RUNNING
+  SResUsage rend;
+  SAssertTrue(SResUsageSample(&rend));
+  print("--- spawn with %s ---", group ? "SPAWNN" : "SPAWN");
+  SResUsagePrintSummary(&rstart, &rend, "task", TASK_COUNT, 1);
+  #endif
+
+  SSchedDestroy(sched);
+  SFuncDestroy(child_func);
+  SFuncDestroy(parent_func);
+}
+
+int main(int argc, const char** argv) {
+  SVM vm = SVM_INIT;
+
+  test_args(&vm);
+  test_refs(&vm);
+  test_group(&vm);
+  test_join(&vm);
+  test_cancel(&vm);
+  bench_spawn(&vm, false);
+  bench_spawn(&vm, true);
+
+  return 0;
+}
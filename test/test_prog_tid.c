@@ -0,0 +1,242 @@
+// Tests task IDs with the TID and TASK instructions, and that IDs of ended tasks
+// are detected as stale, also when their slot has been reused. Benchmarks
+// looking up IDs with TASK, and from several threads at once while tasks come
+// and go.
+#include "test.h"
+#include "bench.h"
+#include <sol/vm.h>
+#include <sol/sched.h>
+#include <sol/tasktab.h>
+
+// TODO: Disable this test if the system does not have pthreads
+#include <pthread.h>
+
+#if S_TEST_SUIT_RUNNING
+#define LOOKUP_COUNT 100000
+#else
+#define LOOKUP_COUNT 10000000
+#endif
+
+#define THREAD_COUNT 4
+
+bool tid_checked = false;
+
+void tid_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  SValue* r = t->ar->registry;
+  assert(r[1].type == SValueTTaskID && r[1].value.id != 0);
+  // The ID was looked up while the subtask was alive
+  assert(r[2].type == SValueTTask && r[2].value.p == r[0].value.p);
+  // ...and found stale after it ended
+  assert(r[3].type == SValueTNil);
+  // Our own ID
+  assert(r[5].type == SValueTTaskID && r[5].value.id == t->id);
+  assert(r[6].type == SValueTTask && r[6].value.p == (void*)t);
+  // The ID of a task which has ended is stale
+  assert(r[7].type == SValueTTaskID && r[7].value.id != r[1].value.id);
+  assert(r[8].type == SValueTNil);
+  tid_checked = true;
+}
+
+void test_tid(SVM* vm) {
+  // Covered: TID, TASK
+  SInstr instructions1[] = {
+    SInstr_RECV(0),                     // R(0) = receive()
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* child_func = SFuncCreate(0, instructions1);
+
+  SValue constants2[] = {
+    SValueFunc(child_func),
+    SValueNumber(1),
+    SValueOpaque(&tid_check),
+  };
+  SInstr instructions2[] = {
+    SInstr_SPAWN(0, S_INSTR_RK_k+0, 0), // R(0) = spawn(K(0))
+    SInstr_TID(1, 0),                   // R(1) = ID of R(0)
+    SInstr_TASK(2, 1),                  // R(2) = task with ID R(1)
+    SInstr_SEND(2, S_INSTR_RK_k+1),     // send 1 to R(2), which ends it
+    SInstr_YIELD(0, 0, 0),              // let it end
+    SInstr_TASK(3, 1),                  // R(3) = task with ID R(1)
+    SInstr_TID(5, 4),                   // R(5) = our ID, since R(4) is nil
+    SInstr_TASK(6, 5),                  // R(6) = task with ID R(5)
+    SInstr_TID(7, 0),                   // R(7) = ID of R(0)
+    SInstr_TASK(8, 7),                  // R(8) = task with ID R(7)
+    SInstr_DBGCB(0, 2, 0),              // check R(1..8)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* parent_func = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(parent_func, 0, 0));
+  SSchedRun(vm, sched);
+
+  assert(tid_checked);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(child_func);
+  SFuncDestroy(parent_func);
+}
+
+void test_reuse() {
+  SInstr instructions[] = {
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* func = SFuncCreate(0, instructions);
+
+  STask* t1 = STaskCreate(func, 0, 0);
+  // A task has no ID until asked for
+  assert(t1->id == 0);
+  STaskID id1 = STaskTabID(0, t1);
+  assert(id1 != 0 && STaskTabID(0, t1) == id1);
+  STask* t = STaskTabLookup(id1);
+  assert(t == t1);
+  STaskRelease(t);
+  STaskRelease(t1);
+  assert(STaskTabLookup(id1) == 0);
+
+  // The freed slot is taken again, with another generation
+  STask* t2 = STaskCreate(func, 0, 0);
+  STaskID id2 = STaskTabID(0, t2);
+  assert(STaskIDIndex(id2) == STaskIDIndex(id1));
+  assert(id2 != id1);
+  assert(STaskTabLookup(id1) == 0);
+  t = STaskTabLookup(id2);
+  assert(t == t2);
+  STaskRelease(t);
+  STaskRelease(t2);
+
+  // IDs which were never given out
+  assert(STaskTabLookup(0) == 0);
+  assert(STaskTabLookup(STaskIDIndex(id1)) == 0);
+
+  SFuncDestroy(func);
+}
+
+// Looks up the ID of a task LOOKUP_COUNT times with TASK, from a scheduler,
+// which doesn't need to pin the task's slot
+void bench_task(SVM* vm) {
+  SInstr instructions1[] = {
+    SInstr_RECV(0),                     // R(0) = receive()
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* child_func = SFuncCreate(0, instructions1);
+
+  SValue constants2[] = {
+    SValueFunc(child_func),
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(LOOKUP_COUNT),
+  };
+  SInstr instructions2[] = {
+    SInstr_SPAWN(0, S_INSTR_RK_k+0, 0), // 0  R(0) = spawn(K(0))
+    SInstr_TID(1, 0),                   // 1  R(1) = ID of R(0)
+    SInstr_LOADK(3, 1),                 // 2  R(3) = 0
+    SInstr_TASK(2, 1),                  // 3  R(2) = task with ID R(1)
+    SInstr_ADD(3, 3, S_INSTR_RK_k+2),   // 4  R(3) = R(3) + 1
+    SInstr_LT(0, 3, S_INSTR_RK_k+3),    // 5  if (R(3) < LOOKUP_COUNT) JUMP
+    SInstr_JUMP(-4),                    // 6    PC -= 4 to TASK
+    SInstr_SEND(0, S_INSTR_RK_k+1),     // 7  send 0 to R(0), which ends it
+    SInstr_RETURN(0, 0),                // 8  return
+  };
+  SFunc* parent_func = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(parent_func, 0, 0));
+
+  SResUsage rstart;
+  SAssertTrue(SResUsageSample(&rstart));
+
+  SSchedRun(vm, sched);
+
+  #if !S_TEST_SUIT_RUNNING
+  SResUsage rend;
+  SAssertTrue(SResUsageSample(&rend));
+  print("--- lookup with TASK ---");
+  SResUsagePrintSummary(&rstart, &rend, "lookup", LOOKUP_COUNT, 1);
+  #endif
+
+  SSchedDestroy(sched);
+  SFuncDestroy(child_func);
+  SFuncDestroy(parent_func);
+}
+
+typedef struct {
+  pthread_t thread;
+  SFunc*    func;
+  STaskID   shared;  // ID of a task which lives throughout
+  uint32_t  stale;   // Stale IDs found
+} Thread;
+
+void* thread_main(void* d) {
+  Thread* th = (Thread*)d;
+  STask* own = 0;
+  STaskID ownid = 0;
+  uint32_t i = 0;
+  for (; i != LOOKUP_COUNT; ++i) {
+    // Look up the shared task, which everyone else does too
+    STask* t = STaskTabLookup(th->shared);
+    assert(t != 0);
+    STaskRelease(t);
+    // Every now and then, replace our own task, so that slots are reused
+    if ((i & 63) == 0) {
+      if (own != 0) {
+        STaskRelease(own);
+        if (STaskTabLookup(ownid) == 0) {
+          ++th->stale;
+        }
+      }
+      own = STaskCreate(th->func, 0, 0);
+      ownid = STaskTabID(0, own);
+    }
+  }
+  STaskRelease(own);
+  return 0;
+}
+
+void bench_lookup() {
+  SInstr instructions[] = {
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* func = SFuncCreate(0, instructions);
+  STask* shared = STaskCreate(func, 0, 0);
+
+  SResUsage rstart;
+  SAssertTrue(SResUsageSample(&rstart));
+
+  Thread threads[THREAD_COUNT];
+  size_t i = 0;
+  for (; i != THREAD_COUNT; ++i) {
+    threads[i] = (Thread){0, func, STaskTabID(0, shared), 0};
+    SAssertNil(pthread_create(&threads[i].thread, 0, &thread_main,
+                              (void*)&threads[i]));
+  }
+  for (i = 0; i != THREAD_COUNT; ++i) {
+    SAssertNil(pthread_join(threads[i].thread, 0));
+    // Every replaced task's ID was found stale
+    assert(threads[i].stale == (LOOKUP_COUNT - 1) / 64);
+  }
+
+  #if !S_TEST_SUIT_RUNNING
+  SResUsage rend;
+  SAssertTrue(SResUsageSample(&rend));
+  print("--- lookup of a shared ID by %d threads ---", THREAD_COUNT);
+  SResUsagePrintSummary(&rstart, &rend, "lookup",
+                        (size_t)LOOKUP_COUNT * THREAD_COUNT, THREAD_COUNT);
+  #endif
+
+  STaskRelease(shared);
+  SFuncDestroy(func);
+}
+
+int main(int argc, const char** argv) {
+  SVM vm = SVM_INIT;
+
+  test_tid(&vm);
+  test_reuse();
+  bench_task(&vm);
+  #if !S_WITHOUT_SMP
+  bench_lookup();
+  #endif
+
+  return 0;
+}
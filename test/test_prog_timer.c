@@ -21,11 +21,10 @@ void task1_on_resumed(SVM* vm, SSched* s, STask* t, SInstr* pc) {
   assert(SInstrGetOP(*t->ar->pc) == S_OP_YIELD);
   assert(SInstrGetA(*t->ar->pc) == 1); // wait for timer
 
-  // Verify that task1 is the only task in the run queue (task2 has already
+  // Verify that the run queue is empty (task1 is running and task2 has already
   // ended)
-  assert(s->rhead == task1);
-  assert(s->rtail == task1);
-  assert(task1->next == 0);
+  assert(s->rqmask == 0);
+  assert(s->rq[STaskPriNormal].count == 0);
 
   // Verify that the wait queue is empty
   assert(s->whead == 0);
@@ -40,10 +39,9 @@ void task2_on_task1_suspended(SVM* vm, SSched* s, STask* t, SInstr* pc) {
   assert(t == task2);
   assert(sequence++ == 0);
 
-  // Verify that task2 is the only task in the run queue
-  assert(s->rhead == task2);
-  assert(s->rtail == task2);
-  assert(task2->next == 0);
+  // Verify that the run queue is empty (task2 is running)
+  assert(s->rqmask == 0);
+  assert(s->rq[STaskPriNormal].count == 0);
 
   // Verify that task1 is the only task in the wait queue
   assert(s->whead == task1);
@@ -87,13 +85,11 @@ void test_timer(SVM* vm) {
   SSchedTask(sched, task1);
   SSchedTask(sched, task2);
 
-  // Verify run queue is: -> task1 <-> task2 <-
-  assert(sched->rhead == task1);
-  assert(task1->next == task2);
-  assert(task1->prev == 0);
-  assert(sched->rtail == task2);
-  assert(task2->prev == task1);
-  assert(task2->next == 0);
+  // Verify run queue is: -> task1 -> task2 <-
+  assert(sched->rqmask == (1 << STaskPriNormal));
+  assert(sched->rq[STaskPriNormal].count == 2);
+  assert(SRunQAt(&sched->rq[STaskPriNormal], 0) == task1);
+  assert(SRunQAt(&sched->rq[STaskPriNormal], 1) == task2);
 
   // Verify that wait queue is empty
   assert(sched->whead == 0);
@@ -111,10 +107,71 @@ void test_timer(SVM* vm) {
   SFuncDestroy(func2);
 }
 
+bool timer_fired = false;
+size_t busy_runs = 0;
+
+void poll_on_timer(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  timer_fired = true;
+}
+
+void poll_busy_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  ++busy_runs;
+  t->ar->registry[0] = SValueNumber(timer_fired ? 1 : 0);
+}
+
+void test_poll(SVM* vm) {
+  // A task waits for a timer while another task keeps the run queue busy. Since
+  // the only watcher is the timer, the scheduler should not poll for events
+  // until the timer has expired.
+  SValue constants1[] = {
+    SValueNumber(2),
+    SValueOpaque(&poll_on_timer),
+  };
+  SInstr instructions1[] = {
+    SInstr_YIELD(1, S_INSTR_RK_k+0, 0), // wait for timer
+    SInstr_DBGCB(0, 1, 0),              // timer_fired = true
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* func1 = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueOpaque(&poll_busy_check),
+    SValueNumber(1),
+  };
+  SInstr instructions2[] = {
+    SInstr_DBGCB(0, 0, 0),            // 0  R(0) = timer_fired
+    SInstr_EQ(0, 0, S_INSTR_RK_k+1),  // 1  if (R(0) == 1) JUMP else PC++
+    SInstr_JUMP(2),                   // 2    PC += 2 to RETURN
+    SInstr_YIELD(0, 0, 0),            // 3  yield
+    SInstr_JUMP(-5),                  // 4  PC -= 5 to DBGCB
+    SInstr_RETURN(0, 0),              // 5  return
+  };
+  SFunc* func2 = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(func1, 0, 0));
+  SSchedTask(sched, STaskCreate(func2, 0, 0));
+  SSchedRun(vm, sched);
+
+  assert(timer_fired);
+  assert(sched->ntimers == 0);
+  assert(sched->timers.len == 0);
+  // Events are only polled for once the timer has expired
+  assert(sched->stats.polls >= 1);
+  assert(sched->stats.polls <= 2);
+  assert(sched->stats.pollskips > 0);
+  assert(busy_runs > sched->stats.pollskips);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(func1);
+  SFuncDestroy(func2);
+}
+
 int main(int argc, const char** argv) {
   SVM vm = SVM_INIT;
 
   test_timer(&vm);
+  test_poll(&vm);
 
   return 0;
 }
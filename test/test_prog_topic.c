@@ -0,0 +1,289 @@
+// Tests topics with the TOPIC, PUBLISH, SUBSCRIBE and TRECV instructions, and
+// benchmarks publishing to many subscribers.
+#include "test.h"
+#include "bench.h"
+#include <sol/vm.h>
+#include <sol/sched.h>
+#include <sol/topic.h>
+#include <sol/buf.h>
+
+#if S_TEST_SUIT_RUNNING
+#define VALUE_COUNT 1000
+#else
+#define VALUE_COUNT 100000
+#endif
+
+bool log_checked = false;
+
+void log_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  SValue* r = t->ar->registry;
+  // The log only kept the last two values, so 1 and 2 were missed
+  assert(r[2].type == SValueTNumber && r[2].value.n == 3);
+  assert(r[3].type == SValueTNumber && r[3].value.n == 2);
+  // The buffer is referenced by R(5), R(6) and the log
+  assert(r[6].type == SValueTBuf);
+  assert(r[6].value.p == r[5].value.p);
+  assert(((SBuf*)r[6].value.p)->refc == 3);
+  assert(r[7].type == SValueTNumber && r[7].value.n == 0);
+  // The cursor is past the last value
+  assert(r[1].type == SValueTNumber && r[1].value.n == 4);
+  log_checked = true;
+}
+
+void test_log(SVM* vm) {
+  // Covered: TOPIC, SUBSCRIBE, PUBLISH, TRECV of a value that holds a
+  // reference, and TRECV after falling behind
+  SValue constants[] = {
+    SValueNumber(2),
+    SValueNumber(1),
+    SValueNumber(2),
+    SValueNumber(3),
+    SValueNumber(4),
+    SValueOpaque(&log_check),
+  };
+  SInstr instructions[] = {
+    SInstr_TOPIC(0, S_INSTR_RK_k+0),    // R(0) = new topic keeping 2 values
+    SInstr_SUBSCRIBE(1, 0),             // R(1) = cursor of R(0)
+    SInstr_PUBLISH(0, S_INSTR_RK_k+1),  // publish 1 to R(0)
+    SInstr_PUBLISH(0, S_INSTR_RK_k+2),  // publish 2 to R(0)
+    SInstr_PUBLISH(0, S_INSTR_RK_k+3),  // publish 3 to R(0)
+    SInstr_BUF(5, S_INSTR_RK_k+4),      // R(5) = new buffer of 4 bytes
+    SInstr_PUBLISH(0, 5),               // publish R(5) to R(0)
+    SInstr_TRECV(2, 0, 1),              // R(2) = R(0) at R(1); R(3) = missed
+    SInstr_TRECV(6, 0, 1),              // R(6) = R(0) at R(1); R(7) = missed
+    SInstr_DBGCB(0, 5, 0),              // check R(1..7)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* func = SFuncCreate(constants, instructions);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(func, 0, 0));
+  SSchedRun(vm, sched);
+
+  assert(log_checked);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(func);
+}
+
+bool fanout_checked = false;
+
+void fanout_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // Each of the three subscribers received all values
+  assert(t->ar->registry[5].type == SValueTNumber);
+  assert(t->ar->registry[5].value.n == 3 * (100 * 101 / 2));
+  fanout_checked = true;
+}
+
+void test_fanout(SVM* vm) {
+  // Covered: TRECV waiting for a value, PUBLISH waking waiting subscribers
+  // A task publishes the numbers 1 to 100 to three subscribers, which each
+  // send back the sum of the values they received.
+  SValue constants1[] = {
+    SValueTrue,
+    SValueNumber(0),
+    SValueNumber(100),
+  };
+  SInstr instructions1[] = {
+    SInstr_RECV(0),                     // 0  R(0) = receive(); R(1) = sender
+    SInstr_SUBSCRIBE(2, 0),             // 1  R(2) = cursor of R(0)
+    SInstr_SEND(1, S_INSTR_RK_k+0),     // 2  send true to R(1)
+    SInstr_LOADK(5, 1),                 // 3  R(5) = 0
+    SInstr_TRECV(3, 0, 2),              // 4  R(3) = R(0) at R(2)
+    SInstr_ADD(5, 5, 3),                // 5  R(5) = R(5) + R(3)
+    SInstr_LT(0, 3, S_INSTR_RK_k+2),    // 6  if (R(3) < 100) JUMP
+    SInstr_JUMP(-4),                    // 7    PC -= 4 to TRECV
+    SInstr_SEND(1, 5),                  // 8  send R(5) to R(1)
+    SInstr_RETURN(0, 0),                // 9  return
+  };
+  SFunc* sub_func = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueNumber(128),
+    SValueFunc(sub_func),
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(100),
+    SValueOpaque(&fanout_check),
+  };
+  SInstr instructions2[] = {
+    SInstr_TOPIC(0, S_INSTR_RK_k+0),    // 0  R(0) = new topic keeping 128
+    SInstr_SPAWN(1, S_INSTR_RK_k+1, 0), // 1  R(1) = spawn(K(1))
+    SInstr_SPAWN(2, S_INSTR_RK_k+1, 0), // 2  R(2) = spawn(K(1))
+    SInstr_SPAWN(3, S_INSTR_RK_k+1, 0), // 3  R(3) = spawn(K(1))
+    SInstr_SEND(1, 0),                  // 4  send R(0) to R(1)
+    SInstr_SEND(2, 0),                  // 5  send R(0) to R(2)
+    SInstr_SEND(3, 0),                  // 6  send R(0) to R(3)
+    SInstr_RECV(7),                     // 7  R(7) = receive() (subscribed)
+    SInstr_RECV(7),                     // 8  R(7) = receive() (subscribed)
+    SInstr_RECV(7),                     // 9  R(7) = receive() (subscribed)
+    SInstr_LOADK(4, 2),                 // 10 R(4) = 0
+    SInstr_ADD(4, 4, S_INSTR_RK_k+3),   // 11 R(4) = R(4) + 1
+    SInstr_PUBLISH(0, 4),               // 12 publish R(4) to R(0)
+    SInstr_LT(0, 4, S_INSTR_RK_k+4),    // 13 if (R(4) < 100) JUMP
+    SInstr_JUMP(-4),                    // 14   PC -= 4 to ADD
+    SInstr_LOADK(5, 2),                 // 15 R(5) = 0
+    SInstr_RECV(7),                     // 16 R(7) = receive()
+    SInstr_ADD(5, 5, 7),                // 17 R(5) = R(5) + R(7)
+    SInstr_RECV(7),                     // 18 R(7) = receive()
+    SInstr_ADD(5, 5, 7),                // 19 R(5) = R(5) + R(7)
+    SInstr_RECV(7),                     // 20 R(7) = receive()
+    SInstr_ADD(5, 5, 7),                // 21 R(5) = R(5) + R(7)
+    SInstr_DBGCB(0, 5, 0),              // 22 check R(5)
+    SInstr_RETURN(0, 0),                // 23 return
+  };
+  SFunc* parent_func = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(parent_func, 0, 0));
+  SSchedRun(vm, sched);
+
+  assert(fanout_checked);
+  assert(sched->whead == 0);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(sub_func);
+  SFuncDestroy(parent_func);
+}
+
+size_t received_count = 0;
+size_t missed_count = 0;
+
+void subscriber_done(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  assert(t->ar->registry[4].type == SValueTNumber);
+  assert(t->ar->registry[5].type == SValueTNumber);
+  SAtomicAddAndFetch(&received_count,
+                     (size_t)(t->ar->registry[4].value.n -
+                              t->ar->registry[5].value.n));
+  SAtomicAddAndFetch(&missed_count, (size_t)t->ar->registry[5].value.n);
+}
+
+// Create a task which runs `func` with topic `tp` in R(0) and, if `subscribe`
+// is true, a cursor of the topic in R(1)
+STask* topic_task(SFunc* func, STopic* tp, bool subscribe) {
+  STask* t = STaskCreate(func, 0, 0);
+  STopicRetain(tp);
+  t->ar->registry[0] = SValueTopic(tp);
+  if (subscribe) {
+    t->ar->registry[1] = SValueNumber((SNumber)STopicSubscribe(tp));
+  }
+  return t;
+}
+
+// Publishes VALUE_COUNT values to `nsubs` subscribers, which run in the same
+// scheduler as the publisher unless `remote` is true
+void bench_fanout(SVM* vm, size_t nsubs, bool remote) {
+  // Reads from topic R(0) at cursor R(1) until it has received or missed
+  // VALUE_COUNT values
+  SValue constants1[] = {
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(VALUE_COUNT),
+    SValueOpaque(&subscriber_done),
+  };
+  SInstr instructions1[] = {
+    SInstr_LOADK(4, 0),                 // 0  R(4) = 0
+    SInstr_LOADK(5, 0),                 // 1  R(5) = 0
+    SInstr_TRECV(2, 0, 1),              // 2  R(2) = R(0) at R(1); R(3) = missed
+    SInstr_ADD(4, 4, S_INSTR_RK_k+1),   // 3  R(4) = R(4) + 1
+    SInstr_ADD(4, 4, 3),                // 4  R(4) = R(4) + R(3)
+    SInstr_ADD(5, 5, 3),                // 5  R(5) = R(5) + R(3)
+    SInstr_LT(0, 4, S_INSTR_RK_k+2),    // 6  if (R(4) < VALUE_COUNT) JUMP
+    SInstr_JUMP(-6),                    // 7    PC -= 6 to TRECV
+    SInstr_DBGCB(0, 3, 0),              // 8  count R(4) and R(5)
+    SInstr_RETURN(0, 0),                // 9  return
+  };
+  SFunc* sub_func = SFuncCreate(constants1, instructions1);
+
+  // Publishes VALUE_COUNT values to topic R(0), yielding after each one
+  SValue constants2[] = {
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(VALUE_COUNT),
+  };
+  SInstr instructions2[] = {
+    SInstr_LOADK(1, 0),                 // 0  R(1) = 0
+    SInstr_ADD(1, 1, S_INSTR_RK_k+1),   // 1  R(1) = R(1) + 1
+    SInstr_PUBLISH(0, 1),               // 2  publish R(1) to R(0)
+    SInstr_YIELD(0, 0, 0),              // 3  yield
+    SInstr_LT(0, 1, S_INSTR_RK_k+2),    // 4  if (R(1) < VALUE_COUNT) JUMP
+    SInstr_JUMP(-5),                    // 5    PC -= 5 to ADD
+    SInstr_RETURN(0, 0),                // 6  return
+  };
+  SFunc* pub_func = SFuncCreate(constants2, instructions2);
+  received_count = 0;
+  missed_count = 0;
+
+  STopic* tp = STopicCreate(1024);
+  S_UNUSED size_t nsched = remote ? 3 : 1;
+  SSched* sched = SSchedCreate();
+  size_t i;
+
+  SResUsage rstart;
+  SAssertTrue(SResUsageSample(&rstart));
+
+  if (!remote) {
+    for (i = 0; i != nsubs; ++i) {
+      SSchedTask(sched, topic_task(sub_func, tp, true));
+    }
+    SSchedTask(sched, topic_task(pub_func, tp, false));
+    STopicRelease(tp);
+    SSchedRun(vm, sched);
+    SSchedDestroy(sched);
+  } else {
+    // Subscribers in two other schedulers, in other threads
+    #if !S_WITHOUT_SMP
+    SSched* sched2 = SSchedCreate();
+    SSched* sched3 = SSchedCreate();
+
+    // Hand all tasks over before the schedulers run, so that no scheduler
+    // exits before the others have started.
+    for (i = 0; i != nsubs; ++i) {
+      SSchedTaskRemote(vm, (i % 2) ? sched3 : sched2,
+                       topic_task(sub_func, tp, true));
+    }
+    SSchedTaskRemote(vm, sched, topic_task(pub_func, tp, false));
+    STopicRelease(tp);
+
+    SSched* scheds[] = {sched, sched2, sched3};
+    run_scheds(vm, scheds, nsched);
+    SSchedDestroy(sched);
+    SSchedDestroy(sched2);
+    SSchedDestroy(sched3);
+    #endif
+  }
+
+  // Every subscriber got every value, unless it fell too far behind a
+  // publisher in another thread
+  assert(received_count + missed_count == nsubs * VALUE_COUNT);
+  assert(remote || missed_count == 0);
+  assert(vm->nwork == 0);
+
+  #if !S_TEST_SUIT_RUNNING
+  SResUsage rend;
+  SAssertTrue(SResUsageSample(&rend));
+  print("--- %zu subscribers, %zu scheduler(s), %zu missed ---", nsubs, nsched,
+        missed_count);
+  SResUsagePrintSummary(&rstart, &rend, "value published", VALUE_COUNT,
+                        nsched);
+  SResUsagePrintSummary(&rstart, &rend, "value received", received_count,
+                        nsched);
+  #endif
+
+  SFuncDestroy(sub_func);
+  SFuncDestroy(pub_func);
+}
+
+int main(int argc, const char** argv) {
+  SVM vm = SVM_INIT;
+
+  test_log(&vm);
+  test_fanout(&vm);
+  bench_fanout(&vm, 1, false);
+  bench_fanout(&vm, 100, false);
+  #if !S_WITHOUT_SMP
+  bench_fanout(&vm, 100, true);
+  #endif
+
+  return 0;
+}
@@ -0,0 +1,239 @@
+// Tests that memory retired with QSBR is freed only once every online
+// participant has passed a quiescent state, that offline participants don't
+// hold it up, and that tasks are freed this way, also when a supertask ends
+// before its subtasks. Benchmarks threads which read a shared object without
+// references while others replace it and retire the old one.
+#include "test.h"
+#include "bench.h"
+#include <sol/qsbr.h>
+#include <sol/vm.h>
+#include <sol/sched.h>
+
+// TODO: Disable this test if the system does not have pthreads
+#include <pthread.h>
+
+#if S_TEST_SUIT_RUNNING
+#define READ_COUNT 100000
+#else
+#define READ_COUNT 10000000
+#endif
+
+#define THREAD_COUNT 4
+#define REPLACE_EVERY 16 // Reads between replacing the shared object
+
+// Quiescent states which are always enough for memory to be freed
+#define GRACE (8 * S_QSBR_ADVANCE_EVERY)
+
+#define MAGIC 0x9e3779b9
+
+typedef struct {
+  SQSBRNode node;
+  volatile uint32_t magic; // MAGIC until freed
+} Obj;
+
+volatile uint32_t nfreed = 0;
+volatile uint32_t nreplaced = 0;
+
+static void obj_free(SQSBRNode* n) {
+  Obj* o = (Obj*)n;
+  assert(o->magic == MAGIC);
+  o->magic = 0;
+  SAtomicAddAndFetch(&nfreed, 1);
+  free((void*)o);
+}
+
+static Obj* obj_create() {
+  Obj* o = (Obj*)malloc(sizeof(Obj));
+  o->node.free = obj_free;
+  o->magic = MAGIC;
+  return o;
+}
+
+// Pass `n` quiescent states with participant `q`
+static void quiesce(SQSBR* q, uint32_t n) {
+  while (n-- != 0) {
+    SQSBRQuiescent(q);
+  }
+}
+
+void test_grace() {
+  SQSBR* q1 = SQSBRCreate();
+  SQSBR* q2 = SQSBRCreate();
+  SQSBROnline(q2);
+  SQSBROnline(q1); // the calling thread retires with q1 from here on
+
+  nfreed = 0;
+  SQSBRRetire(&obj_create()->node);
+
+  // Not freed while q2 hasn't passed a quiescent state
+  quiesce(q1, GRACE);
+  assert(nfreed == 0);
+
+  // Freed once both have, a few times over
+  uint32_t i = 0;
+  for (; i != GRACE && nfreed == 0; ++i) {
+    SQSBRQuiescent(q2);
+    SQSBRQuiescent(q1);
+  }
+  assert(nfreed == 1);
+
+  // An offline participant doesn't hold anything up
+  SQSBROffline(q1);
+  SQSBROffline(q2);
+  SQSBROnline(q1);
+  SQSBRRetire(&obj_create()->node);
+  quiesce(q1, GRACE);
+  assert(nfreed == 2);
+
+  // Memory retired by a thread which isn't online waits for the online
+  // participants, even when the retiring participant went away
+  SQSBROnline(q2); // the calling thread retires with q2 from here on
+  SQSBRRetire(&obj_create()->node);
+  SQSBROffline(q2);
+  SQSBRDestroy(q2);
+  SQSBRRetire(&obj_create()->node);
+  assert(nfreed == 2);
+  quiesce(q1, GRACE);
+  assert(nfreed == 4);
+
+  // With nobody online, there's nobody to wait for
+  SQSBROffline(q1);
+  SQSBRRetire(&obj_create()->node);
+  assert(nfreed == 5);
+
+  // Retired memory is freed when the last participant goes offline
+  SQSBROnline(q1);
+  SQSBRRetire(&obj_create()->node);
+  SQSBROffline(q1);
+  assert(nfreed == 6);
+
+  // Records are reused
+  q2 = SQSBRCreate();
+  assert(q2 != q1);
+  SQSBRDestroy(q1);
+  SQSBRDestroy(q2);
+}
+
+bool sub_ended = false;
+
+void sub_end(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // Our supertask ended before us, but its memory is still there
+  assert(t->supt != 0 && t->supt->ar == 0);
+  sub_ended = true;
+}
+
+void test_tasks(SVM* vm) {
+  // Covered: subtasks which outlive their supertask
+  SValue constants1[] = {
+    SValueOpaque(&sub_end),
+  };
+  SInstr instructions1[] = {
+    SInstr_YIELD(0, 0, 0),
+    SInstr_YIELD(0, 0, 0),
+    SInstr_DBGCB(0, 0, 0),
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* child_func = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueFunc(child_func),
+    SValueNumber(100),
+  };
+  SInstr instructions2[] = {
+    SInstr_SPAWN(0, S_INSTR_RK_k+0, 0), // R(0) = spawn(K(0))
+    SInstr_SPAWNN(1, S_INSTR_RK_k+0,    // R(1) = group of K(1) x spawn(K(0))
+                  S_INSTR_RK_k+1),
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* parent_func = SFuncCreate(constants2, instructions2);
+
+  // Once without and once with exit messages, which are dropped
+  STaskFlag flags[] = { 0, STaskFlagTrapExit };
+  size_t i = 0;
+  for (; i != s_countof(flags); ++i) {
+    sub_ended = false;
+    SSched* sched = SSchedCreate();
+    SSchedTask(sched, STaskCreate(parent_func, 0, flags[i]));
+    SSchedRun(vm, sched);
+    assert(sub_ended);
+    SSchedDestroy(sched);
+  }
+
+  SFuncDestroy(child_func);
+  SFuncDestroy(parent_func);
+}
+
+Obj* volatile shared = 0;
+
+typedef struct {
+  pthread_t thread;
+  SQSBR*    q;
+} Thread;
+
+void* thread_main(void* d) {
+  Thread* th = (Thread*)d;
+  SQSBROnline(th->q);
+  uint32_t i = 0;
+  for (; i != READ_COUNT; ++i) {
+    Obj* o = shared;
+    assert(o->magic == MAGIC);
+    if ((i % REPLACE_EVERY) == 0) {
+      Obj* o2 = obj_create();
+      if (SAtomicCAS(&shared, o, o2)) {
+        SAtomicAddAndFetch(&nreplaced, 1);
+        SQSBRRetire(&o->node);
+      } else {
+        free((void*)o2);
+      }
+    }
+    SQSBRQuiescent(th->q);
+  }
+  SQSBROffline(th->q);
+  return 0;
+}
+
+void bench_readers() {
+  nfreed = 0;
+  shared = obj_create();
+
+  SResUsage rstart;
+  SAssertTrue(SResUsageSample(&rstart));
+
+  Thread threads[THREAD_COUNT];
+  size_t i = 0;
+  for (; i != THREAD_COUNT; ++i) {
+    threads[i] = (Thread){0, SQSBRCreate()};
+    SAssertNil(pthread_create(&threads[i].thread, 0, &thread_main,
+                              (void*)&threads[i]));
+  }
+  for (i = 0; i != THREAD_COUNT; ++i) {
+    SAssertNil(pthread_join(threads[i].thread, 0));
+    SQSBRDestroy(threads[i].q);
+  }
+
+  #if !S_TEST_SUIT_RUNNING
+  SResUsage rend;
+  SAssertTrue(SResUsageSample(&rend));
+  print("--- %d threads reading and replacing a shared object ---",
+        THREAD_COUNT);
+  SResUsagePrintSummary(&rstart, &rend, "read",
+                        (size_t)READ_COUNT * THREAD_COUNT, THREAD_COUNT);
+  print("replaced %u objects", nreplaced);
+  #endif
+
+  // Everything retired was freed once everyone went offline
+  assert(nfreed == nreplaced);
+  SQSBRRetire(&shared->node);
+}
+
+int main(int argc, const char** argv) {
+  SVM vm = SVM_INIT;
+
+  test_grace();
+  test_tasks(&vm);
+  #if !S_WITHOUT_SMP
+  bench_readers();
+  #endif
+
+  return 0;
+}
@@ -0,0 +1,394 @@
+// Tests scheduling policies.
+// Covers priority levels, starvation protection, fair mode and deadline class.
+#include "test.h"
+#include <sol/vm.h>
+#include <sol/sched.h>
+
+int sequence = 0; // For verifying call sequence
+int pri_order[S_TASK_PRI_COUNT]; // sequence number at which a level ran
+
+void record_pri(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  pri_order[t->pri] = sequence++;
+}
+
+void test_pri_order(SVM* vm) {
+  // Tasks run in priority order, regardless of the order they were scheduled in
+  SValue constants[] = {
+    SValueOpaque(&record_pri),
+  };
+  SInstr instructions[] = {
+    SInstr_DBGCB(0, 0, 0), // ccall K(B)(vm, s, t, pc)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* func = SFuncCreate(constants, instructions);
+  SSched* sched = SSchedCreate();
+
+  STask* tasks[S_TASK_PRI_COUNT];
+  int pri = S_TASK_PRI_COUNT;
+  while (pri--) {
+    tasks[pri] = STaskCreate(func, 0, 0);
+    tasks[pri]->pri = (STaskPri)pri;
+    STaskRetain(tasks[pri]); // so we can release after the sched has run
+    SSchedTask(sched, tasks[pri]);
+  }
+  assert(sched->rqmask == (1 << S_TASK_PRI_COUNT) - 1);
+
+  sequence = 0;
+  SSchedRun(vm, sched);
+
+  assert(sequence == S_TASK_PRI_COUNT);
+  assert(pri_order[STaskPriSystem] == 0);
+  assert(pri_order[STaskPriHigh] == 1);
+  assert(pri_order[STaskPriNormal] == 2);
+  assert(pri_order[STaskPriLow] == 3);
+
+  for (pri = 0; pri != S_TASK_PRI_COUNT; ++pri) {
+    STaskRelease(tasks[pri]);
+  }
+  SSchedDestroy(sched);
+  SFuncDestroy(func);
+}
+
+int high_runs = 0;  // Number of times the high-priority task ran
+bool low_ran = false;
+
+void high_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  ++high_runs;
+  t->ar->registry[0] = SValueNumber(low_ran ? 1 : 0);
+}
+
+void low_run(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  low_ran = true;
+}
+
+void test_starvation(SVM* vm) {
+  // A high-priority task which yields until a low-priority task has run. Without
+  // starvation protection this would never end.
+  SValue constants1[] = {
+    SValueOpaque(&high_check),
+    SValueNumber(1),
+  };
+  SInstr instructions1[] = {
+    SInstr_DBGCB(0, 0, 0),            // 0  R(0) = low_ran
+    SInstr_EQ(0, 0, S_INSTR_RK_k+1),  // 1  if (R(0) == 1) JUMP else PC++
+    SInstr_JUMP(2),                   // 2    PC += 2 to RETURN
+    SInstr_YIELD(0, 0, 0),            // 3  yield
+    SInstr_JUMP(-5),                  // 4  PC -= 5 to DBGCB
+    SInstr_RETURN(0, 0),              // 5  return
+  };
+  SFunc* func1 = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueOpaque(&low_run),
+  };
+  SInstr instructions2[] = {
+    SInstr_DBGCB(0, 0, 0),
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* func2 = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  STask* high_task = STaskCreate(func1, 0, 0);
+  high_task->pri = STaskPriHigh;
+  STask* low_task = STaskCreate(func2, 0, 0);
+  low_task->pri = STaskPriLow;
+  SSchedTask(sched, low_task);
+  SSchedTask(sched, high_task);
+
+  SSchedRun(vm, sched);
+
+  assert(low_ran);
+  assert(high_runs > 1);
+  print("high-priority task ran %d times before the low-priority task",
+        high_runs);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(func1);
+  SFuncDestroy(func2);
+}
+
+bool normal_ran = false;
+
+void normal_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  t->ar->registry[0] = SValueNumber(normal_ran ? 1 : 0);
+}
+
+void normal_run(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  normal_ran = true;
+}
+
+void test_starvation_levels(SVM* vm) {
+  // A high-priority and a low-priority task which yield until a normal-priority
+  // task has run. The levels passed over take turns, so the normal-priority
+  // task runs even though the low-priority task is always runnable.
+  SValue constants1[] = {
+    SValueOpaque(&normal_check),
+    SValueNumber(1),
+  };
+  SInstr instructions1[] = {
+    SInstr_DBGCB(0, 0, 0),            // 0  R(0) = normal_ran
+    SInstr_EQ(0, 0, S_INSTR_RK_k+1),  // 1  if (R(0) == 1) JUMP else PC++
+    SInstr_JUMP(2),                   // 2    PC += 2 to RETURN
+    SInstr_YIELD(0, 0, 0),            // 3  yield
+    SInstr_JUMP(-5),                  // 4  PC -= 5 to DBGCB
+    SInstr_RETURN(0, 0),              // 5  return
+  };
+  SFunc* func1 = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueOpaque(&normal_run),
+  };
+  SInstr instructions2[] = {
+    SInstr_DBGCB(0, 0, 0),
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* func2 = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  STask* high_task = STaskCreate(func1, 0, 0);
+  high_task->pri = STaskPriHigh;
+  STask* low_task = STaskCreate(func1, 0, 0);
+  low_task->pri = STaskPriLow;
+  STask* normal_task = STaskCreate(func2, 0, 0);
+  SSchedTask(sched, normal_task);
+  SSchedTask(sched, low_task);
+  SSchedTask(sched, high_task);
+
+  SSchedRun(vm, sched);
+
+  assert(normal_ran);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(func1);
+  SFuncDestroy(func2);
+}
+
+#define FAIR_B_TASK_COUNT 10
+STask* fair_a;                      // Task of group A
+STask* fair_b[FAIR_B_TASK_COUNT];   // Tasks of group B
+uint64_t fair_a_icount = 0;         // Instructions executed by group A
+uint64_t fair_b_icount = 0;         // Instructions executed by group B
+
+void fair_on_end(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  if (t != fair_a || fair_a_icount != 0) {
+    return;
+  }
+  // Group A just finished. Sample how much group B got to run meanwhile.
+  fair_a_icount = t->icount;
+  size_t i = 0;
+  for (; i != FAIR_B_TASK_COUNT; ++i) {
+    fair_b_icount += fair_b[i]->icount;
+  }
+}
+
+void test_fair(SVM* vm) {
+  // Group A has one task and group B has ten tasks, all running the same busy
+  // loop. In fair mode both groups should get about the same amount of
+  // instructions executed, where a round-robin scheduler would give group B ten
+  // times as much.
+  SValue constants[] = {
+    SValueNumber(500),
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueOpaque(&fair_on_end),
+  };
+  SInstr instructions[] = {
+    SInstr_LOADK(0, 0),               // 0  R(0) = K(0)
+    SInstr_LE(0, 0, S_INSTR_RK_k+1),  // 1  if (R(0) <= 0) JUMP else PC++
+    SInstr_JUMP(2),                   // 2    PC += 2 to DBGCB
+    SInstr_SUB(0, 0, S_INSTR_RK_k+2), // 3  R(0) = R(0) - 1
+    SInstr_JUMP(-4),                  // 4  PC -= 4 to LE
+    SInstr_DBGCB(0, 3, 0),            // 5  ccall K(3)(vm, s, t, pc)
+    SInstr_RETURN(0, 0),              // 6  return
+  };
+  SFunc* func = SFuncCreate(constants, instructions);
+  SSched* sched = SSchedCreate();
+  sched->policy = SSchedPolicyFair;
+
+  fair_a = STaskCreate(func, 0, 0);
+  SSchedTask(sched, fair_a);
+  assert(fair_a->group != 0); // got a group of its own
+
+  SSchedGroup* group_b = SSchedGroupCreate();
+  size_t i = 0;
+  for (; i != FAIR_B_TASK_COUNT; ++i) {
+    fair_b[i] = STaskCreate(func, 0, 0);
+    fair_b[i]->group = group_b;
+    STaskRetain(fair_b[i]); // so we can inspect it after it ended
+    SSchedTask(sched, fair_b[i]);
+  }
+  assert(group_b->refc == FAIR_B_TASK_COUNT);
+
+  SSchedRun(vm, sched);
+
+  print("fair: group A executed %llu instructions, group B %llu",
+        (unsigned long long)fair_a_icount,
+        (unsigned long long)fair_b_icount);
+  assert(fair_a_icount != 0);
+  assert(fair_b_icount > fair_a_icount / 2);
+  assert(fair_b_icount < fair_a_icount * 2);
+
+  for (i = 0; i != FAIR_B_TASK_COUNT; ++i) {
+    STaskRelease(fair_b[i]);
+  }
+  SSchedDestroy(sched);
+  SFuncDestroy(func);
+}
+
+int dl_sequence[3];
+
+void dl_record(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  dl_sequence[sequence] = (t->flags & STaskFlagDeadline) ? 1 : 0;
+  ++sequence;
+}
+
+void test_deadline(SVM* vm) {
+  SValue constants[] = {
+    SValueOpaque(&dl_record),
+  };
+  SInstr instructions[] = {
+    SInstr_DBGCB(0, 0, 0), // ccall K(B)(vm, s, t, pc)
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* func = SFuncCreate(constants, instructions);
+  SSched* sched = SSchedCreate();
+
+  // Admission control
+  STask* t1 = STaskCreate(func, 0, 0);
+  STask* t2 = STaskCreate(func, 0, 0);
+  assert(SSchedAdmitDeadline(sched, t1, 1000, 500));  // 50%
+  assert(!SSchedAdmitDeadline(sched, t2, 1000, 500)); // 100% would be too much
+  assert(!(t2->flags & STaskFlagDeadline));
+  assert(SSchedAdmitDeadline(sched, t2, 10000, 1000)); // 60%
+  assert(sched->dlutil == 600000);
+  STaskRelease(t2);
+
+  // A deadline task runs before best-effort tasks scheduled before it, even
+  // ones with higher priority
+  STask* t3 = STaskCreate(func, 0, 0);
+  t3->pri = STaskPriSystem;
+  SSchedTask(sched, t3);
+  STask* t4 = STaskCreate(func, 0, 0);
+  SSchedTask(sched, t4);
+  SSchedTask(sched, t1);
+
+  sequence = 0;
+  SSchedRun(vm, sched);
+  assert(sequence == 3);
+  assert(dl_sequence[0] == 1);
+  assert(dl_sequence[1] == 0);
+  assert(dl_sequence[2] == 0);
+
+  // The deadline task's activation was counted and it gave back its share
+  assert(sched->stats.dlruns == 1);
+  assert(sched->dlutil == 100000);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(func);
+}
+
+void test_deadline_miss(SVM* vm) {
+  // A task that can not make its 10 microsecond deadline
+  SValue constants[] = {
+    SValueNumber(1000),
+    SValueNumber(0),
+    SValueNumber(1),
+  };
+  SInstr instructions[] = {
+    SInstr_LOADK(0, 0),               // 0  R(0) = K(0)
+    SInstr_LE(0, 0, S_INSTR_RK_k+1),  // 1  if (R(0) <= 0) JUMP else PC++
+    SInstr_JUMP(2),                   // 2    PC += 2 to RETURN
+    SInstr_SUB(0, 0, S_INSTR_RK_k+2), // 3  R(0) = R(0) - 1
+    SInstr_JUMP(-4),                  // 4  PC -= 4 to LE
+    SInstr_RETURN(0, 0),              // 5  return
+  };
+  SFunc* func = SFuncCreate(constants, instructions);
+  SSched* sched = SSchedCreate();
+
+  STask* t = STaskCreate(func, 0, 0);
+  assert(SSchedAdmitDeadline(sched, t, 10, 1));
+  SSchedTask(sched, t);
+  SSchedRun(vm, sched);
+
+  assert(sched->stats.dlruns == 1);
+  assert(sched->stats.dlmisses == 1);
+  assert(sched->dlutil == 0);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(func);
+}
+
+#define DL_YIELD_MAX 1000000
+size_t dl_yields = 0;  // Times the yielding deadline task ran
+bool dl_be_ran = false; // True once the best-effort task ran
+
+void dl_yield(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  ++dl_yields;
+  t->ar->registry[0] = SValueNumber(
+    (dl_be_ran || dl_yields == DL_YIELD_MAX) ? 1 : 0);
+}
+
+void dl_be(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  dl_be_ran = true;
+}
+
+void test_deadline_yield(SVM* vm) {
+  // A deadline task which yields in a loop until a best-effort task has run.
+  // Once it has used up its runtime it should stop being picked first.
+  SValue constants1[] = {
+    SValueOpaque(&dl_yield),
+    SValueNumber(1),
+  };
+  SInstr instructions1[] = {
+    SInstr_DBGCB(0, 0, 0),            // 0  R(0) = best-effort task ran
+    SInstr_EQ(0, 0, S_INSTR_RK_k+1),  // 1  if (R(0) == 1) JUMP else PC++
+    SInstr_JUMP(2),                   // 2    PC += 2 to RETURN
+    SInstr_YIELD(0, 0, 0),            // 3  yield
+    SInstr_JUMP(-5),                  // 4  PC -= 5 to DBGCB
+    SInstr_RETURN(0, 0),              // 5  return
+  };
+  SFunc* dl_func = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueOpaque(&dl_be),
+  };
+  SInstr instructions2[] = {
+    SInstr_DBGCB(0, 0, 0), // dl_be_ran = true
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* be_func = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  STask* t = STaskCreate(dl_func, 0, 0);
+  assert(SSchedAdmitDeadline(sched, t, 10000, 100));
+  SSchedTask(sched, t);
+  SSchedTask(sched, STaskCreate(be_func, 0, 0));
+
+  dl_yields = 0;
+  dl_be_ran = false;
+  SSchedRun(vm, sched);
+
+  assert(dl_be_ran);
+  assert(dl_yields < DL_YIELD_MAX);
+  assert(sched->stats.dlthrottles == 1);
+  assert(sched->stats.dlruns == 1);
+  assert(sched->dlutil == 0);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(be_func);
+  SFuncDestroy(dl_func);
+}
+
+int main(int argc, const char** argv) {
+  SVM vm = SVM_INIT;
+
+  test_pri_order(&vm);
+  test_starvation(&vm);
+  test_starvation_levels(&vm);
+  test_fair(&vm);
+  test_deadline(&vm);
+  test_deadline_miss(&vm);
+  test_deadline_yield(&vm);
+
+  return 0;
+}
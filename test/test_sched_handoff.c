@@ -0,0 +1,150 @@
+// Benchmarks the latency of one task handing off to another while the run queue
+// is busy with batch tasks, with and without the runnext slot.
+//
+// Two long-lived tasks, "ping" and "pong", bounce a message back and forth with
+// SEND and RECV. Each message wakes its receiver, and the time from one task
+// receiving a message until the other one receives the reply is the handoff
+// latency. Meanwhile BATCH_TASK_COUNT tasks keep yielding in the run queue.
+#include "test.h"
+#include "bench.h"
+#include <sol/host.h> // for SHostMonotonicUSecs
+#include <sol/vm.h>
+#include <sol/sched.h>
+
+#if S_TEST_SUIT_RUNNING
+#define HANDOFF_COUNT     1000
+#define BATCH_TASK_COUNT  100
+#else
+#define HANDOFF_COUNT     10000
+#define BATCH_TASK_COUNT  1000
+#endif
+
+size_t handoffs_left = 0;
+uint64_t handoff_time = 0;    // When the last handoff happened
+uint64_t handoff_usecs = 0;   // Total time from handoff to handoff
+size_t batch_runs = 0;        // Number of times any batch task ran
+
+void handoff(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // Called when ping or pong received a message. R(2) = 1 if ping should send
+  // another one.
+  uint64_t now = SHostMonotonicUSecs();
+  if (handoff_time != 0) {
+    handoff_usecs += now - handoff_time;
+  }
+  handoff_time = now;
+  t->ar->registry[2] = SValueNumber(handoffs_left ? 1 : 0);
+  if (handoffs_left) {
+    --handoffs_left;
+  }
+}
+
+void batch_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  // Called each time a batch task runs. R(0) = 1 when done.
+  ++batch_runs;
+  t->ar->registry[0] = SValueNumber(handoffs_left ? 0 : 1);
+}
+
+// Returns the average number of batch task runs per handoff
+double run_pingpong(SVM* vm, uint32_t runnext_max, const char* name) {
+  // pong replies to each message with 1, until it receives 0
+  SValue pong_constants[] = {
+    SValueOpaque(&handoff),
+    SValueNumber(0),
+    SValueNumber(1),
+  };
+  SInstr pong_instructions[] = {
+    SInstr_RECV(0),                      // 0  R(0) = receive(); R(1) = sender
+    SInstr_EQ(0, 0, S_INSTR_RK_k+1),     // 1  if (R(0) == 0) JUMP else PC++
+    SInstr_JUMP(3),                      // 2    PC += 3 to RETURN
+    SInstr_DBGCB(0, 0, 0),               // 3  record handoff
+    SInstr_SEND(1, S_INSTR_RK_k+2),      // 4  send 1 to R(1)
+    SInstr_JUMP(-6),                     // 5  PC -= 6 to RECV
+    SInstr_RETURN(0, 0),                 // 6  return
+  };
+  SFunc* pong_fun = SFuncCreate(pong_constants, pong_instructions);
+
+  // ping spawns pong and sends it 1 and waits for the reply until there are no
+  // handoffs left, and then sends it 0
+  SValue ping_constants[] = {
+    SValueOpaque(&handoff),
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueFunc(pong_fun),
+  };
+  SInstr ping_instructions[] = {
+    SInstr_SPAWN(3, S_INSTR_RK_k+3, 0),  // 0  R(3) = spawn(K(3))
+    SInstr_SEND(3, S_INSTR_RK_k+2),      // 1  send 1 to R(3)
+    SInstr_RECV(0),                      // 2  R(0) = receive(); R(1) = sender
+    SInstr_DBGCB(0, 0, 0),               // 3  R(2) = handoffs left ? 1 : 0
+    SInstr_EQ(0, 2, S_INSTR_RK_k+2),     // 4  if (R(2) == 1) JUMP else PC++
+    SInstr_JUMP(-5),                     // 5    PC -= 5 to SEND
+    SInstr_SEND(3, S_INSTR_RK_k+1),      // 6  send 0 to R(3)
+    SInstr_RETURN(0, 0),                 // 7  return
+  };
+  SFunc* ping_fun = SFuncCreate(ping_constants, ping_instructions);
+
+  SValue batch_constants[] = {
+    SValueOpaque(&batch_check),
+    SValueNumber(1),
+  };
+  SInstr batch_instructions[] = {
+    SInstr_DBGCB(0, 0, 0),            // 0  R(0) = done ? 1 : 0
+    SInstr_EQ(0, 0, S_INSTR_RK_k+1),  // 1  if (R(0) == 1) JUMP else PC++
+    SInstr_JUMP(2),                   // 2    PC += 2 to RETURN
+    SInstr_YIELD(0, 0, 0),            // 3  yield
+    SInstr_JUMP(-5),                  // 4  PC -= 5 to DBGCB
+    SInstr_RETURN(0, 0),              // 5  return
+  };
+  SFunc* batch_fun = SFuncCreate(batch_constants, batch_instructions);
+
+  SSched* sched = SSchedCreate();
+  sched->runnext_max = runnext_max;
+
+  size_t i = 0;
+  for (; i != BATCH_TASK_COUNT; ++i) {
+    SSchedTask(sched, STaskCreate(batch_fun, 0, 0));
+  }
+  SSchedTask(sched, STaskCreate(ping_fun, 0, 0));
+
+  handoffs_left = HANDOFF_COUNT;
+  handoff_time = 0;
+  handoff_usecs = 0;
+  batch_runs = 0;
+
+  SResUsage rstart;
+  SAssertTrue(SResUsageSample(&rstart));
+  SSchedRun(vm, sched);
+  assert(handoffs_left == 0);
+
+  #if !S_TEST_SUIT_RUNNING
+  SResUsage rend;
+  SAssertTrue(SResUsageSample(&rend));
+  print("--- %s ---", name);
+  SResUsagePrintSummary(&rstart, &rend, "handoff", HANDOFF_COUNT, 1);
+  #endif
+  print("Latency:     %.2f us per handoff (%.2f batch task runs in between)",
+        (double)handoff_usecs / HANDOFF_COUNT,
+        (double)batch_runs / HANDOFF_COUNT);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(ping_fun);
+  SFuncDestroy(pong_fun);
+  SFuncDestroy(batch_fun);
+
+  return (double)batch_runs / HANDOFF_COUNT;
+}
+
+int main(int argc, const char** argv) {
+  SVM vm = SVM_INIT;
+
+  double without_runnext = run_pingpong(&vm, 0, "without runnext");
+  double with_runnext = run_pingpong(&vm, 3, "with runnext");
+
+  // Without runnext, every handoff waits for all batch tasks to run. With
+  // runnext, a batch task only gets to run when a chain of handoffs reaches
+  // runnext_max.
+  assert(without_runnext >= BATCH_TASK_COUNT);
+  assert(with_runnext < 1.0);
+
+  return 0;
+}
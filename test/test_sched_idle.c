@@ -0,0 +1,178 @@
+// Tests the scheduler idle policy and handing tasks to a scheduler from
+// another thread.
+#include "test.h"
+#include <sol/vm.h>
+#include <sol/sched.h>
+#include <sol/host.h>
+
+#define REMOTE_TASK_COUNT 100
+
+void test_park(SVM* vm) {
+  // A task waiting for a timer is the only task. The scheduler is the only
+  // one running, so it should park right away until the timer expires.
+  SValue constants[] = {
+    SValueNumber(2),
+  };
+  SInstr instructions[] = {
+    SInstr_YIELD(1, S_INSTR_RK_k+0, 0), // wait for timer
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* func = SFuncCreate(constants, instructions);
+  SSched* sched = SSchedCreate();
+  sched->idle_spins = 10;
+  sched->idle_yields = 2;
+  SSchedTask(sched, STaskCreate(func, 0, 0));
+  SSchedRun(vm, sched);
+
+  // Idle once while waiting for the timer, and once more before exiting
+  assert(sched->stats.idles == 2);
+  assert(sched->stats.parks >= 1);
+  assert(sched->stats.spinwakes == 0);
+  assert(sched->stats.yieldwakes == 0);
+  assert(sched->stats.idleusecs >= sched->stats.parkusecs);
+  assert(vm->nwork == 0);
+  assert(vm->nsched == 0);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(func);
+}
+
+void busy_wait(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  uint64_t end = SHostMonotonicUSecs() + 5000;
+  while (SHostMonotonicUSecs() < end) {}
+}
+
+void test_poll_before_idle(SVM* vm) {
+  // One task waits for a timer while the other keeps the scheduler busy until
+  // after the timer has expired. The scheduler should find the expired timer
+  // when the run queue runs empty, without going idle.
+  SValue constants1[] = {
+    SValueNumber(1),
+  };
+  SInstr instructions1[] = {
+    SInstr_YIELD(1, S_INSTR_RK_k+0, 0), // wait for timer
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* timer_func = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueOpaque(&busy_wait),
+  };
+  SInstr instructions2[] = {
+    SInstr_DBGCB(0, 0, 0), // run for 5ms
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* busy_func = SFuncCreate(constants2, instructions2);
+
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(timer_func, 0, 0));
+  SSchedTask(sched, STaskCreate(busy_func, 0, 0));
+  SSchedRun(vm, sched);
+
+  // Idle only before exiting
+  assert(sched->stats.idles == 1);
+  assert(sched->stats.polls >= 1);
+  assert(vm->nwork == 0);
+
+  SSchedDestroy(sched);
+  SFuncDestroy(busy_func);
+  SFuncDestroy(timer_func);
+}
+
+SSched* remote_sched = 0;  // Scheduler that remote tasks are handed to
+SFunc* remote_func = 0;    // Function of the remote tasks
+size_t remote_runs = 0;    // Number of remote tasks that have run
+
+void remote_run(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  assert(s == remote_sched);
+  ++remote_runs;
+}
+
+void remote_hand(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  size_t i = 0;
+  for (; i != REMOTE_TASK_COUNT; ++i) {
+    SSchedTaskRemote(vm, remote_sched, STaskCreate(remote_func, 0, 0));
+  }
+}
+
+void remote_check(SVM* vm, SSched* s, STask* t, SInstr* pc) {
+  t->ar->registry[0] = SValueNumber(
+    (remote_runs == REMOTE_TASK_COUNT) ? 1 : 0);
+}
+
+void test_remote(SVM* vm) {
+  // A task in one scheduler hands tasks to another scheduler, which runs them
+  SValue constants1[] = {
+    SValueOpaque(&remote_run),
+  };
+  SInstr instructions1[] = {
+    SInstr_DBGCB(0, 0, 0), // ++remote_runs
+    SInstr_RETURN(0, 0),
+  };
+  remote_func = SFuncCreate(constants1, instructions1);
+
+  SValue constants2[] = {
+    SValueOpaque(&remote_hand),
+  };
+  SInstr instructions2[] = {
+    SInstr_DBGCB(0, 0, 0), // hand REMOTE_TASK_COUNT tasks to remote_sched
+    SInstr_RETURN(0, 0),
+  };
+  SFunc* hand_func = SFuncCreate(constants2, instructions2);
+
+  // Keeps remote_sched running until all remote tasks have run
+  SValue constants3[] = {
+    SValueOpaque(&remote_check),
+    SValueNumber(1),
+  };
+  SInstr instructions3[] = {
+    SInstr_DBGCB(0, 0, 0),            // 0  R(0) = all remote tasks ran
+    SInstr_EQ(0, 0, S_INSTR_RK_k+1),  // 1  if (R(0) == 1) JUMP else PC++
+    SInstr_JUMP(2),                   // 2    PC += 2 to RETURN
+    SInstr_YIELD(0, 0, 0),            // 3  yield
+    SInstr_JUMP(-5),                  // 4  PC -= 5 to DBGCB
+    SInstr_RETURN(0, 0),              // 5  return
+  };
+  SFunc* check_func = SFuncCreate(constants3, instructions3);
+
+  remote_runs = 0;
+  remote_sched = SSchedCreate();
+
+#if S_WITHOUT_SMP
+  // One scheduler which hands tasks to itself
+  SSchedTask(remote_sched, STaskCreate(hand_func, 0, 0));
+  SSchedRun(vm, remote_sched);
+
+#else // S_WITHOUT_SMP
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(hand_func, 0, 0));
+
+  // Hand the task that keeps remote_sched running before any scheduler runs,
+  // or remote_sched might find itself with nothing to do and exit.
+  SSchedTaskRemote(vm, remote_sched, STaskCreate(check_func, 0, 0));
+
+  SSched* scheds[] = {sched, remote_sched};
+  run_scheds(vm, scheds, s_countof(scheds));
+  SSchedDestroy(sched);
+#endif // S_WITHOUT_SMP
+
+  assert(remote_runs == REMOTE_TASK_COUNT);
+  assert(remote_sched->rq_remote == 0);
+  assert(vm->nwork == 0);
+  assert(vm->nsched == 0);
+
+  SSchedDestroy(remote_sched);
+  SFuncDestroy(remote_func);
+  SFuncDestroy(hand_func);
+  SFuncDestroy(check_func);
+}
+
+int main(int argc, const char** argv) {
+  SVM vm = SVM_INIT;
+
+  test_park(&vm);
+  test_poll_before_idle(&vm);
+  test_remote(&vm);
+
+  return 0;
+}
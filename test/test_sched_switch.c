@@ -0,0 +1,114 @@
+// Benchmarks the cost of a task switch with different numbers of runnable tasks.
+//
+// Every task yields a number of times and then ends, so each run of a task is
+// one pop from and one push to the run queue. With many tasks, the tasks no
+// longer fit in the CPU caches and the cost of finding the next task dominates.
+//
+// Also benchmarks a single CPU-bound task, which the scheduler keeps resuming
+// each time it's forced to yield by the execution limit.
+#include "test.h"
+#include "bench.h"
+#include <sol/vm.h>
+#include <sol/sched.h>
+
+#if S_TEST_SUIT_RUNNING
+#define TOTAL_SWITCHES 100000
+#define SINGLE_ITERATIONS 100000
+static const uint32_t task_counts[] = { 10, 1000, 10000 };
+#else
+#define TOTAL_SWITCHES 10000000
+#define SINGLE_ITERATIONS 100000000
+static const uint32_t task_counts[] = { 10, 10000, 1000000 };
+#endif
+
+void bench_switch(SVM* vm, uint32_t task_count) {
+  uint32_t rounds = S_MAX(TOTAL_SWITCHES / task_count, 2);
+  SValue constants[] = {
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(rounds),
+  };
+  SInstr instructions[] = {
+    SInstr_LOADK(0, 0),                           // 0  R(0) = K(0) = 0
+    SInstr_YIELD(0, 0, 0),                        // 1  yield
+    SInstr_ADD(0, 0, S_INSTR_RK_k+1),             // 2  R(0) = R(0) + 1
+    SInstr_LT(0, 0, S_INSTR_RK_k+2),              // 3  if (R(0) < K(2)) JUMP
+    SInstr_JUMP(-4),                              // 4    PC -= 4 to YIELD
+    SInstr_RETURN(0, 0),                          // 5  return
+  };
+  SFunc* func = SFuncCreate(constants, instructions);
+  SSched* sched = SSchedCreate();
+
+  uint32_t i = 0;
+  for (; i != task_count; ++i) {
+    SSchedTask(sched, STaskCreate(func, 0, 0));
+  }
+  assert(sched->rq[STaskPriNormal].count == task_count);
+
+  SResUsage rstart;
+  SAssertTrue(SResUsageSample(&rstart));
+  SSchedRun(vm, sched);
+
+  assert(sched->rqmask == 0);
+  assert(sched->rq[STaskPriNormal].count == 0);
+
+  #if !S_TEST_SUIT_RUNNING
+  SResUsage rend;
+  SAssertTrue(SResUsageSample(&rend));
+  print("--- %u tasks x %u rounds ---", task_count, rounds);
+  SResUsagePrintSummary(&rstart, &rend, "switch",
+                        (size_t)task_count * (rounds + 1), 1);
+  #endif
+
+  SSchedDestroy(sched);
+  SFuncDestroy(func);
+}
+
+void bench_single(SVM* vm) {
+  SValue constants[] = {
+    SValueNumber(0),
+    SValueNumber(1),
+    SValueNumber(SINGLE_ITERATIONS),
+  };
+  SInstr instructions[] = {
+    SInstr_LOADK(0, 0),                           // 0  R(0) = K(0) = 0
+    SInstr_ADD(0, 0, S_INSTR_RK_k+1),             // 1  R(0) = R(0) + 1
+    SInstr_LT(0, 0, S_INSTR_RK_k+2),              // 2  if (R(0) < K(2)) JUMP
+    SInstr_JUMP(-3),                              // 3    PC -= 3 to ADD
+    SInstr_RETURN(0, 0),                          // 4  return
+  };
+  SFunc* func = SFuncCreate(constants, instructions);
+  SSched* sched = SSchedCreate();
+  SSchedTask(sched, STaskCreate(func, 0, 0));
+
+  SResUsage rstart;
+  SAssertTrue(SResUsageSample(&rstart));
+  SSchedRun(vm, sched);
+
+  // The task never yields by itself, so every time it was forced to yield, it
+  // should have been resumed right away.
+  assert(sched->stats.resumes > 0);
+  assert(sched->stats.idles == 1);
+
+  #if !S_TEST_SUIT_RUNNING
+  SResUsage rend;
+  SAssertTrue(SResUsageSample(&rend));
+  print("--- 1 task x %u iterations (%llu resumes) ---", SINGLE_ITERATIONS,
+        (unsigned long long)sched->stats.resumes);
+  SResUsagePrintSummary(&rstart, &rend, "instruction",
+                        (size_t)SINGLE_ITERATIONS * 3, 1);
+  #endif
+
+  SSchedDestroy(sched);
+  SFuncDestroy(func);
+}
+
+int main(int argc, const char** argv) {
+  SVM vm = SVM_INIT;
+  size_t i = 0;
+  for (; i != s_countof(task_counts); ++i) {
+    bench_switch(&vm, task_counts[i]);
+  }
+  bench_single(&vm);
+  return 0;
+}